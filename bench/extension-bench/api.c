@@ -0,0 +1,477 @@
+/*
+ * In-process implementation of the glirc extension API.
+ *
+ * Every function declared in glirc-api.h is provided so that any
+ * extension can be loaded. The client state is a single network with
+ * the channels found in the replayed log. Outgoing messages are only
+ * counted, timers run from the replay loop, and jobs run to completion
+ * on the calling thread.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bench.h"
+
+double bench_now(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static char *dup_len(const char *str, size_t len)
+{
+        char *res = malloc(len + 1);
+        if (res) {
+                memcpy(res, str, len);
+                res[len] = '\0';
+        }
+        return res;
+}
+
+static int is_network(struct glirc *G, const char *net, size_t netlen)
+{
+        return netlen == strlen(G->network) && !memcmp(net, G->network, netlen);
+}
+
+static int find_channel(struct glirc *G, const char *chan, size_t chanlen)
+{
+        for (size_t i = 0; i < G->channels_n; i++) {
+                if (!glirc_identifier_cmp(G->channels[i], strlen(G->channels[i]), chan, chanlen)) {
+                        return 1;
+                }
+        }
+        return 0;
+}
+
+/* NULL terminated array of copies of strs */
+static char **export_strings(char * const *strs, size_t n)
+{
+        char **res = calloc(n + 1, sizeof *res);
+        if (res == NULL) return NULL;
+        for (size_t i = 0; i < n; i++) {
+                res[i] = strdup(strs[i]);
+        }
+        return res;
+}
+
+/* Single allocation glirc_string_list holding copies of strs */
+static struct glirc_string_list *export_string_list(char * const *strs, size_t n)
+{
+        size_t bytes = 0;
+        for (size_t i = 0; i < n; i++) {
+                bytes += strlen(strs[i]) + 1;
+        }
+
+        size_t header = sizeof (struct glirc_string_list) + n * sizeof (struct glirc_string);
+        struct glirc_string_list *res = malloc(header + bytes);
+        if (res == NULL) return NULL;
+
+        char *next = (char *)res + header;
+        res->n = n;
+        for (size_t i = 0; i < n; i++) {
+                size_t len = strlen(strs[i]);
+                memcpy(next, strs[i], len + 1);
+                res->strs[i].str = next;
+                res->strs[i].len = len;
+                next += len + 1;
+        }
+        return res;
+}
+
+/*
+ * Messages
+ */
+
+int glirc_send_message(struct glirc *G, const struct glirc_message *msg)
+{
+        G->sent++;
+        return 0;
+}
+
+int glirc_print(struct glirc *G, enum message_code code, const char *msg, size_t msglen)
+{
+        G->printed++;
+        if (G->verbose) {
+                fprintf(stderr, "%s: %.*s\n", code == ERROR_MESSAGE ? "error" : "print", (int)msglen, msg);
+        }
+        return 0;
+}
+
+int glirc_inject_chat(struct glirc *G,
+                const char* net, size_t netLen,
+                const char* src, size_t srcLen,
+                const char* tgt, size_t tgtLen,
+                const char* msg, size_t msgLen)
+{
+        G->injected++;
+        return 0;
+}
+
+int glirc_send_messages(struct glirc *G, const struct glirc_message *msgs, size_t n)
+{
+        G->sent += n;
+        return 0;
+}
+
+int glirc_print_many(struct glirc *G, enum message_code code, const struct glirc_string *msgs, size_t n)
+{
+        G->printed += n;
+        if (G->verbose) {
+                for (size_t i = 0; i < n; i++) {
+                        fprintf(stderr, "%s: %.*s\n", code == ERROR_MESSAGE ? "error" : "print",
+                                (int)msgs[i].len, msgs[i].str);
+                }
+        }
+        return 0;
+}
+
+int glirc_inject_chat_many(struct glirc *G,
+                const char* net, size_t netLen,
+                const char* src, size_t srcLen,
+                const char* tgt, size_t tgtLen,
+                const struct glirc_string *msgs, size_t n)
+{
+        G->injected += n;
+        return 0;
+}
+
+int glirc_subscribe(struct glirc *G, const struct glirc_string *commands, size_t commands_len)
+{
+        // Subscriptions are read from the extension record before the
+        // replay starts, later changes aren't simulated.
+        return 0;
+}
+
+/*
+ * Client state
+ */
+
+char ** glirc_list_networks(struct glirc *G)
+{
+        char *net = (char *)G->network;
+        return export_strings(&net, 1);
+}
+
+char ** glirc_list_channels(struct glirc *G, const char *net, size_t netlen)
+{
+        if (!is_network(G, net, netlen)) return NULL;
+        return export_strings(G->channels, G->channels_n);
+}
+
+char ** glirc_list_channel_users(struct glirc *G, const char *net, size_t net_len, const char *chan, size_t chan_len)
+{
+        if (!is_network(G, net, net_len) || !find_channel(G, chan, chan_len)) return NULL;
+        char *nick = (char *)G->nick;
+        return export_strings(&nick, 1);
+}
+
+struct glirc_string_list * glirc_list_networks_packed(struct glirc *G)
+{
+        char *net = (char *)G->network;
+        return export_string_list(&net, 1);
+}
+
+struct glirc_string_list * glirc_list_channels_packed(struct glirc *G, const char *net, size_t netlen)
+{
+        if (!is_network(G, net, netlen)) return NULL;
+        return export_string_list(G->channels, G->channels_n);
+}
+
+struct glirc_string_list * glirc_list_channel_users_packed(struct glirc *G, const char *net, size_t netlen, const char *chan, size_t chanlen)
+{
+        if (!is_network(G, net, netlen) || !find_channel(G, chan, chanlen)) return NULL;
+        char *nick = (char *)G->nick;
+        return export_string_list(&nick, 1);
+}
+
+struct glirc_roster * glirc_channel_roster(struct glirc *G, const char *net, size_t netlen, const char *chan, size_t chanlen)
+{
+        if (!is_network(G, net, netlen) || !find_channel(G, chan, chanlen)) return NULL;
+
+        size_t len = strlen(G->nick);
+        size_t header = sizeof (struct glirc_roster) + sizeof (struct glirc_roster_entry);
+        struct glirc_roster *res = malloc(header + len + 3);
+        if (res == NULL) return NULL;
+
+        char *nick = (char *)res + header;
+        memcpy(nick, G->nick, len + 1);
+        nick[len + 1] = '\0'; // empty sigils
+        nick[len + 2] = '\0'; // unknown account
+
+        res->n = 1;
+        res->members[0].nick    = (struct glirc_string) { nick, len };
+        res->members[0].sigils  = (struct glirc_string) { nick + len + 1, 0 };
+        res->members[0].account = (struct glirc_string) { nick + len + 2, 0 };
+        return res;
+}
+
+void glirc_current_focus(struct glirc *G, char **net, size_t *netlen, char **tgt, size_t *tgtlen)
+{
+        const char *chan = G->channels_n > 0 ? G->channels[0] : "";
+        if (net) *net = strdup(G->network);
+        if (netlen) *netlen = strlen(G->network);
+        if (tgt) *tgt = strdup(chan);
+        if (tgtlen) *tgtlen = strlen(chan);
+}
+
+void glirc_set_focus(struct glirc *G, const char *net, size_t netlen, const char *tgt, size_t tgtlen) {}
+
+char * glirc_my_nick(struct glirc *G, const char *net, size_t netlen)
+{
+        return is_network(G, net, netlen) ? strdup(G->nick) : NULL;
+}
+
+char * glirc_user_account(struct glirc *G, const char *net, size_t netlen, const char *nick, size_t nicklen)
+{
+        return NULL;
+}
+
+char * glirc_user_channel_modes(struct glirc *G, const char *net, size_t netlen, const char *chan, size_t chanlen, const char *nick, size_t nicklen)
+{
+        if (!is_network(G, net, netlen) || !find_channel(G, chan, chanlen)) return NULL;
+        return strdup("");
+}
+
+char ** glirc_channel_modes(struct glirc *G, const char *net, size_t netlen, const char *chan, size_t chanlen)
+{
+        if (!is_network(G, net, netlen) || !find_channel(G, chan, chanlen)) return NULL;
+        return export_strings(NULL, 0);
+}
+
+char ** glirc_channel_masks(struct glirc *G, const char *net, size_t netlen, const char *chan, size_t chanlen, char mode)
+{
+        if (!is_network(G, net, netlen) || !find_channel(G, chan, chanlen)) return NULL;
+        return export_strings(NULL, 0);
+}
+
+struct glirc_string_list * glirc_channel_modes_packed(struct glirc *G, const char *net, size_t netlen, const char *chan, size_t chanlen)
+{
+        if (!is_network(G, net, netlen) || !find_channel(G, chan, chanlen)) return NULL;
+        return export_string_list(NULL, 0);
+}
+
+struct glirc_string_list * glirc_channel_masks_packed(struct glirc *G, const char *net, size_t netlen, const char *chan, size_t chanlen, char mode)
+{
+        if (!is_network(G, net, netlen) || !find_channel(G, chan, chanlen)) return NULL;
+        return export_string_list(NULL, 0);
+}
+
+void glirc_mark_seen(struct glirc *G, const char *net, size_t net_len, const char *chan, size_t chan_len) {}
+void glirc_clear_window(struct glirc *G, const char *net, size_t net_len, const char *chan, size_t chan_len) {}
+
+/* RFC 1459 case-insensitive comparison, as used for nicknames */
+static int irc_fold(unsigned char c)
+{
+        switch (c) {
+        case '[': return '{';
+        case ']': return '}';
+        case '\\': return '|';
+        case '~': return '^';
+        default: return tolower(c);
+        }
+}
+
+int glirc_identifier_cmp(const char *s, size_t s_len, const char *t, size_t t_len)
+{
+        size_t n = s_len < t_len ? s_len : t_len;
+        for (size_t i = 0; i < n; i++) {
+                int d = irc_fold(s[i]) - irc_fold(t[i]);
+                if (d) return d;
+        }
+        return (s_len > t_len) - (s_len < t_len);
+}
+
+int glirc_is_channel(struct glirc *G, const char *net, size_t netlen, const char *tgt, size_t tgtlen)
+{
+        return tgtlen > 0 && (*tgt == '#' || *tgt == '&');
+}
+
+int glirc_is_logged_on(struct glirc *G, const char *net, size_t netlen, const char *tgt, size_t tgtlen)
+{
+        return is_network(G, net, netlen);
+}
+
+char * glirc_resolve_path(struct glirc *G, const char *path, size_t path_len)
+{
+        const char *home = getenv("HOME");
+        if (home && path_len > 0 && path[0] == '~') {
+                size_t home_len = strlen(home);
+                char *res = malloc(home_len + path_len);
+                if (res) {
+                        memcpy(res, home, home_len);
+                        memcpy(res + home_len, path + 1, path_len - 1);
+                        res[home_len + path_len - 1] = '\0';
+                }
+                return res;
+        }
+        return dup_len(path, path_len);
+}
+
+/*
+ * Windows, the replayed log isn't recorded in any window
+ */
+
+char ** glirc_window_lines(struct glirc *G, const char *net, size_t netlen, const char *tgt, size_t tgtlen, int filtered)
+{
+        return export_strings(NULL, 0);
+}
+
+struct glirc_string_list * glirc_window_lines_packed(struct glirc *G, const char *net, size_t netlen, const char *tgt, size_t tgtlen, int filtered)
+{
+        return export_string_list(NULL, 0);
+}
+
+struct glirc_window_page * glirc_window_history(struct glirc *G, const char *net, size_t netlen, const char *tgt, size_t tgtlen, int filtered, size_t start, size_t limit, long long before)
+{
+        return calloc(1, sizeof (struct glirc_window_page));
+}
+
+/*
+ * Timers
+ */
+
+static timer_id add_timer(struct glirc *G, unsigned long millis, unsigned long period, timer_callback *cb, void *dat)
+{
+        for (int i = 0; i < BENCH_TIMERS; i++) {
+                struct bench_timer *t = &G->timers[i];
+                if (t->id == 0) {
+                        t->id = ++G->next_timer;
+                        t->due = bench_now() + millis / 1000.0;
+                        t->period = period / 1000.0;
+                        t->cb = cb;
+                        t->dat = dat;
+                        return t->id;
+                }
+        }
+        return 0;
+}
+
+static struct bench_timer *lookup_timer(struct glirc *G, timer_id tid)
+{
+        for (int i = 0; i < BENCH_TIMERS; i++) {
+                if (tid != 0 && G->timers[i].id == tid) return &G->timers[i];
+        }
+        return NULL;
+}
+
+timer_id glirc_set_timer(struct glirc *G, unsigned long millis, timer_callback *cb, void *dat)
+{
+        return add_timer(G, millis, 0, cb, dat);
+}
+
+timer_id glirc_set_interval(struct glirc *G, unsigned long millis, timer_callback *cb, void *dat)
+{
+        return millis == 0 ? 0 : add_timer(G, millis, millis, cb, dat);
+}
+
+int glirc_reschedule_timer(struct glirc *G, timer_id tid, unsigned long millis)
+{
+        struct bench_timer *t = lookup_timer(G, tid);
+        if (t == NULL) return 1;
+        t->due = bench_now() + millis / 1000.0;
+        return 0;
+}
+
+void *glirc_cancel_timer(struct glirc *G, timer_id tid)
+{
+        struct bench_timer *t = lookup_timer(G, tid);
+        if (t == NULL) return NULL;
+        t->id = 0;
+        return t->dat;
+}
+
+/* Run the timers that are due. Interval timers are scheduled again
+ * before their callback runs, like in the client.
+ */
+void bench_run_timers(struct glirc *G)
+{
+        double now = bench_now();
+        for (int i = 0; i < BENCH_TIMERS; i++) {
+                struct bench_timer t = G->timers[i];
+                if (t.id == 0 || t.due > now) continue;
+
+                if (t.period > 0) {
+                        G->timers[i].due = now + t.period;
+                } else {
+                        G->timers[i].id = 0;
+                }
+                G->fired++;
+                t.cb(t.dat, t.id);
+        }
+}
+
+/*
+ * Jobs run synchronously, so finish callbacks run before submission
+ * returns.
+ */
+
+void glirc_thread(struct glirc *G, void *(*start)(void *), void(*finish)(void*), void *arg)
+{
+        G->jobs++;
+        finish(start(arg));
+}
+
+job_id glirc_submit_job(struct glirc *G, void *(*start)(void *), void(*finish)(void*), void *arg)
+{
+        job_id jid = ++G->next_job;
+        glirc_thread(G, start, finish, arg);
+        return jid;
+}
+
+job_id glirc_submit_long_job(struct glirc *G, void *(*start)(void *), void(*finish)(void*), void *arg)
+{
+        return glirc_submit_job(G, start, finish, arg);
+}
+
+void *glirc_cancel_job(struct glirc *G, job_id jid)
+{
+        return NULL;
+}
+
+void glirc_job_stats(struct glirc *G, struct glirc_job_stats *stats)
+{
+        stats->queued = 0;
+        stats->active = 0;
+        stats->completed = G->jobs;
+        stats->average_ms = 0;
+}
+
+/*
+ * Deallocation
+ */
+
+void glirc_free_string(char *s)
+{
+        free(s);
+}
+
+void glirc_free_strings(char **strs)
+{
+        if (strs == NULL) return;
+        for (char **s = strs; *s; s++) {
+                free(*s);
+        }
+        free(strs);
+}
+
+void glirc_free_window_page(struct glirc_window_page *page)
+{
+        free(page);
+}
+
+void glirc_free_string_list(struct glirc_string_list *list)
+{
+        free(list);
+}
+
+void glirc_free_roster(struct glirc_roster *roster)
+{
+        free(roster);
+}
@@ -0,0 +1,514 @@
+/*
+ * Throughput benchmark for glirc extensions.
+ *
+ * An extension is loaded with dlopen and started against the stubbed
+ * client API in api.c. The raw IRC lines of a recorded log are parsed
+ * ahead of time and replayed through process_message (or
+ * process_messages with -b) as if they had arrived from a server,
+ * honoring the extension's subscriptions. With -c every PRIVMSG is
+ * also passed through process_chat as if it had been typed. Timers run
+ * between messages as their deadlines pass.
+ *
+ * Run with: ./extension-bench [options] extension.so log [args...]
+ *
+ *   -n COUNT   messages to replay, cycling through the log (100000)
+ *   -b SIZE    pass messages in batches of SIZE to process_messages
+ *   -c         also replay PRIVMSG text through process_chat
+ *   -N NAME    network name (bench)
+ *   -m NICK    client nickname (me)
+ *   -v         show messages printed by the extension
+ *
+ * Arguments after the log are passed to the extension's start
+ * callback, for example the script for the Lua extension.
+ *
+ * Allocations are counted by interposing malloc, which is only
+ * available with glibc.
+ */
+
+#define _GNU_SOURCE
+
+#include <dlfcn.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bench.h"
+
+#define MAX_PARAMS 16
+
+/* Run timers after this many messages */
+#define TIMER_CHECK 256
+
+/*
+ * Allocation counting
+ */
+
+static atomic_ulong allocations;
+static atomic_int counting;
+
+#if defined(__GLIBC__)
+#define COUNT_ALLOCATIONS 1
+
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void *, size_t);
+extern void __libc_free(void *);
+
+static void count_allocation(void)
+{
+        if (atomic_load_explicit(&counting, memory_order_relaxed)) {
+                atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+        }
+}
+
+void *malloc(size_t n)
+{
+        count_allocation();
+        return __libc_malloc(n);
+}
+
+void *calloc(size_t n, size_t m)
+{
+        count_allocation();
+        return __libc_calloc(n, m);
+}
+
+void *realloc(void *p, size_t n)
+{
+        count_allocation();
+        return __libc_realloc(p, n);
+}
+
+void free(void *p)
+{
+        __libc_free(p);
+}
+#endif
+
+/*
+ * Log parsing
+ */
+
+struct replay_message {
+        struct glirc_message msg;
+        struct glirc_chat chat;
+        int interested;         // passed to process_message
+        int is_chat;            // passed to process_chat with -c
+        struct glirc_string params[MAX_PARAMS];
+};
+
+static void unescape_tag(char *str, size_t *len)
+{
+        char *out = str;
+        for (size_t i = 0; i < *len; i++) {
+                if (str[i] != '\\' || i + 1 == *len) {
+                        *out++ = str[i];
+                        continue;
+                }
+                switch (str[++i]) {
+                case ':': *out++ = ';'; break;
+                case 's': *out++ = ' '; break;
+                case 'r': *out++ = '\r'; break;
+                case 'n': *out++ = '\n'; break;
+                default: *out++ = str[i]; break;
+                }
+        }
+        *len = out - str;
+}
+
+static struct glirc_string mk(const char *str, size_t len)
+{
+        return (struct glirc_string) { str, len };
+}
+
+/* Parse an IRC message tag section, without the leading @ */
+static int parse_tags(char *tags, struct glirc_message *msg)
+{
+        size_t n = 1;
+        for (char *p = tags; *p; p++) {
+                if (*p == ';') n++;
+        }
+
+        struct glirc_string *keys = calloc(n, sizeof *keys);
+        struct glirc_string *vals = calloc(n, sizeof *vals);
+        if (keys == NULL || vals == NULL) return 1;
+
+        char *save;
+        size_t i = 0;
+        for (char *tag = strtok_r(tags, ";", &save); tag; tag = strtok_r(NULL, ";", &save)) {
+                char *eq = strchr(tag, '=');
+                size_t vallen = eq ? strlen(eq + 1) : 0;
+                if (eq) {
+                        *eq = '\0';
+                        unescape_tag(eq + 1, &vallen);
+                }
+                keys[i] = mk(tag, strlen(tag));
+                vals[i] = eq ? mk(eq + 1, vallen) : mk("", 0);
+                i++;
+        }
+
+        msg->tagkeys = keys;
+        msg->tagvals = vals;
+        msg->tags_n = i;
+        return 0;
+}
+
+static void parse_prefix(char *prefix, struct glirc_message *msg)
+{
+        char *at = strchr(prefix, '@');
+        if (at) {
+                *at = '\0';
+                msg->prefix_host = mk(at + 1, strlen(at + 1));
+        }
+        char *bang = strchr(prefix, '!');
+        if (bang) {
+                *bang = '\0';
+                msg->prefix_user = mk(bang + 1, strlen(bang + 1));
+        }
+        msg->prefix_nick = mk(prefix, strlen(prefix));
+}
+
+static char *next_word(char **line)
+{
+        char *word = *line;
+        char *space = strchr(word, ' ');
+        if (space) {
+                *space = '\0';
+                *line = space + 1;
+                while (**line == ' ') (*line)++;
+        } else {
+                *line = word + strlen(word);
+        }
+        return word;
+}
+
+/* Parse a raw IRC line in place. Returns non-zero for lines that
+ * aren't messages.
+ */
+static int parse_line(char *line, struct replay_message *m)
+{
+        memset(m, 0, sizeof *m);
+        m->msg.prefix_nick = m->msg.prefix_user = m->msg.prefix_host = mk("", 0);
+
+        if (*line == '@') {
+                line++;
+                if (parse_tags(next_word(&line), &m->msg)) return 1;
+        }
+        if (*line == ':') {
+                line++;
+                parse_prefix(next_word(&line), &m->msg);
+        }
+
+        char *cmd = next_word(&line);
+        if (*cmd == '\0') return 1;
+        for (char *p = cmd; *p; p++) {
+                if (*p >= 'a' && *p <= 'z') *p -= 'a' - 'A';
+        }
+        m->msg.command = mk(cmd, strlen(cmd));
+
+        size_t n = 0;
+        while (*line && n < MAX_PARAMS) {
+                if (*line == ':' || n + 1 == MAX_PARAMS) {
+                        if (*line == ':') line++;
+                        m->params[n++] = mk(line, strlen(line));
+                        break;
+                }
+                char *param = next_word(&line);
+                m->params[n++] = mk(param, strlen(param));
+        }
+        m->msg.params = m->params;
+        m->msg.params_n = n;
+        return 0;
+}
+
+/* Read every message from the log into a newly allocated array */
+static struct replay_message *load_log(const char *path, size_t *count)
+{
+        FILE *f = fopen(path, "r");
+        if (f == NULL) {
+                perror(path);
+                return NULL;
+        }
+
+        size_t n = 0, cap = 1024;
+        struct replay_message *msgs = malloc(cap * sizeof *msgs);
+        char *line = NULL;
+        size_t linecap = 0;
+        ssize_t len;
+
+        while (msgs && (len = getline(&line, &linecap, f)) >= 0) {
+                while (len > 0 && (line[len-1] == '\n' || line[len-1] == '\r')) {
+                        line[--len] = '\0';
+                }
+                if (len == 0) continue;
+
+                if (n == cap) {
+                        cap *= 2;
+                        struct replay_message *bigger = realloc(msgs, cap * sizeof *msgs);
+                        if (bigger == NULL) {
+                                free(msgs);
+                                msgs = NULL;
+                                break;
+                        }
+                        msgs = bigger;
+                }
+
+                // Each message keeps its own copy of the line for its strings
+                char *copy = strdup(line);
+                if (copy && !parse_line(copy, &msgs[n])) {
+                        n++;
+                }
+        }
+
+        free(line);
+        fclose(f);
+        if (msgs == NULL) {
+                fprintf(stderr, "%s: out of memory\n", path);
+                return NULL;
+        }
+
+        // params point into the array element, fix them after the reallocs
+        for (size_t i = 0; i < n; i++) {
+                msgs[i].msg.params = msgs[i].params;
+        }
+        *count = n;
+        return msgs;
+}
+
+/*
+ * Extension loading
+ */
+
+static int is_subscribed(const struct glirc_extension *ext, int api, struct glirc_string cmd)
+{
+        if (api < 1 || ext->subscriptions == NULL) return 1;
+        for (const char * const *s = ext->subscriptions; *s; s++) {
+                if (strlen(*s) == cmd.len && !strncasecmp(*s, cmd.str, cmd.len)) return 1;
+        }
+        return 0;
+}
+
+/* Fill in the fields that depend on the client and the extension */
+static void prepare(struct glirc *G, const struct glirc_extension *ext, int api,
+                    struct replay_message *msgs, size_t n)
+{
+        for (size_t i = 0; i < n; i++) {
+                struct replay_message *m = &msgs[i];
+                m->msg.network = mk(G->network, strlen(G->network));
+                m->interested = ext->process_message && is_subscribed(ext, api, m->msg.command);
+
+                int privmsg = m->msg.command.len == 7 && !memcmp(m->msg.command.str, "PRIVMSG", 7);
+                if (privmsg && m->msg.params_n == 2) {
+                        m->is_chat = 1;
+                        m->chat.network = m->msg.network;
+                        m->chat.target = m->params[0];
+                        m->chat.message = m->params[1];
+                }
+        }
+}
+
+/* Record each channel targeted in the log as joined */
+static void collect_channels(struct glirc *G, const struct replay_message *msgs, size_t n)
+{
+        for (size_t i = 0; i < n; i++) {
+                const struct glirc_message *msg = &msgs[i].msg;
+                if (msg->params_n == 0) continue;
+
+                struct glirc_string tgt = msg->params[0];
+                if (!glirc_is_channel(G, NULL, 0, tgt.str, tgt.len)) continue;
+
+                int seen = 0;
+                for (size_t j = 0; j < G->channels_n && !seen; j++) {
+                        seen = !glirc_identifier_cmp(G->channels[j], strlen(G->channels[j]), tgt.str, tgt.len);
+                }
+                if (seen) continue;
+
+                char **bigger = realloc(G->channels, (G->channels_n + 1) * sizeof *bigger);
+                if (bigger == NULL) return;
+                G->channels = bigger;
+                G->channels[G->channels_n++] = strndup(tgt.str, tgt.len);
+        }
+}
+
+/*
+ * Latency statistics
+ */
+
+struct latencies {
+        uint64_t *ns;
+        size_t n, cap;
+};
+
+static void record(struct latencies *l, double start, double stop)
+{
+        if (l->n < l->cap) {
+                l->ns[l->n++] = (uint64_t)((stop - start) * 1e9);
+        }
+}
+
+static int compare_ns(const void *x, const void *y)
+{
+        uint64_t a = *(const uint64_t *)x, b = *(const uint64_t *)y;
+        return (a > b) - (a < b);
+}
+
+static void report(const char *name, struct latencies *l)
+{
+        if (l->n == 0) return;
+        qsort(l->ns, l->n, sizeof *l->ns, compare_ns);
+        printf("%-16s %10zu calls  p50 %8.2fus  p99 %8.2fus  max %8.2fus\n",
+               name, l->n,
+               l->ns[(l->n - 1) / 2] / 1e3,
+               l->ns[(size_t)((l->n - 1) * 0.99)] / 1e3,
+               l->ns[l->n - 1] / 1e3);
+}
+
+static void usage(const char *prog)
+{
+        fprintf(stderr, "Usage: %s [-n count] [-b size] [-c] [-N network] [-m nick] [-v]"
+                        " extension log [args...]\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+        long count = 100000;
+        long batch = 0;
+        int chat = 0;
+
+        static struct glirc G = { .network = "bench", .nick = "me" };
+
+        int opt;
+        while ((opt = getopt(argc, argv, "n:b:cN:m:v")) != -1) {
+                switch (opt) {
+                case 'n': count = atol(optarg); break;
+                case 'b': batch = atol(optarg); break;
+                case 'c': chat = 1; break;
+                case 'N': G.network = optarg; break;
+                case 'm': G.nick = optarg; break;
+                case 'v': G.verbose = 1; break;
+                default: usage(argv[0]); return 1;
+                }
+        }
+        if (argc - optind < 2 || count <= 0 || batch < 0) {
+                usage(argv[0]);
+                return 1;
+        }
+
+        const char *path = argv[optind];
+        size_t log_n;
+        struct replay_message *msgs = load_log(argv[optind + 1], &log_n);
+        if (msgs == NULL) return 1;
+        if (log_n == 0) {
+                fprintf(stderr, "%s: no messages\n", argv[optind + 1]);
+                return 1;
+        }
+
+        void *dl = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+        if (dl == NULL) {
+                fprintf(stderr, "%s\n", dlerror());
+                return 1;
+        }
+        const struct glirc_extension *ext = dlsym(dl, "extension");
+        if (ext == NULL) {
+                fprintf(stderr, "%s\n", dlerror());
+                return 1;
+        }
+        const int *version = dlsym(dl, "extension_api_version");
+        int api = version ? *version : 0;
+
+        if (batch > 0 && (api < 2 || ext->process_messages == NULL)) {
+                fprintf(stderr, "%s: no process_messages callback, ignoring -b\n", ext->name);
+                batch = 0;
+        }
+
+        collect_channels(&G, msgs, log_n);
+        prepare(&G, ext, api, msgs, log_n);
+
+        size_t ext_args_n = argc - optind - 2;
+        struct glirc_string *ext_args = calloc(ext_args_n + 1, sizeof *ext_args);
+        for (size_t i = 0; i < ext_args_n; i++) {
+                const char *arg = argv[optind + 2 + i];
+                ext_args[i] = mk(arg, strlen(arg));
+        }
+
+        struct latencies msg_lat  = { calloc(count, sizeof (uint64_t)), 0, count };
+        struct latencies chat_lat = { chat ? calloc(count, sizeof (uint64_t)) : NULL, 0, chat ? count : 0 };
+        struct glirc_message *batch_buf = batch ? calloc(batch, sizeof *batch_buf) : NULL;
+        enum process_result *batch_out = batch ? calloc(batch, sizeof *batch_out) : NULL;
+        if (ext_args == NULL || msg_lat.ns == NULL || (chat && chat_lat.ns == NULL) ||
+            (batch && (batch_buf == NULL || batch_out == NULL))) {
+                fprintf(stderr, "out of memory\n");
+                return 1;
+        }
+
+        void *S = ext->start ? ext->start(&G, path, ext_args, ext_args_n) : NULL;
+
+        unsigned long dropped = 0, dispatched = 0;
+        size_t pending = 0;
+
+        atomic_store(&allocations, 0);
+        atomic_store(&counting, 1);
+        double start = bench_now();
+
+        for (long i = 0; i < count; i++) {
+                struct replay_message *m = &msgs[i % log_n];
+
+                if (m->interested) {
+                        dispatched++;
+                        if (batch) {
+                                batch_buf[pending++] = m->msg;
+                        } else {
+                                double t0 = bench_now();
+                                enum process_result r = ext->process_message(S, &m->msg);
+                                record(&msg_lat, t0, bench_now());
+                                dropped += r == DROP_MESSAGE;
+                        }
+                }
+
+                if (batch && (pending == (size_t)batch || (i + 1 == count && pending > 0))) {
+                        for (size_t j = 0; j < pending; j++) batch_out[j] = PASS_MESSAGE;
+                        double t0 = bench_now();
+                        ext->process_messages(S, batch_buf, pending, batch_out);
+                        record(&msg_lat, t0, bench_now());
+                        for (size_t j = 0; j < pending; j++) dropped += batch_out[j] == DROP_MESSAGE;
+                        pending = 0;
+                }
+
+                if (chat && m->is_chat && ext->process_chat) {
+                        double t0 = bench_now();
+                        ext->process_chat(S, &m->chat);
+                        record(&chat_lat, t0, bench_now());
+                }
+
+                if (i % TIMER_CHECK == 0) {
+                        bench_run_timers(&G);
+                }
+        }
+
+        double stop = bench_now();
+        atomic_store(&counting, 0);
+        unsigned long allocs = atomic_load(&allocations);
+
+        if (ext->stop) ext->stop(S);
+
+        double secs = stop - start;
+        printf("%s %d.%d (API version %d)\n", ext->name, ext->major_version, ext->minor_version, api);
+        printf("%ld messages in %.3fs: %.0f messages/s, %lu dispatched, %lu dropped\n",
+               count, secs, count / secs, dispatched, dropped);
+        report(batch ? "process_messages" : "process_message", &msg_lat);
+        report("process_chat", &chat_lat);
+#if defined(COUNT_ALLOCATIONS)
+        printf("%.2f allocations/message\n", (double)allocs / count);
+#else
+        (void)allocs;
+        printf("allocations not counted on this platform\n");
+#endif
+        printf("client calls: %lu sent, %lu printed, %lu injected, %lu jobs, %lu timers\n",
+               G.sent, G.printed, G.injected, G.jobs, G.fired);
+
+        dlclose(dl);
+        return 0;
+}
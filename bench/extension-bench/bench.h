@@ -0,0 +1,40 @@
+#ifndef GLIRC_EXTENSION_BENCH
+#define GLIRC_EXTENSION_BENCH 1
+
+#include <stddef.h>
+
+#include "glirc-api.h"
+
+#define BENCH_TIMERS 64
+
+struct bench_timer {
+        timer_id id;            // 0 when the slot is free
+        double due;             // monotonic seconds
+        double period;          // 0 for one-shot timers
+        timer_callback *cb;
+        void *dat;
+};
+
+/* Client state seen by the extension through the stubbed API */
+struct glirc {
+        const char *network;
+        const char *nick;
+        char **channels;        // channels seen in the replayed log
+        size_t channels_n;
+        int verbose;            // echo glirc_print to stderr
+
+        unsigned long sent;     // glirc_send_message calls
+        unsigned long printed;  // glirc_print calls
+        unsigned long injected; // glirc_inject_chat calls
+        unsigned long jobs;     // jobs and threads run
+        unsigned long fired;    // timer callbacks run
+
+        timer_id next_timer;
+        job_id next_job;
+        struct bench_timer timers[BENCH_TIMERS];
+};
+
+double bench_now(void);
+void bench_run_timers(struct glirc *G);
+
+#endif
@@ -17,6 +17,9 @@ import Foreign.C
 foreign export ccall glirc_send_message       :: Glirc_send_message
 foreign export ccall glirc_print              :: Glirc_print
 foreign export ccall glirc_inject_chat        :: Glirc_inject_chat
+foreign export ccall glirc_send_messages      :: Glirc_send_messages
+foreign export ccall glirc_print_many         :: Glirc_print_many
+foreign export ccall glirc_inject_chat_many   :: Glirc_inject_chat_many
 foreign export ccall glirc_list_networks      :: Glirc_list_networks
 foreign export ccall glirc_identifier_cmp     :: Glirc_identifier_cmp
 foreign export ccall glirc_is_channel         :: Glirc_is_channel
@@ -39,3 +42,22 @@ foreign export ccall glirc_set_timer          :: Glirc_set_timer
 foreign export ccall glirc_cancel_timer       :: Glirc_cancel_timer
 foreign export ccall glirc_window_lines       :: Glirc_window_lines
 foreign export ccall glirc_thread             :: Glirc_thread
+foreign export ccall glirc_subscribe          :: Glirc_subscribe
+foreign export ccall glirc_batch_messages     :: Glirc_batch_messages
+foreign export ccall glirc_window_history     :: Glirc_window_history
+foreign export ccall glirc_free_window_page   :: Glirc_free_window_page
+foreign export ccall glirc_list_networks_packed       :: Glirc_list_networks_packed
+foreign export ccall glirc_list_channels_packed       :: Glirc_list_channels_packed
+foreign export ccall glirc_list_channel_users_packed  :: Glirc_list_channel_users_packed
+foreign export ccall glirc_channel_modes_packed       :: Glirc_channel_modes_packed
+foreign export ccall glirc_channel_masks_packed       :: Glirc_channel_masks_packed
+foreign export ccall glirc_window_lines_packed        :: Glirc_window_lines_packed
+foreign export ccall glirc_free_string_list           :: Glirc_free_string_list
+foreign export ccall glirc_channel_roster     :: Glirc_channel_roster
+foreign export ccall glirc_free_roster        :: Glirc_free_roster
+foreign export ccall glirc_submit_job         :: Glirc_submit_job
+foreign export ccall glirc_submit_long_job    :: Glirc_submit_job
+foreign export ccall glirc_cancel_job         :: Glirc_cancel_job
+foreign export ccall glirc_job_stats          :: Glirc_job_stats
+foreign export ccall glirc_set_interval       :: Glirc_set_interval
+foreign export ccall glirc_reschedule_timer   :: Glirc_reschedule_timer
@@ -0,0 +1,410 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <openssl/ssl.h>
+
+/*
+ * Client-side TLS session cache shared by every connection in the
+ * process. Sessions are stored under a key chosen by the caller,
+ * typically the server name, port and verification settings, and
+ * offered again on the next connection with the same key. TLS 1.3
+ * tickets arrive after the handshake and are picked up by the new
+ * session callback whenever a connection reads them.
+ *
+ * When a file is configured the cache is written to it after changes
+ * so that sessions survive restarts of the process. Changes only mark
+ * the cache dirty and a background thread writes the file, so that a
+ * handshake never waits for the disk. Changes made while the file is
+ * being written are saved together on the next pass.
+ */
+
+#define HOOKUP_SESSIONS 256
+
+struct session_entry {
+    char *key;
+    SSL_SESSION *session;
+    unsigned long stamp; // insertion order used for eviction
+};
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct session_entry cache[HOOKUP_SESSIONS];
+static unsigned long cache_clock;
+static char *cache_file;
+
+static pthread_cond_t cache_dirty_cond = PTHREAD_COND_INITIALIZER; // dirty was set
+static pthread_cond_t cache_idle_cond = PTHREAD_COND_INITIALIZER;  // writer is idle
+static int cache_dirty;
+static int cache_writing;
+static int writer_started;
+
+static pthread_once_t key_index_once = PTHREAD_ONCE_INIT;
+static int key_index = -1;
+
+static void
+free_key(void *parent, void *ptr, CRYPTO_EX_DATA *ad, int idx, long argl, void *argp)
+{
+    (void)parent; (void)ad; (void)idx; (void)argl; (void)argp;
+    free(ptr);
+}
+
+static void
+init_key_index(void)
+{
+    key_index = SSL_get_ex_new_index(0, NULL, NULL, NULL, free_key);
+}
+
+static int
+expired(SSL_SESSION *session)
+{
+    long start = SSL_SESSION_get_time(session);
+    long timeout = SSL_SESSION_get_timeout(session);
+    return time(NULL) >= start + timeout;
+}
+
+static struct session_entry *
+find_entry(char const* key)
+{
+    for (int i = 0; i < HOOKUP_SESSIONS; i++) {
+        if (cache[i].key && 0 == strcmp(cache[i].key, key)) {
+            return &cache[i];
+        }
+    }
+    return NULL;
+}
+
+static void
+clear_entry(struct session_entry *entry)
+{
+    free(entry->key);
+    SSL_SESSION_free(entry->session);
+    memset(entry, 0, sizeof *entry);
+}
+
+/* Store a session taking ownership of it. Caller holds cache_lock. */
+static int
+store_entry(char const* key, SSL_SESSION *session)
+{
+    struct session_entry *entry = find_entry(key);
+
+    if (entry == NULL) {
+        // use a free slot or evict the oldest entry
+        entry = &cache[0];
+        for (int i = 0; i < HOOKUP_SESSIONS; i++) {
+            if (cache[i].key == NULL) { entry = &cache[i]; break; }
+            if (cache[i].stamp < entry->stamp) { entry = &cache[i]; }
+        }
+
+        char *copy = strdup(key);
+        if (copy == NULL) { return 0; }
+
+        if (entry->key) { clear_entry(entry); }
+        entry->key = copy;
+    } else {
+        SSL_SESSION_free(entry->session);
+    }
+
+    entry->session = session;
+    entry->stamp = ++cache_clock;
+    return 1;
+}
+
+/*
+ * Persistence: one line per session with the hex encoded key and the
+ * hex encoded DER serialization of the session.
+ */
+
+static void
+write_hex(FILE *f, unsigned char const* buf, size_t len)
+{
+    for (size_t i = 0; i < len; i++) {
+        fprintf(f, "%02x", buf[i]);
+    }
+}
+
+static size_t
+read_hex(char const* hex, size_t hexlen, unsigned char *out)
+{
+    size_t n = 0;
+    for (size_t i = 0; i + 1 < hexlen; i += 2) {
+        unsigned int byte;
+        if (1 != sscanf(hex + i, "%2x", &byte)) { break; }
+        out[n++] = byte;
+    }
+    return n;
+}
+
+/*
+ * Serialize the live sessions into a buffer. Caller holds cache_lock.
+ * Returns NULL when out of memory.
+ */
+static char *
+serialize_cache(size_t *len)
+{
+    char *buf = NULL;
+    FILE *f = open_memstream(&buf, len);
+    if (f == NULL) { return NULL; }
+
+    for (int i = 0; i < HOOKUP_SESSIONS; i++) {
+        struct session_entry *entry = &cache[i];
+        if (entry->key == NULL || expired(entry->session)) { continue; }
+
+        int derlen = i2d_SSL_SESSION(entry->session, NULL);
+        if (derlen <= 0) { continue; }
+
+        unsigned char *der = malloc(derlen);
+        if (der == NULL) { continue; }
+
+        unsigned char *cursor = der;
+        i2d_SSL_SESSION(entry->session, &cursor);
+
+        write_hex(f, (unsigned char const*)entry->key, strlen(entry->key));
+        fputc(' ', f);
+        write_hex(f, der, derlen);
+        fputc('\n', f);
+        free(der);
+    }
+
+    if (fclose(f)) {
+        free(buf);
+        return NULL;
+    }
+    return buf;
+}
+
+/* Replace the file at path with the serialized cache. */
+static void
+write_cache(char const* path, char const* buf, size_t len)
+{
+    char *tmp = malloc(strlen(path) + sizeof ".XXXXXX");
+    if (tmp == NULL) { return; }
+    sprintf(tmp, "%s.XXXXXX", path);
+
+    // sessions contain secrets, mkstemp creates the file private and
+    // unique to this writer
+    int fd = mkstemp(tmp);
+    if (fd == -1) { free(tmp); return; }
+
+    FILE *f = fdopen(fd, "w");
+    if (f == NULL) {
+        close(fd);
+        remove(tmp);
+        free(tmp);
+        return;
+    }
+
+    int bad = fwrite(buf, 1, len, f) != len;
+    bad = fclose(f) || bad;
+
+    if (bad || rename(tmp, path)) {
+        remove(tmp);
+    }
+    free(tmp);
+}
+
+/* Background thread writing the cache whenever it is marked dirty. */
+static void *
+writer_main(void *arg)
+{
+    (void)arg;
+
+    pthread_mutex_lock(&cache_lock);
+    for (;;) {
+        while (!cache_dirty) {
+            pthread_cond_wait(&cache_dirty_cond, &cache_lock);
+        }
+        cache_dirty = 0;
+        cache_writing = 1;
+
+        size_t len;
+        char *buf = serialize_cache(&len);
+        char *path = cache_file ? strdup(cache_file) : NULL;
+        pthread_mutex_unlock(&cache_lock);
+
+        if (buf && path) { write_cache(path, buf, len); }
+        free(buf);
+        free(path);
+
+        pthread_mutex_lock(&cache_lock);
+        cache_writing = 0;
+        if (!cache_dirty) { pthread_cond_broadcast(&cache_idle_cond); }
+    }
+    return NULL;
+}
+
+/* Schedule a write of the cache file. Caller holds cache_lock. */
+static void
+mark_dirty(void)
+{
+    if (cache_file == NULL) { return; }
+    cache_dirty = 1;
+    pthread_cond_signal(&cache_dirty_cond);
+}
+
+static int
+new_session_cb(SSL *ssl, SSL_SESSION *session)
+{
+    pthread_once(&key_index_once, init_key_index);
+
+    char const* key = SSL_get_ex_data(ssl, key_index);
+    if (key == NULL) { return 0; }
+
+    pthread_mutex_lock(&cache_lock);
+    int stored = store_entry(key, session);
+    if (stored) { mark_dirty(); }
+    pthread_mutex_unlock(&cache_lock);
+
+    // returning 1 transfers ownership of the session to the cache
+    return stored;
+}
+
+/* Configure a context to report new client sessions to the cache. */
+void
+hookup_session_cache_install(SSL_CTX *ctx)
+{
+    SSL_CTX_set_session_cache_mode(ctx,
+        SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(ctx, new_session_cb);
+}
+
+/*
+ * Remember the cache key for a connection and offer the cached session
+ * for that key if there is one. The connection's context must have been
+ * configured with hookup_session_cache_install.
+ *
+ * Returns 1 when a session was offered, 0 when not, -1 on error.
+ */
+int
+hookup_session_cache_prepare(SSL *ssl, char const* key)
+{
+    pthread_once(&key_index_once, init_key_index);
+    if (key_index < 0) { return -1; }
+
+    char *copy = strdup(key);
+    if (copy == NULL) { return -1; }
+
+    free(SSL_get_ex_data(ssl, key_index));
+    if (!SSL_set_ex_data(ssl, key_index, copy)) {
+        free(copy);
+        return -1;
+    }
+
+    int offered = 0;
+
+    pthread_mutex_lock(&cache_lock);
+    struct session_entry *entry = find_entry(key);
+    if (entry) {
+        if (expired(entry->session) || !SSL_SESSION_is_resumable(entry->session)) {
+            clear_entry(entry);
+        } else {
+            offered = SSL_set_session(ssl, entry->session);
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    return offered;
+}
+
+/* Returns 1 when the handshake resumed a previous session. */
+int
+hookup_session_reused(SSL *ssl)
+{
+    return SSL_session_reused(ssl) ? 1 : 0;
+}
+
+/*
+ * Load sessions saved in the given file and save future changes to it.
+ * A missing file is not an error.
+ *
+ * Returns 0 on success, -1 on error with errno set.
+ */
+int
+hookup_session_cache_set_file(char const* path)
+{
+    char *copy = strdup(path);
+    if (copy == NULL) { return -1; }
+
+    FILE *f = fopen(path, "r");
+    if (f == NULL && errno != ENOENT) {
+        free(copy);
+        return -1;
+    }
+
+    pthread_mutex_lock(&cache_lock);
+
+    if (!writer_started) {
+        pthread_t writer;
+        int err = pthread_create(&writer, NULL, writer_main, NULL);
+        if (err) {
+            pthread_mutex_unlock(&cache_lock);
+            if (f) { fclose(f); }
+            free(copy);
+            errno = err;
+            return -1;
+        }
+        pthread_detach(writer);
+        writer_started = 1;
+    }
+
+    free(cache_file);
+    cache_file = copy;
+
+    if (f) {
+        char *line = NULL;
+        size_t cap = 0;
+        ssize_t len;
+
+        while (0 < (len = getline(&line, &cap, f))) {
+            char *space = memchr(line, ' ', len);
+            if (space == NULL) { continue; }
+
+            size_t keyhex = space - line;
+            size_t derhex = len - keyhex - 1;
+            if (derhex > 0 && line[len-1] == '\n') { derhex--; }
+
+            unsigned char *buf = malloc(keyhex / 2 + derhex / 2 + 1);
+            if (buf == NULL) { continue; }
+
+            size_t keylen = read_hex(line, keyhex, buf);
+            buf[keylen] = '\0';
+            char *key = strdup((char *)buf);
+
+            size_t derlen = read_hex(space + 1, derhex, buf);
+            unsigned char const* cursor = buf;
+            SSL_SESSION *session = d2i_SSL_SESSION(NULL, &cursor, derlen);
+            free(buf);
+
+            if (key && session && !expired(session) && store_entry(key, session)) {
+                session = NULL;
+            }
+            SSL_SESSION_free(session);
+            free(key);
+        }
+
+        free(line);
+        fclose(f);
+    }
+
+    pthread_mutex_unlock(&cache_lock);
+    return 0;
+}
+
+/*
+ * Wait until pending changes have been written to the cache file, used
+ * when the process is about to exit.
+ */
+void
+hookup_session_cache_flush(void)
+{
+    pthread_mutex_lock(&cache_lock);
+    while (cache_dirty || cache_writing) {
+        pthread_cond_wait(&cache_idle_cond, &cache_lock);
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
@@ -15,7 +15,7 @@ successful connection.
 
 Use 'connect' and 'close' to establish and close network connections.
 
-Use 'recv', 'recvLine', and 'send' to receive and transmit data on an
+Use 'recv', 'recvLine', 'recvLines', and 'send' to receive and transmit data on an
 open network connection.
 
 TLS and SOCKS parameters can be provided. When both are provided a connection
@@ -36,7 +36,9 @@ module Hookup
   -- * Reading and writing data
   recv,
   recvLine,
+  recvLines,
   send,
+  sendMany,
   putBuf,
 
   -- * Configuration
@@ -47,6 +49,10 @@ module Hookup
   PEM.PemPasswordSupply(..),
   defaultTlsParams,
 
+  -- * TLS session cache
+  getTlsSessionResumed,
+  setTlsSessionFile,
+  flushTlsSessionFile,
 
   -- * Errors
   ConnectionFailure(..),
@@ -131,6 +137,7 @@ data TlsParams = TlsParams
   , tpCipherSuite        :: String -- ^ OpenSSL cipher suite name (e.g. @\"HIGH\"@)
   , tpCipherSuiteTls13   :: Maybe String -- ^ OpenSSL cipher suites for TLS 1.3
   , tpVerify             :: TlsVerify -- ^ Hostname to use when checking certificate validity
+  , tpSessionCache       :: Bool -- ^ Resume sessions from the process-wide TLS session cache
   }
 
 data TlsVerify
@@ -205,6 +212,7 @@ defaultTlsParams = TlsParams
   , tpCipherSuite        = "HIGH"
   , tpCipherSuiteTls13   = Nothing
   , tpVerify             = VerifyDefault
+  , tpSessionCache       = True
   }
 
 ------------------------------------------------------------------------
@@ -374,7 +382,7 @@ openNetworkHandle params mkSocket =
   case cpTls params of
     Nothing  -> Socket <$> mkSocket
     Just tls ->
-        do (clientCert, ssl) <- startTls tls (cpHost params) mkSocket
+        do (clientCert, ssl) <- startTls tls (cpHost params) (cpPort params) mkSocket
            pure (SSL clientCert ssl)
 
 
@@ -388,6 +396,10 @@ networkSend :: NetworkHandle -> ByteString -> IO ()
 networkSend (Socket s) = SocketB.sendAll s
 networkSend (SSL  _ s) = SSL.write       s
 
+networkSendMany :: NetworkHandle -> [ByteString] -> IO ()
+networkSendMany (Socket s) = SocketB.sendMany s
+networkSendMany (SSL  _ s) = SSL.write s . B.concat
+
 networkRecv :: NetworkHandle -> Int -> IO ByteString
 networkRecv (Socket s) = SocketB.recv s
 networkRecv (SSL  _ s) = SSL.read     s
@@ -494,6 +506,49 @@ recvLine (Connection bufVar hVar) n =
                else go h (bsn + B.length more) more (bs:bss)
 
 
+-- | Receive all of the lines available from the network connection.
+-- Lines already in the buffer are returned without waiting; otherwise
+-- this waits for at least one complete line. The lines are slices of
+-- the received chunks and an unterminated remainder is kept in the
+-- buffer. Both @"\\r\\n"@ and @"\\n"@ are recognized.
+--
+-- Returning 'Nothing' means that the peer has closed its half of
+-- the connection.
+--
+-- Throws: 'SSL.ConnectionAbruptlyTerminated', 'SSL.ProtocolError', 'ConnectionFailure', 'IOError'
+recvLines ::
+  Connection              {- ^ open connection             -} ->
+  Int                     {- ^ maximum line length         -} ->
+  IO (Maybe [ByteString]) {- ^ next lines or end-of-stream -}
+recvLines (Connection bufVar hVar) n =
+  modifyMVar bufVar $ \bs ->
+    do h <- readMVar hVar
+       go h (B.length bs) bs []
+  where
+    -- same as recvLine until the first line terminator is found
+    go h bsn bs bss =
+      case B8.elemIndex '\n' bs of
+        Just i ->
+          case splitLines [] (B.tail b) of
+            (ls, rest) -> return (rest, Just (cleanEnd (B.concat (reverse (a:bss))) : ls))
+          where
+            (a,b) = B.splitAt i bs
+        Nothing ->
+          do when (bsn >= n) (throwIO LineTooLong)
+             more <- networkRecv h n
+             if B.null more -- connection closed
+               then if bsn == 0 then return (B.empty, Nothing)
+                                else throwIO LineTruncated
+               else go h (bsn + B.length more) more (bs:bss)
+
+    splitLines acc bs =
+      case B8.elemIndex '\n' bs of
+        Nothing -> (reverse acc, bs)
+        Just i  -> splitLines (cleanEnd a : acc) (B.tail b)
+          where
+            (a,b) = B.splitAt i bs
+
+
 -- | Push a 'ByteString' onto the buffer so that it will be the first
 -- bytes to be read on the next receive operation. This could perhaps
 -- be useful for putting the unused portion of a 'recv' back into the
@@ -525,19 +580,33 @@ send (Connection _ hVar) bs =
   do h <- readMVar hVar
      networkSend h bs
 
+-- | Send several chunks on the network connection as if they were one.
+-- Plain connections use a single vectored send and TLS connections
+-- encrypt the chunks together so they can share a record.
+--
+-- Throws: 'IOError', 'SSL.ProtocolError'
+sendMany ::
+  Connection   {- ^ open connection -} ->
+  [ByteString] {- ^ chunks          -} ->
+  IO ()
+sendMany (Connection _ hVar) bss =
+  do h <- readMVar hVar
+     networkSendMany h bss
+
 
 upgradeTls ::
   TlsParams {- ^ connection params -} ->
   String {- ^ hostname -} ->
+  PortNumber {- ^ port, used for the session cache -} ->
   Connection ->
   IO ()
-upgradeTls tp hostname (Connection bufVar hVar) =
+upgradeTls tp hostname port (Connection bufVar hVar) =
   modifyMVar_ bufVar $ \buf ->
   modifyMVar  hVar   $ \h ->
   case h of
     SSL{} -> return (h, buf)
     Socket s ->
-      do (cert, ssl) <- startTls tp hostname (pure s)
+      do (cert, ssl) <- startTls tp hostname port (pure s)
          return (SSL cert ssl, B.empty)
 
 ------------------------------------------------------------------------
@@ -549,11 +618,12 @@ upgradeTls tp hostname (Connection bufVar hVar) =
 -- requested. This function requires that the TLSParams component
 -- of 'ConnectionParams' is set.
 startTls ::
-  TlsParams {- ^ connection params      -} ->
-  String    {- ^ hostname               -} ->
-  IO Socket {- ^ socket creation action -} ->
+  TlsParams  {- ^ connection params      -} ->
+  String     {- ^ hostname               -} ->
+  PortNumber {- ^ port                   -} ->
+  IO Socket  {- ^ socket creation action -} ->
   IO (Maybe X509, SSL) {- ^ (client certificate, connected TLS) -}
-startTls tp hostname mkSocket = SSL.withOpenSSL $
+startTls tp hostname port mkSocket = SSL.withOpenSSL $
   do ctx <- SSL.context
 
      -- configure context
@@ -569,6 +639,7 @@ startTls tp hostname mkSocket = SSL.withOpenSSL $
        VerifyNone    -> pure ()
      SSL.contextAddOption           ctx SSL.SSL_OP_ALL
      SSL.contextRemoveOption        ctx SSL.SSL_OP_DONT_INSERT_EMPTY_FRAGMENTS
+     when (tpSessionCache tp) (installSessionCache ctx)
 
 
      -- configure certificates
@@ -588,10 +659,26 @@ startTls tp hostname mkSocket = SSL.withOpenSSL $
      isip <- isIpAddress hostname
      unless isip (SSL.setTlsextHostName ssl hostname)
 
+     when (tpSessionCache tp) (prepareSession ssl (sessionKey tp hostname port))
+
      SSL.connect ssl
 
      return (clientCert, ssl)
 
+-- | Sessions are only resumed for connections to the same server with
+-- the same verification and client certificate settings. Resuming a
+-- session skips certificate verification, so a session established
+-- without verification must never satisfy a verified connection.
+sessionKey :: TlsParams -> String -> PortNumber -> String
+sessionKey tp hostname port =
+  intercalate "\n"
+    [ hostname
+    , show port
+    , show (tpVerify tp)
+    , fromMaybe "" (tpClientCertificate tp)
+    , fromMaybe "" (tpServerCertificate tp)
+    ]
+
 isIpAddress :: HostName -> IO Bool
 isIpAddress host =
  do res <- try (Socket.getAddrInfo
@@ -621,6 +708,26 @@ verifyPeer = SSL.VerifyPeer
   , SSL.vpCallback         = Nothing
   }
 
+-- | Test if the TLS handshake resumed a cached session. Connections
+-- without TLS were not resumed.
+getTlsSessionResumed :: Connection -> IO Bool
+getTlsSessionResumed (Connection _ hVar) =
+  withMVar hVar $ \h ->
+  case h of
+    Socket{}  -> return False
+    SSL _ ssl -> sessionReused ssl
+
+-- | Load saved TLS sessions from a file and keep the file updated as
+-- new sessions are established, so that reconnecting after a restart
+-- can resume them. The file is created readable only by its owner.
+setTlsSessionFile :: FilePath -> IO ()
+setTlsSessionFile = setSessionCacheFile
+
+-- | Wait until new sessions have been written to the file given to
+-- 'setTlsSessionFile'. Use before exiting so the newest sessions are kept.
+flushTlsSessionFile :: IO ()
+flushTlsSessionFile = flushSessionCacheFile
+
 -- | Get peer certificate if one exists.
 getPeerCertificate :: Connection -> IO (Maybe X509.X509)
 getPeerCertificate (Connection _ hVar) =
@@ -43,15 +43,84 @@ struct glirc_command {
         struct glirc_string command;
 };
 
+struct glirc_window_line {
+        struct glirc_string text;
+        long long time; /* seconds since the Unix epoch */
+};
+
+/* A list of strings allocated as a single block. Each string is also
+ * null-terminated. */
+struct glirc_string_list {
+        size_t n;
+        struct glirc_string strs[];
+};
+
+struct glirc_roster_entry {
+        struct glirc_string nick;
+        struct glirc_string sigils;
+        struct glirc_string account; /* empty when not known */
+};
+
+/* The members of a channel, allocated as a single block */
+struct glirc_roster {
+        size_t n;
+        struct glirc_roster_entry members[];
+};
+
+/* A page of window lines, newest first, allocated as a single block */
+struct glirc_window_page {
+        size_t n;
+        size_t cursor; /* start of the next page, 0 when no older lines remain */
+        struct glirc_window_line lines[];
+};
+
 typedef void *start_type         (struct glirc *G, const char *path, const struct glirc_string *args, size_t args_len);
 typedef void stop_type           (void *S);
+typedef void stop_jobs_type      (void *S);
 typedef enum process_result process_message_type(void *S, const struct glirc_message *);
+typedef void process_messages_type(void *S, const struct glirc_message *msgs, size_t n, enum process_result *out);
 typedef enum process_result process_chat_type(void *S, const struct glirc_chat *);
 typedef void process_command_type(void *S, const struct glirc_command *);
 
 typedef long timer_id;
 typedef void timer_callback(void *dat, timer_id);
 
+typedef long job_id;
+
+struct glirc_job_stats {
+        size_t queued;        /* jobs waiting for a worker thread */
+        size_t active;        /* jobs running */
+        unsigned long completed;
+        double average_ms;    /* average running time of completed jobs */
+};
+
+/* Version of the struct glirc_extension layout. The client only reads
+ * fields added after version 0 from extensions that export it with
+ * GLIRC_EXTENSION_API_VERSION.
+ */
+#define GLIRC_API_VERSION 4
+
+#if defined(__GNUC__)
+#define GLIRC_API_EXPORT __attribute__ ((visibility ("default")))
+#else
+#define GLIRC_API_EXPORT
+#endif
+
+/* Values for the flags field of struct glirc_extension */
+enum glirc_extension_flags {
+        /* The extension only observes traffic and never drops
+         * messages. The client runs it on its own dispatcher thread
+         * unless configured otherwise. */
+        GLIRC_OBSERVE_ONLY = 1,
+        /* The extension drops messages and must always run in the
+         * client's event loop. */
+        GLIRC_SYNCHRONOUS  = 2
+};
+
+#define GLIRC_EXTENSION_API_VERSION \
+        extern GLIRC_API_EXPORT const int extension_api_version; \
+        const int extension_api_version = GLIRC_API_VERSION
+
 struct glirc_extension {
         const char *name;
         int major_version, minor_version;
@@ -60,6 +129,34 @@ struct glirc_extension {
         process_message_type *process_message;
         process_command_type *process_command;
         process_chat_type    *process_chat;
+
+        /* version 1: NULL-terminated list of commands passed to
+         * process_message, or NULL for every command */
+        const char * const   *subscriptions;
+
+        /* version 2: optional, called instead of process_message with
+         * several messages at once, storing a result for each in out.
+         * The batch is offered before the client has processed any of
+         * its messages, so the callback must not inject chat or print
+         * lines that belong after a message of the batch and must not
+         * depend on client state that the earlier messages of the batch
+         * will change. Batches are only used while every extension
+         * loaded before this one also accepts batches. An extension
+         * that only sometimes wants batches can turn them off and on
+         * again with glirc_batch_messages, process_message is used
+         * while they are off. */
+        process_messages_type *process_messages;
+
+        /* version 3: glirc_extension_flags */
+        unsigned flags;
+
+        /* version 4: optional, called when the client stops the
+         * extension while some of its jobs are still running. Jobs
+         * that haven't started have already been cancelled and the
+         * extension should make the running ones return promptly.
+         * Their finish callbacks are not called and stop is called
+         * once the last of them has returned. */
+        stop_jobs_type       *stop_jobs;
 };
 
 int glirc_send_message(struct glirc *G, const struct glirc_message *);
@@ -69,6 +166,13 @@ int glirc_inject_chat(struct glirc *G,
                 const char* src, size_t srcLen,
                 const char* tgt, size_t tgtLen,
                 const char* msg, size_t msgLen);
+int glirc_send_messages(struct glirc *G, const struct glirc_message *msgs, size_t n);
+int glirc_print_many(struct glirc *G, enum message_code, const struct glirc_string *msgs, size_t n);
+int glirc_inject_chat_many(struct glirc *G,
+                const char* net, size_t netLen,
+                const char* src, size_t srcLen,
+                const char* tgt, size_t tgtLen,
+                const struct glirc_string *msgs, size_t n);
 char ** glirc_list_networks(struct glirc *G);
 char ** glirc_list_channels(struct glirc *G, const char *net, size_t netlen);
 char ** glirc_list_channel_users(struct glirc *G, const char *net, size_t net_len, const char *chan, size_t chan_len);
@@ -88,11 +192,30 @@ int glirc_is_logged_on(struct glirc *G, const char *net, size_t netlen,
                                         const char *tgt, size_t tgtlen);
 char * glirc_resolve_path(struct glirc *G, const char *path, size_t path_len);
 timer_id glirc_set_timer(struct glirc *G, unsigned long millis, timer_callback *cb, void *dat);
+timer_id glirc_set_interval(struct glirc *G, unsigned long millis, timer_callback *cb, void *dat);
+int glirc_reschedule_timer(struct glirc *G, timer_id tid, unsigned long millis);
 void *glirc_cancel_timer(struct glirc *G, timer_id tid);
 char ** glirc_window_lines(struct glirc *G, const char *net, size_t netlen, const char *tgt, size_t tgtlen, int filtered);
+struct glirc_string_list * glirc_list_networks_packed(struct glirc *G);
+struct glirc_string_list * glirc_list_channels_packed(struct glirc *G, const char *net, size_t netlen);
+struct glirc_string_list * glirc_list_channel_users_packed(struct glirc *G, const char *net, size_t netlen, const char *chan, size_t chanlen);
+struct glirc_roster * glirc_channel_roster(struct glirc *G, const char *net, size_t netlen, const char *chan, size_t chanlen);
+struct glirc_string_list * glirc_channel_modes_packed(struct glirc *G, const char *net, size_t netlen, const char *chan, size_t chanlen);
+struct glirc_string_list * glirc_channel_masks_packed(struct glirc *G, const char *net, size_t netlen, const char *chan, size_t chanlen, char mode);
+struct glirc_string_list * glirc_window_lines_packed(struct glirc *G, const char *net, size_t netlen, const char *tgt, size_t tgtlen, int filtered);
+struct glirc_window_page * glirc_window_history(struct glirc *G, const char *net, size_t netlen, const char *tgt, size_t tgtlen, int filtered, size_t start, size_t limit, long long before);
 void glirc_thread(struct glirc *G, void *(*start)(void *), void(*finish)(void*), void *arg);
+job_id glirc_submit_job(struct glirc *G, void *(*start)(void *), void(*finish)(void*), void *arg);
+job_id glirc_submit_long_job(struct glirc *G, void *(*start)(void *), void(*finish)(void*), void *arg);
+void *glirc_cancel_job(struct glirc *G, job_id jid);
+void glirc_job_stats(struct glirc *G, struct glirc_job_stats *stats);
+int glirc_subscribe(struct glirc *G, const struct glirc_string *commands, size_t commands_len);
+int glirc_batch_messages(struct glirc *G, int enable);
 
 void glirc_free_string(char *);
 void glirc_free_strings(char **);
+void glirc_free_window_page(struct glirc_window_page *);
+void glirc_free_string_list(struct glirc_string_list *);
+void glirc_free_roster(struct glirc_roster *);
 
 #endif
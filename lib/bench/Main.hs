@@ -0,0 +1,66 @@
+{-|
+Module      : Main
+Description : Benchmarks for the irc-core message parsers
+Copyright   : (c) Eric Mertens, 2018
+License     : ISC
+Maintainer  : emertens@gmail.com
+
+This module compares the Text and ByteString IRC message parsers on a
+log of raw IRC lines. The log is read from the file named by the
+@IRC_DUMP@ environment variable and defaults to the sample traffic
+used by the extension benchmark.
+
+@
+IRC_DUMP=network.log cabal bench irc-core
+@
+
+-}
+module Main (main) where
+
+import           Criterion.Main
+import qualified Data.ByteString.Char8 as B8
+import           Data.List (foldl')
+import           Data.Maybe (fromMaybe)
+import qualified Data.Text as Text
+import           Irc.RawIrcMsg
+import           System.Environment (lookupEnv)
+
+main :: IO ()
+main =
+  do path  <- fromMaybe "../bench/extension-bench/traffic.irc" <$> lookupEnv "IRC_DUMP"
+     lines' <- filter (not . B8.null) . map dropCR . B8.lines <$> B8.readFile path
+     defaultMain
+       [ env (pure lines') $ \ls ->
+         bgroup "parse"
+           [ bench "Text"                    $ whnf (count (fmap useAll . parseRawIrcMsg . asUtf8)) ls
+           , bench "ByteString"              $ whnf (count (fmap useLine . parseRawIrcLine)) ls
+           , bench "ByteString, decoded"     $ whnf (count (fmap (useAll . decodeRawIrcLine) . parseRawIrcLine)) ls
+           , bench "ByteString, command only" $ whnf (count (fmap (useCommand . rawIrcLineMsg) . parseRawIrcLine)) ls
+           ]
+       ]
+  where
+    dropCR l
+      | not (B8.null l), B8.last l == '\r' = B8.init l
+      | otherwise                          = l
+
+-- | Add up a measure of each parsed line so that all of it is demanded.
+count :: (a -> Maybe Int) -> [a] -> Int
+count f = foldl' (\acc x -> acc + fromMaybe 0 (f x)) 0
+
+-- | Demand every field of a decoded message, as the client does.
+useAll :: RawIrcMsg -> Int
+useAll m = length (_msgTags m)
+         + maybe 0 (const 1) (_msgPrefix m)
+         + Text.length (_msgCommand m)
+         + sum (map Text.length (_msgParams m))
+
+-- | Demand only the command, as for a message that is filtered out.
+useCommand :: RawIrcMsg -> Int
+useCommand = Text.length . _msgCommand
+
+-- | Demand the slices of a message, as an extension does.
+useLine :: RawIrcLine -> Int
+useLine l = length (lineTags l)
+          + maybe 0 B8.length (linePrefix l)
+          + B8.length (lineCommand l)
+          + sum (map B8.length (lineParams l))
@@ -19,6 +19,7 @@ module Irc.RateLimit
   ( RateLimit
   , newRateLimit
   , tickRateLimit
+  , tryTickRateLimit
   ) where
 
 import Control.Concurrent
@@ -61,3 +62,15 @@ tickRateLimit r = modifyMVar_ (rateStamp r) $ \stamp ->
      when (excess > 0) (threadDelay (ceiling (1000000 * excess)))
 
      return stamp'
+
+-- | Account for an event in the context of a 'RateLimit' only when it
+-- can proceed without delay. Returns 'True' when the event was counted
+-- and the rate limited action may proceed immediately.
+tryTickRateLimit :: RateLimit -> IO Bool
+tryTickRateLimit r = modifyMVar (rateStamp r) $ \stamp ->
+  do now <- getCurrentTime
+     let stamp' = ratePenalty r `addUTCTime` max stamp now
+         diff   = diffUTCTime stamp' now
+         excess = diff - rateThreshold r
+
+     return $! if excess > 0 then (stamp, False) else (stamp', True)
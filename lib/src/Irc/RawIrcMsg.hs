@@ -30,6 +30,13 @@ module Irc.RawIrcMsg
   , prefixParser
   , simpleTokenParser
 
+  -- * Undecoded IRC messages
+  , RawIrcLine(..)
+  , parseRawIrcLine
+  , rawIrcLineMsg
+  , decodeRawIrcLine
+  , unescapeTagBytes
+
   -- * Permissive text decoder
   , asUtf8
   ) where
@@ -38,6 +45,7 @@ import           Control.Applicative
 import           Data.Attoparsec.Text as P
 import           Data.ByteString (ByteString)
 import qualified Data.ByteString as B
+import qualified Data.ByteString.Char8 as B8
 import qualified Data.ByteString.Lazy as L
 import           Data.ByteString.Builder (Builder)
 import qualified Data.ByteString.Builder as Builder
@@ -48,6 +56,7 @@ import qualified Data.Text as Text
 import qualified Data.Text.Encoding as Text
 import           Data.Vector (Vector)
 import qualified Data.Vector as Vector
+import           Data.Word (Word8)
 
 import           Irc.UserInfo
 import           View
@@ -215,6 +224,122 @@ simpleTokenParser =
 spaces :: Parser ()
 spaces = P.skipWhile (== ' ')
 
+-- | 'RawIrcLine' is an IRC message split into the same parts as
+-- 'RawIrcMsg' but without decoding them. Each part is a slice of the
+-- line it was parsed from, so the line stays in memory as long as any
+-- part of it does. Tag values are still escaped.
+data RawIrcLine = RawIrcLine
+  { lineTags    :: [(ByteString, ByteString)] -- ^ IRCv3.2 message tag keys and escaped values
+  , linePrefix  :: !(Maybe ByteString)        -- ^ Optional sender of message
+  , lineCommand :: !ByteString                -- ^ Command
+  , lineParams  :: [ByteString]               -- ^ Command parameters
+  }
+  deriving (Eq, Read, Show)
+
+-- | Split an IRC protocol message without its trailing newline into
+-- its parts. This accepts exactly the messages that 'parseRawIrcMsg'
+-- accepts, but it works on the bytes received from the server and
+-- finds each delimiter with a single scan instead of decoding the
+-- message first.
+parseRawIrcLine :: ByteString -> Maybe RawIrcLine
+parseRawIrcLine x0 =
+  do (prefix, x2) <-
+       case B.uncons x1 of
+         Just (0x3a, rest) -> do (p, rest') <- lineToken rest
+                                 Just (Just p, rest')
+         _                 -> Just (Nothing, x1)
+     (cmd, x3) <- lineToken x2
+     Just $! RawIrcLine
+       { lineTags    = tags
+       , linePrefix  = prefix
+       , lineCommand = cmd
+       , lineParams  = lineParamSlices maxMiddleParams x3
+       }
+  where
+    (tags, x1) =
+      case B.uncons x0 of
+        Just (0x40, rest) ->
+          case breakSpace rest of
+            (sec, rest') -> (map splitTag (splitTags sec), skipSpaces rest')
+        _ -> ([], x0)
+
+    -- like 'sepBy1', an empty section is a single empty tag
+    splitTags sec
+      | B.null sec = [B.empty]
+      | otherwise  = B.split 0x3b sec
+
+    splitTag tag =
+      case B.elemIndex 0x3d tag of
+        Nothing -> (tag, B.empty)
+        Just i  -> (B.take i tag, B.drop (i+1) tag)
+
+-- | Split the parameters of a message like 'paramsParser'.
+lineParamSlices :: Int {- ^ possible middle parameters -} -> ByteString -> [ByteString]
+lineParamSlices !n x =
+  case B.uncons x of
+    Nothing -> []
+    Just (0x3a, rest) -> [rest]
+    Just{}
+      | n == 0    -> [x]
+      | otherwise -> case breakSpace x of
+                       (tok, rest) -> tok : lineParamSlices (n-1) (skipSpaces rest)
+
+-- | Take the next space-delimited lexeme like 'simpleTokenParser'.
+lineToken :: ByteString -> Maybe (ByteString, ByteString)
+lineToken x
+  | B.null tok = Nothing
+  | otherwise  = Just (tok, skipSpaces rest)
+  where
+    (tok, rest) = breakSpace x
+
+-- | Split at the first space, found with @memchr@.
+breakSpace :: ByteString -> (ByteString, ByteString)
+breakSpace x =
+  case B.elemIndex spaceByte x of
+    Nothing -> (x, B.empty)
+    Just i  -> B.splitAt i x
+
+skipSpaces :: ByteString -> ByteString
+skipSpaces = B.dropWhile (== spaceByte)
+
+spaceByte :: Word8
+spaceByte = 0x20
+
+-- | Decode the parts of a 'RawIrcLine' as they are needed. Each part is
+-- decoded with 'asUtf8' the first time it is used.
+rawIrcLineMsg :: RawIrcLine -> RawIrcMsg
+rawIrcLineMsg l = RawIrcMsg
+  { _msgTags    = [ TagEntry (asUtf8 k) (asUtf8 (unescapeTagBytes v)) | (k,v) <- lineTags l ]
+  , _msgPrefix  = parseUserInfo . asUtf8 <$> linePrefix l
+  , _msgCommand = asUtf8 (lineCommand l)
+  , _msgParams  = map asUtf8 (lineParams l)
+  }
+
+-- | Decode all of the parts of a 'RawIrcLine' now. The resulting message
+-- doesn't refer to the line it was parsed from.
+decodeRawIrcLine :: RawIrcLine -> RawIrcMsg
+decodeRawIrcLine l =
+  forceList tags `seq` forceList params `seq` forceList prefix `seq` msg
+  where
+    msg@(RawIrcMsg tags prefix _ params) = rawIrcLineMsg l
+
+    forceList :: Foldable t => t a -> ()
+    forceList = foldr seq ()
+
+-- | Apply the message tag unescape algorithm to a tag value.
+unescapeTagBytes :: ByteString -> ByteString
+unescapeTagBytes v
+  | B.notElem 0x5c v = v
+  | otherwise        = B8.pack (aux (B8.unpack v))
+  where
+    aux ('\\':':':xs) = ';':aux xs
+    aux ('\\':'s':xs) = ' ':aux xs
+    aux ('\\':'\\':xs) = '\\':aux xs
+    aux ('\\':'r':xs) = '\r':aux xs
+    aux ('\\':'n':xs) = '\n':aux xs
+    aux (x:xs)        = x : aux xs
+    aux ""            = ""
+
 -- | Serialize a structured IRC protocol message back into its wire
 -- format. This command adds the required trailing newline.
 renderRawIrcMsg :: RawIrcMsg -> ByteString
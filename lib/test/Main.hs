@@ -12,6 +12,7 @@ This module test IRC message parsing.
 module Main (main) where
 
 import qualified Data.Text as Text
+import qualified Data.Text.Encoding as Text
 import           Data.Hashable
 import           Data.Semigroup
 import           Irc.RawIrcMsg
@@ -31,7 +32,7 @@ main =
 tests :: Test
 tests = test [ irc0, irc2, irc15, ircWithPrefix, ircWithTags,
                parseUserInfos, renderUserInfos, renderIrc,
-               badRawMsgs, userInfoFields, identifierInstances ]
+               badRawMsgs, rawIrcLines, userInfoFields, identifierInstances ]
 
 -- | Check that we can handle commands without parameters
 irc0 :: Test
@@ -243,6 +244,27 @@ badRawMsgs = test
       (parseRawIrcMsg "@glguy=tester")
   ]
 
+-- | Check that the ByteString parser agrees with the Text parser
+rawIrcLines :: Test
+rawIrcLines = test
+  [ assertEqual (show line)
+      (parseRawIrcMsg line)
+      (rawIrcLineMsg <$> parseRawIrcLine (Text.encodeUtf8 line))
+  | line <- lines15 ++
+      [ "COMMAND", "COMMAND  ", "COMMAND :", "COMMAND param1   :param2 "
+      , ":glguy!~glguy@haskell/developer/glguy PRIVMSG #haskell :hello  world "
+      , ":morgan.example.net 254 glguytest 57555 :channels formed"
+      , "@time=value;this=\\n\\rand\\\\\\s\\:that CMD"
+      , "@this\\s=value CMD", "@this;that CMD", "@;x=a=b CMD", "@ CMD"
+      , "@trailing=\\ :prefix CMD", "PRIVMSG #ħ :ünïcode"
+      , ": CMD", "", "   ", "  CMD", ":glguy!glguy@glguy", "@glguy=tester"
+      ]
+  ]
+  where
+    params  = map (Text.pack . show) [1 .. 16 :: Int]
+    lines15 = [ "001 " <> Text.unwords params
+              , "001 " <> Text.unwords (take 14 params) <> "  :last  two" ]
+
 identifierInstances :: Test
 identifierInstances = test
   [ assertEqual "read" (Just ("GLGUY"::Identifier)) (readMaybe "\"glguy\"")
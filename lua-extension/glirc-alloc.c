@@ -0,0 +1,133 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "glirc-alloc.h"
+
+/* Blocks kept on each free list before they are returned to malloc */
+#define ALLOC_POOL_DEPTH 512
+
+struct free_block {
+        struct free_block *next;
+};
+
+struct alloc_state *new_alloc_state(size_t limit)
+{
+        struct alloc_state *st = calloc(1, sizeof *st);
+        if (st) {
+                st->limit = limit;
+        }
+        return st;
+}
+
+void free_alloc_state(struct alloc_state *st)
+{
+        if (st == NULL) return;
+
+        for (int i = 0; i < ALLOC_POOL_CLASSES; i++) {
+                struct free_block *b = st->pool[i];
+                while (b) {
+                        struct free_block *next = b->next;
+                        free(b);
+                        b = next;
+                }
+        }
+        free(st);
+}
+
+/* Size class of a small block, every block in a class is allocated
+ * with the class's largest size so that blocks can be reused for any
+ * request in the class.
+ */
+static int size_class(size_t n)
+{
+        return n <= ALLOC_POOL_MAX ? (int)((n + ALLOC_POOL_STEP - 1) / ALLOC_POOL_STEP) - 1 : -1;
+}
+
+static void *alloc_block(struct alloc_state *st, size_t n)
+{
+        int c = size_class(n);
+        if (c < 0) {
+                return malloc(n);
+        }
+
+        struct free_block *b = st->pool[c];
+        if (b) {
+                st->pool[c] = b->next;
+                st->pool_len[c]--;
+                st->pool_hits++;
+                return b;
+        }
+        return malloc((c + 1) * ALLOC_POOL_STEP);
+}
+
+static void free_block(struct alloc_state *st, void *ptr, size_t n)
+{
+        int c = size_class(n);
+        if (c < 0 || st->pool_len[c] >= ALLOC_POOL_DEPTH) {
+                free(ptr);
+                return;
+        }
+
+        struct free_block *b = ptr;
+        b->next = st->pool[c];
+        st->pool[c] = b;
+        st->pool_len[c]++;
+}
+
+/* lua_Alloc implementation that keeps the statistics in the
+ * alloc_state passed as ud and enforces its limit. When ptr is NULL,
+ * osize is the kind of object being allocated rather than a size.
+ */
+void *glirc_lua_alloc(void *ud, void *ptr, size_t osize, size_t nsize)
+{
+        struct alloc_state *st = ud;
+        if (ptr == NULL) osize = 0;
+
+        if (nsize == 0) {
+                if (ptr) {
+                        free_block(st, ptr, osize);
+                        st->bytes -= osize;
+                        st->frees++;
+                }
+                return NULL;
+        }
+
+        // Lua requires that shrinking never fails
+        if (nsize > osize && st->limit && st->bytes - osize + nsize > st->limit) {
+                st->failures++;
+                return NULL;
+        }
+
+        void *res;
+        if (ptr == NULL) {
+                res = alloc_block(st, nsize);
+                if (res) st->allocs++;
+        } else if (size_class(osize) >= 0 && size_class(osize) == size_class(nsize)) {
+                res = ptr;
+                st->reallocs++;
+        } else if (size_class(osize) < 0 && size_class(nsize) < 0) {
+                res = realloc(ptr, nsize);
+                if (res) st->reallocs++;
+        } else {
+                res = alloc_block(st, nsize);
+                if (res) {
+                        memcpy(res, ptr, osize < nsize ? osize : nsize);
+                        free_block(st, ptr, osize);
+                        st->reallocs++;
+                }
+        }
+
+        if (res == NULL) {
+                // a failed shrink leaves the original block in place
+                if (nsize <= osize) {
+                        st->bytes -= osize - nsize;
+                        return ptr;
+                }
+                st->failures++;
+                return NULL;
+        }
+
+        st->bytes = st->bytes - osize + nsize;
+        if (st->bytes > st->peak) st->peak = st->bytes;
+        return res;
+}
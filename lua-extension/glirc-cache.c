@@ -0,0 +1,220 @@
+/* Bytecode cache for Lua scripts and modules
+ *
+ * Compiled chunks are stored in a cache directory, one file per source
+ * path. Each file starts with a header line naming the Lua release and
+ * the source path, modification time in nanoseconds, and size; a cached
+ * chunk is only used when all of these still match.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "glirc-cache.h"
+
+#ifdef __APPLE__
+#define MTIME_NSEC(st) ((st).st_mtimespec.tv_nsec)
+#else
+#define MTIME_NSEC(st) ((st).st_mtim.tv_nsec)
+#endif
+
+/* FNV-1a, used to give each source path its own cache file */
+static unsigned long long hash_path(const char *path)
+{
+        unsigned long long h = 14695981039346656037ULL;
+        for (; *path; path++) {
+                h ^= (unsigned char)*path;
+                h *= 1099511628211ULL;
+        }
+        return h;
+}
+
+/* Load the chunk in cachefile when its header matches.
+ *
+ * Returns LUA_OK and pushes the chunk, otherwise pushes nothing.
+ *
+ * [-0, +(0|1), m]
+ */
+static int load_cached
+  (lua_State *L,
+   const char *cachefile,
+   const char *header,
+   const char *chunkname)
+{
+        FILE *f = fopen(cachefile, "rb");
+        if (f == NULL) return LUA_ERRFILE;
+
+        size_t hlen = strlen(header);
+        int status = LUA_ERRFILE;
+        char *buf = NULL;
+        struct stat st;
+
+        if (fstat(fileno(f), &st) == 0 &&
+            (size_t)st.st_size > hlen &&
+            (buf = malloc(st.st_size)) &&
+            fread(buf, 1, st.st_size, f) == (size_t)st.st_size &&
+            memcmp(buf, header, hlen) == 0) {
+                status = luaL_loadbufferx(L, buf + hlen, st.st_size - hlen, chunkname, "b");
+                if (status != LUA_OK) {
+                        lua_pop(L, 1);
+                }
+        }
+
+        free(buf);
+        fclose(f);
+        return status;
+}
+
+static int write_chunk(lua_State *L, const void *p, size_t sz, void *ud)
+{
+        return fwrite(p, 1, sz, ud) != sz;
+}
+
+/* Create a uniquely named temporary file next to cachefile, creating
+ * the cache directory when it is missing. The name is stored in tmpfile.
+ */
+static FILE *open_temporary(const char *dir, const char *cachefile, char *tmpfile)
+{
+        sprintf(tmpfile, "%s.XXXXXX", cachefile);
+        int fd = mkstemp(tmpfile);
+        if (fd == -1 && errno == ENOENT && mkdir(dir, 0700) == 0) {
+                sprintf(tmpfile, "%s.XXXXXX", cachefile);
+                fd = mkstemp(tmpfile);
+        }
+        if (fd == -1) return NULL;
+
+        FILE *f = fdopen(fd, "wb");
+        if (f == NULL) {
+                close(fd);
+                remove(tmpfile);
+        }
+        return f;
+}
+
+/* Store the chunk on the top of the stack in cachefile. Writes go to a
+ * temporary file that is renamed into place so that concurrent clients
+ * never see a partial chunk. Failures only cost the cache entry.
+ *
+ * [-0, +0, m]
+ */
+static void save_cached
+  (lua_State *L,
+   const char *dir,
+   const char *cachefile,
+   const char *header)
+{
+        char *tmpfile = malloc(strlen(cachefile) + sizeof ".XXXXXX");
+        if (tmpfile == NULL) return;
+
+        FILE *f = open_temporary(dir, cachefile, tmpfile);
+        if (f) {
+                int bad = fputs(header, f) < 0;
+                lua_pushvalue(L, -1);
+                bad = bad || lua_dump(L, write_chunk, f, 0);
+                lua_pop(L, 1);
+                bad = fclose(f) || bad;
+
+                if (bad || rename(tmpfile, cachefile)) {
+                        remove(tmpfile);
+                }
+        }
+
+        free(tmpfile);
+}
+
+/* Drop-in replacement for luaL_loadfile that reuses the cached chunk
+ * for path from dir when it is current and refreshes it otherwise.
+ *
+ * [-0, +1, m]
+ */
+int glirc_cache_loadfile(lua_State *L, const char *dir, const char *path)
+{
+        struct stat st;
+        if (stat(path, &st)) {
+                return luaL_loadfile(L, path);
+        }
+
+        char key[17];
+        snprintf(key, sizeof key, "%016llx", hash_path(path));
+
+        const char *header    = lua_pushfstring(L, "glirc-luac %s %I %I %I %s\n",
+                                    LUA_RELEASE,
+                                    (lua_Integer)st.st_mtime,
+                                    (lua_Integer)MTIME_NSEC(st),
+                                    (lua_Integer)st.st_size,
+                                    path);
+        const char *cachefile = lua_pushfstring(L, "%s/%s.luac", dir, key);
+        const char *chunkname = lua_pushfstring(L, "@%s", path);
+        // STACK: header cachefile chunkname
+
+        int status = load_cached(L, cachefile, header, chunkname);
+        if (status != LUA_OK) {
+                status = luaL_loadfile(L, path);
+                if (status == LUA_OK) {
+                        save_cached(L, dir, cachefile, header);
+                }
+        }
+        // STACK: header cachefile chunkname result
+
+        lua_replace(L, -4);
+        lua_pop(L, 2);
+        return status;
+}
+
+/* package.searchers entry that finds modules along package.path like
+ * the standard Lua searcher but loads them through the cache.
+ * Upvalues: cache directory, package table
+ */
+static int cache_searcher(lua_State *L)
+{
+        const char *name = luaL_checkstring(L, 1);
+        const char *dir  = lua_tostring(L, lua_upvalueindex(1));
+
+        lua_getfield(L, lua_upvalueindex(2), "searchpath");
+        lua_pushvalue(L, 1);
+        lua_getfield(L, lua_upvalueindex(2), "path");
+        lua_call(L, 2, 1);             // STACK: name filename
+
+        // Leave reporting missing modules to the standard searcher
+        if (!lua_isstring(L, -1)) return 0;
+
+        const char *filename = lua_tostring(L, -1);
+        if (glirc_cache_loadfile(L, dir, filename) != LUA_OK) {
+                return luaL_error(L, "error loading module '%s' from file '%s':\n\t%s",
+                                  name, filename, lua_tostring(L, -1));
+        }
+        lua_insert(L, -2);             // STACK: name loader filename
+        return 2;
+}
+
+/* Install cache_searcher ahead of the standard Lua file searcher.
+ *
+ * [-0, +0, e]
+ */
+void glirc_install_cache_searcher(lua_State *L, const char *dir)
+{
+        lua_getglobal(L, "package");
+        lua_getfield(L, -1, "searchers"); // STACK: package searchers
+        luaL_checktype(L, -1, LUA_TTABLE);
+
+        lua_Integer n = luaL_len(L, -1);
+        for (lua_Integer i = n; i >= 2; i--) {
+                lua_rawgeti(L, -1, i);
+                lua_rawseti(L, -2, i + 1);
+        }
+
+        lua_pushstring(L, dir);
+        lua_pushvalue(L, -3);
+        lua_pushcclosure(L, cache_searcher, 2);
+        lua_rawseti(L, -2, 2);
+
+        lua_pop(L, 2);
+}
@@ -10,6 +10,19 @@ Through this library scripts can send messages, check modes, and more.
 @copyright Eric Mertens 2018
 */
 
+#define _GNU_SOURCE // pipe2
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
 #include <lauxlib.h>
 
 #include "glirc-api.h"
@@ -17,6 +30,13 @@ Through this library scripts can send messages, check modes, and more.
 #include "glirc-marshal.h"
 #include "glirc-thread.h"
 
+#ifdef __APPLE__
+#include <crt_externs.h>
+#define environ (*_NSGetEnviron())
+#else
+extern char **environ;
+#endif
+
 /***
 Send an IRC command on a connected network. Message tags are ignored
 when sending a message.
@@ -143,6 +163,41 @@ static int glirc_lua_error(lua_State *L)
         return 0;
 }
 
+/***
+Print several messages to the client console in one update. This is
+cheaper than calling `glirc.print` for each line of a long report.
+@function print_many
+@tparam {string,...} messages Messages to print in order
+@tparam[opt=false] boolean error Print the messages as errors
+@raise `'client failure'`
+@usage glirc.print_many{'first line', 'second line'}
+*/
+static int glirc_lua_print_many(lua_State *L)
+{
+        luaL_checktype(L, 1, LUA_TTABLE);
+        int const error = lua_toboolean(L, 2);
+        luaL_checktype(L, 3, LUA_TNONE);
+
+        lua_Integer const n = luaL_len(L, 1);
+
+        // Array allocated on Lua heap automatically cleaned up on error
+        struct glirc_string *msgs =
+                lua_newuserdata(L, (n > 0 ? n : 1) * sizeof *msgs);
+
+        // Strings remain reachable through the table argument
+        for (lua_Integer i = 0; i < n; i++) {
+                int ty = lua_rawgeti(L, 1, i+1);
+                luaL_argcheck(L, ty == LUA_TSTRING, 1, "expected strings");
+                msgs[i].str = lua_tolstring(L, -1, &msgs[i].len);
+                lua_pop(L, 1);
+        }
+
+        if (glirc_print_many(get_glirc(L), error ? ERROR_MESSAGE : NORMAL_MESSAGE, msgs, n)) {
+                luaL_error(L, "client failure");
+        }
+        return 0;
+}
+
 /***
 Generate a list of names of connected networks.
 @function list_networks
@@ -154,7 +209,7 @@ static int glirc_lua_list_networks(lua_State *L)
 {
         luaL_checktype(L, 1, LUA_TNONE);
 
-        char **networks = glirc_list_networks(get_glirc(L));
+        struct glirc_string_list *networks = glirc_list_networks_packed(get_glirc(L));
         if (networks == NULL) { luaL_error(L, "client failure"); }
 
         import_string_array(L, networks);
@@ -176,7 +231,7 @@ static int glirc_lua_list_channels(lua_State *L)
         const char *network = luaL_checklstring(L, 1, &network_len);
         luaL_checktype(L, 2, LUA_TNONE);
 
-        char **channels = glirc_list_channels(get_glirc(L), network, network_len);
+        struct glirc_string_list *channels = glirc_list_channels_packed(get_glirc(L), network, network_len);
         if (channels == NULL) { luaL_error(L, "no such network"); }
 
         import_string_array(L, channels);
@@ -200,7 +255,7 @@ static int glirc_lua_list_channel_users(lua_State *L)
         const char *channel = luaL_checklstring(L, 2, &channel_len);
         luaL_checktype(L, 3, LUA_TNONE);
 
-        char **users = glirc_list_channel_users
+        struct glirc_string_list *users = glirc_list_channel_users_packed
                         (get_glirc(L), network, network_len,
                                        channel, channel_len);
         if (users == NULL) { luaL_error(L, "no such channel"); }
@@ -256,6 +311,53 @@ static int glirc_lua_user_channel_modes(lua_State *L)
         return 1;
 }
 
+/***
+List the users in a channel along with their mode sigils and services
+accounts. All of the entries come from the same snapshot of the client
+state.
+@function channel_roster
+@tparam string network Network name
+@tparam string channel Channel name
+@treturn {table,...} A table of records with fields `nick`, `sigils`, and `account`. `account` is `nil` when not known.
+@raise `'no such channel'`
+@usage glirc.channel_roster('mynet', '#somechan') --> { { nick = 'an_op', sigils = '@', account = 'anaccount' } }
+*/
+static int glirc_lua_channel_roster(lua_State *L)
+{
+        size_t netlen, chanlen;
+        const char *net = luaL_checklstring(L, 1, &netlen);
+        const char *chan = luaL_checklstring(L, 2, &chanlen);
+        luaL_checktype(L, 3, LUA_TNONE);
+
+        struct glirc_roster *roster = glirc_channel_roster(get_glirc(L), net, netlen, chan, chanlen);
+        if (roster == NULL) { luaL_error(L, "no such channel"); }
+
+        lua_createtable(L, roster->n, 0);
+
+        for (size_t i = 0; i < roster->n; i++) {
+                const struct glirc_roster_entry *entry = &roster->members[i];
+
+                lua_createtable(L, 0, 3);
+
+                push_glirc_string(L, &entry->nick);
+                lua_setfield(L, -2, "nick");
+
+                push_glirc_string(L, &entry->sigils);
+                lua_setfield(L, -2, "sigils");
+
+                if (entry->account.len > 0) {
+                        push_glirc_string(L, &entry->account);
+                        lua_setfield(L, -2, "account");
+                }
+
+                lua_rawseti(L, -2, i+1);
+        }
+
+        glirc_free_roster(roster);
+
+        return 1;
+}
+
 /***
 Return the modes for a channel
 @function channel_modes
@@ -271,18 +373,19 @@ static int glirc_lua_channel_modes(lua_State *L)
         const char *chan = luaL_checklstring(L, 2, &chanlen);
         luaL_checktype(L, 3, LUA_TNONE);
 
-        char **modes = glirc_channel_modes(get_glirc(L), net, netlen, chan, chanlen);
+        struct glirc_string_list *modes = glirc_channel_modes_packed(get_glirc(L), net, netlen, chan, chanlen);
 
         if (modes) {
-                lua_newtable(L);
-                for (int i = 0; modes[i] != NULL; i++) {
-                        char key[] = {0,0};
-                        key[0] = modes[i][0];
-                        lua_pushstring(L, &modes[i][1]);
-                        lua_setfield(L, -2, key);
+                lua_createtable(L, 0, modes->n);
+                for (size_t i = 0; i < modes->n; i++) {
+                        const struct glirc_string *mode = &modes->strs[i];
+                        if (mode->len == 0) continue;
+                        lua_pushlstring(L, mode->str, 1);
+                        lua_pushlstring(L, mode->str + 1, mode->len - 1);
+                        lua_rawset(L, -3);
                 }
 
-                glirc_free_strings(modes);
+                glirc_free_string_list(modes);
 
                 return 1;
         } else {
@@ -309,7 +412,7 @@ static int glirc_lua_channel_masks(lua_State *L)
         luaL_argcheck(L, modelen == 1, 3, "expected single mode character");
         luaL_checktype(L, 4, LUA_TNONE);
 
-        char **masks = glirc_channel_masks(get_glirc(L), net, netlen, chan, chanlen, *mode);
+        struct glirc_string_list *masks = glirc_channel_masks_packed(get_glirc(L), net, netlen, chan, chanlen, *mode);
 
         if (masks) {
                 import_string_array(L, masks);
@@ -584,6 +687,84 @@ static int glirc_lua_set_timer(lua_State *L)
         return 1;
 }
 
+static void on_interval(void *dat, timer_id tid) {
+        (void)tid;
+
+        struct thread_state * const st = dat;
+        lua_State * const L = st->L;
+
+        // get callback function, the state is kept for the next call
+        thread_state_value(st);
+
+        if (lua_pcall(L, 0, 0, 0)) {
+                // STACK: error
+                size_t len;
+                const char *msg = lua_tolstring(L, -1, &len);
+                glirc_print(get_glirc(L), ERROR_MESSAGE, msg, len);
+                lua_remove(L, -1);
+        }
+}
+
+/***
+Register a recurring timer callback.
+
+The given callback will be called every time the given number of
+milliseconds passes until the timer is cancelled with `cancel_timer`.
+
+@function set_interval
+@tparam integer millis Milliseconds period
+@tparam func callback Callback function
+@treturn integer Timer ID
+@raise 'bad period'
+
+@usage
+glirc.set_interval(1000, function()
+    glirc.print('another second has passed')
+end)
+*/
+static int glirc_lua_set_interval(lua_State *L)
+{
+        lua_Integer millis = luaL_checkinteger(L, 1);
+        luaL_checkany(L, 2);
+        luaL_checktype(L, 3, LUA_TNONE);
+        luaL_argcheck(L, millis > 0, 1, "bad period");
+
+        // Wrap top (2) value into closure
+        struct thread_state * const ts = new_thread_state(L, sizeof *ts);
+
+        timer_id tid = glirc_set_interval(get_glirc(L), millis, on_interval, ts);
+
+        lua_pushinteger(L, tid);
+
+        return 1;
+}
+
+/***
+Change when a timer will next run, keeping its ID and callback.
+Recurring timers keep their period.
+
+@function reschedule_timer
+@tparam integer Timer ID
+@tparam integer millis Milliseconds delay
+@raise 'no such timer'
+@usage
+local tid = glirc.set_timer(1000, callback)
+glirc.reschedule_timer(tid, 5000)
+*/
+static int glirc_lua_reschedule_timer(lua_State *L)
+{
+        lua_Integer tid = luaL_checkinteger(L, 1);
+        lua_Integer millis = luaL_checkinteger(L, 2);
+        luaL_checktype(L, 3, LUA_TNONE);
+        luaL_argcheck(L, millis >= 0, 2, "bad delay");
+
+        if (glirc_reschedule_timer(get_glirc(L), tid, millis)) {
+                return luaL_error(L, "no such timer");
+        }
+
+        return 0;
+}
+
 /***
 Cancel an active timer by ID.
 
@@ -626,14 +807,212 @@ static int glirc_lua_window_lines(lua_State *L)
         int filtered = lua_toboolean(L, 3);
         luaL_checktype(L, 4, LUA_TNONE);
 
-        char **res = glirc_window_lines(get_glirc(L), network, network_len,
-                                                      target, target_len,
-                                                      filtered);
+        struct glirc_string_list *res = glirc_window_lines_packed
+                        (get_glirc(L), network, network_len,
+                                       target, target_len,
+                                       filtered);
         if (res == NULL) { luaL_error(L, "client failure"); }
         import_string_array(L, res);
         return 1;
 }
 
+/***
+Limit the messages passed to process_message to the given commands.
+Messages with other commands are skipped by the client before any
+work is done to marshal them. Call without arguments to receive every
+message again.
+@function subscribe
+@tparam[opt] {string,...} commands IRC commands and numerics
+@raise `'client failure'`
+@usage
+glirc.subscribe{'PRIVMSG', 'NOTICE', '001'}
+glirc.subscribe() -- all messages
+*/
+static int glirc_lua_subscribe(lua_State *L)
+{
+        if (lua_isnoneornil(L, 1)) {
+                lua_settop(L, 0);
+                if (glirc_subscribe(get_glirc(L), NULL, 0)) {
+                        luaL_error(L, "client failure");
+                }
+                return 0;
+        }
+
+        luaL_checktype(L, 1, LUA_TTABLE);
+        luaL_checktype(L, 2, LUA_TNONE);
+
+        lua_Integer const n = luaL_len(L, 1);
+
+        // Array allocated on Lua heap automatically cleaned up on error
+        struct glirc_string *commands =
+                lua_newuserdata(L, (n > 0 ? n : 1) * sizeof *commands);
+
+        // Strings remain reachable through the table argument
+        for (lua_Integer i = 0; i < n; i++) {
+                int ty = lua_rawgeti(L, 1, i+1);
+                luaL_argcheck(L, ty == LUA_TSTRING, 1, "expected strings");
+                commands[i].str = lua_tolstring(L, -1, &commands[i].len);
+                lua_pop(L, 1);
+        }
+
+        if (glirc_subscribe(get_glirc(L), commands, n)) {
+                luaL_error(L, "client failure");
+        }
+        return 0;
+}
+
+/***
+Choose how the messages of a run received together are passed to
+process_message. Scripts start with batches off and each message is
+offered once the client has processed the messages before it. With
+batches on, every message of the run is offered before the client
+processes any of them, all within one call into the interpreter, so
+process_message must not rely on client state changed by the earlier
+messages of the run, and lines it prints or injects appear ahead of
+those messages.
+@function batch_messages
+@tparam boolean enable Offer runs of messages as a batch
+@raise `'client failure'`
+@usage glirc.batch_messages(true)
+*/
+static int glirc_lua_batch_messages(lua_State *L)
+{
+        luaL_checktype(L, 1, LUA_TBOOLEAN);
+        luaL_checktype(L, 2, LUA_TNONE);
+
+        if (glirc_batch_messages(get_glirc(L), lua_toboolean(L, 1))) {
+                luaL_error(L, "client failure");
+        }
+        return 0;
+}
+
+/* Iteration state for window_history */
+struct history_state {
+        struct glirc_window_page *page; /* current page, NULL before the first */
+        size_t next;                    /* index of the next line in page */
+        size_t cursor;                  /* cursor for the page after this one */
+        size_t remaining;               /* lines left before the limit, 0 for no limit */
+        size_t page_size;
+        long long before;
+        int filtered;
+        int done;
+};
+
+/* This global variable provides a unique key for storing
+ * the history_state metatable in the Lua registry.
+ */
+static char history_state_key;
+
+static int history_state_gc(lua_State *L)
+{
+        struct history_state *hs = lua_touserdata(L, 1);
+        glirc_free_window_page(hs->page);
+        hs->page = NULL;
+        return 0;
+}
+
+/* Iterator function with upvalues: network, target, state */
+static int history_next(lua_State *L)
+{
+        struct history_state *hs = lua_touserdata(L, lua_upvalueindex(3));
+
+        if (hs->page == NULL || hs->next == hs->page->n) {
+                if (hs->done) return 0;
+
+                size_t network_len, target_len;
+                const char *network = lua_tolstring(L, lua_upvalueindex(1), &network_len);
+                const char *target  = lua_tolstring(L, lua_upvalueindex(2), &target_len);
+
+                size_t want = hs->page_size;
+                if (hs->remaining != 0 && hs->remaining < want) want = hs->remaining;
+
+                glirc_free_window_page(hs->page);
+                hs->page = glirc_window_history(get_glirc(L), network, network_len,
+                                                target, target_len, hs->filtered,
+                                                hs->cursor, want, hs->before);
+                if (hs->page == NULL) luaL_error(L, "client failure");
+
+                hs->next   = 0;
+                hs->cursor = hs->page->cursor;
+                hs->done   = hs->cursor == 0 || hs->page->n < want;
+                if (hs->remaining != 0) {
+                        hs->remaining -= hs->page->n;
+                        if (hs->remaining == 0) hs->done = 1;
+                }
+
+                if (hs->page->n == 0) return 0;
+        }
+
+        const struct glirc_window_line *line = &hs->page->lines[hs->next++];
+        push_glirc_string(L, &line->text);
+        lua_pushinteger(L, line->time);
+        return 2;
+}
+
+/***
+Iterate over the lines of a window, newest first. Lines are fetched from
+the client a page at a time as the loop advances, so stopping early only
+pays for the lines that were visited.
+@function window_history
+@tparam string network Network name
+@tparam string target Target name
+@tparam[opt] table options `filtered` (use the /grep filter), `before`
+(only lines before this Unix time), `limit` (maximum lines), `page`
+(lines fetched at a time, default 20)
+@treturn func Iterator producing line text and Unix time
+@raise `'client failure'`
+@usage
+for text, time in glirc.window_history('mynet', '#mychannel', {limit = 20}) do
+    print(os.date('%H:%M', time), text)
+end
+*/
+static int glirc_lua_window_history(lua_State *L)
+{
+        luaL_checkstring(L, 1);
+        luaL_checkstring(L, 2);
+        if (!lua_isnoneornil(L, 3)) luaL_checktype(L, 3, LUA_TTABLE);
+        luaL_checktype(L, 4, LUA_TNONE);
+
+        lua_Integer before = 0, limit = 0, page_size = 20;
+        int filtered = 0;
+
+        if (lua_istable(L, 3)) {
+                lua_getfield(L, 3, "filtered");
+                filtered = lua_toboolean(L, -1);
+                lua_getfield(L, 3, "before");
+                before = luaL_optinteger(L, -1, 0);
+                lua_getfield(L, 3, "limit");
+                limit = luaL_optinteger(L, -1, 0);
+                lua_getfield(L, 3, "page");
+                page_size = luaL_optinteger(L, -1, 20);
+                lua_pop(L, 4);
+        }
+        luaL_argcheck(L, limit >= 0 && page_size > 0, 3, "invalid limit or page");
+
+        lua_settop(L, 2);                           // STACK: network target
+
+        struct history_state *hs = lua_newuserdata(L, sizeof *hs);
+        *hs = (struct history_state) {
+                .remaining = limit,
+                .page_size = page_size,
+                .before    = before,
+                .filtered  = filtered,
+        };
+
+        if (lua_rawgetp(L, LUA_REGISTRYINDEX, &history_state_key) == LUA_TNIL) {
+                lua_pop(L, 1);
+                lua_createtable(L, 0, 1);
+                lua_pushcfunction(L, history_state_gc);
+                lua_setfield(L, -2, "__gc");
+                lua_pushvalue(L, -1);
+                lua_rawsetp(L, LUA_REGISTRYINDEX, &history_state_key);
+        }
+        lua_setmetatable(L, -2);                    // STACK: network target state
+
+        lua_pushcclosure(L, history_next, 3);
+        return 1;
+}
+
 struct system_state {
         struct thread_state base;
         int result;
@@ -668,12 +1047,15 @@ start_system(void *R)
 }
 
 /***
-Run a system command in a separate thread given a continuation
-for the result.
+Run a system command on one of the client's worker threads given a
+continuation for the result. Commands wait in a queue when all of the
+workers are busy. When the queue for this extension is full the
+command is not run.
 @function system
 @tparam string command Shell command
 @tparam function callback Callback to run on system return value
-@usage glirc.window_lines('curl URL > tmpfile', print)
+@treturn ?integer Job ID that can be passed to `cancel_job`, `nil` when the queue is full
+@usage glirc.system('curl URL > tmpfile', print)
 */
 int glirc_lua_system(lua_State *L) {
 
@@ -690,9 +1072,538 @@ int glirc_lua_system(lua_State *L) {
 
         strcpy(st->command, command);
 
-        // REQUEST NEW THREAD
-        glirc_thread(get_glirc(L), start_system, finish_system, st);
+        // QUEUE JOB
+        job_id job = glirc_submit_job(get_glirc(L), start_system, finish_system, st);
+        if (job == 0) {
+                free_thread_state(&st->base);
+                return 0;
+        }
+
+        lua_pushinteger(L, job);
+        return 1;
+}
+
+/***
+Cancel a job started by `system` that is still waiting for a worker
+thread. Its callback will not be called.
+@function cancel_job
+@tparam integer job Job ID
+@treturn boolean `true` when the job was cancelled, `false` when it already started
+@usage glirc.cancel_job(job) --> true
+*/
+static int glirc_lua_cancel_job(lua_State *L)
+{
+        job_id job = luaL_checkinteger(L, 1);
+        luaL_checktype(L, 2, LUA_TNONE);
+
+        struct thread_state *st = glirc_cancel_job(get_glirc(L), job);
+        if (st != NULL) {
+                free_thread_state(st);
+        }
+
+        lua_pushboolean(L, st != NULL);
+        return 1;
+}
+
+/***
+Report on the jobs this script has started with `system`. Scripts can
+use this to shed load when the client is busy.
+@function job_stats
+@treturn table Fields `queued` and `active` count the jobs waiting for and running on a worker, `completed` counts the finished jobs, and `average_ms` is their average running time
+@usage glirc.job_stats() --> { queued = 0, active = 1, completed = 12, average_ms = 250.0 }
+*/
+static int glirc_lua_job_stats(lua_State *L)
+{
+        luaL_checktype(L, 1, LUA_TNONE);
+
+        struct glirc_job_stats stats = {0};
+        glirc_job_stats(get_glirc(L), &stats);
+
+        lua_createtable(L, 0, 4);
+        lua_pushinteger(L, stats.queued);
+        lua_setfield(L, -2, "queued");
+        lua_pushinteger(L, stats.active);
+        lua_setfield(L, -2, "active");
+        lua_pushinteger(L, stats.completed);
+        lua_setfield(L, -2, "completed");
+        lua_pushnumber(L, stats.average_ms);
+        lua_setfield(L, -2, "average_ms");
+        return 1;
+}
+
+/* Processes started by glirc.spawn are watched by a single long job
+ * per Lua state, on a thread of its own rather than a pool worker. It
+ * blocks in poll until one of their pipes is readable, a process that
+ * closed its pipe exits, or the wake pipe is written. Its finish
+ * callback reads what is available on the client thread, reaps the
+ * processes that exited, and then waits again. Exits are seen through a
+ * process descriptor where the system has them; otherwise the watcher
+ * checks the remaining processes whenever its poll times out. At most
+ * the buffer limit is read from each pipe per wake up so a fast process
+ * blocks on a full pipe rather than filling memory.
+ */
+#define SPAWN_DEFAULT_BUFFER 65536
+
+/* Interval for checking exits of processes without a descriptor */
+#define SPAWN_REAP_INTERVAL_MS 100
+
+struct spawn_state {
+        struct thread_state base; // uservalue: options table
+        struct spawn_state *next; // other processes of this Lua state
+        pid_t pid;                // until reaped on the client thread
+        int fd;                   // stdout pipe, -1 after end of file
+        int pidfd;                // process descriptor, -1 when unavailable
+        int status;               // set when reaped
+        size_t len;               // bytes of a partial line in buf
+        size_t cap;
+        char buf[];
+};
+
+/* Argument of the job waiting for output, the wake pipe comes first.
+ * The processes waited for without a descriptor follow the fds.
+ */
+struct spawn_poll {
+        lua_State *L;
+        nfds_t n;
+        size_t npids;
+        pid_t *pids;
+        struct pollfd fds[];
+};
+
+/* Processes of a Lua state, stored in the registry */
+struct spawn_set {
+        struct spawn_state *procs;
+        struct spawn_poll *poll;  // job waiting for output, if any
+        int wake[2];              // wakes the poll job, -1 until needed
+};
+
+static char spawn_set_key;
+
+static struct spawn_set *
+get_spawn_set(lua_State *L)
+{
+        lua_rawgetp(L, LUA_REGISTRYINDEX, &spawn_set_key);
+        struct spawn_set *set = lua_touserdata(L, -1);
+        lua_pop(L, 1);
+
+        if (set == NULL) {
+                set = lua_newuserdata(L, sizeof *set);
+                set->procs = NULL;
+                set->poll = NULL;
+                set->wake[0] = set->wake[1] = -1;
+                lua_rawsetp(L, LUA_REGISTRYINDEX, &spawn_set_key);
+        }
+        return set;
+}
+
+/* Create a pipe with both ends closed on exec */
+static int
+cloexec_pipe(int fds[2], int flags)
+{
+#ifdef __APPLE__
+        if (pipe(fds)) return -1;
+        for (int i = 0; i < 2; i++) {
+                fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+                if (flags) fcntl(fds[i], F_SETFL, flags);
+        }
         return 0;
+#else
+        return pipe2(fds, O_CLOEXEC | flags);
+#endif
+}
+
+/* Open a descriptor that becomes readable when the process exits, or
+ * return -1 when the system doesn't provide them.
+ */
+static int
+open_pidfd(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+        return syscall(SYS_pidfd_open, pid, 0);
+#else
+        (void)pid;
+        return -1;
+#endif
+}
+
+/* Call one of the callbacks in the options table of a process.
+ * Errors are reported to the client.
+ *
+ * [-nargs, +0, -]
+ */
+static void
+spawn_callback(struct spawn_state *st, const char *name, int nargs)
+{
+        lua_State *L = st->base.L;
+
+        thread_state_value(&st->base);
+        lua_getfield(L, -1, name);       // STACK: args options callback
+        lua_remove(L, -2);               // STACK: args callback
+
+        if (lua_isnil(L, -1)) {
+                lua_pop(L, nargs + 1);
+                return;
+        }
+
+        lua_insert(L, -nargs-1);         // STACK: callback args
+        if (lua_pcall(L, nargs, 0, 0)) {
+                size_t len;
+                const char *msg = lua_tolstring(L, -1, &len);
+                glirc_print(get_glirc(L), ERROR_MESSAGE, msg, len);
+                lua_pop(L, 1);
+        }
+}
+
+static void
+spawn_output(struct spawn_state *st, const char *str, size_t len)
+{
+        if (len > 0 && str[len-1] == '\r') len--;
+        lua_pushlstring(st->base.L, str, len);
+        spawn_callback(st, "on_stdout", 1);
+}
+
+/* Deliver each complete line in the buffer and keep the remainder.
+ * A full buffer without a line ending is delivered as it is.
+ */
+static void
+spawn_lines(struct spawn_state *st)
+{
+        char *start = st->buf;
+        char *end = st->buf + st->len;
+        char *nl;
+
+        while ((nl = memchr(start, '\n', end - start))) {
+                spawn_output(st, start, nl - start);
+                start = nl + 1;
+        }
+
+        st->len = end - start;
+        memmove(st->buf, start, st->len);
+
+        if (st->len == st->cap) {
+                spawn_output(st, st->buf, st->len);
+                st->len = 0;
+        }
+}
+
+static void
+spawn_read(struct spawn_state *st)
+{
+        size_t budget = st->cap;
+
+        while (budget > 0) {
+                size_t want = st->cap - st->len;
+                if (want > budget) want = budget;
+
+                ssize_t n = read(st->fd, st->buf + st->len, want);
+                if (n > 0) {
+                        st->len += n;
+                        budget -= n;
+                        spawn_lines(st);
+                } else if (n < 0 && errno == EINTR) {
+                        continue;
+                } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                        return;
+                } else {
+                        // end of file or a broken pipe, flush the last line
+                        if (st->len > 0) {
+                                spawn_output(st, st->buf, st->len);
+                                st->len = 0;
+                        }
+                        close(st->fd);
+                        st->fd = -1;
+                        return;
+                }
+        }
+}
+
+/* Report the exit of a reaped process and forget it */
+static void
+spawn_exited(struct spawn_set *set, struct spawn_state *st, pid_t res)
+{
+        lua_State *L = st->base.L;
+
+        for (struct spawn_state **p = &set->procs; *p; p = &(*p)->next) {
+                if (*p == st) { *p = st->next; break; }
+        }
+        st->pid = -1;
+        if (st->pidfd != -1) {
+                close(st->pidfd);
+                st->pidfd = -1;
+        }
+
+        if (res > 0 && WIFSIGNALED(st->status)) {
+                lua_pushnil(L);
+                lua_pushinteger(L, WTERMSIG(st->status));
+        } else if (res > 0) {
+                lua_pushinteger(L, WEXITSTATUS(st->status));
+                lua_pushnil(L);
+        } else {
+                lua_pushnil(L);
+                lua_pushnil(L);
+        }
+        spawn_callback(st, "on_exit", 2);
+
+        free_thread_state(&st->base);
+}
+
+static pid_t
+spawn_waitpid(struct spawn_state *st, int options)
+{
+        pid_t res;
+        while ((res = waitpid(st->pid, &st->status, options)) == -1 && errno == EINTR);
+        return res;
+}
+
+/* Reap a process after the end of its output once it has exited */
+static void
+spawn_reap(struct spawn_set *set, struct spawn_state *st)
+{
+        pid_t res = spawn_waitpid(st, WNOHANG);
+        if (res != 0) {
+                spawn_exited(set, st, res);
+        }
+}
+
+/* Check for an exit without reaping the process, so that its ID can't
+ * be reused while the client thread might still signal it.
+ */
+static int
+spawn_has_exited(pid_t pid)
+{
+        siginfo_t info;
+        info.si_pid = 0;
+        int res;
+        while ((res = waitid(P_PID, pid, &info, WEXITED | WNOHANG | WNOWAIT)) && errno == EINTR);
+        return res || info.si_pid != 0;
+}
+
+static void *
+spawn_poll_start(void *dat)
+{
+        struct spawn_poll *job = dat;
+        int timeout = job->npids > 0 ? SPAWN_REAP_INTERVAL_MS : -1;
+
+        for (;;) {
+                int res = poll(job->fds, job->n, timeout);
+                if (res == -1 && errno == EINTR) continue;
+                if (res != 0) break;
+
+                for (size_t i = 0; i < job->npids; i++) {
+                        if (spawn_has_exited(job->pids[i])) return job;
+                }
+        }
+        return job;
+}
+
+static void spawn_poll_finish(void *dat);
+
+/* Make sure a poll job is waiting on every open pipe and for every
+ * process that has closed its pipe but not exited. A running job is
+ * woken up so that it starts again with the current processes.
+ */
+static void
+spawn_watch(lua_State *L, struct spawn_set *set)
+{
+        if (set->poll) {
+                char c = 0;
+                while (write(set->wake[1], &c, 1) == -1 && errno == EINTR);
+                return;
+        }
+
+        nfds_t n = 1;
+        size_t npids = 0;
+        for (struct spawn_state *st = set->procs; st; st = st->next) {
+                if (st->fd != -1 || st->pidfd != -1) n++;
+                else npids++;
+        }
+        if (n == 1 && npids == 0) return;
+
+        struct spawn_poll *job = malloc(sizeof *job + n * sizeof job->fds[0] + npids * sizeof (pid_t));
+        if (job == NULL) {
+                static const char msg[] = "spawn: out of memory, output is no longer read";
+                glirc_print(get_glirc(L), ERROR_MESSAGE, msg, sizeof msg - 1);
+                return;
+        }
+
+        job->L = L;
+        job->n = 0;
+        job->npids = 0;
+        job->pids = (pid_t *)(job->fds + n);
+        job->fds[job->n++] = (struct pollfd) { .fd = set->wake[0], .events = POLLIN };
+        for (struct spawn_state *st = set->procs; st; st = st->next) {
+                if (st->fd != -1) {
+                        job->fds[job->n++] = (struct pollfd) { .fd = st->fd, .events = POLLIN };
+                } else if (st->pidfd != -1) {
+                        job->fds[job->n++] = (struct pollfd) { .fd = st->pidfd, .events = POLLIN };
+                } else {
+                        job->pids[job->npids++] = st->pid;
+                }
+        }
+
+        if (glirc_submit_long_job(get_glirc(L), spawn_poll_start, spawn_poll_finish, job) == 0) {
+                static const char msg[] = "spawn: client failure, output is no longer read";
+                glirc_print(get_glirc(L), ERROR_MESSAGE, msg, sizeof msg - 1);
+                free(job);
+                return;
+        }
+        set->poll = job;
+}
+
+static void
+spawn_poll_finish(void *dat)
+{
+        struct spawn_poll *job = dat;
+        lua_State *L = job->L;
+        struct spawn_set *set = get_spawn_set(L);
+
+        char drain[64];
+        while (read(set->wake[0], drain, sizeof drain) > 0);
+
+        // Pipes without output return EAGAIN. Callbacks can add
+        // processes at the front of the list and wake this job again.
+        struct spawn_state *next;
+        for (struct spawn_state *st = set->procs; st; st = next) {
+                next = st->next;
+                if (st->fd != -1) spawn_read(st);
+                if (st->fd == -1) spawn_reap(set, st);
+        }
+
+        free(job);
+        set->poll = NULL;
+        spawn_watch(L, set);
+}
+
+/* Kill the processes of a Lua state when it stops with jobs running so
+ * that their pipes close and the jobs waiting on them return.
+ */
+void glirc_interrupt_spawns(lua_State *L)
+{
+        struct spawn_set *set = get_spawn_set(L);
+
+        for (struct spawn_state *st = set->procs; st; st = st->next) {
+                kill(st->pid, SIGKILL);
+        }
+
+        if (set->poll) {
+                char c = 0;
+                while (write(set->wake[1], &c, 1) == -1 && errno == EINTR);
+        }
+}
+
+/* Kill, reap and close the remaining processes of a stopping Lua state.
+ * No jobs are running by then, but their finish callbacks never ran.
+ */
+void glirc_close_spawns(lua_State *L)
+{
+        struct spawn_set *set = get_spawn_set(L);
+
+        for (struct spawn_state *st = set->procs; st; st = st->next) {
+                if (st->fd != -1) close(st->fd);
+                if (st->pidfd != -1) close(st->pidfd);
+                kill(st->pid, SIGKILL);
+                spawn_waitpid(st, 0);
+        }
+        set->procs = NULL;
+
+        free(set->poll);
+        set->poll = NULL;
+
+        for (int i = 0; i < 2; i++) {
+                if (set->wake[i] != -1) close(set->wake[i]);
+                set->wake[i] = -1;
+        }
+}
+
+/***
+Start a process without a shell and stream its output to callbacks.
+The process reads from `/dev/null` and its standard error is discarded.
+Standard output is delivered one line at a time without the line ending.
+When a line is longer than `max_buffer` bytes it is delivered in pieces.
+Output is only read while there is room in the buffer, so a process that
+writes faster than the callbacks run waits for them. Processes still
+running when the extension stops are killed.
+@function spawn
+@tparam {string,...} argv Program name, found in `PATH`, followed by its arguments
+@tparam table options Callbacks `on_stdout(line)` and `on_exit(code, signal)`. `code` is the exit status, or `nil` when the process was killed by `signal`. The optional `max_buffer` field limits the bytes of output held for each process.
+@treturn integer Process ID
+@raise `'spawn failed'` with the reason
+@usage
+glirc.spawn({'curl', '-s', url}, {
+    on_stdout = function(line) glirc.print(line) end,
+    on_exit = function(code) glirc.print('curl exited with ' .. tostring(code)) end,
+})
+*/
+static int glirc_lua_spawn(lua_State *L)
+{
+        luaL_checktype(L, 1, LUA_TTABLE);
+        luaL_checktype(L, 2, LUA_TTABLE);
+        luaL_checktype(L, 3, LUA_TNONE);
+
+        lua_Integer cap = SPAWN_DEFAULT_BUFFER;
+        if (lua_getfield(L, 2, "max_buffer") != LUA_TNIL) {
+                cap = luaL_checkinteger(L, -1);
+                luaL_argcheck(L, cap > 0, 2, "bad max_buffer");
+        }
+        lua_pop(L, 1);
+
+        lua_Integer argc = luaL_len(L, 1);
+        luaL_argcheck(L, argc > 0, 1, "empty argv");
+
+        // The strings stay reachable from the argv table
+        char **argv = lua_newuserdata(L, (argc + 1) * sizeof *argv);
+        for (lua_Integer i = 0; i < argc; i++) {
+                if (lua_geti(L, 1, i+1) != LUA_TSTRING) {
+                        return luaL_argerror(L, 1, "expected strings");
+                }
+                argv[i] = (char *)lua_tostring(L, -1);
+                lua_pop(L, 1);
+        }
+        argv[argc] = NULL;
+        lua_pop(L, 1);
+
+        struct spawn_set *set = get_spawn_set(L);
+        if (set->wake[0] == -1 && cloexec_pipe(set->wake, O_NONBLOCK)) {
+                return luaL_error(L, "spawn failed: %s", strerror(errno));
+        }
+
+        int fds[2];
+        if (cloexec_pipe(fds, 0)) {
+                return luaL_error(L, "spawn failed: %s", strerror(errno));
+        }
+        fcntl(fds[0], F_SETFL, O_NONBLOCK);
+
+        posix_spawn_file_actions_t actions;
+        posix_spawn_file_actions_init(&actions);
+        posix_spawn_file_actions_addopen(&actions, 0, "/dev/null", O_RDONLY, 0);
+        posix_spawn_file_actions_adddup2(&actions, fds[1], 1);
+        posix_spawn_file_actions_addopen(&actions, 2, "/dev/null", O_WRONLY, 0);
+
+        pid_t pid;
+        int err = posix_spawnp(&pid, argv[0], &actions, NULL, argv, environ);
+        posix_spawn_file_actions_destroy(&actions);
+        close(fds[1]);
+
+        if (err) {
+                close(fds[0]);
+                return luaL_error(L, "spawn failed: %s", strerror(err));
+        }
+
+        lua_pushvalue(L, 2);
+        struct spawn_state *st = (struct spawn_state *)
+                new_thread_state(L, sizeof *st + cap);
+        st->pid = pid;
+        st->fd = fds[0];
+        st->pidfd = open_pidfd(pid);
+        st->status = 0;
+        st->len = 0;
+        st->cap = cap;
+        st->next = set->procs;
+        set->procs = st;
+        spawn_watch(L, set);
+
+        lua_pushinteger(L, pid);
+        return 1;
 }
 
 /***
@@ -766,6 +1677,7 @@ static luaL_Reg glirc_lib[] =
   , { "inject_chat"       , glirc_lua_inject_chat        }
   , { "print"             , glirc_lua_print_string       }
   , { "error"             , glirc_lua_error              }
+  , { "print_many"        , glirc_lua_print_many         }
   , { "identifier_cmp"    , glirc_lua_identifier_cmp     }
   , { "list_networks"     , glirc_lua_list_networks      }
   , { "list_channels"     , glirc_lua_list_channels      }
@@ -773,6 +1685,7 @@ static luaL_Reg glirc_lib[] =
   , { "my_nick"           , glirc_lua_my_nick            }
   , { "user_account"      , glirc_lua_user_account       }
   , { "user_channel_modes", glirc_lua_user_channel_modes }
+  , { "channel_roster"    , glirc_lua_channel_roster     }
   , { "channel_modes"     , glirc_lua_channel_modes      }
   , { "channel_masks"     , glirc_lua_channel_masks      }
   , { "mark_seen"         , glirc_lua_mark_seen          }
@@ -783,9 +1696,17 @@ static luaL_Reg glirc_lib[] =
   , { "is_channel"        , glirc_lua_is_channel         }
   , { "resolve_path"      , glirc_lua_resolve_path       }
   , { "set_timer"         , glirc_lua_set_timer          }
+  , { "set_interval"      , glirc_lua_set_interval       }
+  , { "reschedule_timer"  , glirc_lua_reschedule_timer   }
   , { "cancel_timer"      , glirc_lua_cancel_timer       }
   , { "window_lines"      , glirc_lua_window_lines       }
+  , { "window_history"    , glirc_lua_window_history     }
   , { "system"            , glirc_lua_system             }
+  , { "cancel_job"        , glirc_lua_cancel_job         }
+  , { "job_stats"         , glirc_lua_job_stats          }
+  , { "spawn"             , glirc_lua_spawn              }
+  , { "subscribe"         , glirc_lua_subscribe          }
+  , { "batch_messages"    , glirc_lua_batch_messages     }
   , { NULL                , NULL                         }
   };
 
@@ -15,6 +15,9 @@ registered.  Client interaction is available through the `glirc` lirary.
 #define _POSIX_C_SOURCE 200809L
 
 #include <assert.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <libgen.h>
 
@@ -22,7 +25,9 @@ registered.  Client interaction is available through the `glirc` lirary.
 #include <lauxlib.h>
 #include <lualib.h>
 
+#include "glirc-alloc.h"
 #include "glirc-api.h"
+#include "glirc-cache.h"
 #include "glirc-marshal.h"
 #include "glirc-lib.h"
 #include "glirc-thread.h"
@@ -38,6 +43,38 @@ static_assert(LUA_EXTRASPACE >= sizeof(struct glirc *),
  */
 static char glirc_callback_module_key;
 
+/* Registry key for the table of callbacks found through the module's
+ * metatable, indexed by callback_id, see push_inherited_callback.
+ */
+static char glirc_callback_cache_key;
+
+/* Registry key for the description of the garbage collector settings
+ * reported by the stats command.
+ */
+static char glirc_gc_mode_key;
+
+enum callback_id {
+        CALLBACK_STOP = 1,
+        CALLBACK_MESSAGE,
+        CALLBACK_COMMAND,
+        CALLBACK_CHAT,
+        CALLBACK_LAST = CALLBACK_CHAT
+};
+
+static const char * const callback_names[] = {
+        [CALLBACK_STOP   ] = "stop",
+        [CALLBACK_MESSAGE] = "process_message",
+        [CALLBACK_COMMAND] = "process_command",
+        [CALLBACK_CHAT   ] = "process_chat",
+};
+
+/* Protected lookup of module[name] for push_inherited_callback */
+static int get_callback(lua_State *L)
+{
+        lua_gettable(L, 1);
+        return 1;
+}
+
 /* Push path to glirc.lua which should be in the same directory
  * as the given path to the extension shared library.
  *
@@ -66,6 +103,18 @@ static void push_scriptname
         }
 }
 
+/* Interpreter settings given as --option arguments ahead of the
+ * script name.
+ */
+struct lua_options {
+        size_t memory_limit;   // bytes, 0 for no limit
+        int gc_mode;           // 0 for the default collector
+        int gc_params[3];      // 0 keeps the default value
+        int cache;             // load scripts through the bytecode cache
+        const char *cache_dir; // NULL for the default cache directory
+        size_t cache_dir_len;
+};
+
 static void push_args_table(lua_State *L, const struct glirc_string *args, size_t args_len) {
         lua_createtable(L, args_len > 1 ? args_len - 1 : 0, 1);
         for (size_t i = 1; i < args_len; i++) {
@@ -74,6 +123,29 @@ static void push_args_table(lua_State *L, const struct glirc_string *args, size_
         }
 }
 
+/* Push the directory used for cached bytecode, or nil when the cache
+ * is disabled. The default is a .luac directory beside the script.
+ */
+static void push_cache_dir
+  (lua_State *L,
+   const struct lua_options *opts,
+   const char *scriptpath)
+{
+        if (!opts->cache) {
+                lua_pushnil(L);
+        } else if (opts->cache_dir) {
+                char *dir = glirc_resolve_path
+                              (get_glirc(L), opts->cache_dir, opts->cache_dir_len);
+                lua_pushstring(L, dir);
+                glirc_free_string(dir);
+        } else {
+                const char *slash = strrchr(scriptpath, '/');
+                lua_pushlstring(L, scriptpath, slash ? slash - scriptpath + 1 : 0);
+                lua_pushliteral(L, ".luac");
+                lua_concat(L, 2);
+        }
+}
+
 /* This function actually initialized the Lua state and
  * runs the user's script. It is allowed to raise errors
  * which will be caught by the use of lua_pcall in start.
@@ -86,24 +158,35 @@ static int initialize_lua(lua_State *L)
         const char * const path                = lua_touserdata(L, 1);
         const struct glirc_string * const args = lua_touserdata(L, 2);
         const lua_Integer args_len             = lua_tointeger (L, 3);
+        const struct lua_options * const opts  = lua_touserdata(L, 4);
 
         lua_settop(L, 0);
 
         push_args_table(L, args, args_len);
         push_scriptname(L, path, args, args_len);
         const char *scriptpath = lua_tostring(L, 2);
+        push_cache_dir(L, opts, scriptpath);
+        const char *cachedir = lua_tostring(L, 3);
 
         // Load user script
-        if (luaL_loadfile(L, scriptpath)) { // STACK: arg scriptpath script
+        int status = cachedir
+                   ? glirc_cache_loadfile(L, cachedir, scriptpath)
+                   : luaL_loadfile(L, scriptpath);
+        if (status) {            // STACK: arg scriptpath cachedir script
                 lua_error(L);
         }
-        lua_insert(L, 1);        // STACK script arg scriptpath
-        lua_rawseti(L, -2, 0);   // STACK: script arg
-        lua_setglobal(L, "arg"); // STACK: script
+        lua_insert(L, 1);        // STACK: script arg scriptpath cachedir
+        lua_insert(L, 2);        // STACK: script cachedir arg scriptpath
+        lua_rawseti(L, -2, 0);   // STACK: script cachedir arg
+        lua_setglobal(L, "arg"); // STACK: script cachedir
 
         // Initialize libraries
         luaL_openlibs(L);
         glirc_install_lib(L);
+        if (cachedir) {
+                glirc_install_cache_searcher(L, cachedir);
+        }
+        lua_pop(L, 1);           // STACK: script
 
         // Execute user script
         lua_call(L, 0, 1);       // STACK: module
@@ -114,6 +197,162 @@ static int initialize_lua(lua_State *L)
         return 0;
 }
 
+enum { GC_INCREMENTAL = 1, GC_GENERATIONAL };
+
+#define OPTION_MAX 64
+
+/* Parse a byte count with an optional K, M, or G suffix */
+static int parse_size(const char *str, size_t *out)
+{
+        char *end;
+        unsigned long long n = strtoull(str, &end, 10);
+        if (end == str) return 1;
+
+        switch (*end) {
+        case 'K': n <<= 10; end++; break;
+        case 'M': n <<= 20; end++; break;
+        case 'G': n <<= 30; end++; break;
+        }
+        if (*end) return 1;
+
+        *out = n;
+        return 0;
+}
+
+/* Parse a collector mode followed by up to three comma separated
+ * parameters: --gc=incremental,PAUSE,STEPMUL,STEPSIZE or
+ * --gc=generational,MINORMUL,MAJORMUL
+ */
+static int parse_gc(char *str, struct lua_options *opts)
+{
+        char *save;
+        char *mode = strtok_r(str, ",", &save);
+
+        // Parameters this Lua release can apply are accepted
+        int nparams;
+
+        if (mode == NULL) return 1;
+        if (!strcmp(mode, "incremental")) {
+                opts->gc_mode = GC_INCREMENTAL;
+#if LUA_VERSION_NUM >= 504
+                nparams = 3;
+#else
+                nparams = 2; // no step size setting before Lua 5.4
+#endif
+        } else if (!strcmp(mode, "generational")) {
+#if LUA_VERSION_NUM >= 504
+                opts->gc_mode = GC_GENERATIONAL;
+                nparams = 2;
+#else
+                return 1;
+#endif
+        } else {
+                return 1;
+        }
+
+        char *param;
+        for (int i = 0; (param = strtok_r(NULL, ",", &save)); i++) {
+                char *end;
+                long n = strtol(param, &end, 10);
+                if (i >= nparams || *end || n < 0 || n > 10000) return 1;
+                opts->gc_params[i] = n;
+        }
+        return 0;
+}
+
+/* Consume the leading --option arguments. Returns the number of
+ * arguments used or -1 with an error message in err.
+ */
+static int parse_options
+  (const struct glirc_string *args,
+   size_t args_len,
+   struct lua_options *opts,
+   char *err, size_t errlen)
+{
+        size_t i;
+        for (i = 0; i < args_len; i++) {
+                char arg[OPTION_MAX];
+                if (args[i].len < 2 || strncmp(args[i].str, "--", 2)) break;
+
+                // Directory names can be longer than the other options
+                if (args[i].len > 17 && !strncmp(args[i].str, "--bytecode-cache=", 17)) {
+                        opts->cache = 1;
+                        opts->cache_dir = args[i].str + 17;
+                        opts->cache_dir_len = args[i].len - 17;
+                        continue;
+                }
+
+                if (args[i].len >= sizeof arg) {
+                        snprintf(err, errlen, "Lua option too long");
+                        return -1;
+                }
+                memcpy(arg, args[i].str, args[i].len);
+                arg[args[i].len] = '\0';
+
+                int bad;
+                if (!strncmp(arg, "--memory-limit=", 15)) {
+                        bad = parse_size(arg + 15, &opts->memory_limit);
+                } else if (!strncmp(arg, "--gc=", 5)) {
+                        bad = parse_gc(arg + 5, opts);
+                } else if (!strcmp(arg, "--bytecode-cache")) {
+                        opts->cache = 1;
+                        bad = 0;
+                } else {
+                        bad = 1;
+                }
+
+                if (bad) {
+                        snprintf(err, errlen, "Bad Lua option: %.*s", (int)args[i].len, args[i].str);
+                        return -1;
+                }
+        }
+        return i;
+}
+
+/* Apply the collector settings and remember them for the stats
+ * command.
+ *
+ * [-0, +0, m]
+ */
+static void setup_gc(lua_State *L, const struct lua_options *opts)
+{
+        const int *p = opts->gc_params;
+
+        switch (opts->gc_mode) {
+        case GC_INCREMENTAL:
+#if LUA_VERSION_NUM >= 504
+                lua_gc(L, LUA_GCINC, p[0], p[1], p[2]);
+                lua_pushfstring(L, "incremental (pause %d, step multiplier %d, step size %d)",
+                                p[0], p[1], p[2]);
+#else
+                if (p[0]) lua_gc(L, LUA_GCSETPAUSE, p[0]);
+                if (p[1]) lua_gc(L, LUA_GCSETSTEPMUL, p[1]);
+                lua_pushfstring(L, "incremental (pause %d, step multiplier %d)",
+                                p[0], p[1]);
+#endif
+                break;
+#if LUA_VERSION_NUM >= 504
+        case GC_GENERATIONAL:
+                lua_gc(L, LUA_GCGEN, p[0], p[1]);
+                lua_pushfstring(L, "generational (minor multiplier %d, major multiplier %d)",
+                                p[0], p[1]);
+                break;
+#endif
+        default:
+                lua_pushstring(L, "default");
+                break;
+        }
+        lua_rawsetp(L, LUA_REGISTRYINDEX, &glirc_gc_mode_key);
+}
+
+static int panic(lua_State *L)
+{
+        const char *msg = lua_tostring(L, -1);
+        if (msg == NULL) msg = "error object is not a string";
+        fprintf(stderr, "PANIC: unprotected error in call to Lua API (%s)\n", msg);
+        return 0;
+}
+
 /* Start the Lua interpreter, run glirc.lua in current directory,
  * register the first returned result of running the file as
  * the callback for message processing.
@@ -126,23 +365,44 @@ static void *start
    size_t args_len)
 {
         const char * err;
+        char errbuf[OPTION_MAX + 32];
         lua_State *L = NULL;
+        struct alloc_state *alloc = NULL;
+
+        struct lua_options opts = {0};
+        int used = parse_options(args, args_len, &opts, errbuf, sizeof errbuf);
+        if (used < 0) {
+                err = errbuf;
+                goto cleanup;
+        }
+        args += used;
+        args_len -= used;
 
-        L = luaL_newstate();
+        alloc = new_alloc_state(opts.memory_limit);
+        if (alloc) {
+                L = lua_newstate(glirc_lua_alloc, alloc);
+        }
         if (L == NULL) {
                 err = "Failed to allocate Lua interpreter";
                 goto cleanup;
         }
+        lua_atpanic(L, panic);
 
         // Store glirc token in extra space, used for re-entry into glirc
         set_glirc(L, G);
 
+        // Scripts opt in to batches with glirc.batch_messages
+        glirc_batch_messages(G, 0);
+
+        setup_gc(L, &opts);
+
         lua_pushcfunction    (L, initialize_lua);
         lua_pushlightuserdata(L, (void*)path);
         lua_pushlightuserdata(L, (void*)args);
         lua_pushinteger      (L, args_len);
+        lua_pushlightuserdata(L, &opts);
 
-        if (lua_pcall(L, 3, 0, 0)) {
+        if (lua_pcall(L, 4, 0, 0)) {
                 err = lua_tostring(L, -1);
                 goto cleanup;
         }
@@ -153,35 +413,143 @@ cleanup:
         glirc_print(G, ERROR_MESSAGE, err, strlen(err));
         // close *after* printing error. Error could be on stack
         if (L) lua_close(L);
+        free_alloc_state(alloc);
         return NULL;
 }
 
+/* Close the interpreter along with its allocator */
+static void close_lua(lua_State *L)
+{
+        void *alloc;
+        lua_getallocf(L, &alloc);
+        lua_close(L);
+        free_alloc_state(alloc);
+}
+
+static void print_stat(lua_State *L, const char *fmt, ...)
+{
+        char buf[256];
+        va_list ap;
+        va_start(ap, fmt);
+        int len = vsnprintf(buf, sizeof buf, fmt, ap);
+        va_end(ap);
+
+        if (len < 0) return;
+        if ((size_t)len >= sizeof buf) len = sizeof buf - 1;
+        glirc_print(get_glirc(L), NORMAL_MESSAGE, buf, len);
+}
+
+/* Report the memory and collector statistics for /extension Lua __glirc_stats */
+static void print_stats(lua_State *L)
+{
+        void *ud;
+        lua_getallocf(L, &ud);
+        const struct alloc_state *st = ud;
+
+        print_stat(L, "Memory: %zu KiB in use, %zu KiB peak, limit %zu KiB",
+                   st->bytes >> 10, st->peak >> 10, st->limit >> 10);
+
+        print_stat(L, "Allocations: %lu, reallocations: %lu, frees: %lu, from pool: %lu, refused: %lu",
+                   st->allocs, st->reallocs, st->frees, st->pool_hits, st->failures);
 
-static int callback_worker(lua_State *L)
-{       int n = lua_gettop(L);                                         // args... name
-        lua_rawgetp(L, LUA_REGISTRYINDEX, &glirc_callback_module_key); // args... name ext
-        lua_insert(L, 1);                                              // ext name args... name
-        if (lua_gettable(L, 1) != LUA_TNIL) {                          // ext args... callback/nil
-            lua_insert(L, 1);                                          // callback ext args...
-            lua_call(L, n, 1);                                         // result
+        lua_rawgetp(L, LUA_REGISTRYINDEX, &glirc_gc_mode_key);
+        print_stat(L, "Collector: %s", lua_tostring(L, -1));
+        lua_pop(L, 1);
+}
+
+
+static void report_error(lua_State *L)
+{
+        size_t msglen = 0;
+        const char *msg = lua_tolstring(L, -1, &msglen);
+        glirc_print(get_glirc(L), ERROR_MESSAGE, msg, msglen);
+        lua_pop(L, 1); // discard error message
+}
+
+/* Push the callback the module finds through its metatable, or false
+ * when there is none. The lookup can run the module's metamethods; a
+ * lookup that raises an error, as strict modules do for missing fields,
+ * counts as a missing callback. Results are cached until the module's
+ * metatable is replaced.
+ *
+ * [-0, +1, m]
+ */
+static void push_inherited_callback(lua_State *L, int module, enum callback_id id)
+{
+        lua_rawgetp(L, LUA_REGISTRYINDEX, &glirc_callback_cache_key); // STACK: cache
+        if (!lua_getmetatable(L, module)) lua_pushnil(L);              // STACK: cache metatable
+        if (lua_isnil(L, -2) || (lua_rawgeti(L, -2, 0), !lua_rawequal(L, -1, -2))) {
+                lua_settop(L, module);
+                lua_createtable(L, CALLBACK_LAST, 0);
+                if (!lua_getmetatable(L, module)) lua_pushnil(L);
+                lua_rawseti(L, -2, 0);
+                lua_pushvalue(L, -1);
+                lua_rawsetp(L, LUA_REGISTRYINDEX, &glirc_callback_cache_key);
+        } else {
+                lua_settop(L, module + 1);
+        }                                                              // STACK: cache
+
+        if (lua_rawgeti(L, -1, id) == LUA_TNIL) {                      // STACK: cache callback
+                lua_pop(L, 1);
+                lua_pushcfunction(L, get_callback);
+                lua_pushvalue(L, module);
+                lua_pushstring(L, callback_names[id]);
+                if (lua_pcall(L, 2, 1, 0) != LUA_OK || lua_isnil(L, -1)) {
+                        lua_pop(L, 1);
+                        lua_pushboolean(L, 0);
+                }
+                lua_pushvalue(L, -1);
+                lua_rawseti(L, -3, id);
         }
-        return 1; // result/nil
+        lua_remove(L, -2);                                             // STACK: callback
 }
 
+/* Push the callback and the module it is called on. Returns 0 and
+ * pushes nothing when the script doesn't handle this event, so the
+ * caller can skip marshaling its arguments.
+ *
+ * The module's own field is checked on every event, so handlers the
+ * script assigns, replaces, or removes later take effect at once
+ * without running any metamethods. Only when the field is missing is
+ * the handler looked up through the module's metatable.
+ */
+static int push_callback(lua_State *L, enum callback_id id)
+{
+        lua_rawgetp(L, LUA_REGISTRYINDEX, &glirc_callback_module_key); // STACK: module
+        const int module = lua_gettop(L);
+
+        if (lua_istable(L, module)) {
+                lua_pushstring(L, callback_names[id]);
+                lua_rawget(L, module);                                 // STACK: module callback
+        } else {
+                lua_pushnil(L);
+        }
+
+        if (lua_isnil(L, -1)) {
+                lua_pop(L, 1);
+                push_inherited_callback(L, module, id);
+        }
+
+        if (!lua_toboolean(L, -1)) {
+                lua_pop(L, 2);
+                return 0;
+        }
+
+        lua_insert(L, module);                                         // STACK: callback module
+        return 1;
+}
+
+/* Call the callback pushed by push_callback with the nargs arguments
+ * pushed after it.
+ */
 static enum process_result
-callback (lua_State *L, const char *name, int nargs)
+callback (lua_State *L, int nargs)
 {
-                                               // STACK: arguments...
-        lua_pushcfunction(L, callback_worker); // STACK: arguments... worker
-        lua_insert(L, -nargs-1);               // STACK: worker arguments...
-        lua_pushstring(L, name);               // STACK: worker arguments... name
+                                               // STACK: callback module arguments...
         int res = lua_pcall(L, 1+nargs, 1, 0); // STACK: result
 
         if (res != LUA_OK) {
-                size_t msglen = 0;
-                const char *msg = lua_tolstring(L, -1, &msglen);
-                glirc_print(get_glirc(L), ERROR_MESSAGE, msg, msglen);
-                lua_pop(L, 1); // discard error message
+                report_error(L);
                 return PASS_MESSAGE;
         }
 
@@ -198,15 +566,27 @@ Callback used by client when unloading the Lua extension.
 static void stop_entrypoint(void *L)
 {
         if (L == NULL) return;
-        callback(L, "stop", 0);
-        lua_close(L);
+        if (push_callback(L, CALLBACK_STOP)) {
+                callback(L, 0);
+        }
+        glirc_close_spawns(L);
+        close_lua(L);
+}
+
+/* Called when the extension stops while jobs are still running. Spawned
+ * processes are killed so that the jobs watching them return.
+ */
+static void stop_jobs_entrypoint(void *L)
+{
+        if (L == NULL) return;
+        glirc_interrupt_spawns(L);
 }
 
 /***
 Callback used when client receives message from the server.
 @function process_message
 @tparam extension self Extension module
-@tparam message message Message received
+@tparam message message Message received, valid only during this call
 @treturn bool Return true to drop this message
 */
 static enum process_result
@@ -214,9 +594,95 @@ message_entrypoint
   (void *L,
    const struct glirc_message *msg)
 {
-        if (L == NULL) return PASS_MESSAGE;
-        push_glirc_message(L, msg);
-        return callback(L, "process_message", 1);
+        if (L == NULL || !push_callback(L, CALLBACK_MESSAGE)) return PASS_MESSAGE;
+
+        // A second reference keeps the proxy alive until it is invalidated
+        struct message_proxy *proxy = push_glirc_message_proxy(L, msg);
+        lua_pushvalue(L, -1);
+        lua_insert(L, -4);
+        enum process_result res = callback(L, 1);
+        invalidate_message_proxy(proxy);
+        lua_pop(L, 1);
+        return res;
+}
+
+/* Call process_message on the messages of a batch starting at the
+ * given index. The callback and module are at the bottom of the stack;
+ * the index is advanced and a result stored for each message as it
+ * completes, so after an error the caller can carry on with the next
+ * message. The proxy in use is recorded in current, and kept alive in
+ * the registry under that address, so it can be invalidated even when
+ * the callback raises an error.
+ */
+static int batch_worker(lua_State *L)
+{
+        const struct glirc_message * const msgs = lua_touserdata(L, 3);
+        const size_t n                          = lua_tointeger (L, 4);
+        enum process_result * const out         = lua_touserdata(L, 5);
+        struct message_proxy ** const current   = lua_touserdata(L, 6);
+        size_t * const next                     = lua_touserdata(L, 7);
+        lua_settop(L, 2);                                 // STACK: callback module
+
+        for (; *next < n; ++*next) {
+                lua_pushvalue(L, 1);
+                lua_pushvalue(L, 2);
+                *current = push_glirc_message_proxy(L, &msgs[*next]);
+                lua_pushvalue(L, -1);
+                lua_rawsetp(L, LUA_REGISTRYINDEX, current); // STACK: callback module callback module proxy
+                lua_call(L, 2, 1);                          // STACK: callback module result
+                invalidate_message_proxy(*current);
+                *current = NULL;
+                out[*next] = lua_toboolean(L, -1) ? DROP_MESSAGE : PASS_MESSAGE;
+                lua_settop(L, 2);
+        }
+        return 0;
+}
+
+/* Callback used when client receives a batch of messages from the
+ * server, only while the script has turned batches on. The whole batch
+ * is processed in a single pcall, calling the script's process_message
+ * for each message in turn. An error is reported for the message that
+ * raised it and a new pcall picks up the rest of the batch.
+ */
+static void
+messages_entrypoint
+  (void *L,
+   const struct glirc_message *msgs,
+   size_t n,
+   enum process_result *out)
+{
+        for (size_t i = 0; i < n; i++) {
+                out[i] = PASS_MESSAGE;
+        }
+
+        if (L == NULL || !push_callback(L, CALLBACK_MESSAGE)) return;
+                                                          // STACK: callback module
+        struct message_proxy *current = NULL;
+        size_t next = 0;
+
+        while (next < n) {
+                lua_pushcfunction(L, batch_worker);
+                lua_pushvalue(L, -3);
+                lua_pushvalue(L, -3);                     // STACK: callback module worker callback module
+                lua_pushlightuserdata(L, (void*)msgs);
+                lua_pushinteger(L, n);
+                lua_pushlightuserdata(L, out);
+                lua_pushlightuserdata(L, &current);
+                lua_pushlightuserdata(L, &next);
+
+                if (lua_pcall(L, 7, 0, 0) != LUA_OK) {
+                        if (current) {
+                                invalidate_message_proxy(current);
+                                current = NULL;
+                        }
+                        report_error(L);
+                        next++;
+                }
+        }
+
+        lua_pop(L, 2);
+        lua_pushnil(L);
+        lua_rawsetp(L, LUA_REGISTRYINDEX, &current);
 }
 
 /***
@@ -231,13 +697,15 @@ chat_entrypoint
   (void *L,
    const struct glirc_chat *chat)
 {
-        if (L == NULL) return PASS_MESSAGE;
+        if (L == NULL || !push_callback(L, CALLBACK_CHAT)) return PASS_MESSAGE;
         push_glirc_chat(L, chat);
-        return callback(L, "process_chat", 1);
+        return callback(L, 1);
 }
 
 /***
-Callback used when client submits an /extension Lua command
+Callback used when client submits an /extension Lua command. The
+`__glirc_stats` command is handled by the extension itself and reports
+the interpreter's memory use.
 @function process_command
 @tparam extension self Extension module
 @tparam string command Command text
@@ -248,16 +716,28 @@ command_entrypoint
    const struct glirc_command *cmd)
 {
         if (L == NULL) return;
+
+        static const char stats_command[] = "__glirc_stats";
+        if (cmd->command.len == sizeof stats_command - 1 &&
+            !memcmp(cmd->command.str, stats_command, sizeof stats_command - 1)) {
+                print_stats(L);
+                return;
+        }
+
+        if (!push_callback(L, CALLBACK_COMMAND)) return;
         push_glirc_command(L, cmd);
-        callback(L, "process_command", 1);
+        callback(L, 1);
 }
 
 
 /***
 When scripting glirc, the glirc.lua file should return a table with these
 fields. Any omitted field will be ignored during its corresponding event.
+Fields can be replaced later by assigning to the table.
 
-process_message is called with a message argument.
+process_message is called with a message argument. Each message is
+offered once the client has processed the ones before it, unless the
+script turns on batches with `glirc.batch_messages`.
 
 process_command is called with a command argument.
 
@@ -284,6 +764,12 @@ Table used with process_chat
 
 /***
 Table used with send_message and process_message.
+
+process_message receives a proxy with these fields instead of a table.
+Its fields are built when first read, assignments to it are kept for
+the rest of the call, and `pairs` works as usual. The proxy can't be
+used once process_message returns, so copy out any fields that are
+needed later.
 @table message
 @tfield {[string]=string,...} tags Message tags
 @tfield string network Network name
@@ -300,6 +786,8 @@ Prefix information for messages being sent or received
 @tfield string host Hostname
 */
 
+GLIRC_EXTENSION_API_VERSION;
+
 struct glirc_extension extension = {
         .name            = "Lua",
         .major_version   = MAJOR,
@@ -309,4 +797,7 @@ struct glirc_extension extension = {
         .process_message = message_entrypoint,
         .process_command = command_entrypoint,
         .process_chat    = chat_entrypoint,
+        .process_messages = messages_entrypoint,
+        .flags           = GLIRC_SYNCHRONOUS,
+        .stop_jobs       = stop_jobs_entrypoint,
 };
@@ -1,5 +1,12 @@
+#include <lauxlib.h>
+
 #include "glirc-marshal.h"
 
+/* This global variable provides a unique key for storing
+ * the message proxy metatable in the Lua registry.
+ */
+static char message_proxy_key;
+
 /* Helper
  * Pushes the string represented by the argument to the top of the stack
  *
@@ -23,25 +30,20 @@ void push_glirc_string(lua_State *L, const struct glirc_string *s)
 
 /* Helper function
  * Returns: Array of strings
- * Import the given array of strings, free the strings and the list
+ * Import the given list of strings and free it
  *
  * [-0, +1, m]
  */
-void import_string_array(lua_State *L, char **list)
+void import_string_array(lua_State *L, struct glirc_string_list *list)
 {
-        int count = 0;
-        while (list[count] != NULL) {
-                count++;
-        }
-
-        lua_createtable(L, count, 0);
+        lua_createtable(L, list->n, 0);
 
-        for (int i = 0; list[i] != NULL; i++) {
-                lua_pushstring(L, list[i]);
+        for (size_t i = 0; i < list->n; i++) {
+                push_glirc_string(L, &list->strs[i]);
                 lua_rawseti(L, -2, i+1);
         }
 
-        glirc_free_strings(list);
+        glirc_free_string_list(list);
 }
 
 /* Push a table onto the top of the stack containing all of the fields
@@ -57,6 +59,54 @@ void push_glirc_command(lua_State *L, const struct glirc_command *cmd)
         lua_setfield(L,-2,"command");
 }
 
+/* Push a table containing the prefix fields of the message struct
+ *
+ * [-0, +1, m]
+ * */
+static void push_glirc_prefix(lua_State *L, const struct glirc_message *msg)
+{
+        lua_createtable(L, 0, 3);
+        push_glirc_string(L, &msg->prefix_nick);
+        lua_setfield(L, -2, "nick");
+        push_glirc_string(L, &msg->prefix_user);
+        lua_setfield(L, -2, "user");
+        push_glirc_string(L, &msg->prefix_host);
+        lua_setfield(L, -2, "host");
+}
+
+/* Push an array containing the parameters of the message struct
+ *
+ * [-0, +1, m]
+ * */
+static void push_glirc_params(lua_State *L, const struct glirc_message *msg)
+{
+        const int nrec = 0, narr = msg->params_n;
+        lua_createtable(L, narr, nrec);
+
+        /* initialize table */
+        for (int i = 0; i < narr; i++) {
+                push_glirc_string(L, &msg->params[i]);
+                lua_rawseti(L, -2, i+1);
+        }
+}
+
+/* Push a table mapping the tag keys of the message struct to their values
+ *
+ * [-0, +1, m]
+ * */
+static void push_glirc_tags(lua_State *L, const struct glirc_message *msg)
+{
+        const int nrec = msg->tags_n, narr = 0;
+        lua_createtable(L, narr, nrec);
+
+        /* initialize table */
+        for (int i = 0; i < nrec; i++) {
+                push_glirc_string(L, &msg->tagkeys[i]);
+                push_glirc_string(L, &msg->tagvals[i]);
+                lua_rawset(L, -3);
+        }
+}
+
 /* Push a table onto the top of the stack containing all of the fields
  * of the message struct
  *
@@ -69,42 +119,185 @@ void push_glirc_message(lua_State *L, const struct glirc_message *msg)
         push_glirc_string(L, &msg->network);
         lua_setfield(L,-2,"network");
 
-        lua_createtable(L, 0, 3);
-        push_glirc_string(L, &msg->prefix_nick);
-        lua_setfield(L, -2, "nick");
-        push_glirc_string(L, &msg->prefix_user);
-        lua_setfield(L, -2, "user");
-        push_glirc_string(L, &msg->prefix_host);
-        lua_setfield(L, -2, "host");
+        push_glirc_prefix(L, msg);
         lua_setfield(L, -2, "prefix");
 
         push_glirc_string(L, &msg->command);
         lua_setfield(L, -2, "command");
 
-        { /* populate params */
-                const int nrec = 0, narr = msg->params_n;
-                lua_createtable(L, narr, nrec);
+        push_glirc_params(L, msg);
+        lua_setfield(L,-2,"params");
 
-                /* initialize table */
-                for (int i = 0; i < narr; i++) {
-                        push_glirc_string(L, &msg->params[i]);
-                        lua_rawseti(L, -2, i+1);
-                }
-                lua_setfield(L,-2,"params");
+        push_glirc_tags(L, msg);
+        lua_setfield(L,-2,"tags");
+}
+
+/* Helper
+ * Returns the message behind the proxy at index i, raising an error
+ * when the value isn't a message proxy, as when a metamethod is called
+ * directly, or when the callback it was passed to has already returned.
+ */
+static const struct glirc_message *check_message_proxy(lua_State *L, int i)
+{
+        struct message_proxy *proxy = lua_touserdata(L, i);
+        int ok = proxy != NULL && lua_getmetatable(L, i);
+        if (ok) {
+                lua_rawgetp(L, LUA_REGISTRYINDEX, &message_proxy_key);
+                ok = lua_rawequal(L, -1, -2);
+                lua_pop(L, 2);
         }
+        if (!ok) {
+                luaL_argerror(L, i, "glirc message expected");
+        }
+        if (proxy->msg == NULL) {
+                luaL_error(L, "message used after its callback returned");
+        }
+        return proxy->msg;
+}
+
+/* Helper
+ * Push the table caching the materialized fields of the proxy at index 1,
+ * creating it on first use.
+ *
+ * [-0, +1, m]
+ */
+static void push_proxy_cache(lua_State *L)
+{
+        if (lua_getuservalue(L, 1) != LUA_TTABLE) {
+                lua_pop(L, 1);
+                lua_createtable(L, 0, 4);
+                lua_pushvalue(L, -1);
+                lua_setuservalue(L, 1);
+        }
+}
+
+/* Metamethod: proxy[key]
+ * Strings are pushed as needed. The prefix, params, and tags tables are
+ * built on first access and cached so they can be shared and updated.
+ */
+static int message_proxy_index(lua_State *L)
+{
+        const struct glirc_message *msg = check_message_proxy(L, 1);
+
+        push_proxy_cache(L);         // STACK: proxy key cache
+        lua_pushvalue(L, 2);
+        if (lua_rawget(L, -2) != LUA_TNIL) {
+                return 1;
+        }
+        lua_pop(L, 1);               // STACK: proxy key cache
+
+        if (lua_type(L, 2) != LUA_TSTRING) {
+                return 0;
+        }
+        const char *key = lua_tostring(L, 2);
+
+        if (!strcmp(key, "command")) {
+                push_glirc_string(L, &msg->command);
+                return 1;
+        } else if (!strcmp(key, "network")) {
+                push_glirc_string(L, &msg->network);
+                return 1;
+        } else if (!strcmp(key, "params")) {
+                push_glirc_params(L, msg);
+        } else if (!strcmp(key, "prefix")) {
+                push_glirc_prefix(L, msg);
+        } else if (!strcmp(key, "tags")) {
+                push_glirc_tags(L, msg);
+        } else {
+                return 0;
+        }
+
+        lua_pushvalue(L, -1);
+        lua_setfield(L, -3, key);
+        return 1;
+}
+
+/* Metamethod: proxy[key] = value
+ * Assignments are kept in the cache and shadow the message fields.
+ */
+static int message_proxy_newindex(lua_State *L)
+{
+        (void)check_message_proxy(L, 1);
+
+        push_proxy_cache(L);         // STACK: proxy key value cache
+        lua_insert(L, 2);            // STACK: proxy cache key value
+        lua_rawset(L, 2);
+        return 0;
+}
+
+/* Iterator over the proxy cache, next without a global lookup */
+static int message_proxy_next(lua_State *L)
+{
+        lua_settop(L, 2);
+        if (lua_next(L, 1)) {
+                return 2;
+        }
+        lua_pushnil(L);
+        return 1;
+}
+
+/* Metamethod: pairs(proxy)
+ * Materializes every field, then iterates over the cache.
+ */
+static int message_proxy_pairs(lua_State *L)
+{
+        static const char * const fields[] =
+                { "network", "prefix", "command", "params", "tags" };
 
-        { /* populate tags */
-                const int nrec = msg->tags_n, narr = 0;
-                lua_createtable(L, narr, nrec);
+        (void)check_message_proxy(L, 1);
+        lua_settop(L, 1);
 
-                /* initialize table */
-                for (int i = 0; i < nrec; i++) {
-                        push_glirc_string(L, &msg->tagkeys[i]);
-                        push_glirc_string(L, &msg->tagvals[i]);
-                        lua_rawset(L, -3);
+        push_proxy_cache(L);         // STACK: proxy cache
+        for (size_t i = 0; i < sizeof fields / sizeof *fields; i++) {
+                if (lua_getfield(L, 1, fields[i]) != LUA_TNIL) {
+                        lua_setfield(L, 2, fields[i]);
+                } else {
+                        lua_pop(L, 1);
                 }
-                lua_setfield(L,-2,"tags");
         }
+
+        lua_pushcfunction(L, message_proxy_next);
+        lua_insert(L, 2);            // STACK: proxy next cache
+        lua_pushnil(L);
+        return 3;
+}
+
+static const luaL_Reg message_proxy_methods[] = {
+        { "__index"   , message_proxy_index    },
+        { "__newindex", message_proxy_newindex },
+        { "__pairs"   , message_proxy_pairs    },
+        { NULL        , NULL                   }
+};
+
+/* Push a proxy for the message struct that builds the same fields as
+ * push_glirc_message on demand. The proxy borrows msg, so the caller
+ * must invalidate it before msg goes away.
+ *
+ * [-0, +1, m]
+ * */
+struct message_proxy *
+push_glirc_message_proxy(lua_State *L, const struct glirc_message *msg)
+{
+        struct message_proxy *proxy = lua_newuserdata(L, sizeof *proxy);
+        proxy->msg = msg;
+
+        if (lua_rawgetp(L, LUA_REGISTRYINDEX, &message_proxy_key) == LUA_TNIL) {
+                lua_pop(L, 1);
+                luaL_newlib(L, message_proxy_methods);
+                lua_pushliteral(L, "glirc message");
+                lua_setfield(L, -2, "__name");
+                lua_pushvalue(L, -1);
+                lua_rawsetp(L, LUA_REGISTRYINDEX, &message_proxy_key);
+        }
+        lua_setmetatable(L, -2);
+
+        return proxy;
+}
+
+/* Detach a proxy from its message, later accesses raise an error */
+void invalidate_message_proxy(struct message_proxy *proxy)
+{
+        proxy->msg = NULL;
 }
 
 /* Push a table onto the top of the stack containing all of the fields
@@ -0,0 +1,29 @@
+#ifndef GLIRC_ALLOC
+#define GLIRC_ALLOC 1
+
+#include <stddef.h>
+#include <lua.h>
+
+/* Requests up to this size are served from per-size free lists */
+#define ALLOC_POOL_MAX   128
+#define ALLOC_POOL_STEP  16
+#define ALLOC_POOL_CLASSES (ALLOC_POOL_MAX / ALLOC_POOL_STEP)
+
+struct alloc_state {
+        size_t bytes;             // bytes in use by Lua
+        size_t peak;              // largest value of bytes
+        size_t limit;             // 0 for no limit
+        unsigned long allocs;
+        unsigned long frees;
+        unsigned long reallocs;
+        unsigned long pool_hits;  // small allocations served from a free list
+        unsigned long failures;   // allocations refused by the limit or malloc
+        void *pool[ALLOC_POOL_CLASSES];
+        size_t pool_len[ALLOC_POOL_CLASSES];
+};
+
+struct alloc_state *new_alloc_state(size_t limit);
+void free_alloc_state(struct alloc_state *st);
+void *glirc_lua_alloc(void *ud, void *ptr, size_t osize, size_t nsize);
+
+#endif
@@ -0,0 +1,9 @@
+#ifndef GLIRC_LUA_CACHE
+#define GLIRC_LUA_CACHE 1
+
+#include <lua.h>
+
+int glirc_cache_loadfile(lua_State *L, const char *dir, const char *path);
+void glirc_install_cache_searcher(lua_State *L, const char *dir);
+
+#endif
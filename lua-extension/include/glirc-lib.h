@@ -7,5 +7,7 @@
 #define MINOR 0
 
 void glirc_install_lib(lua_State *L);
+void glirc_interrupt_spawns(lua_State *L);
+void glirc_close_spawns(lua_State *L);
 
 #endif
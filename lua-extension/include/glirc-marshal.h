@@ -16,11 +16,18 @@ static inline void set_glirc(lua_State *L, struct glirc *G)
         *(struct glirc **)lua_getextraspace(L) = G;
 }
 
+/* Userdata standing in for a message table during process_message */
+struct message_proxy {
+        const struct glirc_message *msg; /* NULL once the callback returns */
+};
+
 void push_glirc_chat(lua_State *L, const struct glirc_chat *chat);
 void push_glirc_message(lua_State *L, const struct glirc_message *msg);
+struct message_proxy *push_glirc_message_proxy(lua_State *L, const struct glirc_message *msg);
+void invalidate_message_proxy(struct message_proxy *proxy);
 void push_glirc_command(lua_State *L, const struct glirc_command *cmd);
 void push_glirc_string(lua_State *L, const struct glirc_string *s);
-void import_string_array(lua_State *L, char **list);
+void import_string_array(lua_State *L, struct glirc_string_list *list);
 int get_glirc_string(lua_State *L, int i, struct glirc_string *s);
 
 #endif
@@ -5,13 +5,62 @@ OTR::OTR(const OtrlMessageAppOps *ops, void *opdata)
 
 OTR::~OTR() { otrl_userstate_free(us); }
 
+bool
+OTR::ContextKey::operator==(const ContextKey &rhs) const
+{
+    return username == rhs.username && accountname == rhs.accountname && protocol == rhs.protocol;
+}
+
+size_t
+OTR::ContextKeyHash::operator()(const ContextKey &key) const
+{
+    std::hash<std::string> h;
+    size_t seed = h(key.username);
+    seed ^= h(key.accountname) + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+    seed ^= h(key.protocol)    + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+    return seed;
+}
+
+// Finds the best instance for a peer. The peer's master context comes
+// from the index so only that peer's instances are searched instead of
+// libotr's list of every context ever created.
 ConnContext *
 OTR::context_find
   (const std::string &username, const std::string &accountname, const std::string &protocol) const
 {
-    return otrl_context_find
+    auto it = contexts.find(ContextKey{username, accountname, protocol});
+    if (it != contexts.end()) {
+        return otrl_context_find_recent_secure_instance(it->second);
+    }
+
+    auto context = otrl_context_find
                 (us, username.c_str(), accountname.c_str(), protocol.c_str(),
                  OTRL_INSTAG_BEST, 0, nullptr, nullptr, nullptr);
+    if (context) context_index(context);
+    return context;
+}
+
+void
+OTR::context_index(ConnContext *context) const
+{
+    auto master = context->m_context ? context->m_context : context;
+    contexts[ContextKey{master->username, master->accountname, master->protocol}] = master;
+}
+
+void
+OTR::context_index(const char *username, const char *accountname, const char *protocol) const
+{
+    auto context = otrl_context_find
+                (us, username, accountname, protocol,
+                 OTRL_INSTAG_MASTER, 0, nullptr, nullptr, nullptr);
+    if (context) context_index(context);
+}
+
+// Called by libotr for each context created while reading fingerprints
+void
+OTR::context_added(void *data, ConnContext *context)
+{
+    static_cast<const OTR *>(data)->context_index(context);
 }
 
 void
@@ -21,13 +70,16 @@ OTR::message_disconnect_all_instances(
 {
   otrl_message_disconnect_all_instances
           (us, ops, opdata, accountname.c_str(), protocol.c_str(), username.c_str());
+
+  // The contexts remain in libotr's list in the finished state
+  context_index(username.c_str(), accountname.c_str(), protocol.c_str());
 }
 
 
 gcry_error_t
-OTR::privkey_write_fingerprints(const char *path) const
+OTR::privkey_write_fingerprints(FILE *file) const
 {
-    return otrl_privkey_write_fingerprints(us, path);
+    return otrl_privkey_write_fingerprints_FILEp(us, file);
 }
 
 
@@ -37,10 +89,43 @@ OTR::privkey_generate(const char *path, const char *accountname, const char *pro
     return otrl_privkey_generate(us, path, accountname, protocol);
 }
 
+// The split key generation functions allow the expensive calculate
+// step to run on a separate thread. Only calculate may be called
+// off the client thread: start and finish access the user state.
 gcry_error_t
-OTR::instag_generate(const char *path, const char *accountname, const char *protocol) const
+OTR::privkey_generate_start(const char *accountname, const char *protocol, void **newkey) const
 {
-    return otrl_instag_generate(us, path, accountname, protocol);
+    return otrl_privkey_generate_start(us, accountname, protocol, newkey);
+}
+
+gcry_error_t
+OTR::privkey_generate_calculate(void *newkey)
+{
+    return otrl_privkey_generate_calculate(newkey);
+}
+
+gcry_error_t
+OTR::privkey_generate_finish(FILE *file, void *newkey) const
+{
+    return otrl_privkey_generate_finish_FILEp(us, newkey, file);
+}
+
+void
+OTR::privkey_generate_cancelled(void *newkey) const
+{
+    otrl_privkey_generate_cancelled(us, newkey);
+}
+
+gcry_error_t
+OTR::instag_generate(FILE *file, const char *accountname, const char *protocol) const
+{
+    return otrl_instag_generate_FILEp(us, file, accountname, protocol);
+}
+
+gcry_error_t
+OTR::instag_write(FILE *file) const
+{
+    return otrl_instag_write_FILEp(us, file);
 }
 
 gcry_error_t
@@ -58,7 +143,7 @@ OTR::instag_read(const char *path) const
 gcry_error_t
 OTR::privkey_read_fingerprints(const char *path) const
 {
-    return otrl_privkey_read_fingerprints(us, path, nullptr, nullptr);
+    return otrl_privkey_read_fingerprints(us, path, context_added, const_cast<OTR *>(this));
 }
 
 void
@@ -85,15 +170,15 @@ OTR::message_poll() {
 }
 
 std::tuple<gcry_error_t, bool>
-OTR::message_sending(const std::string &accountname,
-                     const std::string &protocol,
-                     const std::string &username,
-                     const std::string &message) const
+OTR::message_sending(const char *accountname,
+                     const char *protocol,
+                     const char *username,
+                     const char *message) const
 {
     char * newmsg = nullptr;
 
     auto err = otrl_message_sending
-      (us, ops, opdata, accountname.c_str(), protocol.c_str(), username.c_str(), OTRL_INSTAG_BEST, message.c_str(),
+      (us, ops, opdata, accountname, protocol, username, OTRL_INSTAG_BEST, message,
        nullptr, &newmsg, OTRL_FRAGMENT_SEND_ALL, nullptr, nullptr, nullptr);
 
     otrl_message_free(newmsg);
@@ -101,22 +186,16 @@ OTR::message_sending(const std::string &accountname,
     return std::make_tuple(err, bool(newmsg));
 }
 
-std::tuple<int, bool, std::string>
-OTR::message_receiving(const std::string &accountname,
-                       const std::string &protocol,
-                       const std::string &username,
-                       const std::string &message) const
+std::tuple<int, OtrlMessage>
+OTR::message_receiving(const char *accountname,
+                       const char *protocol,
+                       const char *username,
+                       const char *message) const
 {
     char *newmsg = nullptr;
-    std::string newmessage;
 
-    int internal = otrl_message_receiving(us, ops, opdata, accountname.c_str(), protocol.c_str(), username.c_str(),
-                      message.c_str(), &newmsg, NULL, NULL, NULL, NULL);
-
-    if (newmsg) {
-        newmessage = newmsg;
-        otrl_message_free(newmsg);
-    }
+    int internal = otrl_message_receiving(us, ops, opdata, accountname, protocol, username,
+                      message, &newmsg, NULL, NULL, NULL, NULL);
 
-    return std::make_tuple(internal, bool(newmsg), std::move(newmessage));
+    return std::make_tuple(internal, OtrlMessage(newmsg));
 }
@@ -2,18 +2,45 @@
 #ifndef OTR_HPP
 #define OTR_HPP
 
+#include <memory>
 #include <string>
+#include <tuple>
+#include <unordered_map>
 
 extern "C" {
     #include <libotr/proto.h>
     #include <libotr/message.h>
     #include <libotr/privkey.h>
+    #include <libotr/context.h>
 }
 
+struct OtrlMessageFree {
+        void operator()(char *message) const { otrl_message_free(message); }
+};
+
+/* Message allocated by libotr */
+using OtrlMessage = std::unique_ptr<char, OtrlMessageFree>;
+
 class OTR {
         const OtrlMessageAppOps *ops;
         void *opdata;
 
+        struct ContextKey {
+                std::string username, accountname, protocol;
+                bool operator==(const ContextKey &) const;
+        };
+
+        struct ContextKeyHash {
+                size_t operator()(const ContextKey &) const;
+        };
+
+        /* Master contexts by peer. libotr keeps every context it has
+         * created in one list until the user state is freed, so these
+         * pointers stay valid for the lifetime of the OTR object. */
+        mutable std::unordered_map<ContextKey, ConnContext *, ContextKeyHash> contexts;
+
+        static void context_added(void *, ConnContext *);
+
 public:
         OtrlUserState us;
 
@@ -25,13 +52,21 @@ public:
         ConnContext * context_find
           (const std::string &username, const std::string &accountname, const std::string &protocol) const;
 
+        void context_index(ConnContext *context) const;
+        void context_index(const char *username, const char *accountname, const char *protocol) const;
+
         void message_disconnect_all_instances(
                         const std::string &accountname, const std::string &protocol,
                         const std::string &username) const;
 
-        gcry_error_t privkey_write_fingerprints(const char *path) const;
+        gcry_error_t privkey_write_fingerprints(FILE *file) const;
         gcry_error_t privkey_generate(const char *path, const char *accountname, const char *protocol) const;
-        gcry_error_t instag_generate(const char *path, const char *accountname, const char *protocol) const;
+        gcry_error_t privkey_generate_start(const char *accountname, const char *protocol, void **newkey) const;
+        gcry_error_t privkey_generate_finish(FILE *file, void *newkey) const;
+        void privkey_generate_cancelled(void *newkey) const;
+        static gcry_error_t privkey_generate_calculate(void *newkey);
+        gcry_error_t instag_generate(FILE *file, const char *accountname, const char *protocol) const;
+        gcry_error_t instag_write(FILE *file) const;
         gcry_error_t privkey_read(const char *path) const;
         gcry_error_t instag_read(const char *path) const;
         gcry_error_t privkey_read_fingerprints(const char *path) const;
@@ -43,17 +78,18 @@ public:
 
         void message_poll();
 
+        /* All arguments are NUL-terminated strings borrowed for the call */
         std::tuple<gcry_error_t, bool>
-        message_sending(const std::string &accountname,
-                        const std::string &protocol,
-                        const std::string &username,
-                        const std::string &message) const;
-
-        std::tuple<int, bool, std::string>
-        message_receiving(const std::string &accountname,
-                          const std::string &protocol,
-                          const std::string &username,
-                          const std::string &message) const;
+        message_sending(const char *accountname,
+                        const char *protocol,
+                        const char *username,
+                        const char *message) const;
+
+        std::tuple<int, OtrlMessage>
+        message_receiving(const char *accountname,
+                          const char *protocol,
+                          const char *username,
+                          const char *message) const;
 };
 
 #endif
@@ -0,0 +1,152 @@
+/*
+ * Message dispatch benchmark for the OTR extension.
+ *
+ * The extension is linked against stub implementations of the client
+ * API and fed a mix of server traffic that resembles a busy network:
+ * mostly channel chatter and protocol noise with occasional plaintext
+ * private messages. No OTR sessions are established, so this measures
+ * the cost of deciding what to do with a message, not the crypto.
+ *
+ * Run with: ./glirc-otr-bench [iterations]
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <vector>
+
+#include <unistd.h>
+
+extern "C" {
+    #include "glirc-api.h"
+}
+
+extern struct glirc_extension extension;
+
+namespace {
+
+size_t allocations;
+
+glirc_string mk(const char *str) { return { str, strlen(str) }; }
+
+} // namespace
+
+void *operator new(size_t n)
+{
+    allocations++;
+    if (void *p = malloc(n)) return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+
+/*
+ * Client API stubs
+ */
+
+extern "C" {
+
+int glirc_send_message(struct glirc *, const struct glirc_message *) { return 0; }
+int glirc_print(struct glirc *, enum message_code, const char *, size_t) { return 0; }
+
+int glirc_print_many(struct glirc *, enum message_code, const struct glirc_string *, size_t) { return 0; }
+
+int glirc_inject_chat(struct glirc *, const char *, size_t, const char *, size_t,
+                      const char *, size_t, const char *, size_t) { return 0; }
+
+int glirc_inject_chat_many(struct glirc *, const char *, size_t, const char *, size_t,
+                           const char *, size_t, const struct glirc_string *, size_t) { return 0; }
+
+void glirc_current_focus(struct glirc *, char **net, size_t *netlen, char **tgt, size_t *tgtlen)
+{
+    if (net) *net = strdup("bench");
+    if (netlen) *netlen = 5;
+    if (tgt) *tgt = strdup("peer");
+    if (tgtlen) *tgtlen = 4;
+}
+
+char *glirc_my_nick(struct glirc *, const char *, size_t) { return strdup("me"); }
+
+int glirc_is_channel(struct glirc *, const char *, size_t, const char *tgt, size_t tgtlen)
+{
+    return tgtlen > 0 && (*tgt == '#' || *tgt == '&');
+}
+
+int glirc_is_logged_on(struct glirc *, const char *, size_t, const char *, size_t) { return 1; }
+timer_id glirc_set_timer(struct glirc *, unsigned long, timer_callback *, void *) { return 1; }
+timer_id glirc_set_interval(struct glirc *, unsigned long, timer_callback *, void *) { return 1; }
+void *glirc_cancel_timer(struct glirc *, timer_id) { return nullptr; }
+
+void glirc_thread(struct glirc *, void *(*start)(void *), void (*finish)(void *), void *arg)
+{
+    finish(start(arg));
+}
+
+void glirc_free_string(char *s) { free(s); }
+
+}
+
+int main(int argc, char **argv)
+{
+    long iterations = argc > 1 ? atol(argv[1]) : 1000000;
+
+    // Keep the extension away from the real key and fingerprint files
+    char dir[] = "/tmp/glirc-otr-bench.XXXXXX";
+    if (!mkdtemp(dir)) { perror("mkdtemp"); return 1; }
+    setenv("HOME", dir, 1);
+
+    glirc_string chan_params[2] = { mk("#haskell"), mk("has anyone tried the new release?") };
+    glirc_string priv_params[2] = { mk("me"), mk("are you around later?") };
+    glirc_string ping_params[1] = { mk("irc.example.net") };
+    glirc_string join_params[1] = { mk("#haskell") };
+    glirc_string tagkeys[2]     = { mk("time"), mk("account") };
+    glirc_string tagvals[2]     = { mk("2020-01-01T00:00:00.000Z"), mk("someone") };
+
+    auto msg = [](const char *cmd, const glirc_string *params, size_t n) {
+        glirc_message m = {};
+        m.network     = mk("bench");
+        m.prefix_nick = mk("someone");
+        m.prefix_user = mk("~user");
+        m.prefix_host = mk("example.com");
+        m.command     = mk(cmd);
+        m.params      = params;
+        m.params_n    = n;
+        return m;
+    };
+
+    std::vector<glirc_message> traffic = {
+        msg("PRIVMSG", chan_params, 2),
+        msg("PRIVMSG", chan_params, 2),
+        msg("PRIVMSG", chan_params, 2),
+        msg("PRIVMSG", priv_params, 2),
+        msg("PING"   , ping_params, 1),
+        msg("JOIN"   , join_params, 1),
+        msg("NOTICE" , chan_params, 2),
+        msg("PRIVMSG", chan_params, 2),
+    };
+    for (auto &m : traffic) {
+        m.tagkeys = tagkeys;
+        m.tagvals = tagvals;
+        m.tags_n  = 2;
+    }
+
+    void *S = extension.start(nullptr, "glirc-otr-bench", nullptr, 0);
+
+    allocations = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (long i = 0; i < iterations; i++) {
+        extension.process_message(S, &traffic[i % traffic.size()]);
+    }
+    auto stop = std::chrono::steady_clock::now();
+
+    double secs = std::chrono::duration<double>(stop - start).count();
+    printf("%ld messages in %.3fs: %.0f messages/s, %.2f allocations/message\n",
+           iterations, secs, iterations / secs, double(allocations) / iterations);
+
+    extension.stop(S);
+    rmdir(dir);
+    return 0;
+}
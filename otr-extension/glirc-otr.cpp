@@ -1,13 +1,23 @@
 #define _GNU_SOURCE
 
+#include <cerrno>
 #include <cstring>
 #include <cstdbool>
 #include <cstdlib>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <deque>
+#include <map>
 #include <string>
+#include <string_view>
 #include <sstream>
 #include <tuple>
+#include <vector>
 #include <iomanip>
 
+#include <unistd.h>
+
 #include "OTR.hpp"
 
 extern "C" {
@@ -30,6 +40,30 @@ using namespace std;
 #define GREEN(x) "\00303" x PLAIN
 #define RED(x)   "\00304" x PLAIN
 
+// Delay between a state change and writing it to disk. Changes made
+// in the meantime are written by the same flush.
+#define FLUSH_DELAY_MS 2000
+
+// Flood control for our own messages on each network, by default the
+// client's default flood-penalty and flood-threshold. Messages are sent
+// at once while there is credit and only the excess is paced, so queued
+// fragments never pile up in the client's send queue ahead of the
+// user's other messages. The client's settings aren't available to
+// extensions, so the --flood-penalty and --flood-threshold arguments
+// set them, and only our own messages and the user's chat messages
+// are counted; this is an approximation of the client's rate limit.
+#define SEND_PENALTY_MS   2000
+#define SEND_THRESHOLD_MS 10000
+
+// Every line the server relays is limited to 512 bytes including the
+// ":nick!user@host PRIVMSG target :" prefix and the trailing CRLF.
+#define IRC_LINE_LIMIT 512
+#define PRIVMSG_OVERHEAD (sizeof(": PRIVMSG  :\r\n") - 1)
+
+// Fragment size used until our own user and host are known
+#define DEFAULT_FRAGMENT_SIZE 400
+#define MIN_FRAGMENT_SIZE 64
+
 #define QUERY_TEXT "?OTRv23? This message is attempting to initiate an encrypted" \
                    " session, but your client doesn't support this protocol."
 
@@ -53,6 +87,10 @@ void create_privkey(void *, const char *, const char *);
 void create_instag(void *, const char *, const char *);
 void timer_control(void *, unsigned int);
 void timer_entrypoint(void *, timer_id);
+void flush_entrypoint(void *, timer_id);
+void send_entrypoint(void *, timer_id);
+void *keygen_start(void *);
+void keygen_finish(void *);
 
 OtrlMessageAppOps ops = {
     .policy            = op_policy,
@@ -99,6 +137,20 @@ void normalizeCase(string *str) {
    for (auto &x : *str) { x = casemap[(unsigned char)x]; }
 }
 
+string normalized(string_view str) {
+   string result(str);
+   normalizeCase(&result);
+   return result;
+}
+
+// Case-insensitive identifier comparison without normalizing copies
+bool same_identifier(string_view x, string_view y) {
+   return x.size() == y.size() &&
+          equal(x.begin(), x.end(), y.begin(), [](char a, char b) {
+              return casemap[(unsigned char)a] == casemap[(unsigned char)b];
+          });
+}
+
 /* Construct a glirc_string from a null-terminated C string */
 inline struct glirc_string mk_glirc_string(const char * str) {
         return (struct glirc_string) { .str = str, .len = strlen(str) };
@@ -109,6 +161,80 @@ inline string make_string(const glirc_string &s) {
         return string(s.str, s.len);
 }
 
+/* Borrow a glirc_string for the duration of a callback */
+inline string_view make_view(const glirc_string &s) {
+        return string_view(s.str, s.len);
+}
+
+struct OpData;
+
+// Private key generation running on a background thread. The job is
+// owned by its OpData until the finish callback runs on the client
+// thread.
+struct Keygen {
+    OpData *opdata;
+    string accountname;
+    string protocol;
+    void *newkey;
+    gcry_error_t err;
+    chrono::steady_clock::time_point started;
+
+    // peers whose key exchange was abandoned while waiting for the key
+    vector<string> peers;
+};
+
+// Accounts are identified by (accountname, protocol) and peers
+// by (accountname, protocol, username), all normalized.
+using AccountKey = tuple<string, string>;
+using PeerKey    = tuple<string, string, string>;
+
+// Flood control settings, in the sense of the client's flood-penalty
+// and flood-threshold
+struct FloodLimit {
+    chrono::milliseconds penalty   {SEND_PENALTY_MS};
+    chrono::milliseconds threshold {SEND_THRESHOLD_MS};
+};
+
+// Messages waiting to be sent on one network. Peers take turns so a
+// long message to one peer doesn't delay everything sent to the others.
+struct SendQueue {
+    /* pending messages by recipient, never empty */
+    map<string, deque<string>, less<>> peers;
+
+    /* recipient that was sent to most recently */
+    string last_peer;
+
+    /* time our sending is caught up to, as in the client's rate limit */
+    chrono::steady_clock::time_point stamp;
+
+    // Milliseconds until another message can be sent, 0 when it can
+    // be sent now.
+    long wait_ms(chrono::steady_clock::time_point now, const FloodLimit &limit) const {
+        auto next   = max(stamp, now) + limit.penalty;
+        auto excess = next - now - limit.threshold;
+        return max(0L, long(chrono::ceil<chrono::milliseconds>(excess).count()));
+    }
+
+    void sent(chrono::steady_clock::time_point now, const FloodLimit &limit) {
+        stamp = max(stamp, now) + limit.penalty;
+    }
+};
+
+// What we know about our connection to a network, learned from the
+// messages passing through message_entrypoint so that the common
+// paths don't need to call back into the client.
+struct NetworkInfo {
+    /* normalized nickname, empty until known */
+    string nick;
+
+    /* our username and hostname as seen by other users, empty until known */
+    string user, host;
+
+    /* channel prefixes from ISUPPORT, valid when have_chantypes is set */
+    string chantypes;
+    bool have_chantypes = false;
+};
+
 // It is useful to store a copy of the user state in the opdata
 // because some callbacks forget to provide it
 struct OpData {
@@ -125,10 +251,149 @@ private:
     unsigned long timer_interval;
     long timer_id;
 
+    /* pending private key generation jobs */
+    map<AccountKey, Keygen*> keygens;
+
+    /* chat messages waiting on a private key or a secure session */
+    map<PeerKey, vector<string>> held_messages;
+
+    /* state files with changes not yet written to disk */
+    bool fingerprints_dirty;
+    bool instags_dirty;
+    bool flush_pending;
+    long flush_timer;
+
+    void schedule_flush() {
+        if (!flush_pending) {
+            flush_pending = true;
+            flush_timer = glirc_set_timer(G, FLUSH_DELAY_MS, flush_entrypoint, this);
+        }
+    }
+
+    /* outgoing messages paced per network */
+    map<string, SendQueue, less<>> send_queues;
+    bool send_pending;
+    long send_timer;
+
+    SendQueue &send_queue(string_view network) {
+        auto it = send_queues.find(network);
+        if (it == send_queues.end()) {
+            it = send_queues.emplace(string(network), SendQueue()).first;
+        }
+        return it->second;
+    }
+
+    // Wake up when the first network with queued messages has credit
+    // again. A pending timer is never more than one penalty away.
+    void schedule_send() {
+        if (send_pending) return;
+
+        auto now = chrono::steady_clock::now();
+        long delay = -1;
+        for (auto &&entry : send_queues) {
+            if (entry.second.peers.empty()) continue;
+            auto wait = entry.second.wait_ms(now, flood);
+            if (delay < 0 || wait < delay) delay = wait;
+        }
+
+        if (delay >= 0) {
+            send_pending = true;
+            send_timer = glirc_set_timer(G, max(delay, 1L), send_entrypoint, this);
+        }
+    }
+
+    /* per-network connection details keyed by network name */
+    map<string, NetworkInfo, less<>> networks;
+
+    NetworkInfo &network_info(string_view network) {
+        auto it = networks.find(network);
+        if (it == networks.end()) {
+            it = networks.emplace(string(network), NetworkInfo()).first;
+        }
+        return it->second;
+    }
+
 public:
+    /* pacing of our own messages */
+    FloodLimit flood;
+
+    /* peer whose message libotr is currently processing */
+    const string *active_peer;
+
     OpData(glirc *G) :
             G(G), otr(&ops, this),
-            timer_active(false), timer_interval(0), timer_id(0) {}
+            timer_active(false), timer_interval(0), timer_id(0),
+            fingerprints_dirty(false), instags_dirty(false),
+            flush_pending(false), flush_timer(0),
+            send_pending(false), send_timer(0),
+            active_peer(nullptr) {}
+
+    // Threads have all finished by the time the client stops an
+    // extension, but the finish callbacks of pending jobs are skipped.
+    ~OpData() {
+        for (auto &&entry : keygens) {
+            otr.privkey_generate_cancelled(entry.second->newkey);
+            delete entry.second;
+        }
+    }
+
+    OpData(const OpData &) = delete;
+    OpData &operator=(const OpData &) = delete;
+
+    const Keygen *find_keygen(string_view accountname, string_view protocol) const {
+        if (keygens.empty()) return nullptr;
+        auto it = keygens.find(make_tuple(string(accountname), string(protocol)));
+        return it == keygens.end() ? nullptr : it->second;
+    }
+
+    void fingerprints_changed() { fingerprints_dirty = true; schedule_flush(); }
+    void instags_changed()      { instags_dirty = true;      schedule_flush(); }
+
+    void flush_state();
+    void flush_finished() { flush_pending = false; }
+
+    void send_message(const char *network, const char *recipient, const char *message);
+    void send_next();
+    void send_all();
+
+    // Count a message the client sends for the user against the
+    // network's flood credit.
+    void user_sent(string_view network) {
+        send_queue(network).sent(chrono::steady_clock::now(), flood);
+    }
+
+    // Number of messages queued for a peer and the number of flood
+    // penalties until the last of them goes out.
+    tuple<size_t, size_t> send_backlog(string_view network, string_view recipient) const {
+        auto q = send_queues.find(network);
+        if (q == send_queues.end()) return make_tuple(0, 0);
+
+        auto it = q->second.peers.find(recipient);
+        if (it == q->second.peers.end()) return make_tuple(0, 0);
+
+        auto depth = it->second.size();
+        size_t intervals = 0;
+        for (auto &&entry : q->second.peers) {
+            intervals += min(depth, entry.second.size());
+        }
+        return make_tuple(depth, intervals);
+    }
+
+    void start_keygen(const char *accountname, const char *protocol);
+    void keygen_finished(Keygen *job);
+
+    void hold_message(const string &accountname, const string &protocol,
+                      const string &username, const string &message) {
+        held_messages[make_tuple(accountname, protocol, username)].push_back(message);
+    }
+
+    void discard_held(const string &accountname, const string &protocol, const string &username) {
+        held_messages.erase(make_tuple(accountname, protocol, username));
+    }
+
+    void release_held(const string &accountname, const string &protocol, const string &username);
+    void send_chat(const string &accountname, const string &protocol,
+                   const string &username, const string &message);
 
     tuple<string,string> current_focus() {
 
@@ -146,14 +411,20 @@ public:
       return make_tuple(net_out, tgt_out);
     }
 
-    string my_nick(const string &network) {
-        auto me = glirc_my_nick(G, network.c_str(), network.length());
-        string result;
-        if (me) {
-                result = string(me);
+    // Returns our normalized nickname on a network, or an empty
+    // string when it isn't known. The client is only asked when the
+    // extension was started after the connection registered.
+    const string &my_nick(string_view network) {
+        auto &info = network_info(network);
+        if (info.nick.empty()) {
+            auto me = glirc_my_nick(G, network.data(), network.size());
+            if (me) {
+                info.nick = me;
+                normalizeCase(&info.nick);
                 glirc_free_string(me);
+            }
         }
-        return result;
+        return info.nick;
     }
 
     ConnContext *get_current_context() {
@@ -162,34 +433,111 @@ public:
         if (net.empty() || tgt.empty()) return NULL;
         normalizeCase(&tgt);
 
-        auto me = my_nick(net);
+        auto &me = my_nick(net);
         if (me.empty()) return NULL;
-        normalizeCase(&me);
 
         return otr.context_find(tgt, me, net);
     }
 
-    bool is_channel(const string &net, const string &tgt) {
-        return glirc_is_channel(G, net.c_str(), net.length(), tgt.c_str(), tgt.length());
+    // The client is only asked when no ISUPPORT has been seen
+    // for the network since the extension started.
+    bool is_channel(string_view net, string_view tgt) {
+        auto it = networks.find(net);
+        if (it != networks.end() && it->second.have_chantypes) {
+            return !tgt.empty() && it->second.chantypes.find(tgt[0]) != string::npos;
+        }
+        return glirc_is_channel(G, net.data(), net.size(), tgt.data(), tgt.size());
     }
 
-    void schedule_timer() {
-        if (timer_active) {
-            glirc_cancel_timer(G, timer_id);
+    /* RPL_WELCOME: the first parameter is our nickname */
+    void observe_welcome(const struct glirc_message *msg) {
+        if (msg->params_n < 1) return;
+        auto &info = network_info(make_view(msg->network));
+        info.nick = normalized(make_view(msg->params[0]));
+        info.user.clear();
+        info.host.clear();
+    }
+
+    // Returns our network entry when a message was sent by us
+    NetworkInfo *own_message(const struct glirc_message *msg) {
+        auto it = networks.find(make_view(msg->network));
+        if (it == networks.end() || it->second.nick.empty()) return nullptr;
+        if (!same_identifier(make_view(msg->prefix_nick), it->second.nick)) return nullptr;
+        return &it->second;
+    }
+
+    // Our own JOINs, NICKs and echoed messages carry the prefix
+    // that the server shows to everyone else.
+    void observe_prefix(const struct glirc_message *msg) {
+        auto info = own_message(msg);
+        if (info && msg->prefix_user.len > 0 && msg->prefix_host.len > 0) {
+            info->user.assign(msg->prefix_user.str, msg->prefix_user.len);
+            info->host.assign(msg->prefix_host.str, msg->prefix_host.len);
         }
-        timer_active = timer_interval > 0;
-        if (timer_active) {
-                timer_id = glirc_set_timer(G, 1000 * timer_interval, timer_entrypoint, this);
+    }
+
+    void observe_nick(const struct glirc_message *msg) {
+        if (msg->params_n < 1) return;
+        observe_prefix(msg);
+        if (auto info = own_message(msg)) {
+            info->nick = normalized(make_view(msg->params[0]));
+        }
+    }
+
+    /* RPL_HOSTHIDDEN: nick, host, description */
+    void observe_hosthidden(const struct glirc_message *msg) {
+        if (msg->params_n < 2) return;
+        auto &info = network_info(make_view(msg->network));
+        info.host.assign(msg->params[1].str, msg->params[1].len);
+    }
+
+    // Largest message body that reaches the target in one line: the
+    // client splits longer messages and the server truncates them,
+    // either of which corrupts an OTR fragment.
+    int fragment_size(string_view net, string_view target) const {
+        auto it = networks.find(net);
+        if (it == networks.end()) return DEFAULT_FRAGMENT_SIZE;
+
+        auto &info = it->second;
+        if (info.nick.empty() || info.user.empty() || info.host.empty()) {
+            return DEFAULT_FRAGMENT_SIZE;
         }
+
+        // nick!user@host
+        auto prefix = info.nick.size() + info.user.size() + info.host.size() + 2;
+        auto used   = prefix + PRIVMSG_OVERHEAD + target.size();
+        if (used + MIN_FRAGMENT_SIZE > IRC_LINE_LIMIT) return MIN_FRAGMENT_SIZE;
+        return IRC_LINE_LIMIT - used;
     }
 
-    void timer_finished() {
-        timer_active = false;
+    /* RPL_ISUPPORT: nick, tokens..., trailing description */
+    void observe_isupport(const struct glirc_message *msg) {
+        for (size_t i = 1; i + 1 < msg->params_n; i++) {
+            auto token = make_view(msg->params[i]);
+            if (token == "-CHANTYPES") {
+                network_info(make_view(msg->network)).have_chantypes = false;
+            } else if (token.substr(0, 9) == "CHANTYPES" &&
+                       (token.size() == 9 || token[9] == '=')) {
+                auto &info = network_info(make_view(msg->network));
+                info.chantypes = string(token.substr(token.size() == 9 ? 9 : 10));
+                info.have_chantypes = true;
+            }
+        }
     }
 
+    // The poll timer recurs on its own and only needs replacing
+    // when libotr asks for a different interval
     void timer_control(unsigned long interval) {
+        if (timer_active && interval == timer_interval) return;
+
+        if (timer_active) {
+            glirc_cancel_timer(G, timer_id);
+        }
         timer_interval = interval;
-        schedule_timer();
+        timer_active = timer_interval > 0;
+        if (timer_active) {
+                timer_id = glirc_set_interval(G, 1000 * timer_interval, timer_entrypoint, this);
+        }
     }
 };
 
@@ -237,6 +585,72 @@ void print_status(struct glirc *G, ConnContext *context, const char *fmt, ...)
   va_end(ap);
 }
 
+/*
+ * Lines of a multi-line status report for one context. The lines are
+ * added to the context's chat window in a single update by print.
+ */
+class StatusReport {
+  struct glirc *G;
+  ConnContext *context;
+  vector<string> lines;
+
+public:
+  StatusReport(struct glirc *G, ConnContext *context) : G(G), context(context) {}
+
+  void add(const char *fmt, ...) __attribute__ ((format (printf, 2, 3)));
+  void print() const;
+};
+
+void StatusReport::add(const char *fmt, ...)
+{
+  char *msg = NULL;
+  va_list ap;
+  va_start(ap, fmt);
+  int len = vasprintf(&msg, fmt, ap);
+  va_end(ap);
+
+  if (0 > len || !msg) abort();
+
+  lines.emplace_back(msg, len);
+  free(msg);
+}
+
+void StatusReport::print() const
+{
+  vector<glirc_string> msgs;
+  msgs.reserve(lines.size());
+  for (auto const& line : lines) {
+    msgs.push_back({ .str = line.data(), .len = line.size() });
+  }
+
+  const char *net = context->protocol;
+  const char *src = PLUGIN_USER;
+  const char *tgt = context->username;
+
+  glirc_inject_chat_many
+    (G, net, strlen(net),
+     src, strlen(src),
+     tgt, strlen(tgt),
+     msgs.data(), msgs.size());
+}
+
+
+void send_privmsg(struct glirc *G, const char *net, const char *tgt, const char *msg)
+{
+  struct glirc_string params[2] = {
+    mk_glirc_string(tgt),
+    mk_glirc_string(msg),
+  };
+
+  struct glirc_message m = {
+    .network  = mk_glirc_string(net),
+    .command  = mk_glirc_string("PRIVMSG"),
+    .params   = params,
+    .params_n = 2,
+  };
+
+  glirc_send_message(G, &m);
+}
 
 char *state_path(const char *what)
 {
@@ -248,6 +662,158 @@ char *state_path(const char *what)
   return res;
 }
 
+// Replace a state file by writing a temporary file next to it and
+// renaming it into place, so an interrupted write never leaves a
+// truncated file behind.
+template <typename Write>
+gcry_error_t write_state(const char *what, Write write)
+{
+  char *path = state_path(what);
+  if (!path) return gcry_error(GPG_ERR_NO_DATA);
+
+  // mkstemp creates the file with mode 0600 and a name no other
+  // client writing the same state can be using
+  auto tmp = string(path) + ".XXXXXX";
+  gcry_error_t err = 0;
+
+  int fd = mkstemp(&tmp[0]);
+  FILE *file = fd < 0 ? nullptr : fdopen(fd, "w");
+
+  if (!file) {
+    err = gcry_error_from_errno(errno);
+    if (fd >= 0) {
+      close(fd);
+      unlink(tmp.c_str());
+    }
+  } else {
+    err = write(file);
+    if (!err && (fflush(file) || fsync(fileno(file)))) err = gcry_error_from_errno(errno);
+    if (fclose(file) && !err) err = gcry_error_from_errno(errno);
+    if (!err && rename(tmp.c_str(), path)) err = gcry_error_from_errno(errno);
+    if (err) unlink(tmp.c_str());
+  }
+
+  free(path);
+  return err;
+}
+
+void report_write_error(struct glirc *G, const char *what, gcry_error_t err)
+{
+  ostringstream out;
+  out << "OTR: Failed to save " << what << " [" << gcry_strerror(err) << "]";
+  auto str = out.str();
+  glirc_print(G, ERROR_MESSAGE, str.c_str(), str.length());
+}
+
+// Write every state file that changed since the last flush
+void OpData::flush_state()
+{
+  if (flush_pending) {
+    glirc_cancel_timer(G, flush_timer);
+    flush_pending = false;
+  }
+
+  if (fingerprints_dirty) {
+    fingerprints_dirty = false;
+    auto err = write_state("fingerprints",
+                 [this](FILE *file) { return otr.privkey_write_fingerprints(file); });
+    if (err) report_write_error(G, "fingerprints", err);
+  }
+
+  if (instags_dirty) {
+    instags_dirty = false;
+    auto err = write_state("instags",
+                 [this](FILE *file) { return otr.instag_write(file); });
+    if (err) report_write_error(G, "instance tags", err);
+  }
+}
+
+// Entry point from client when the flush delay has elapsed
+void flush_entrypoint(void *L, timer_id tid)
+{
+  (void)tid;
+  GET_opdata;
+
+  opdata->flush_finished();
+  opdata->flush_state();
+}
+
+// Send a message now while the network has flood credit, otherwise
+// queue it behind the messages already waiting for the same peer.
+void OpData::send_message(const char *network, const char *recipient, const char *message)
+{
+  auto &q = send_queue(network);
+  auto now = chrono::steady_clock::now();
+
+  if (q.peers.empty() && q.wait_ms(now, flood) == 0) {
+    q.sent(now, flood);
+    q.last_peer = recipient;
+    send_privmsg(G, network, recipient, message);
+    return;
+  }
+
+  auto peer = q.peers.find(string_view(recipient));
+  if (peer == q.peers.end()) {
+    peer = q.peers.emplace(recipient, deque<string>()).first;
+  }
+  peer->second.emplace_back(message);
+
+  schedule_send();
+}
+
+// Send the queued messages each network has credit for, taking the
+// peers in turn after the one sent to last.
+void OpData::send_next()
+{
+  send_pending = false;
+  auto now = chrono::steady_clock::now();
+
+  for (auto &&entry : send_queues) {
+    auto &q = entry.second;
+
+    while (!q.peers.empty() && q.wait_ms(now, flood) == 0) {
+      auto peer = q.peers.upper_bound(q.last_peer);
+      if (peer == q.peers.end()) peer = q.peers.begin();
+
+      q.sent(now, flood);
+      q.last_peer = peer->first;
+      send_privmsg(G, entry.first.c_str(), peer->first.c_str(), peer->second.front().c_str());
+
+      peer->second.pop_front();
+      if (peer->second.empty()) q.peers.erase(peer);
+    }
+  }
+
+  schedule_send();
+}
+
+// Send everything still queued, used when the extension stops
+void OpData::send_all()
+{
+  if (send_pending) {
+    glirc_cancel_timer(G, send_timer);
+    send_pending = false;
+  }
+
+  for (auto &&q : send_queues) {
+    for (auto &&peer : q.second.peers) {
+      for (auto &&message : peer.second) {
+        send_privmsg(G, q.first.c_str(), peer.first.c_str(), message.c_str());
+      }
+    }
+  }
+  send_queues.clear();
+}
+
+// Entry point from client when the send interval has elapsed
+void send_entrypoint(void *L, timer_id tid)
+{
+  (void)tid;
+  GET_opdata;
+
+  opdata->send_next();
+}
+
 OtrlPolicy op_policy(void *L, ConnContext *context)
 {
   (void)L; (void)context;
@@ -306,19 +872,7 @@ inject_message
   // inject_chat gets called even when there's no chat to inject!
   if (strlen(message) == 0) { return; }
 
-  struct glirc_string params[2] = {
-    mk_glirc_string(recipient),
-    mk_glirc_string(message),
-  };
-
-  struct glirc_message m = {
-    .network  = mk_glirc_string(protocol),
-    .command  = mk_glirc_string("PRIVMSG"),
-    .params   = params,
-    .params_n = 2,
-  };
-
-  glirc_send_message(opdata->G, &m);
+  opdata->send_message(protocol, recipient, message);
 }
 
 void
@@ -361,9 +915,8 @@ handle_msg_event
 
 int max_message_size(void *L, ConnContext *context)
 {
-  (void)L, (void)context;
-
-  return 400; // pessimistic
+  GET_opdata;
+  return opdata->fragment_size(context->protocol, context->username);
 }
 
 int is_logged_in
@@ -388,6 +941,9 @@ void gone_secure(void *L, ConnContext *context)
   print_status(opdata->G, context,
       "Connection secured [%s]",
       trusted  ? GREEN("trusted") : RED("untrusted"));
+
+  opdata->otr.context_index(context);
+  opdata->release_held(context->accountname, context->protocol, context->username);
 }
 
 void still_secure(void *L, ConnContext *context, int is_reply)
@@ -407,9 +963,11 @@ new_fingerprint
   (void *L, OtrlUserState us, const char *accountname, const char *net,
    const char *tgt, unsigned char fp[20])
 {
-  (void)us, (void)accountname;
+  (void)us;
   GET_opdata;
 
+  opdata->otr.context_index(tgt, accountname, net);
+
   char human[OTRL_PRIVKEY_FPRINT_HUMAN_LEN];
   otrl_privkey_hash_to_human(human, fp);
 
@@ -419,29 +977,209 @@ new_fingerprint
 void write_fingerprints(void *L)
 {
   GET_opdata;
-
-  char *path = state_path("fingerprints");
-  if (path) opdata->otr.privkey_write_fingerprints(path);
-  free(path);
+  opdata->fingerprints_changed();
 }
 
+// Generating a key takes several seconds, so this only starts a
+// background job. libotr gives up on the message that needed the key;
+// the key exchange is restarted once the job finishes.
 void create_privkey(void *L, const char *accountname, const char *protocol)
 {
     GET_opdata;
+    opdata->start_keygen(accountname, protocol);
+}
+
+void OpData::start_keygen(const char *accountname, const char *protocol)
+{
+    auto key = make_tuple(string(accountname), string(protocol));
+    auto it  = keygens.find(key);
+
+    if (it != keygens.end()) {
+        auto &peers = it->second->peers;
+        if (active_peer && find(peers.begin(), peers.end(), *active_peer) == peers.end()) {
+            peers.push_back(*active_peer);
+        }
+        return;
+    }
 
     char *path = state_path("keys");
-    if (path) opdata->otr.privkey_generate(path, accountname, protocol);
+    if (!path) return;
     free(path);
+
+    void *newkey = nullptr;
+    auto err = otr.privkey_generate_start(accountname, protocol, &newkey);
+    if (err || !newkey) {
+        if (active_peer) {
+            glirc_printf(G, protocol, PLUGIN_USER, active_peer->c_str(),
+                         RED("Private key generation failed") " [%s]", gcry_strerror(err));
+        } else {
+            const char *errmsg = "OTR: Private key generation failed";
+            glirc_print(G, ERROR_MESSAGE, errmsg, strlen(errmsg));
+        }
+        return;
+    }
+
+    auto job = new Keygen {
+        this, accountname, protocol, newkey, 0, chrono::steady_clock::now(), {}
+    };
+    if (active_peer) job->peers.push_back(*active_peer);
+    keygens[key] = job;
+
+    if (!active_peer) {
+        ostringstream out;
+        out << "OTR: Generating private key for " << accountname << " on " << protocol << "...";
+        auto str = out.str();
+        glirc_print(G, NORMAL_MESSAGE, str.c_str(), str.length());
+    } else {
+        glirc_printf(G, protocol, PLUGIN_USER, active_peer->c_str(),
+                     "Generating private key [" BOLD("%s") "], messages will be held until it is ready",
+                     accountname);
+    }
+
+    glirc_thread(G, keygen_start, keygen_finish, job);
 }
 
+// Runs on the worker thread
+void *keygen_start(void *K)
+{
+    auto job = static_cast<Keygen*>(K);
+    job->err = OTR::privkey_generate_calculate(job->newkey);
+    return job;
+}
+
+// Runs on the client thread after keygen_start returns
+void keygen_finish(void *K)
+{
+    auto job = static_cast<Keygen*>(K);
+    job->opdata->keygen_finished(job);
+}
+
+void OpData::keygen_finished(Keygen *job)
+{
+    keygens.erase(make_tuple(job->accountname, job->protocol));
+
+    // Keys are written immediately: losing one would
+    // invalidate every fingerprint our peers have stored.
+    auto err = job->err;
+    bool finished = false;
+    if (!err) {
+        err = write_state("keys", [this, job, &finished](FILE *file) {
+                  finished = true;
+                  return otr.privkey_generate_finish(file, job->newkey);
+              });
+    }
+    if (!finished) {
+        otr.privkey_generate_cancelled(job->newkey);
+    }
 
+    auto net = job->protocol.c_str();
+    auto secs = chrono::duration_cast<chrono::seconds>
+                  (chrono::steady_clock::now() - job->started).count();
+
+    // Collect the held messages for this account, keeping the ones
+    // for peers who will restart the key exchange until it completes.
+    vector<pair<string, vector<string>>> ready;
+    for (auto it = held_messages.begin(); it != held_messages.end(); ) {
+        auto &me   = get<0>(it->first);
+        auto &prot = get<1>(it->first);
+        auto &peer = get<2>(it->first);
+        bool waiting = find(job->peers.begin(), job->peers.end(), peer) != job->peers.end();
+
+        if (me != job->accountname || prot != job->protocol || (!err && waiting)) {
+            ++it;
+        } else {
+            ready.emplace_back(peer, move(it->second));
+            it = held_messages.erase(it);
+        }
+    }
+
+    if (err) {
+        for (auto &&entry : ready) {
+            glirc_printf(G, net, PLUGIN_USER, entry.first.c_str(),
+                         RED("Private key generation failed") " [%s], %zu held messages discarded",
+                         gcry_strerror(err), entry.second.size());
+        }
+        for (auto &&peer : job->peers) {
+            auto held = find_if(ready.begin(), ready.end(),
+                                [&peer](auto &&entry) { return entry.first == peer; });
+            if (held != ready.end()) continue;
+            glirc_printf(G, net, PLUGIN_USER, peer.c_str(),
+                         RED("Private key generation failed") " [%s]", gcry_strerror(err));
+        }
+    } else {
+        char human[OTRL_PRIVKEY_FPRINT_HUMAN_LEN];
+        const char *myfp = otrl_privkey_fingerprint
+                             (otr.us, human, job->accountname.c_str(), net);
+
+        for (auto &&peer : job->peers) {
+            glirc_printf(G, net, PLUGIN_USER, peer.c_str(),
+                         "Private key ready [" BOLD("%s") "] after %llds, restarting key exchange",
+                         myfp ? myfp : "?", static_cast<long long>(secs));
+            send_message(net, peer.c_str(), QUERY_TEXT);
+        }
+
+        if (job->peers.empty()) {
+            ostringstream out;
+            out << "OTR: Private key ready for " << job->accountname << " on " << job->protocol;
+            auto str = out.str();
+            glirc_print(G, NORMAL_MESSAGE, str.c_str(), str.length());
+        }
+
+        for (auto &&entry : ready) {
+            for (auto &&message : entry.second) {
+                send_chat(job->accountname, job->protocol, entry.first, message);
+            }
+        }
+    }
+
+    delete job;
+}
+
+// Send the messages that were held for a peer now that it is safe to
+void OpData::release_held(const string &accountname, const string &protocol, const string &username)
+{
+    auto it = held_messages.find(make_tuple(accountname, protocol, username));
+    if (it == held_messages.end()) return;
+
+    auto messages = move(it->second);
+    held_messages.erase(it);
+
+    for (auto &&message : messages) {
+        send_chat(accountname, protocol, username, message);
+    }
+}
+
+// Send a chat message through libotr after the client has already
+// accepted it, sending it as plaintext when libotr leaves it unchanged.
+void OpData::send_chat(const string &accountname, const string &protocol,
+                       const string &username, const string &message)
+{
+    gcry_error_t err;
+    bool has_newmsg;
+
+    tie(err, has_newmsg) = otr.message_sending
+                             (accountname.c_str(), protocol.c_str(), username.c_str(), message.c_str());
+
+    if (err) {
+        glirc_printf(G, protocol.c_str(), PLUGIN_USER, username.c_str(), "PANIC: OTR encryption error");
+    } else if (!has_newmsg) {
+        send_message(protocol.c_str(), username.c_str(), message.c_str());
+    }
+}
+
+
+// libotr can only generate an instance tag by writing the whole set to a
+// file. It is generated into a scratch file and saved with the next flush.
 void create_instag(void *L, const char *accountname, const char *protocol)
 {
     GET_opdata;
 
-    char *path = state_path("instags");
-    if (path) opdata->otr.instag_generate(path, accountname, protocol);
-    free(path);
+    FILE *scratch = tmpfile();
+    if (!scratch) return;
+    opdata->otr.instag_generate(scratch, accountname, protocol);
+    fclose(scratch);
+
+    opdata->instags_changed();
 }
 
 // Entry point from client when timer triggers
@@ -449,12 +1187,8 @@ void timer_entrypoint(void *L, timer_id tid) {
 
     GET_opdata;
 
-    opdata->timer_finished();
-
-    // Running poll might update timer_interval
+    // Running poll might update the interval through timer_control
     opdata->otr.message_poll();
-
-    opdata->schedule_timer();
 }
 
 void timer_control(void *L, unsigned int interval)
@@ -464,17 +1198,56 @@ void timer_control(void *L, unsigned int interval)
     opdata->timer_control(interval);
 }
 
+// Parse a number of seconds given to one of the flood arguments
+bool parse_seconds(string_view text, chrono::milliseconds &out)
+{
+  string str(text);
+  char *end;
+  double secs = strtod(str.c_str(), &end);
+  if (end == str.c_str() || *end || !(secs >= 0 && secs <= 3600)) return false;
+  out = chrono::milliseconds(llround(secs * 1000));
+  return true;
+}
+
+// Apply the extension arguments --flood-penalty=SECONDS and
+// --flood-threshold=SECONDS, reporting the ones that aren't understood.
+void parse_arguments(OpData *opdata, const struct glirc_string *args, size_t args_len)
+{
+  static const string_view penalty   = "--flood-penalty=";
+  static const string_view threshold = "--flood-threshold=";
+
+  for (size_t i = 0; i < args_len; i++) {
+    auto arg = make_view(args[i]);
+    bool ok;
+    if (arg.substr(0, penalty.size()) == penalty) {
+      ok = parse_seconds(arg.substr(penalty.size()), opdata->flood.penalty);
+    } else if (arg.substr(0, threshold.size()) == threshold) {
+      ok = parse_seconds(arg.substr(threshold.size()), opdata->flood.threshold);
+    } else {
+      ok = false;
+    }
+
+    if (!ok) {
+      auto msg = "OTR: Bad argument " + string(arg);
+      glirc_print(opdata->G, ERROR_MESSAGE, msg.data(), msg.size());
+    }
+  }
+
+  // A threshold below the penalty would hold back every message here,
+  // while the client still sends one per penalty
+  opdata->flood.threshold = max(opdata->flood.threshold, opdata->flood.penalty);
+}
+
 void *start_entrypoint
   (struct glirc *G,
    const char *lib_path,
    const struct glirc_string *args, size_t args_len)
 {
   (void)lib_path;
-  (void)args;
-  (void)args_len;
 
   OTRL_INIT;
   auto opdata = new OpData(G);
+  parse_arguments(opdata, args, args_len);
 
   char *path = state_path("keys");
   if (path) opdata->otr.privkey_read(path);
@@ -494,6 +1267,8 @@ void *start_entrypoint
 void stop_entrypoint(void *L)
 {
   GET_opdata;
+  opdata->send_all();
+  opdata->flush_state();
   delete opdata;
 }
 
@@ -503,29 +1278,35 @@ void stop_entrypoint(void *L)
 string
 rebuild_userinfo(const struct glirc_message *msg)
 {
-    ostringstream out;
-    out << msg->prefix_nick.str;
+    string out;
+    out.reserve(msg->prefix_nick.len + msg->prefix_user.len + msg->prefix_host.len + 2);
+    out.append(msg->prefix_nick.str, msg->prefix_nick.len);
 
     if (msg->prefix_user.len > 0) {
-        out << "!" << msg->prefix_user.str;
+        out += '!';
+        out.append(msg->prefix_user.str, msg->prefix_user.len);
     }
 
     if (msg->prefix_host.len > 0) {
-        out << "@" << msg->prefix_host.str;
+        out += '@';
+        out.append(msg->prefix_host.str, msg->prefix_host.len);
     }
 
-    return out.str();
+    return out;
 }
 
 bool in_batch(const struct glirc_message *msg) {
     for (size_t i = 0; i < msg->tags_n; i++) {
-        if ("batch" == make_string(msg->tagkeys[i])) {
+        if (make_view(msg->tagkeys[i]) == "batch") {
             return true;
         }
     }
     return false;
 }
 
+// Strings provided by the client are NUL-terminated, so the network
+// name and message body are handed to libotr without being copied.
+// Only the nicknames are copied, because libotr needs them normalized.
 enum process_result
 process_privmsg(OpData *opdata, const struct glirc_message *msg)
 {
@@ -543,77 +1324,99 @@ process_privmsg(OpData *opdata, const struct glirc_message *msg)
         }
     }
 
-    auto net    = make_string(msg->network);
-    auto target = make_string(msg->params[0]);
-    if (opdata->is_channel(net, target)) {
+    // With echo-message our own messages come back to us
+    opdata->observe_prefix(msg);
+
+    if (opdata->is_channel(make_view(msg->network), make_view(msg->params[0]))) {
         return PASS_MESSAGE;
     }
 
-    auto message = make_string(msg->params[1]);
-    auto sender = make_string(msg->prefix_nick);
-    normalizeCase(&sender);
-    normalizeCase(&target);
+    auto target = normalized(make_view(msg->params[0]));
+    auto sender = normalized(make_view(msg->prefix_nick));
 
     int internal;
-    bool has_newmsg;
-    string newmessage;
-    tie(internal, has_newmsg, newmessage) =
-        opdata->otr.message_receiving(target, net, sender, message);
+    OtrlMessage newmessage;
+    opdata->active_peer = &sender;
+    tie(internal, newmessage) =
+        opdata->otr.message_receiving(target.c_str(), msg->network.str, sender.c_str(), msg->params[1].str);
+    opdata->active_peer = nullptr;
 
-    if (!internal && has_newmsg) {
+    if (!internal && newmessage) {
         auto userinfo = rebuild_userinfo(msg);
         glirc_inject_chat(opdata->G,
                              msg->network.str    , msg->network.len,
                              userinfo.c_str()    , userinfo.length(),
                              msg->prefix_nick.str, msg->prefix_nick.len,
-                             newmessage.c_str()  , newmessage.length());
+                             newmessage.get()    , strlen(newmessage.get()));
     }
 
-    return (internal || has_newmsg) ? DROP_MESSAGE : PASS_MESSAGE;
+    return (internal || newmessage) ? DROP_MESSAGE : PASS_MESSAGE;
 }
 
 enum process_result
 message_entrypoint(void *L, const struct glirc_message *msg)
 {
     GET_opdata;
-    auto cmd = make_string(msg->command);
+    auto cmd = make_view(msg->command);
 
     if (cmd == "PRIVMSG") {
         return process_privmsg(opdata, msg);
-    } else {
-        return PASS_MESSAGE;
     }
-}
 
+    if (cmd == "NICK") {
+        opdata->observe_nick(msg);
+    } else if (cmd == "JOIN") {
+        opdata->observe_prefix(msg);
+    } else if (cmd == "396") {
+        opdata->observe_hosthidden(msg);
+    } else if (cmd == "001") {
+        opdata->observe_welcome(msg);
+    } else if (cmd == "005") {
+        opdata->observe_isupport(msg);
+    }
+
+    return PASS_MESSAGE;
+}
 
 enum process_result chat_entrypoint(void *L, const struct glirc_chat *chat)
 {
     GET_opdata;
 
-    auto network = make_string(chat->network);
-    auto target  = make_string(chat->target);
-    auto msg     = make_string(chat->message);
+    auto network = make_view(chat->network);
 
-    if (opdata->is_channel(network, target)) {
+    if (opdata->is_channel(network, make_view(chat->target))) {
+        opdata->user_sent(network);
         return PASS_MESSAGE;
     }
 
-    auto me = opdata->my_nick(network);
+    auto &me = opdata->my_nick(network);
     if (me.empty()) return DROP_MESSAGE;
-    normalizeCase(&me);
 
-    normalizeCase(&target);
+    auto target = normalized(make_view(chat->target));
+
+    // Messages typed while our key is being generated are sent once
+    // it is available.
+    if (opdata->find_keygen(me, network)) {
+        opdata->hold_message(me, string(network), target, make_string(chat->message));
+        return DROP_MESSAGE;
+    }
 
     gcry_error_t err;
     bool has_newmsg;
 
-    tie(err,has_newmsg) = opdata->otr.message_sending(me, network, target, msg);
+    opdata->active_peer = &target;
+    tie(err,has_newmsg) = opdata->otr.message_sending
+                            (me.c_str(), chat->network.str, target.c_str(), chat->message.str);
+    opdata->active_peer = nullptr;
 
     if (err) {
-        glirc_printf(opdata->G, network.c_str(), PLUGIN_USER, target.c_str(), "PANIC: OTR encryption error");
+        glirc_printf(opdata->G, chat->network.str, PLUGIN_USER, target.c_str(), "PANIC: OTR encryption error");
     }
 
-    return err || has_newmsg ? DROP_MESSAGE : PASS_MESSAGE;
+    if (err || has_newmsg) return DROP_MESSAGE;
+
+    opdata->user_sent(network);
+    return PASS_MESSAGE;
 }
 
 void cmd_start (OpData *opdata, const string &cmd_arg)
@@ -629,19 +1432,7 @@ void cmd_start (OpData *opdata, const string &cmd_arg)
       return;
     }
 
-    struct glirc_string params[2] = {
-      mk_glirc_string(tgt.c_str()),
-      mk_glirc_string(QUERY_TEXT),
-    };
-
-    struct glirc_message m = {
-      .network  = mk_glirc_string(net.c_str()),
-      .command  = mk_glirc_string("PRIVMSG"),
-      .params   = params,
-      .params_n = 2,
-    };
-
-    glirc_send_message(opdata->G, &m);
+    opdata->send_message(net.c_str(), tgt.c_str(), QUERY_TEXT);
 }
 
 void cmd_end (OpData *opdata, const string &params)
@@ -653,11 +1444,11 @@ void cmd_end (OpData *opdata, const string &params)
   if (net.empty() || tgt.empty()) return;
   normalizeCase(&tgt);
 
-  auto me = opdata->my_nick(net);
+  auto &me = opdata->my_nick(net);
   if (me.empty()) return;
-  normalizeCase(&me);
 
   opdata->otr.message_disconnect_all_instances(me, net, tgt);
+  opdata->discard_held(me, net, tgt);
 
   const char * const src = PLUGIN_USER;
   const char * const msg = RED("Session terminated");
@@ -705,9 +1496,7 @@ void cmd_trust (OpData *opdata, const string &params)
 
   otrl_context_set_trust(context->active_fingerprint, "manual");
 
-  char *path = state_path("fingerprints");
-  if (path) otrl_privkey_write_fingerprints(opdata->otr.us, path);
-  free(path);
+  opdata->fingerprints_changed();
 
   char human[OTRL_PRIVKEY_FPRINT_HUMAN_LEN];
   otrl_privkey_hash_to_human(human, context->active_fingerprint->fingerprint);
@@ -726,9 +1515,7 @@ void cmd_untrust (OpData *opdata, const string &params)
 
   otrl_context_set_trust(context->active_fingerprint, "");
 
-  char *path = state_path("fingerprints");
-  if (path) otrl_privkey_write_fingerprints(opdata->otr.us, path);
-  free(path);
+  opdata->fingerprints_changed();
 
   char human[OTRL_PRIVKEY_FPRINT_HUMAN_LEN];
   otrl_privkey_hash_to_human(human, context->active_fingerprint->fingerprint);
@@ -749,12 +1536,22 @@ void cmd_status (OpData *opdata, const string &params)
     return;
   }
 
+  StatusReport report(opdata->G, context);
+
   char human[OTRL_PRIVKEY_FPRINT_HUMAN_LEN];
   const char *myfp =
           otrl_privkey_fingerprint(opdata->otr.us, human, context->accountname, context->protocol);
 
   if (myfp) {
-    print_status(opdata->G, context, "Local  fingerprint [" BOLD("%s") "]", myfp);
+    report.add("Local  fingerprint [" BOLD("%s") "]", myfp);
+  }
+
+  auto job = opdata->find_keygen(context->accountname, context->protocol);
+  if (job) {
+    auto secs = chrono::duration_cast<chrono::seconds>
+                  (chrono::steady_clock::now() - job->started).count();
+    report.add("Local  private key [" BOLD("generating") "] [" BOLD("%llds") "]",
+                 static_cast<long long>(secs));
   }
 
   Fingerprint *fp = context->active_fingerprint;
@@ -762,13 +1559,13 @@ void cmd_status (OpData *opdata, const string &params)
     otrl_privkey_hash_to_human(human, fp->fingerprint);
 
     if (otrl_context_is_fingerprint_trusted(fp)) {
-      print_status(opdata->G, context, "Remote fingerprint [" BOLD("%s") "] [" GREEN("%s") "]", human, fp->trust);
+      report.add("Remote fingerprint [" BOLD("%s") "] [" GREEN("%s") "]", human, fp->trust);
     } else {
-      print_status(opdata->G, context, "Remote fingerprint [" BOLD("%s") "] [" RED("untrusted") "]", human);
+      report.add("Remote fingerprint [" BOLD("%s") "] [" RED("untrusted") "]", human);
     }
   }
 
-  print_status(opdata->G, context,
+  report.add(
       "Local instance [" BOLD("%08X") "] Remote instance [" BOLD("%08X") "] Protocol [" BOLD("%u") "]",
       context->our_instance, context->their_instance, context->protocol_version);
 
@@ -778,7 +1575,18 @@ void cmd_status (OpData *opdata, const string &params)
     [OTRL_MSGSTATE_FINISHED ] = RED  ("finished" ),
   };
 
-  print_status(opdata->G, context, "Connection state [%s]", statuses[context->msgstate]);
+  report.add("Connection state [%s]", statuses[context->msgstate]);
+  report.add("Fragment size [" BOLD("%d") "]",
+             opdata->fragment_size(context->protocol, context->username));
+
+  size_t depth, intervals;
+  tie(depth, intervals) = opdata->send_backlog(context->protocol, context->username);
+  if (depth > 0) {
+    report.add("Send queue [" BOLD("%zu") "] [" BOLD("%zus") "]",
+               depth, size_t(intervals * opdata->flood.penalty.count() / 1000));
+  }
+
+  report.print();
 }
 
 /*
@@ -819,12 +1627,18 @@ void cmd_help(OpData *opdata, const string &params)
 {
   (void)params;
 
-  for_each(begin(cmd_impls), end(cmd_impls), [opdata](auto &&c) {
+  vector<string> lines;
+  for_each(begin(cmd_impls), end(cmd_impls), [&lines](auto &&c) {
       ostringstream out;
       out << "OTR: " << left << setw(7) << c.name << " - " << c.doc;
-      const auto s = out.str();
-      glirc_print(opdata->G, NORMAL_MESSAGE, s.c_str(), s.length());
+      lines.push_back(out.str());
   });
+
+  vector<glirc_string> msgs;
+  for (auto const& line : lines) {
+    msgs.push_back({ .str = line.data(), .len = line.size() });
+  }
+  glirc_print_many(opdata->G, NORMAL_MESSAGE, msgs.data(), msgs.size());
 }
 
 void command_entrypoint
@@ -852,8 +1666,19 @@ void command_entrypoint
   }
 }
 
+// Commands handled by message_entrypoint
+const char * const subscriptions[] = {
+    "PRIVMSG", "NICK", "JOIN", "396", "001", "005", nullptr
+};
+
 } /* end namespace */
 
+GLIRC_EXTENSION_API_VERSION;
+
+// There is no process_messages: the client applies a batch only after
+// the callback returns, so a line decrypted by process_privmsg and
+// injected with glirc_inject_chat would be shown ahead of the messages
+// that arrived before it in the same batch.
 struct glirc_extension extension __attribute__ ((visibility ("default"))) = {
         .name            = NAME,
         .major_version   = MAJOR,
@@ -863,4 +1688,6 @@ struct glirc_extension extension __attribute__ ((visibility ("default"))) = {
         .process_message = message_entrypoint,
         .process_chat    = chat_entrypoint,
         .process_command = command_entrypoint,
+        .subscriptions   = subscriptions,
+        .flags           = GLIRC_SYNCHRONOUS,
 };
@@ -8,6 +8,7 @@ use std::collections::HashMap;
 use std::ffi::CStr;
 use std::mem;
 use std::os::raw::c_char;
+use std::os::raw::c_int;
 use std::os::raw::c_void;
 use std::panic;
 use std::ptr;
@@ -19,8 +20,118 @@ type command_callback = fn(&glirc, &[&str]);
 
 struct my_state<'a> {
     commands: HashMap<&'a str, command_callback>,
+    privmsgs: u64,
 }
 
+/// Most parameters a single IRC message can have
+const MAX_PARAMS: usize = 15;
+
+/*
+ * Borrowed views of client data
+ */
+
+/// IRC message passed to a callback. The strings borrow the client's
+/// buffers and are only valid for the duration of the callback.
+#[derive(Clone, Copy)]
+pub struct Message<'a> {
+    raw: &'a glirc_message,
+}
+
+/// Chat message passed to a callback, borrowed like 'Message'.
+#[derive(Clone, Copy)]
+pub struct Chat<'a> {
+    raw: &'a glirc_chat,
+}
+
+/// Iterator over borrowed strings such as message parameters
+#[derive(Clone)]
+pub struct Strings<'a> {
+    iter: slice::Iter<'a, glirc_string>,
+}
+
+/// Iterator over borrowed message tag keys and values
+#[derive(Clone)]
+pub struct Tags<'a> {
+    keys: slice::Iter<'a, glirc_string>,
+    vals: slice::Iter<'a, glirc_string>,
+}
+
+impl<'a> Message<'a> {
+    /// Wrap a message pointer received from the client.
+    pub unsafe fn from_raw(raw: *const glirc_message) -> Message<'a> {
+        Message { raw: &*raw }
+    }
+
+    pub fn network(&self) -> &'a str { view_str(&self.raw.network) }
+    pub fn command(&self) -> &'a str { view_str(&self.raw.command) }
+    pub fn prefix_nick(&self) -> &'a str { view_str(&self.raw.prefix_nick) }
+    pub fn prefix_user(&self) -> &'a str { view_str(&self.raw.prefix_user) }
+    pub fn prefix_host(&self) -> &'a str { view_str(&self.raw.prefix_host) }
+
+    pub fn params(&self) -> Strings<'a> {
+        Strings { iter: unsafe { view_array(self.raw.params, self.raw.params_n) }.iter() }
+    }
+
+    pub fn param(&self, i: usize) -> Option<&'a str> {
+        unsafe { view_array(self.raw.params, self.raw.params_n) }.get(i).map(view_str)
+    }
+
+    pub fn tags(&self) -> Tags<'a> {
+        unsafe {
+            Tags {
+                keys: view_array(self.raw.tagkeys, self.raw.tags_n).iter(),
+                vals: view_array(self.raw.tagvals, self.raw.tags_n).iter(),
+            }
+        }
+    }
+
+    pub fn tag(&self, key: &str) -> Option<&'a str> {
+        self.tags().find(|&(k, _)| k == key).map(|(_, v)| v)
+    }
+}
+
+impl<'a> Chat<'a> {
+    /// Wrap a chat pointer received from the client.
+    pub unsafe fn from_raw(raw: *const glirc_chat) -> Chat<'a> {
+        Chat { raw: &*raw }
+    }
+
+    pub fn network(&self) -> &'a str { view_str(&self.raw.network) }
+    pub fn target(&self) -> &'a str { view_str(&self.raw.target) }
+    pub fn message(&self) -> &'a str { view_str(&self.raw.message) }
+}
+
+impl<'a> Iterator for Strings<'a> {
+    type Item = &'a str;
+
+    fn next(&mut self) -> Option<&'a str> { self.iter.next().map(view_str) }
+    fn size_hint(&self) -> (usize, Option<usize>) { self.iter.size_hint() }
+}
+
+impl<'a> ExactSizeIterator for Strings<'a> {}
+
+impl<'a> Strings<'a> {
+    /// Remaining strings as raw bytes
+    pub fn bytes(self) -> impl Iterator<Item = &'a [u8]> {
+        self.iter.map(view_bytes)
+    }
+}
+
+impl<'a> Iterator for Tags<'a> {
+    type Item = (&'a str, &'a str);
+
+    fn next(&mut self) -> Option<(&'a str, &'a str)> {
+        match (self.keys.next(), self.vals.next()) {
+            (Some(k), Some(v)) => Some((view_str(k), view_str(v))),
+            _ => None,
+        }
+    }
+
+    fn size_hint(&self) -> (usize, Option<usize>) { self.keys.size_hint() }
+}
+
+impl<'a> ExactSizeIterator for Tags<'a> {}
+
 impl glirc {
 
     fn write_message(&self, code: message_code, msg: &str) {
@@ -29,6 +140,26 @@ impl glirc {
         }
     }
 
+    #[allow(dead_code)]
+    fn write_messages(&self, code: message_code, msgs: &[&str]) {
+        let v: Vec<glirc_string> = msgs.iter().map(|&x| export_string(x)).collect();
+        unsafe {
+            glirc_print_many(mem::transmute(self), code, v.as_ptr(), v.len());
+        }
+    }
+
+    #[allow(dead_code)]
+    fn inject_chat_many(&self, net: &str, src: &str, tgt: &str, msgs: &[&str]) {
+        let v: Vec<glirc_string> = msgs.iter().map(|&x| export_string(x)).collect();
+        unsafe {
+            glirc_inject_chat_many(mem::transmute(self),
+                                   net.as_ptr() as *const i8, net.len(),
+                                   src.as_ptr() as *const i8, src.len(),
+                                   tgt.as_ptr() as *const i8, tgt.len(),
+                                   v.as_ptr(), v.len());
+        }
+    }
+
     #[allow(dead_code)]
     fn list_networks(&self) -> Vec<String> {
         unsafe { import_strings(glirc_list_networks(mem::transmute(self))) }
@@ -36,24 +167,71 @@ impl glirc {
 
     #[allow(dead_code)]
     fn list_channels(&self, net: &str) -> Vec<String> {
-        unsafe { import_strings(glirc_list_channels(mem::transmute(self), export_string(net))) }
+        unsafe { import_strings(glirc_list_channels(mem::transmute(self),
+                                                     net.as_ptr() as *const i8, net.len())) }
     }
 
+    /// Send a command to a network. The parameters are marshaled on the
+    /// stack. Returns false when there are too many parameters or the
+    /// client can't send the command.
     #[allow(dead_code)]
-    fn irc_command(&self, net: &str, cmd: &str, args: &[&str]) {
+    fn irc_command(&self, net: &str, cmd: &str, args: &[&str]) -> bool {
+
+        if args.len() > MAX_PARAMS { return false }
 
-        let v: Vec<glirc_string> = args.iter().map(|&x| export_string(x)).collect();
+        let mut v = [glirc_string::default(); MAX_PARAMS];
+        for (p, &x) in v.iter_mut().zip(args) {
+            *p = export_string(x);
+        }
 
         let gmsg = glirc_message {
             network: export_string(net),
             command: export_string(cmd),
             params: v.as_ptr(),
-            params_n: v.len(),
+            params_n: args.len(),
             ..Default::default()
         };
 
         unsafe {
-            glirc_send_message(mem::transmute(self), &gmsg);
+            glirc_send_message(mem::transmute(self), &gmsg) == 0
+        }
+    }
+
+    /// Send a PRIVMSG without allocating.
+    #[allow(dead_code)]
+    fn privmsg(&self, net: &str, tgt: &str, msg: &str) -> bool {
+        self.irc_command(net, "PRIVMSG", &[tgt, msg])
+    }
+
+    /// Send a borrowed message back out unchanged, for example to
+    /// relay it to another network's view of the same message.
+    #[allow(dead_code)]
+    fn forward(&self, msg: Message) -> bool {
+        unsafe {
+            glirc_send_message(mem::transmute(self), msg.raw) == 0
+        }
+    }
+
+    /// Send several commands, each given as network, command and
+    /// arguments, in one call. Returns the number of commands that
+    /// could not be sent.
+    #[allow(dead_code)]
+    fn irc_commands(&self, cmds: &[(&str, &str, &[&str])]) -> usize {
+
+        let params: Vec<Vec<glirc_string>> =
+            cmds.iter().map(|&(_, _, args)| args.iter().map(|&x| export_string(x)).collect()).collect();
+
+        let gmsgs: Vec<glirc_message> = cmds.iter().zip(params.iter()).map(|(&(net, cmd, _), v)|
+            glirc_message {
+                network: export_string(net),
+                command: export_string(cmd),
+                params: v.as_ptr(),
+                params_n: v.len(),
+                ..Default::default()
+            }).collect();
+
+        unsafe {
+            glirc_send_messages(mem::transmute(self), gmsgs.as_ptr(), gmsgs.len()) as usize
         }
     }
 
@@ -62,8 +240,8 @@ impl glirc {
     fn list_channel_users(&self, net: &str, chan: &str) -> Vec<String> {
         unsafe {
             import_strings(glirc_list_channel_users(mem::transmute(self),
-                                                    export_string(net),
-                                                    export_string(chan)))
+                                                    net.as_ptr() as *const i8, net.len(),
+                                                    chan.as_ptr() as *const i8, chan.len()))
         }
     }
 
@@ -91,6 +269,21 @@ unsafe fn import_string<'a>(_: &'a glirc, gstr: &glirc_string) -> &'a str {
     str::from_utf8_unchecked(slc)
 }
 
+// The client always passes UTF-8 encoded strings
+fn view_str(gstr: &glirc_string) -> &str {
+    unsafe { str::from_utf8_unchecked(view_bytes(gstr)) }
+}
+
+fn view_bytes(gstr: &glirc_string) -> &[u8] {
+    if gstr.len == 0 { return &[] }
+    unsafe { slice::from_raw_parts(gstr.str as *const u8, gstr.len) }
+}
+
+// Arrays from the client can be NULL when they are empty
+unsafe fn view_array<'a>(p: *const glirc_string, n: usize) -> &'a [glirc_string] {
+    if n == 0 { &[] } else { slice::from_raw_parts(p, n) }
+}
+
 fn export_string(s: &str) -> glirc_string {
     glirc_string {
         str: s.as_ptr() as *const i8,
@@ -142,7 +335,8 @@ unsafe fn import_strings(p: *mut *mut c_char) -> Vec<String> {
 
 #[allow(dead_code)]
 fn identifier_cmp(x: &str, y: &str) -> Ordering {
-    unsafe { glirc_identifier_cmp(export_string(x), export_string(y)).cmp(&0) }
+    unsafe { glirc_identifier_cmp(x.as_ptr() as *const i8, x.len(),
+                                  y.as_ptr() as *const i8, y.len()).cmp(&0) }
 }
 
 /*
@@ -160,7 +354,7 @@ fn my_start<'a>(G: &glirc, path: &str) -> my_state<'a> {
     cmds.insert("nick", nick_command);
     cmds.insert("networks", networks_command);
 
-    my_state { commands: cmds }
+    my_state { commands: cmds, privmsgs: 0 }
 }
 
 fn nick_command(G: &glirc, params: &[&str]) {
@@ -185,6 +379,10 @@ fn my_process_command(G: &glirc, session: &my_state, params: Vec<&str>) {
 
     match params.split_first() {
         None => G.write_message(message_code::ERROR_MESSAGE, "No command"),
+        Some((&"stats", _)) => {
+            let msg = format!("PRIVMSG seen: {}", session.privmsgs);
+            G.write_message(message_code::NORMAL_MESSAGE, &msg)
+        }
         Some((cmd, args)) => {
             match session.commands.get(cmd) {
                 None => G.write_message(message_code::ERROR_MESSAGE, "Missing command"),
@@ -194,6 +392,18 @@ fn my_process_command(G: &glirc, session: &my_state, params: Vec<&str>) {
     }
 }
 
+fn my_process_message(_G: &glirc, session: &mut my_state, msg: Message) -> process_result {
+    // Views borrow the client's buffers, nothing is copied per message
+    if msg.command() == "PRIVMSG" && msg.params().len() == 2 {
+        session.privmsgs += 1;
+    }
+    process_result::PASS_MESSAGE
+}
+
+fn my_process_chat(_G: &glirc, _session: &my_state, _chat: Chat) -> process_result {
+    process_result::PASS_MESSAGE
+}
+
 /*
  * Extension entry points
  */
@@ -201,7 +411,7 @@ fn my_process_command(G: &glirc, session: &my_state, params: Vec<&str>) {
 unsafe extern "C" fn start_entry(G: *mut glirc, path: *const c_char) -> *mut c_void {
     let g = &*G;
     let p = CStr::from_ptr(path).to_str().unwrap();
-    let def = my_state { commands: HashMap::new() };
+    let def = my_state { commands: HashMap::new(), privmsgs: 0 };
     let st = handle_panics(g, || my_start(g, p), def);
     export_session(st)
 }
@@ -221,6 +431,25 @@ unsafe extern "C" fn process_command_entry(G: *mut glirc,
     handle_panics(g, || my_process_command(g, session, params), ());
 }
 
+unsafe extern "C" fn process_message_entry(G: *mut glirc,
+                                           sptr: *mut c_void,
+                                           rawmsg: *const glirc_message) -> process_result {
+    let g = &*G;
+    let session = use_session(g, sptr);
+    let msg = Message::from_raw(rawmsg);
+    handle_panics(g, panic::AssertUnwindSafe(|| my_process_message(g, session, msg)),
+                  process_result::PASS_MESSAGE)
+}
+
+unsafe extern "C" fn process_chat_entry(G: *mut glirc,
+                                        sptr: *mut c_void,
+                                        rawchat: *const glirc_chat) -> process_result {
+    let g = &*G;
+    let session = use_session(g, sptr);
+    let chat = Chat::from_raw(rawchat);
+    handle_panics(g, || my_process_chat(g, session, chat), process_result::PASS_MESSAGE)
+}
+
 fn handle_panics<F: FnOnce() -> R + panic::UnwindSafe, R>(G: &glirc, f: F, def: R) -> R {
     match panic::catch_unwind(f) {
         Ok(x) => x,
@@ -240,6 +469,10 @@ fn handle_panics<F: FnOnce() -> R + panic::UnwindSafe, R>(G: &glirc, f: F, def:
  * Extension metadata
  */
 
+// Version of struct glirc_extension below, GLIRC_API_VERSION in glirc-api.h
+#[no_mangle]
+pub static extension_api_version: c_int = 4;
+
 #[no_mangle]
 pub static mut extension: glirc_extension = glirc_extension {
     name: "rust\0" as *const str as *const c_char,
@@ -247,7 +480,11 @@ pub static mut extension: glirc_extension = glirc_extension {
     minor_version: 0,
     start: Some(start_entry),
     stop: Some(stop_entry),
-    process_message: None,
-    process_chat: None,
+    process_message: Some(process_message_entry),
+    process_chat: Some(process_chat_entry),
     process_command: Some(process_command_entry),
+    subscriptions: 0 as *const *const c_char,
+    process_messages: None,
+    flags: glirc_extension_flags::GLIRC_OBSERVE_ONLY as u32,
+    stop_jobs: None,
 };
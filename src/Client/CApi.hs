@@ -21,41 +21,97 @@ module Client.CApi
   , startExtension
   , stopExtension
   , notifyExtension
+  , notifyExtensionBatch
+  , isSubscribed
   , commandExtension
   , chatExtension
 
   , ThreadEntry(..)
   , threadFinish
+  , runExtensionStop
+  , runExtensionStopJobs
+  , closeExtension
+
+  -- * Client references
+  , ClientRef(..)
+  , Remote(..)
+  , RemoteCall(..)
+  , runRemoteCall
+  , readClient
+  , modifyClient
+  , modifyClient_
+
+  -- * Dispatcher threads
+  , Dispatcher
+  , newDispatcher
+  , tryDispatch
+  , dispatch
+  , stopDispatcher
+  , dispatcherStopped
+  , dispatcherToken
+
+  -- * Extension jobs
+  , WorkerPool
+  , newWorkerPool
+  , submitJob
+  , startLongJob
+  , cancelJob
+  , cancelQueuedJobs
+  , finishJob
+  , jobStats
 
   , popTimer
   , pushTimer
+  , rescheduleTimer
+  , catchUpTimer
   , cancelTimer
 
   , evalNestedIO
   , withChat
   , withRawIrcMsg
+  , withFgnMsg
   ) where
 
 import           Client.Configuration
                    (ExtensionConfiguration,
-                    extensionPath, extensionRtldFlags, extensionArgs)
+                    extensionPath, extensionRtldFlags, extensionArgs,
+                    extensionQueueLimit, extensionJobLimit)
+import           Client.CApi.Stats
 import           Client.CApi.Types
+import           Control.Concurrent (forkOS)
+import           Control.Concurrent.MVar
+import           Control.Concurrent.STM
 import           Control.Lens (view)
 import           Control.Monad
 import           Control.Monad.IO.Class
 import           Control.Monad.Codensity
+import           Control.Exception (SomeException, finally, throwIO, try)
+import           Data.Bifunctor (first)
+import qualified Data.ByteString as B
+import qualified Data.ByteString.Char8 as B8
+import qualified Data.ByteString.Unsafe as B
+import           Data.Either (isRight)
+import           Data.IORef
+import           Data.Foldable (foldl')
+import           Data.HashSet (HashSet)
+import qualified Data.HashSet as HashSet
+import           Data.IntMap (IntMap)
+import qualified Data.IntMap as IntMap
 import           Data.IntPSQ (IntPSQ)
 import qualified Data.IntPSQ as IntPSQ
+import           Data.Maybe (fromMaybe)
+import           Data.Sequence (Seq)
+import qualified Data.Sequence as Seq
 import           Data.Text (Text)
 import qualified Data.Text as Text
+import qualified Data.Text.Encoding as Text
 import           Data.Time
 import           Foreign.C
 import           Foreign.Marshal
 import           Foreign.Ptr
 import           Foreign.Storable
-import           Irc.Identifier
+import           GHC.Clock (getMonotonicTime)
 import           Irc.RawIrcMsg
-import           Irc.UserInfo
 import           System.Posix.DynamicLinker
 
 ------------------------------------------------------------------------
@@ -81,15 +137,350 @@ data ActiveExtension = ActiveExtension
   , aeMajorVersion, aeMinorVersion :: !Int
   , aeTimers  :: !(IntPSQ UTCTime TimerEntry)
   , aeNextTimer :: !Int
-  , aeThreads :: !Int
+  , aeThreads :: !Int -- ^ jobs queued or running
+  , aeJobs    :: !(IntMap Job) -- ^ jobs queued or running by ID
+  , aeNextJob :: !Int
+  , aeQueueLimit :: !Int -- ^ jobs allowed to wait for a worker
+  , aeJobLimit :: !(Maybe Int) -- ^ jobs allowed to run at once, default from the pool size
+  , aeJobSlots :: !(TVar Int) -- ^ jobs running on a worker
+  , aeJobsDone :: !Int -- ^ number of completed jobs
+  , aeJobTime :: !Double -- ^ seconds spent running completed jobs
   , aeLive    :: !Bool
+  , aeSubscriptions :: !(Maybe (HashSet Text)) -- ^ Commands passed to process_message, all when 'Nothing'
+  , aeBatch   :: !(FunPtr ProcessMessages) -- ^ Batch message callback in use, null while batches are off
+  , aeBatchCallback :: !(FunPtr ProcessMessages) -- ^ Optional batch message callback declared by the extension
+  , aeStats   :: !ExtensionStats -- ^ Callback counters and latencies
+  , aeFlags   :: !ExtensionFlags -- ^ Flags declared by the extension
+  , aeStopJobs :: !(FunPtr StopExtension) -- ^ Optional callback to end running jobs before stopping
+  , aeDispatcher :: !(Maybe Dispatcher) -- ^ Thread running the callbacks, when not run synchronously
+  , aeOverflow :: !Int -- ^ messages not observed because the dispatcher queue was full
   }
 
-data TimerEntry = TimerEntry !(FunPtr TimerCallback) !(Ptr ())
+-- | Scheduled callback, its state, and the period of interval timers
+data TimerEntry = TimerEntry !(FunPtr TimerCallback) !(Ptr ()) !(Maybe NominalDiffTime)
 
-data ThreadEntry = ThreadEntry !(FunPtr ThreadFinish) !(Ptr ())
+-- | Result of a job ready to be passed to its finish callback along
+-- with the job's ID and running time in seconds.
+data ThreadEntry = ThreadEntry !Int !Double !(FunPtr ThreadFinish) !(Ptr ())
+
+-- | Pool of bound threads shared by all extensions for running jobs.
+data WorkerPool = WorkerPool
+  { poolSize :: !Int             -- ^ number of worker threads
+  , poolJobs :: !(TVar (Seq Job)) -- ^ jobs in the order they were submitted
+  }
+
+-- | A job waiting for or running on a worker thread
+data Job = Job
+  { jobState :: !(TVar JobState)
+  , jobSlots :: !(TVar Int) -- ^ jobs of the same extension running
+  , jobLimit :: !Int        -- ^ jobs of the same extension allowed to run
+  , jobArg   :: !(Ptr ()) -- ^ start argument, returned on cancellation
+  , jobRun   :: IO ()     -- ^ run the job and report its result
+  }
+
+data JobState = JobQueued | JobRunning | JobCancelled
+  deriving Eq
+
+-- | Start a pool with the given number of worker threads. Workers are
+-- bound threads as extensions may rely on thread-local state.
+newWorkerPool :: Int -> IO WorkerPool
+newWorkerPool n =
+  do q <- newTVarIO Seq.empty
+     let size = max 1 n
+     replicateM_ size (forkOS (forever (runJob =<< atomically (claimJob q))))
+     return (WorkerPool size q)
+  where
+    runJob job = jobRun job `finally` atomically (modifyTVar' (jobSlots job) (subtract 1))
+
+-- | Take the oldest job whose extension isn't already running as many
+-- jobs as it is allowed and mark it running. Jobs that were cancelled
+-- while waiting are discarded.
+claimJob :: TVar (Seq Job) -> STM Job
+claimJob q = go Seq.empty =<< readTVar q
+  where
+    go skipped jobs =
+      case Seq.viewl jobs of
+        Seq.EmptyL -> retry
+        job Seq.:< more ->
+          do st      <- readTVar (jobState job)
+             running <- readTVar (jobSlots job)
+             if st /= JobQueued then go skipped more
+             else if running >= jobLimit job then go (skipped Seq.|> job) more
+             else do writeTVar (jobState job) JobRunning
+                     writeTVar (jobSlots job) (running + 1)
+                     writeTVar q (skipped <> more)
+                     return job
+
+-- | Queue a job to run on the worker pool. The job is given its ID.
+-- When the queue limit is enforced and the extension already has
+-- that many jobs waiting, the job is rejected.
+submitJob ::
+  WorkerPool      {- ^ worker pool          -} ->
+  Bool            {- ^ enforce queue limit  -} ->
+  (Int -> IO ())  {- ^ job                  -} ->
+  Ptr ()          {- ^ job start argument   -} ->
+  ActiveExtension {- ^ extension            -} ->
+  IO (Maybe (Int, ActiveExtension)) {- ^ job ID and updated extension -}
+submitJob pool limited run arg ae =
+  do (queued, _) <- jobCounts ae
+     if limited && queued >= aeQueueLimit ae
+       then return Nothing
+       else
+         do let i = aeNextJob ae
+            var <- newTVarIO JobQueued
+            let job = Job { jobState = var
+                          , jobSlots = aeJobSlots ae
+                          , jobLimit = fromMaybe (defaultJobLimit pool) (aeJobLimit ae)
+                          , jobArg   = arg
+                          , jobRun   = run i }
+            atomically (modifyTVar' (poolJobs pool) (Seq.|> job))
+            return $! Just $! (,) i $! ae
+              { aeJobs    = IntMap.insert i job (aeJobs ae)
+              , aeNextJob = i + 1
+              , aeThreads = aeThreads ae + 1
+              }
+
+-- | Start a job on a bound thread of its own instead of the worker
+-- pool, for jobs that spend their time waiting on something outside
+-- the client. The job is given its ID and is running from the start,
+-- so it can't be cancelled, but it doesn't take a worker or count
+-- against the extension's job limit.
+startLongJob ::
+  (Int -> IO ())  {- ^ job                -} ->
+  Ptr ()          {- ^ job start argument -} ->
+  ActiveExtension {- ^ extension          -} ->
+  IO (Int, ActiveExtension) {- ^ job ID and updated extension -}
+startLongJob run arg ae =
+  do let i = aeNextJob ae
+     var <- newTVarIO JobRunning
+     let job = Job { jobState = var
+                   , jobSlots = aeJobSlots ae
+                   , jobLimit = 0
+                   , jobArg   = arg
+                   , jobRun   = run i }
+     _ <- forkOS (jobRun job)
+     return $! (,) i $! ae
+       { aeJobs    = IntMap.insert i job (aeJobs ae)
+       , aeNextJob = i + 1
+       , aeThreads = aeThreads ae + 1
+       }
+
+-- | Jobs an extension can run at once unless configured otherwise. One
+-- worker is left for the other extensions when the pool has more than one.
+defaultJobLimit :: WorkerPool -> Int
+defaultJobLimit pool = max 1 (poolSize pool - 1)
+
+-- | Cancel a job that hasn't started running yet, returning its
+-- start argument.
+cancelJob ::
+  Int             {- ^ job ID    -} ->
+  ActiveExtension {- ^ extension -} ->
+  IO (Maybe (Ptr (), ActiveExtension))
+cancelJob i ae =
+  case IntMap.lookup i (aeJobs ae) of
+    Nothing  -> return Nothing
+    Just job ->
+      do cancelled <- atomically $
+           do st <- readTVar (jobState job)
+              if st == JobQueued
+                then True <$ writeTVar (jobState job) JobCancelled
+                else return False
+         return $! if cancelled
+           then Just (jobArg job, ae { aeJobs    = IntMap.delete i (aeJobs ae)
+                                     , aeThreads = aeThreads ae - 1 })
+           else Nothing
+
+-- | Cancel all of the jobs of an extension that haven't started
+-- running. Neither of their callbacks will be called.
+cancelQueuedJobs :: ActiveExtension -> IO ActiveExtension
+cancelQueuedJobs ae =
+  do cancelled <- atomically (filterM cancel (IntMap.toList (aeJobs ae)))
+     return $! ae { aeJobs    = foldl' (flip (IntMap.delete . fst)) (aeJobs ae) cancelled
+                  , aeThreads = aeThreads ae - length cancelled }
+  where
+    cancel (_, job) =
+      do st <- readTVar (jobState job)
+         if st == JobQueued
+           then True <$ writeTVar (jobState job) JobCancelled
+           else return False
+
+-- | Record the completion of a job.
+finishJob :: ThreadEntry -> ActiveExtension -> ActiveExtension
+finishJob (ThreadEntry i elapsed _ _) ae = ae
+  { aeJobs     = IntMap.delete i (aeJobs ae)
+  , aeThreads  = aeThreads ae - 1
+  , aeJobsDone = aeJobsDone ae + 1
+  , aeJobTime  = aeJobTime ae + elapsed
+  }
+
+-- | Count the jobs waiting for a worker and the jobs running.
+jobCounts :: ActiveExtension -> IO (Int, Int)
+jobCounts ae =
+  do states <- atomically (traverse (readTVar . jobState) (IntMap.elems (aeJobs ae)))
+     return ( length (filter (JobQueued  ==) states)
+            , length (filter (JobRunning ==) states) )
+
+-- | Statistics about an extension's jobs.
+jobStats :: ActiveExtension -> IO FgnJobStats
+jobStats ae =
+  do (queued, active) <- jobCounts ae
+     let done = aeJobsDone ae
+         average | done == 0 = 0
+                 | otherwise = aeJobTime ae * 1000 / fromIntegral done
+     return FgnJobStats
+       { fjQueued    = fromIntegral queued
+       , fjActive    = fromIntegral active
+       , fjCompleted = fromIntegral done
+       , fjAverageMs = realToFrac average
+       }
+
+------------------------------------------------------------------------
+
+-- | The stable pointer given to extensions refers to one of these.
+-- Entrypoints reach the client state through the 'MVar' which is full
+-- while the client is parked in a callback. Extensions running on a
+-- dispatcher thread instead ask the event loop to run the entrypoint
+-- on their behalf once the dispatcher has taken over the extension.
+data ClientRef s = ClientRef
+  { refMVar   :: !(MVar (Int, s))    -- ^ client state while parked
+  , refRemote :: !(Maybe (Remote s)) -- ^ event loop access for a dispatcher
+  }
+
+-- | Access to the event loop for an extension on a dispatcher thread.
+data Remote s = Remote
+  { remoteId     :: !Int                     -- ^ extension ID
+  , remoteQueue  :: !(TQueue (RemoteCall s)) -- ^ calls run by the event loop
+  , remoteActive :: !(IORef Bool)            -- ^ set once the dispatcher owns the extension
+  }
+
+-- | Entrypoint waiting to be run by the event loop
+data RemoteCall s = RemoteCall !Int ((Int, s) -> IO s)
+
+-- | Run an entrypoint on behalf of an extension's dispatcher thread.
+runRemoteCall :: RemoteCall s -> s -> IO s
+runRemoteCall (RemoteCall i f) st = f (i, st)
+
+activeRemote :: ClientRef s -> IO (Maybe (Remote s))
+activeRemote ref =
+  case refRemote ref of
+    Nothing -> return Nothing
+    Just r  -> do active <- readIORef (remoteActive r)
+                  return $! if active then Just r else Nothing
+
+-- | Run a function on the event loop and wait for its result.
+-- Exceptions are rethrown in the calling thread and leave the client
+-- state unchanged.
+callRemote :: Remote s -> ((Int, s) -> IO (s, a)) -> IO a
+callRemote r f =
+  do res <- newEmptyMVar
+     let call ps =
+           do x <- try (f ps)
+              case x of
+                Left e        -> snd ps <$ putMVar res (Left (e :: SomeException))
+                Right (s', a) -> s'     <$ putMVar res (Right a)
+     atomically (writeTQueue (remoteQueue r) (RemoteCall (remoteId r) call))
+     either throwIO return =<< takeMVar res
+
+-- | Read the client state and the ID of the calling extension.
+readClient :: ClientRef s -> IO (Int, s)
+readClient ref =
+  do mb <- activeRemote ref
+     case mb of
+       Nothing -> readMVar (refMVar ref)
+       Just r  -> callRemote r (\ps -> return (snd ps, ps))
+
+-- | Update the client state on behalf of the calling extension.
+modifyClient :: ClientRef s -> ((Int, s) -> IO ((Int, s), a)) -> IO a
+modifyClient ref f =
+  do mb <- activeRemote ref
+     case mb of
+       Nothing -> modifyMVar (refMVar ref) f
+       Just r  -> callRemote r (fmap (first snd) . f)
+
+-- | Update the client state on behalf of the calling extension.
+modifyClient_ :: ClientRef s -> ((Int, s) -> IO (Int, s)) -> IO ()
+modifyClient_ ref f = modifyClient ref (fmap (\ps -> (ps, ())) . f)
+
+------------------------------------------------------------------------
+
+-- | Bound thread that runs all of the callbacks of an extension so that
+-- a slow extension doesn't delay the event loop. Callbacks run in the
+-- order they were queued.
+data Dispatcher = Dispatcher
+  { dispQueue :: !(TBQueue DispatchItem)
+  , dispDone  :: !(TMVar ())  -- ^ full once the thread has stopped
+  , dispToken :: !(Ptr ())    -- ^ stable pointer to the extension's 'ClientRef'
+  }
+
+data DispatchItem
+  = DispatchCall Callback (IO Int) -- ^ callback returning the number of dropped messages
+  | DispatchStop (IO ())           -- ^ final action before the thread stops
+
+-- | Number of callbacks timed before the statistics are reported when
+-- the dispatcher stays busy.
+dispatcherStatsBatch :: Int
+dispatcherStatsBatch = 64
+
+-- | Start a dispatcher thread. Callback statistics are accumulated on
+-- the thread and passed to the reporting function when the queue is
+-- empty or after 'dispatcherStatsBatch' callbacks.
+newDispatcher ::
+  Int                      {- ^ queue size                      -} ->
+  Ptr ()                   {- ^ extension's stable pointer      -} ->
+  (ExtensionStats -> IO ()) {- ^ report callback statistics     -} ->
+  IO Dispatcher
+newDispatcher size token report =
+  do q    <- newTBQueueIO (fromIntegral size)
+     done <- newEmptyTMVarIO
+     let loop stats n =
+           do mb <- atomically (readTBQueue q)
+              case mb of
+                DispatchStop final ->
+                  do unless (n == 0) (report stats)
+                     _ <- try final :: IO (Either SomeException ())
+                     atomically (putTMVar done ())
+                DispatchCall cb act ->
+                  do t0 <- getMonotonicTime
+                     r  <- try act
+                     t1 <- getMonotonicTime
+                     let drops  = either (\e -> const 0 (e :: SomeException)) id r
+                         stats' = recordCallback cb (t1 - t0) drops stats
+                     idle <- atomically (isEmptyTBQueue q)
+                     if idle || n + 1 >= dispatcherStatsBatch
+                       then report stats' >> loop emptyExtensionStats 0
+                       else loop stats' (n + 1)
+     _ <- forkOS (loop emptyExtensionStats (0 :: Int))
+     return Dispatcher { dispQueue = q, dispDone = done, dispToken = token }
+
+-- | Queue a callback unless the queue is full.
+tryDispatch :: Callback -> IO Int -> Dispatcher -> STM Bool
+tryDispatch cb act d =
+  do full <- isFullTBQueue (dispQueue d)
+     if full then return False
+             else True <$ writeTBQueue (dispQueue d) (DispatchCall cb act)
+
+-- | Queue a callback, waiting for room in the queue.
+dispatch :: Callback -> IO Int -> Dispatcher -> STM ()
+dispatch cb act d = writeTBQueue (dispQueue d) (DispatchCall cb act)
+
+-- | Ask the dispatcher thread to run a final action, typically the
+-- extension's stop callback, after the queued callbacks and stop.
+stopDispatcher :: IO () -> Dispatcher -> STM ()
+stopDispatcher final d = writeTBQueue (dispQueue d) (DispatchStop final)
+
+-- | Wait for the dispatcher thread to stop.
+dispatcherStopped :: Dispatcher -> STM ()
+dispatcherStopped d = readTMVar (dispDone d)
+
+-- | Stable pointer given to the extension, freed once it is unloaded.
+dispatcherToken :: Dispatcher -> Ptr ()
+dispatcherToken = dispToken
 
 -- | Find the earliest timer ready to run if any are available.
+-- One-shot timers are removed from the updated extension while interval
+-- timers are scheduled again one period after this deadline. This
+-- happens before the callback runs so that it can cancel or reschedule
+-- its own interval timer.
 popTimer ::
   ActiveExtension {- ^ extension -} ->
   Maybe (UTCTime, TimerId, FunPtr TimerCallback, Ptr (), ActiveExtension)
@@ -97,31 +488,61 @@ popTimer ::
 popTimer ae =
   do let timers = aeTimers ae
      guard (aeLive ae)
-     (timerId, time, TimerEntry fun ptr, timers') <- IntPSQ.minView timers
-     let ae' = ae { aeTimers = timers' }
+     (timerId, time, entry@(TimerEntry fun ptr period), timers') <- IntPSQ.minView timers
+     let timers'' = case period of
+                      Nothing -> timers'
+                      Just p  -> IntPSQ.insert timerId (addUTCTime p time) entry timers'
+         ae' = ae { aeTimers = timers'' }
      return (time, fromIntegral timerId, fun, ptr, ae')
 
--- | Schedue a new timer event for the given extension.
+-- | Schedue a new timer event for the given extension. Timers with a
+-- period run again after each period until they are cancelled.
 pushTimer ::
-  UTCTime              {- ^ activation time   -} ->
-  FunPtr TimerCallback {- ^ callback function -} ->
-  Ptr ()               {- ^ callback state    -} ->
-  ActiveExtension      {- ^ extension         -} ->
+  UTCTime               {- ^ activation time   -} ->
+  Maybe NominalDiffTime {- ^ repeat period     -} ->
+  FunPtr TimerCallback  {- ^ callback function -} ->
+  Ptr ()                {- ^ callback state    -} ->
+  ActiveExtension       {- ^ extension         -} ->
   (Int,ActiveExtension)
-pushTimer time fun ptr ae = entry `seq` ae' `seq` (i, ae')
+pushTimer time period fun ptr ae = entry `seq` ae' `seq` (i, ae')
   where
-    entry = TimerEntry fun ptr
+    entry = TimerEntry fun ptr period
     i     = aeNextTimer ae
     ae'   = ae { aeTimers = IntPSQ.insert i time entry (aeTimers ae)
                , aeNextTimer = i + 1 }
 
+-- | Move a scheduled timer to a new activation time keeping its ID,
+-- callback, and period.
+rescheduleTimer ::
+  Int             {- ^ timer ID            -} ->
+  UTCTime         {- ^ new activation time -} ->
+  ActiveExtension {- ^ extension           -} ->
+  Maybe ActiveExtension
+rescheduleTimer timerId time ae =
+  do (_, entry) <- IntPSQ.lookup timerId (aeTimers ae)
+     return ae { aeTimers = IntPSQ.insert timerId time entry (aeTimers ae) }
+
+-- | Keep an interval timer that fell behind, for example while the
+-- client was busy, from running again for each of the periods it
+-- missed. Its next activation is moved to one period from now.
+catchUpTimer ::
+  UTCTime         {- ^ current time -} ->
+  Int             {- ^ timer ID     -} ->
+  ActiveExtension {- ^ extension    -} ->
+  ActiveExtension
+catchUpTimer now timerId ae =
+  case IntPSQ.lookup timerId (aeTimers ae) of
+    Just (time, entry@(TimerEntry _ _ (Just p)))
+      | time <= now -> ae { aeTimers = IntPSQ.insert timerId (addUTCTime p now) entry (aeTimers ae) }
+    _ -> ae
+
 -- | Remove a timer from the schedule by ID
 cancelTimer ::
   Int             {- ^ timer ID  -}  ->
   ActiveExtension {- ^ extension -}  ->
   Maybe (Ptr (), ActiveExtension)
 cancelTimer timerId ae =
-  do (_, TimerEntry _ ptr) <- IntPSQ.lookup timerId (aeTimers ae)
+  do (_, TimerEntry _ ptr _) <- IntPSQ.lookup timerId (aeTimers ae)
      return (ptr, ae { aeTimers = IntPSQ.delete timerId (aeTimers ae)})
 
 -- | Load the extension from the given path and call the start
@@ -136,6 +557,20 @@ openExtension config =
      p    <- dlsym dl extensionSymbol
      fgn  <- peek (castFunPtrToPtr p)
      name <- peekCString (fgnName fgn)
+     api  <- extensionApiVersion dl
+     subs <- if api >= 1
+               then peekSubscriptionSet =<< peekSubscriptions (castFunPtrToPtr p)
+               else return Nothing
+     batch <- if api >= 2
+                then peekProcessMessages (castFunPtrToPtr p)
+                else return nullFunPtr
+     flags <- if api >= 3
+                then peekExtensionFlags (castFunPtrToPtr p)
+                else return (ExtensionFlags 0)
+     slots <- newTVarIO 0
+     stopJobs <- if api >= 4
+                   then peekStopJobs (castFunPtrToPtr p)
+                   else return nullFunPtr
      return $! ActiveExtension
        { aeFgn          = fgn
        , aeDL           = dl
@@ -146,9 +581,56 @@ openExtension config =
        , aeMinorVersion = fromIntegral (fgnMinorVersion fgn)
        , aeNextTimer    = 1
        , aeThreads      = 0
+       , aeJobs         = IntMap.empty
+       , aeNextJob      = 1
+       , aeQueueLimit   = view extensionQueueLimit config
+       , aeJobLimit     = view extensionJobLimit config
+       , aeJobSlots     = slots
+       , aeJobsDone     = 0
+       , aeJobTime      = 0
        , aeLive         = True
+       , aeSubscriptions = subs
+       , aeBatch        = batch
+       , aeBatchCallback = batch
+       , aeStats        = emptyExtensionStats
+       , aeFlags        = flags
+       , aeStopJobs     = stopJobs
+       , aeDispatcher   = Nothing
+       , aeOverflow     = 0
        }
 
+-- | The optional symbol that extensions export to declare which version
+-- of @struct glirc_extension@ they were built against.
+extensionApiVersionSymbol :: String
+extensionApiVersionSymbol = "extension_api_version"
+
+-- | Find the API version of a loaded extension. Extensions that don't
+-- export a version predate it and are version 0.
+extensionApiVersion :: DL -> IO Int
+extensionApiVersion dl =
+  do res <- try (dlsym dl extensionApiVersionSymbol) :: IO (Either IOError (FunPtr ()))
+     case res of
+       Left _  -> return 0
+       Right p -> fromIntegral <$> (peek (castFunPtrToPtr p) :: IO CInt)
+
+-- | Import a null-terminated array of command names. A null array
+-- subscribes to every command.
+peekSubscriptionSet :: Ptr CString -> IO (Maybe (HashSet Text))
+peekSubscriptionSet p
+  | p == nullPtr = return Nothing
+  | otherwise    =
+      do names <- traverse peekCString =<< peekArray0 nullPtr p
+         return $! Just $! HashSet.fromList (map (Text.toUpper . Text.pack) names)
+
+-- | Check if an extension wants to process messages with the given command.
+-- Subscriptions are stored upper-cased and commands are compared the same
+-- way, as servers aren't required to send commands in upper case.
+isSubscribed ::
+  Text            {- ^ IRC command -} ->
+  ActiveExtension {- ^ extension   -} ->
+  Bool
+isSubscribed cmd ae = maybe True (HashSet.member (Text.toUpper cmd)) (aeSubscriptions ae)
+
 startExtension ::
   Ptr ()                 {- ^ client stable pointer   -} ->
   ExtensionConfiguration {- ^ extension configuration -} ->
@@ -168,10 +650,26 @@ startExtension stab config ae =
 
 stopExtension :: ActiveExtension -> IO ()
 stopExtension ae =
+  do runExtensionStop ae
+     closeExtension ae
+
+-- | Call the stop callback of an extension.
+runExtensionStop :: ActiveExtension -> IO ()
+runExtensionStop ae =
   do let f = fgnStop (aeFgn ae)
      unless (nullFunPtr == f) $
        runStopExtension f (aeSession ae)
-     dlclose (aeDL ae)
+
+-- | Ask an extension to end its running jobs so that it can be stopped.
+runExtensionStopJobs :: ActiveExtension -> IO ()
+runExtensionStopJobs ae =
+  do let f = aeStopJobs ae
+     unless (nullFunPtr == f) $
+       runStopExtension f (aeSession ae)
+
+-- | Unload an extension after it has been stopped.
+closeExtension :: ActiveExtension -> IO ()
+closeExtension ae = dlclose (aeDL ae)
 
 -- | Call all of the process chat callbacks in the list of extensions.
 -- This operation marshals the IRC message once and shares that across
@@ -203,6 +701,20 @@ notifyExtension ae msg =
        then return True
        else (passMessage ==) <$> runProcessMessage f (aeSession ae) msg
 
+-- | Call the process messages callback of an extension with an array
+-- of messages. The extension must have a batch callback.
+--
+-- Returns 'True' for each message to pass to the client.
+notifyExtensionBatch ::
+  ActiveExtension {- ^ extension                  -} ->
+  [FgnMsg]        {- ^ serialized IRC messages    -} ->
+  IO [Bool]       {- ^ allow each message         -}
+notifyExtensionBatch ae msgs =
+  withArrayLen msgs $ \n msgsPtr ->
+  allocaArray n $ \out ->
+    do pokeArray out (replicate n passMessage)
+       runProcessMessages (aeBatch ae) (aeSession ae) msgsPtr (fromIntegral n) out
+       map (passMessage ==) <$> peekArray n out
 
 -- | Notify an extension of a client command with the given parameters.
 commandExtension ::
@@ -217,28 +729,68 @@ commandExtension command ae = evalNestedIO $
 
 -- | Notify an extension that one of its threads has finished.
 threadFinish :: ThreadEntry -> IO ()
-threadFinish (ThreadEntry f x) = runThreadFinish f x
+threadFinish (ThreadEntry _ _ f x) = runThreadFinish f x
 
--- | Marshal a 'RawIrcMsg' into a 'FgnMsg' which will be valid for
+-- | Marshal a 'RawIrcLine' into a 'FgnMsg' which will be valid for
 -- the remainder of the computation.
 withRawIrcMsg ::
   Text                 {- ^ network      -} ->
-  RawIrcMsg            {- ^ message      -} ->
+  RawIrcLine           {- ^ message      -} ->
   NestedIO (Ptr FgnMsg)
-withRawIrcMsg network RawIrcMsg{..} =
-  do net     <- withText network
-     pfxN    <- withText $ maybe Text.empty (idText.userNick) _msgPrefix
-     pfxU    <- withText $ maybe Text.empty userName _msgPrefix
-     pfxH    <- withText $ maybe Text.empty userHost _msgPrefix
-     cmd     <- withText _msgCommand
-     prms    <- traverse withText _msgParams
-     tags    <- traverse withTag  _msgTags
-     let (keys,vals) = unzip tags
-     (tagN,keysPtr) <- nest2 $ withArrayLen keys
-     valsPtr        <- nest1 $ withArray vals
-     (prmN,prmPtr)  <- nest2 $ withArrayLen prms
-     nest1 $ with $ FgnMsg net pfxN pfxU pfxH cmd prmPtr (fromIntegral prmN)
-                                       keysPtr valsPtr (fromIntegral tagN)
+withRawIrcMsg network raw = nest1 . with =<< withFgnMsg network raw
+
+-- | Marshal the parts of a 'RawIrcLine' into a 'FgnMsg' which will be
+-- valid for the remainder of the computation. The parts are copied as
+-- they were received into one buffer, each followed by a null byte.
+-- Only parts that aren't valid UTF-8 are decoded and encoded again.
+withFgnMsg ::
+  Text                 {- ^ network      -} ->
+  RawIrcLine           {- ^ message      -} ->
+  NestedIO FgnMsg
+withFgnMsg network RawIrcLine{..} =
+  do let command = utf8 lineCommand
+         (nick, user, host) = maybe (B.empty, B.empty, B.empty) (splitPrefix . utf8) linePrefix
+         keys  = map (utf8 . fst) lineTags
+         vals  = map (utf8 . unescapeTagBytes . snd) lineTags
+         prms  = map utf8 lineParams
+         parts = command : nick : user : host : prms ++ keys ++ vals
+         size  = sum [ B.length x + 1 | x <- parts ]
+
+     net  <- withText network
+     buf  <- nest1 $ allocaArray size
+     next <- liftIO (newIORef 0)
+     let place x = liftIO $
+           B.unsafeUseAsCStringLen x $ \(src, len) ->
+           do off <- readIORef next
+              writeIORef next (off + len + 1)
+              let dst = advancePtr buf off
+              copyBytes dst src len
+              pokeElemOff dst len 0
+              return (FgnStringLen dst (fromIntegral len))
+
+     cmd     <- place command
+     pfxN    <- place nick
+     pfxU    <- place user
+     pfxH    <- place host
+     prms'   <- traverse place prms
+     keys'   <- traverse place keys
+     vals'   <- traverse place vals
+     (tagN,keysPtr) <- nest2 $ withArrayLen keys'
+     valsPtr        <- nest1 $ withArray vals'
+     (prmN,prmPtr)  <- nest2 $ withArrayLen prms'
+     return $ FgnMsg net pfxN pfxU pfxH cmd prmPtr (fromIntegral prmN)
+                                    keysPtr valsPtr (fromIntegral tagN)
+  where
+    -- same split as 'parseUserInfo'
+    splitPrefix pfx = (nick, B.drop 1 user, B.drop 1 host)
+      where
+        (nickuser, host) = B8.break ('@' ==) pfx
+        (nick    , user) = B8.break ('!' ==) nickuser
+
+    -- extensions are promised UTF-8, which nearly every line already is
+    utf8 x
+      | B.all (< 0x80) x || isRight (Text.decodeUtf8' x) = x
+      | otherwise = Text.encodeUtf8 (asUtf8 x)
 
 withChat ::
   Text {- ^ network -} ->
@@ -258,12 +810,6 @@ withCommand command =
   do cmd <- withText command
      nest1 $ with $ FgnCmd cmd
 
-withTag :: TagEntry -> NestedIO (FgnStringLen, FgnStringLen)
-withTag (TagEntry k v) =
-  do pk <- withText k
-     pv <- withText v
-     return (pk,pv)
-
 withText :: Text -> NestedIO FgnStringLen
 withText txt =
   do (ptr,len) <- nest1 $ withText0 txt
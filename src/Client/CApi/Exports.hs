@@ -16,18 +16,33 @@ module Client.CApi.Exports
    Glirc_send_message
  , glirc_send_message
 
+ , Glirc_send_messages
+ , glirc_send_messages
+
  , Glirc_print
  , glirc_print
 
+ , Glirc_print_many
+ , glirc_print_many
+
  , Glirc_list_networks
  , glirc_list_networks
 
+ , Glirc_list_networks_packed
+ , glirc_list_networks_packed
+
  , Glirc_list_channels
  , glirc_list_channels
 
+ , Glirc_list_channels_packed
+ , glirc_list_channels_packed
+
  , Glirc_list_channel_users
  , glirc_list_channel_users
 
+ , Glirc_list_channel_users_packed
+ , glirc_list_channel_users_packed
+
  , Glirc_my_nick
  , glirc_my_nick
 
@@ -37,12 +52,24 @@ module Client.CApi.Exports
  , Glirc_user_channel_modes
  , glirc_user_channel_modes
 
+ , Glirc_channel_roster
+ , glirc_channel_roster
+
+ , Glirc_free_roster
+ , glirc_free_roster
+
  , Glirc_channel_modes
  , glirc_channel_modes
 
+ , Glirc_channel_modes_packed
+ , glirc_channel_modes_packed
+
  , Glirc_channel_masks
  , glirc_channel_masks
 
+ , Glirc_channel_masks_packed
+ , glirc_channel_masks_packed
+
  , Glirc_identifier_cmp
  , glirc_identifier_cmp
 
@@ -70,26 +97,63 @@ module Client.CApi.Exports
  , Glirc_free_strings
  , glirc_free_strings
 
+ , Glirc_free_string_list
+ , glirc_free_string_list
+
  , Glirc_inject_chat
  , glirc_inject_chat
 
+ , Glirc_inject_chat_many
+ , glirc_inject_chat_many
+
  , Glirc_resolve_path
  , glirc_resolve_path
 
  , Glirc_set_timer
  , glirc_set_timer
 
+ , Glirc_set_interval
+ , glirc_set_interval
+
+ , Glirc_reschedule_timer
+ , glirc_reschedule_timer
+
  , Glirc_cancel_timer
  , glirc_cancel_timer
 
  , Glirc_window_lines
  , glirc_window_lines
 
+ , Glirc_window_lines_packed
+ , glirc_window_lines_packed
+
+ , Glirc_window_history
+ , glirc_window_history
+
+ , Glirc_free_window_page
+ , glirc_free_window_page
+
  , Glirc_thread
  , glirc_thread
+
+ , Glirc_submit_job
+ , glirc_submit_job
+ , glirc_submit_long_job
+
+ , Glirc_cancel_job
+ , glirc_cancel_job
+
+ , Glirc_job_stats
+ , glirc_job_stats
+
+ , Glirc_subscribe
+ , glirc_subscribe
+
+ , Glirc_batch_messages
+ , glirc_batch_messages
  ) where
 
-import           Client.CApi (cancelTimer, pushTimer, ThreadEntry(..), ActiveExtension(aeThreads))
+import           Client.CApi (cancelTimer, pushTimer, rescheduleTimer, submitJob, startLongJob, cancelJob, jobStats, ThreadEntry(..), ActiveExtension(aeSubscriptions, aeBatch, aeBatchCallback), ClientRef, readClient, modifyClient, modifyClient_)
 import           Client.CApi.Types
 import           Client.Configuration
 import           Client.Message
@@ -97,30 +161,33 @@ import           Client.State
 import           Client.State.Channel
 import           Client.State.Focus
 import           Client.State.Network
-import           Client.State.Window (windowClear, windowSeen, winMessages, wlText)
+import           Client.State.Window (WindowLine, windowClear, windowSeen, windowHistory, winMessages, wlText, wlTimestamp, unpackUTCTime)
 import           Client.UserHost
-import           Control.Concurrent (forkOS)
-import           Control.Concurrent.MVar
 import           Control.Concurrent.STM (atomically, writeTQueue)
 import           Control.Exception
 import           Control.Lens
 import           Control.Monad (unless)
 import           Data.Char (chr)
-import           Data.Foldable (traverse_)
+import           Data.Foldable (for_, foldl', traverse_)
 import           Data.Functor.Compose
+import           Data.Int (Int64)
 import qualified Data.Map as Map
 import           Data.Monoid (First(..))
 import qualified Data.HashMap.Strict as HashMap
+import qualified Data.HashSet as HashSet
 import           Data.Text (Text)
 import qualified Data.Text as Text
 import qualified Data.Text.Lazy as LText
 import qualified Data.Text.Foreign as Text
 import           Data.Time
+import           Data.Time.Clock.POSIX (utcTimeToPOSIXSeconds)
+import           Data.Traversable (for)
 import           Foreign.C
 import           Foreign.Marshal
 import           Foreign.Ptr
 import           Foreign.StablePtr
 import           Foreign.Storable
+import           GHC.Clock (getMonotonicTime)
 import           Irc.Identifier
 import           Irc.RawIrcMsg
 import           Irc.UserInfo
@@ -130,7 +197,7 @@ import           LensUtils
 ------------------------------------------------------------------------
 
 -- | Dereference the stable pointer passed to extension callbacks
-derefToken :: Ptr () -> IO (MVar (Int, ClientState))
+derefToken :: Ptr () -> IO (ClientRef ClientState)
 derefToken = deRefStablePtr . castPtrToStablePtr
 
 
@@ -178,11 +245,11 @@ type Glirc_send_message =
 -- command to a connected server.
 glirc_send_message :: Glirc_send_message
 glirc_send_message token msgPtr =
-  do mvar    <- derefToken token
+  do ref     <- derefToken token
      fgn     <- peek msgPtr
      msg     <- peekFgnMsg fgn
      network <- peekFgnStringLen (fmNetwork fgn)
-     (_,st)  <- readMVar mvar
+     (_,st)  <- readClient ref
      case preview (clientConnection network) st of
        Nothing -> return 1
        Just cs -> 0 <$ sendMsg cs msg
@@ -190,6 +257,33 @@ glirc_send_message token msgPtr =
 
 ------------------------------------------------------------------------
 
+-- | Type of 'glirc_send_messages' extension entry-point
+type Glirc_send_messages =
+  Ptr ()     {- ^ api token                     -} ->
+  Ptr FgnMsg {- ^ array of messages             -} ->
+  CSize      {- ^ number of messages            -} ->
+  IO CInt    {- ^ number of messages not sent   -}
+
+-- | Entry-point into the client when an extension wants to send several
+-- IRC commands at once. The messages for each network are queued for
+-- transmission together and keep their order.
+glirc_send_messages :: Glirc_send_messages
+glirc_send_messages token msgsPtr n =
+  do ref    <- derefToken token
+     fgns   <- peekArray (fromIntegral n) msgsPtr
+     msgs   <- traverse (\fgn -> (,) <$> peekFgnStringLen (fmNetwork fgn)
+                                      <*> peekFgnMsg fgn) fgns
+     (_,st) <- readClient ref
+     let byNetwork = HashMap.fromListWith (flip (++)) [ (net, [msg]) | (net, msg) <- msgs ]
+     missing <- for (HashMap.toList byNetwork) $ \(network, netMsgs) ->
+       case preview (clientConnection network) st of
+         Nothing -> return (length netMsgs)
+         Just cs -> 0 <$ sendMsgs cs netMsgs
+     return (fromIntegral (sum missing))
+  `catch` \SomeException{} -> return (fromIntegral n)
+
+------------------------------------------------------------------------
+
 -- | Type of 'glirc_print' extension entry-point
 type Glirc_print =
   Ptr ()      {- ^ api token         -} ->
@@ -203,7 +297,7 @@ type Glirc_print =
 -- cause the client to draw attention to the message as an error.
 glirc_print :: Glirc_print
 glirc_print stab code msgPtr msgLen =
-  do mvar <- derefToken stab
+  do ref  <- derefToken stab
      txt  <- peekFgnStringLen (FgnStringLen msgPtr msgLen)
      now  <- getZonedTime
 
@@ -214,13 +308,44 @@ glirc_print stab code msgPtr msgLen =
                  , _msgTime    = now
                  , _msgNetwork = Text.empty
                  }
-     modifyMVar_ mvar $ \(i,st) ->
+     modifyClient_ ref $ \(i,st) ->
        do return (i, recordNetworkMessage msg st)
      return 0
   `catch` \SomeException{} -> return 1
 
 ------------------------------------------------------------------------
 
+-- | Type of 'glirc_print_many' extension entry-point
+type Glirc_print_many =
+  Ptr ()           {- ^ api token          -} ->
+  MessageCode      {- ^ enum message_code  -} ->
+  Ptr FgnStringLen {- ^ array of messages  -} ->
+  CSize            {- ^ number of messages -} ->
+  IO CInt          {- ^ 0 on success       -}
+
+-- | Entry-point for extensions to append several messages to the client
+-- buffer in one update. See 'glirc_print'.
+glirc_print_many :: Glirc_print_many
+glirc_print_many stab code msgsPtr n =
+  do ref  <- derefToken stab
+     txts <- traverse peekFgnStringLen =<< peekArray (fromIntegral n) msgsPtr
+     now  <- getZonedTime
+
+     let con | code == normalMessage = NormalBody
+             | otherwise             = ErrorBody
+         msgs = [ ClientMessage
+                    { _msgBody    = con txt
+                    , _msgTime    = now
+                    , _msgNetwork = Text.empty
+                    }
+                | txt <- txts ]
+     modifyClient_ ref $ \(i,st) ->
+       do return (i, foldl' (flip recordNetworkMessage) st msgs)
+     return 0
+  `catch` \SomeException{} -> return 1
+
+------------------------------------------------------------------------
+
 -- | Type of 'glirc_inject_chat' extension entry-point.
 type Glirc_inject_chat =
   Ptr ()  {- ^ api token         -} ->
@@ -240,7 +365,7 @@ type Glirc_inject_chat =
 -- them before showing the user.
 glirc_inject_chat :: Glirc_inject_chat
 glirc_inject_chat stab netPtr netLen srcPtr srcLen tgtPtr tgtLen msgPtr msgLen =
-  do mvar <- derefToken stab
+  do ref  <- derefToken stab
      net  <- peekFgnStringLen (FgnStringLen netPtr netLen)
      src  <- peekFgnStringLen (FgnStringLen srcPtr srcLen)
      tgt  <- mkId <$> peekFgnStringLen (FgnStringLen tgtPtr tgtLen)
@@ -252,13 +377,50 @@ glirc_inject_chat stab netPtr netLen srcPtr srcLen tgtPtr tgtLen msgPtr msgLen =
                  , _msgTime    = now
                  , _msgNetwork = net
                  }
-     modifyMVar_ mvar $ \(i, st) ->
+     modifyClient_ ref $ \(i, st) ->
        do return (i, recordChannelMessage net tgt msg st)
      return 0
   `catch` \SomeException{} -> return 1
 
 ------------------------------------------------------------------------
 
+-- | Type of 'glirc_inject_chat_many' extension entry-point.
+type Glirc_inject_chat_many =
+  Ptr ()           {- ^ api token          -} ->
+  CString          {- ^ network            -} ->
+  CSize            {- ^ network length     -} ->
+  CString          {- ^ source             -} ->
+  CSize            {- ^ source length      -} ->
+  CString          {- ^ target             -} ->
+  CSize            {- ^ target length      -} ->
+  Ptr FgnStringLen {- ^ array of messages  -} ->
+  CSize            {- ^ number of messages -} ->
+  IO CInt          {- ^ 0 on success       -}
+
+-- | Add several messages from the same source to a chat window in one
+-- update. See 'glirc_inject_chat'.
+glirc_inject_chat_many :: Glirc_inject_chat_many
+glirc_inject_chat_many stab netPtr netLen srcPtr srcLen tgtPtr tgtLen msgsPtr n =
+  do ref  <- derefToken stab
+     net  <- peekFgnStringLen (FgnStringLen netPtr netLen)
+     src  <- peekFgnStringLen (FgnStringLen srcPtr srcLen)
+     tgt  <- mkId <$> peekFgnStringLen (FgnStringLen tgtPtr tgtLen)
+     txts <- traverse peekFgnStringLen =<< peekArray (fromIntegral n) msgsPtr
+     now  <- getZonedTime
+
+     let msgs = [ ClientMessage
+                    { _msgBody    = IrcBody (Privmsg (Source (parseUserInfo src) "") tgt txt)
+                    , _msgTime    = now
+                    , _msgNetwork = net
+                    }
+                | txt <- txts ]
+     modifyClient_ ref $ \(i, st) ->
+       do return (i, foldl' (\st' msg -> recordChannelMessage net tgt msg st') st msgs)
+     return 0
+  `catch` \SomeException{} -> return 1
+
+------------------------------------------------------------------------
+
 -- | Type of 'glirc_list_networks' extension entry-point
 type Glirc_list_networks =
   Ptr ()           {- ^ api token                                        -} ->
@@ -270,11 +432,29 @@ type Glirc_list_networks =
 -- @glirc_free_strings@.
 glirc_list_networks :: Glirc_list_networks
 glirc_list_networks stab =
-  do mvar <- derefToken stab
-     (_,st) <- readMVar mvar
-     let networks = views clientConnections HashMap.keys st
-     strs <- traverse (newCString . Text.unpack) networks
-     newArray0 nullPtr strs
+  do ref  <- derefToken stab
+     (_,st) <- readClient ref
+     exportStrings (networkNames st)
+
+------------------------------------------------------------------------
+
+-- | Type of 'glirc_list_networks_packed' extension entry-point
+type Glirc_list_networks_packed =
+  Ptr ()  {- ^ api token -} ->
+  IO (Ptr FgnStringList) {- ^ strings sharing one allocation -}
+
+-- | Like @glirc_list_networks@ but the strings are returned in a single
+-- allocation. @NULL@ returned on failure. The caller is responsible
+-- for freeing successful result with @glirc_free_string_list@.
+glirc_list_networks_packed :: Glirc_list_networks_packed
+glirc_list_networks_packed stab =
+  do ref  <- derefToken stab
+     (_,st) <- readClient ref
+     exportStringList (networkNames st)
+
+-- | Identifiers of the active networks
+networkNames :: ClientState -> [Text]
+networkNames = views clientConnections HashMap.keys
 
 ------------------------------------------------------------------------
 
@@ -313,14 +493,34 @@ type Glirc_list_channels =
 -- freeing successful result with @glirc_free_strings@.
 glirc_list_channels :: Glirc_list_channels
 glirc_list_channels stab networkPtr networkLen =
-  do mvar <- derefToken stab
-     (_,st) <- readMVar mvar
+  do ref  <- derefToken stab
+     (_,st) <- readClient ref
+     network <- peekFgnStringLen (FgnStringLen networkPtr networkLen)
+     maybe (return nullPtr) exportStrings (channelNames network st)
+
+------------------------------------------------------------------------
+
+-- | Type of 'glirc_list_channels_packed' extension entry-point
+type Glirc_list_channels_packed =
+  Ptr ()  {- ^ api token   -} ->
+  CString {- ^ network     -} ->
+  CSize   {- ^ network len -} ->
+  IO (Ptr FgnStringList) {- ^ strings sharing one allocation -}
+
+-- | Like @glirc_list_channels@ but the strings are returned in a single
+-- allocation. @NULL@ returned on failure. The caller is responsible
+-- for freeing successful result with @glirc_free_string_list@.
+glirc_list_channels_packed :: Glirc_list_channels_packed
+glirc_list_channels_packed stab networkPtr networkLen =
+  do ref  <- derefToken stab
+     (_,st) <- readClient ref
      network <- peekFgnStringLen (FgnStringLen networkPtr networkLen)
-     case preview (clientConnection network . csChannels) st of
-        Nothing -> return nullPtr
-        Just m  ->
-          do strs <- traverse (newCString . Text.unpack . idText) (HashMap.keys m)
-             newArray0 nullPtr strs
+     maybe (return nullPtr) exportStringList (channelNames network st)
+
+-- | Names of the channels joined on a network
+channelNames :: Text -> ClientState -> Maybe [Text]
+channelNames network st =
+  map idText . HashMap.keys <$> preview (clientConnection network . csChannels) st
 
 ------------------------------------------------------------------------
 
@@ -339,19 +539,42 @@ type Glirc_list_channel_users =
 -- @glirc_free_strings@.
 glirc_list_channel_users :: Glirc_list_channel_users
 glirc_list_channel_users stab networkPtr networkLen channelPtr channelLen =
-  do mvar    <- derefToken stab
-     (_, st) <- readMVar mvar
+  do ref     <- derefToken stab
+     (_, st) <- readClient ref
      network <- peekFgnStringLen (FgnStringLen networkPtr networkLen)
      channel <- peekFgnStringLen (FgnStringLen channelPtr channelLen)
-     let mb = preview ( clientConnection network
-                      . csChannels . ix (mkId channel)
-                      . chanUsers
-                      ) st
-     case mb of
-       Nothing -> return nullPtr
-       Just m  ->
-         do strs <- traverse (newCString . Text.unpack . idText) (HashMap.keys m)
-            newArray0 nullPtr strs
+     maybe (return nullPtr) exportStrings (channelUserNames network channel st)
+
+------------------------------------------------------------------------
+
+-- | Type of 'glirc_list_channel_users_packed' extension entry-point
+type Glirc_list_channel_users_packed =
+  Ptr ()  {- ^ api token   -} ->
+  CString {- ^ network     -} ->
+  CSize   {- ^ network len -} ->
+  CString {- ^ channel     -} ->
+  CSize   {- ^ channel len -} ->
+  IO (Ptr FgnStringList) {- ^ strings sharing one allocation -}
+
+-- | Like @glirc_list_channel_users@ but the strings are returned in a single
+-- allocation. @NULL@ returned on failure. The caller is responsible
+-- for freeing successful result with @glirc_free_string_list@.
+glirc_list_channel_users_packed :: Glirc_list_channel_users_packed
+glirc_list_channel_users_packed stab networkPtr networkLen channelPtr channelLen =
+  do ref     <- derefToken stab
+     (_, st) <- readClient ref
+     network <- peekFgnStringLen (FgnStringLen networkPtr networkLen)
+     channel <- peekFgnStringLen (FgnStringLen channelPtr channelLen)
+     maybe (return nullPtr) exportStringList (channelUserNames network channel st)
+
+-- | Nicknames of the users on a channel
+channelUserNames :: Text -> Text -> ClientState -> Maybe [Text]
+channelUserNames network channel st =
+  map idText . HashMap.keys <$>
+  preview ( clientConnection network
+          . csChannels . ix (mkId channel)
+          . chanUsers
+          ) st
 
 ------------------------------------------------------------------------
 
@@ -368,8 +591,8 @@ type Glirc_my_nick =
 -- @glirc_free_string@.
 glirc_my_nick :: Glirc_my_nick
 glirc_my_nick stab networkPtr networkLen =
-  do mvar    <- derefToken stab
-     (_,st)  <- readMVar mvar
+  do ref     <- derefToken stab
+     (_,st)  <- readClient ref
      network <- peekFgnStringLen (FgnStringLen networkPtr networkLen)
      let mb = preview (clientConnection network . csNick) st
      case mb of
@@ -393,8 +616,8 @@ type Glirc_user_account =
 -- known, @NULL@ is returned.
 glirc_user_account :: Glirc_user_account
 glirc_user_account stab networkPtr networkLen nickPtr nickLen =
-  do mvar    <- derefToken stab
-     (_,st)  <- readMVar mvar
+  do ref     <- derefToken stab
+     (_,st)  <- readClient ref
      network <- peekFgnStringLen (FgnStringLen networkPtr networkLen)
      nick    <- peekFgnStringLen (FgnStringLen nickPtr    nickLen   )
      let mb = preview ( clientConnection network
@@ -423,8 +646,8 @@ type Glirc_user_channel_modes =
 -- string is returned. If user is not on channel @NULL@ is returned.
 glirc_user_channel_modes :: Glirc_user_channel_modes
 glirc_user_channel_modes stab netPtr netLen chanPtr chanLen nickPtr nickLen =
-  do mvar    <- derefToken stab
-     (_,st)  <- readMVar mvar
+  do ref     <- derefToken stab
+     (_,st)  <- readClient ref
      network <- peekFgnStringLen (FgnStringLen netPtr  netLen)
      chan    <- peekFgnStringLen (FgnStringLen chanPtr chanLen   )
      nick    <- peekFgnStringLen (FgnStringLen nickPtr nickLen   )
@@ -437,6 +660,53 @@ glirc_user_channel_modes stab netPtr netLen chanPtr chanLen nickPtr nickLen =
 
 ------------------------------------------------------------------------
 
+-- | Type of 'glirc_channel_roster' extension entry-point
+type Glirc_channel_roster =
+  Ptr ()  {- ^ api token           -} ->
+  CString {- ^ network name        -} ->
+  CSize   {- ^ network name length -} ->
+  CString {- ^ channel             -} ->
+  CSize   {- ^ channel length      -} ->
+  IO (Ptr FgnRoster)
+
+-- | Return the nickname, mode sigils, and services account of every
+-- user on a channel, taken from a single snapshot of the client state.
+-- Accounts that are not known are returned as empty strings.
+-- Caller is responsible for freeing successful result with
+-- @glirc_free_roster@. If the user is not on a channel @NULL@
+-- is returned.
+glirc_channel_roster :: Glirc_channel_roster
+glirc_channel_roster stab netPtr netLen chanPtr chanLen =
+  do ref     <- derefToken stab
+     (_,st)  <- readClient ref
+     network <- peekFgnStringLen (FgnStringLen netPtr  netLen)
+     chan    <- peekFgnStringLen (FgnStringLen chanPtr chanLen)
+     case preview (clientConnection network) st of
+       Nothing -> return nullPtr
+       Just cs ->
+         case preview (csChannels . ix (mkId chan) . chanUsers) cs of
+           Nothing    -> return nullPtr
+           Just users ->
+             exportRoster
+               [ (idText nick, Text.pack sigils, acct)
+               | (nick, sigils) <- HashMap.toList users
+               , let acct = view (csUsers . ix nick . uhAccount) cs
+               ]
+
+------------------------------------------------------------------------
+
+-- | Type of 'glirc_free_roster' extension entry-point
+type Glirc_free_roster =
+  Ptr FgnRoster {- ^ glirc allocated roster -} ->
+  IO ()
+
+-- | Free a roster returned by @glirc_channel_roster@. If argument is
+-- @NULL@, nothing happens.
+glirc_free_roster :: Glirc_free_roster
+glirc_free_roster = free
+
+------------------------------------------------------------------------
+
 -- | Type of 'glirc_channel_modes' extension entry-point
 type Glirc_channel_modes =
   Ptr ()  {- ^ api token           -} ->
@@ -456,20 +726,42 @@ type Glirc_channel_modes =
 -- modes being returned.
 glirc_channel_modes :: Glirc_channel_modes
 glirc_channel_modes stab netPtr netLen chanPtr chanLen =
-  do mvar    <- derefToken stab
-     (_,st)  <- readMVar mvar
+  do ref     <- derefToken stab
+     (_,st)  <- readClient ref
      network <- peekFgnStringLen (FgnStringLen netPtr  netLen)
      chan    <- peekFgnStringLen (FgnStringLen chanPtr chanLen   )
-     let mb = preview ( clientConnection network
-                      . csChannels . ix (mkId chan)
-                      . chanModes
-                      ) st
-     case mb of
-       Nothing -> return nullPtr
-       Just modeMap ->
-         do let strings = [ mode : Text.unpack arg | (mode,arg) <- Map.toList modeMap ]
-            strs <- traverse newCString strings
-            newArray0 nullPtr strs
+     maybe (return nullPtr) exportStrings (channelModeStrings network chan st)
+
+------------------------------------------------------------------------
+
+-- | Type of 'glirc_channel_modes_packed' extension entry-point
+type Glirc_channel_modes_packed =
+  Ptr ()  {- ^ api token   -} ->
+  CString {- ^ network     -} ->
+  CSize   {- ^ network len -} ->
+  CString {- ^ channel     -} ->
+  CSize   {- ^ channel len -} ->
+  IO (Ptr FgnStringList) {- ^ strings sharing one allocation -}
+
+-- | Like @glirc_channel_modes@ but the strings are returned in a single
+-- allocation. @NULL@ returned on failure. The caller is responsible
+-- for freeing successful result with @glirc_free_string_list@.
+glirc_channel_modes_packed :: Glirc_channel_modes_packed
+glirc_channel_modes_packed stab netPtr netLen chanPtr chanLen =
+  do ref     <- derefToken stab
+     (_,st)  <- readClient ref
+     network <- peekFgnStringLen (FgnStringLen netPtr  netLen)
+     chan    <- peekFgnStringLen (FgnStringLen chanPtr chanLen)
+     maybe (return nullPtr) exportStringList (channelModeStrings network chan st)
+
+-- | Modes of a channel, each as the mode letter followed by its argument
+channelModeStrings :: Text -> Text -> ClientState -> Maybe [Text]
+channelModeStrings network chan st =
+  do modeMap <- preview ( clientConnection network
+                        . csChannels . ix (mkId chan)
+                        . chanModes
+                        ) st
+     return [ Text.cons mode arg | (mode,arg) <- Map.toList modeMap ]
 
 ------------------------------------------------------------------------
 
@@ -494,19 +786,44 @@ type Glirc_channel_masks =
 glirc_channel_masks :: Glirc_channel_masks
 glirc_channel_masks stab netPtr netLen chanPtr chanLen cmode =
   do let mode = chr (fromIntegral cmode) :: Char
-     mvar    <- derefToken stab
-     (_,st)  <- readMVar mvar
+     ref     <- derefToken stab
+     (_,st)  <- readClient ref
      network <- peekFgnStringLen (FgnStringLen netPtr  netLen)
      chan    <- peekFgnStringLen (FgnStringLen chanPtr chanLen   )
-     let mb = preview ( clientConnection network
-                      . csChannels . ix (mkId chan)
-                      . chanLists  . ix mode
-                      ) st
-     case mb of
-       Nothing -> return nullPtr
-       Just listMap ->
-         do strs <- traverse (newCString . Text.unpack) (HashMap.keys listMap)
-            newArray0 nullPtr strs
+     maybe (return nullPtr) exportStrings (channelMasks network chan mode st)
+
+------------------------------------------------------------------------
+
+-- | Type of 'glirc_channel_masks_packed' extension entry-point
+type Glirc_channel_masks_packed =
+  Ptr ()  {- ^ api token   -} ->
+  CString {- ^ network     -} ->
+  CSize   {- ^ network len -} ->
+  CString {- ^ channel     -} ->
+  CSize   {- ^ channel len -} ->
+  CChar   {- ^ mode        -} ->
+  IO (Ptr FgnStringList) {- ^ strings sharing one allocation -}
+
+-- | Like @glirc_channel_masks@ but the strings are returned in a single
+-- allocation. @NULL@ returned on failure. The caller is responsible
+-- for freeing successful result with @glirc_free_string_list@.
+glirc_channel_masks_packed :: Glirc_channel_masks_packed
+glirc_channel_masks_packed stab netPtr netLen chanPtr chanLen cmode =
+  do let mode = chr (fromIntegral cmode) :: Char
+     ref     <- derefToken stab
+     (_,st)  <- readClient ref
+     network <- peekFgnStringLen (FgnStringLen netPtr  netLen)
+     chan    <- peekFgnStringLen (FgnStringLen chanPtr chanLen)
+     maybe (return nullPtr) exportStringList (channelMasks network chan mode st)
+
+-- | Masks in one of the list modes of a channel
+channelMasks :: Text -> Text -> Char -> ClientState -> Maybe [Text]
+channelMasks network chan mode st =
+  HashMap.keys <$>
+  preview ( clientConnection network
+          . csChannels . ix (mkId chan)
+          . chanLists  . ix mode
+          ) st
 
 ------------------------------------------------------------------------
 
@@ -532,8 +849,8 @@ glirc_mark_seen stab networkPtr networkLen channelPtr channelLen =
            | Text.null channel = NetworkFocus network
            | otherwise         = ChannelFocus network (mkId channel)
 
-     mvar <- derefToken stab
-     modifyMVar_ mvar $ \(i,st) ->
+     ref  <- derefToken stab
+     modifyClient_ ref $ \(i,st) ->
        let st' = overStrict (clientWindows . ix focus) windowSeen st
        in st' `seq` return (i,st')
 
@@ -561,8 +878,8 @@ glirc_clear_window stab networkPtr networkLen channelPtr channelLen =
            | Text.null channel = NetworkFocus network
            | otherwise         = ChannelFocus network (mkId channel)
 
-     mvar <- derefToken stab
-     modifyMVar_ mvar $ \(i,st) ->
+     ref  <- derefToken stab
+     modifyClient_ ref $ \(i,st) ->
        let st' = over (clientWindows . ix focus) windowClear st
        in st' `seq` return (i,st')
 
@@ -595,6 +912,25 @@ glirc_free_strings p =
 
 ------------------------------------------------------------------------
 
+-- | Type of 'glirc_free_string_list' extension entry-point
+type Glirc_free_string_list =
+  Ptr FgnStringList {- ^ glirc allocated string list -} ->
+  IO ()
+
+-- | Free a string list returned by one of the @_packed@ extension
+-- entry-points. If argument is @NULL@, nothing happens.
+glirc_free_string_list :: Glirc_free_string_list
+glirc_free_string_list = free
+
+------------------------------------------------------------------------
+
+-- | Marshal strings as a null terminated array of null terminated
+-- strings to be freed with @glirc_free_strings@.
+exportStrings :: [Text] -> IO (Ptr CString)
+exportStrings strs = newArray0 nullPtr =<< traverse (newCString . Text.unpack) strs
+
+------------------------------------------------------------------------
+
 -- | Type of 'glirc_current_focus' extension entry-point
 type Glirc_current_focus =
   Ptr ()      {- ^ api token                           -} ->
@@ -613,8 +949,8 @@ type Glirc_current_focus =
 -- current target.
 glirc_current_focus :: Glirc_current_focus
 glirc_current_focus stab netP netL tgtP tgtL =
-  do mvar   <- derefToken stab
-     (_,st) <- readMVar mvar
+  do ref    <- derefToken stab
+     (_,st) <- readClient ref
      let (net,tgt) = case view clientFocus st of
                        Unfocused        -> (Text.empty, Text.empty)
                        NetworkFocus n   -> (n         , Text.empty)
@@ -642,7 +978,7 @@ type Glirc_set_focus =
 -- Set to chat window otherwise.
 glirc_set_focus :: Glirc_set_focus
 glirc_set_focus stab netP netL tgtP tgtL =
-  do mvar   <- derefToken stab
+  do ref    <- derefToken stab
      net    <- peekFgnStringLen (FgnStringLen netP netL)
      tgt    <- peekFgnStringLen (FgnStringLen tgtP tgtL)
 
@@ -651,7 +987,7 @@ glirc_set_focus stab netP netL tgtP tgtL =
            | Text.null tgt = NetworkFocus net
            | otherwise     = ChannelFocus net (mkId tgt)
 
-     modifyMVar_ mvar $ \(i,st) ->
+     modifyClient_ ref $ \(i,st) ->
        let st' = changeFocus focus st
        in st' `seq` return (i,st')
 
@@ -672,8 +1008,8 @@ type Glirc_is_channel =
 -- If the given network is not currently active this returns @0@.
 glirc_is_channel :: Glirc_is_channel
 glirc_is_channel stab net netL tgt tgtL =
-  do mvar    <- derefToken stab
-     (_,st)  <- readMVar mvar
+  do ref     <- derefToken stab
+     (_,st)  <- readClient ref
      network <- peekFgnStringLen (FgnStringLen net netL)
      target  <- peekFgnStringLen (FgnStringLen tgt tgtL)
 
@@ -698,8 +1034,8 @@ type Glirc_is_logged_on =
 -- If the given network is not currently active this returns @0@.
 glirc_is_logged_on :: Glirc_is_logged_on
 glirc_is_logged_on stab net netL tgt tgtL =
-  do mvar    <- derefToken stab
-     (_,st)  <- readMVar mvar
+  do ref     <- derefToken stab
+     (_,st)  <- readClient ref
      network <- peekFgnStringLen (FgnStringLen net netL)
      target  <- peekFgnStringLen (FgnStringLen tgt tgtL)
 
@@ -722,8 +1058,8 @@ type Glirc_resolve_path =
 -- Free the allocated string with @glirc_free_string@.
 glirc_resolve_path :: Glirc_resolve_path
 glirc_resolve_path stab pathP pathL =
-  do mvar    <- derefToken stab
-     (_,st)  <- readMVar mvar
+  do ref     <- derefToken stab
+     (_,st)  <- readClient ref
      path    <- peekFgnStringLen (FgnStringLen pathP pathL)
 
      let cfgPath = view clientConfigPath st
@@ -744,15 +1080,63 @@ type Glirc_set_timer =
 -- of delay. The returned timer ID can be used to cancel the timer.
 glirc_set_timer :: Glirc_set_timer
 glirc_set_timer stab millis fun ptr =
-  do mvar    <- derefToken stab
+  do ref     <- derefToken stab
      time    <- addUTCTime (fromIntegral millis / 1000) <$> getCurrentTime
-     modifyMVar mvar $ \(i,st) ->
+     modifyClient ref $ \(i,st) ->
        let (timer,st') = st & clientExtensions . esActive . singular (ix i)
-                            %%~ pushTimer time fun ptr
+                            %%~ pushTimer time Nothing fun ptr
        in st' `seq` return ((i,st'), fromIntegral timer)
 
 ------------------------------------------------------------------------
 
+-- | Type of 'glirc_set_interval' extension entry-point
+type Glirc_set_interval =
+  Ptr ()               {- ^ api token           -} ->
+  CULong               {- ^ milliseconds period -} ->
+  FunPtr TimerCallback {- ^ function            -} ->
+  Ptr ()               {- ^ callback state      -} ->
+  IO TimerId           {- ^ timer ID, 0 on error -}
+
+-- | Register a function to be called every given number of milliseconds
+-- until the returned timer ID is cancelled. The timer keeps its ID and
+-- callback state across calls. A period of 0 is rejected.
+glirc_set_interval :: Glirc_set_interval
+glirc_set_interval _ 0 _ _ = return 0
+glirc_set_interval stab millis fun ptr =
+  do ref     <- derefToken stab
+     let period = fromIntegral millis / 1000
+     time    <- addUTCTime period <$> getCurrentTime
+     modifyClient ref $ \(i,st) ->
+       let (timer,st') = st & clientExtensions . esActive . singular (ix i)
+                            %%~ pushTimer time (Just period) fun ptr
+       in st' `seq` return ((i,st'), fromIntegral timer)
+
+------------------------------------------------------------------------
+
+-- | Type of 'glirc_reschedule_timer' extension entry-point
+type Glirc_reschedule_timer =
+  Ptr ()               {- ^ api token          -} ->
+  TimerId              {- ^ timer ID           -} ->
+  CULong               {- ^ milliseconds delay -} ->
+  IO CInt              {- ^ 0 on success       -}
+
+-- | Move the next activation of a timer to the given number of
+-- milliseconds from now, keeping its ID and callback state. Interval
+-- timers keep their period. Fails when no such timer is scheduled,
+-- which includes one-shot timers that have already fired.
+glirc_reschedule_timer :: Glirc_reschedule_timer
+glirc_reschedule_timer stab timerId millis =
+  do ref     <- derefToken stab
+     time    <- addUTCTime (fromIntegral millis / 1000) <$> getCurrentTime
+     modifyClient ref $ \(i,st) ->
+       let mb = st & clientExtensions . esActive . ix i
+                   %%~ rescheduleTimer (fromIntegral timerId) time
+       in return $! case mb of
+            Just st' -> ((i,st'), 0)
+            Nothing  -> ((i,st ), 1)
+
+------------------------------------------------------------------------
+
 -- | Type of 'glirc_cancel_timer' extension entry-point
 type Glirc_cancel_timer =
   Ptr ()               {- ^ api token                   -} ->
@@ -763,8 +1147,8 @@ type Glirc_cancel_timer =
 -- of delay. The returned timer ID can be used to cancel the timer.
 glirc_cancel_timer :: Glirc_cancel_timer
 glirc_cancel_timer stab timerId =
-  do mvar <- derefToken stab
-     modifyMVar mvar $ \(i,st) ->
+  do ref  <- derefToken stab
+     modifyClient ref $ \(i,st) ->
        let Compose mb = st & clientExtensions . esActive . ix i
                    %%~ \ae -> Compose $
                               do (entry, ae') <- cancelTimer (fromIntegral timerId) ae
@@ -792,42 +1176,285 @@ type Glirc_window_lines =
 -- @glirc_free_strings@.
 glirc_window_lines :: Glirc_window_lines
 glirc_window_lines stab net netL tgt tgtL filt =
-  do mvar <- derefToken stab
-     (_,st) <- readMVar mvar
+  do ref  <- derefToken stab
+     (_,st) <- readClient ref
+     network <- peekFgnStringLen (FgnStringLen net netL)
+     channel <- peekFgnStringLen (FgnStringLen tgt tgtL)
+     exportStrings (windowLineTexts network channel (filt /= 0) st)
+
+------------------------------------------------------------------------
+
+-- | Type of 'glirc_window_lines_packed' extension entry-point
+type Glirc_window_lines_packed =
+  Ptr ()  {- ^ api token       -} ->
+  CString {- ^ network name    -} ->
+  CSize   {- ^ network length  -} ->
+  CString {- ^ target name     -} ->
+  CSize   {- ^ target length   -} ->
+  CInt    {- ^ use filter      -} ->
+  IO (Ptr FgnStringList) {- ^ strings sharing one allocation -}
+
+-- | Like @glirc_window_lines@ but the strings are returned in a single
+-- allocation. @NULL@ returned on failure. The caller is responsible
+-- for freeing successful result with @glirc_free_string_list@.
+glirc_window_lines_packed :: Glirc_window_lines_packed
+glirc_window_lines_packed stab net netL tgt tgtL filt =
+  do ref  <- derefToken stab
+     (_,st) <- readClient ref
+     network <- peekFgnStringLen (FgnStringLen net netL)
+     channel <- peekFgnStringLen (FgnStringLen tgt tgtL)
+     exportStringList (windowLineTexts network channel (filt /= 0) st)
+
+-- | Text of the lines of a window, newest first, optionally limited
+-- to those matching the client's filter.
+windowLineTexts :: Text -> Text -> Bool -> ClientState -> [Text]
+windowLineTexts network channel filtered st =
+  map LText.toStrict (filterFun strs)
+  where
+    focus
+      | Text.null network = Unfocused
+      | Text.null channel = NetworkFocus network
+      | otherwise         = ChannelFocus network (mkId channel)
+    filterFun
+      | filtered  = clientFilter st id
+      | otherwise = id
+    strs = toListOf (clientWindows . ix focus . winMessages . each . wlText) st
+
+------------------------------------------------------------------------
+
+-- | Type of 'glirc_window_history' extension entry-point
+type Glirc_window_history =
+  Ptr ()  {- ^ api token                                -} ->
+  CString {- ^ network name                             -} ->
+  CSize   {- ^ network length                           -} ->
+  CString {- ^ target name                              -} ->
+  CSize   {- ^ target length                            -} ->
+  CInt    {- ^ use filter                               -} ->
+  CSize   {- ^ cursor from previous page, 0 for newest  -} ->
+  CSize   {- ^ maximum lines, 0 for no limit            -} ->
+  CLLong  {- ^ only lines before this time, 0 for all   -} ->
+  IO (Ptr FgnWindowPage) {- ^ page of window lines      -}
+
+-- | This extension entry-point returns a page of window lines for the
+-- requested window, newest first, with their timestamps. The page's
+-- cursor continues from the oldest line returned and is unaffected by
+-- lines added to or dropped from the window in between.
+-- Only the lines returned are marshaled, so small pages are cheap even
+-- on large windows.
+-- The caller is responsible for freeing the result with
+-- @glirc_free_window_page@.
+glirc_window_history :: Glirc_window_history
+glirc_window_history stab net netL tgt tgtL filt start limit before =
+  do ref  <- derefToken stab
+     (_,st) <- readClient ref
      network <- peekFgnStringLen (FgnStringLen net netL)
      channel <- peekFgnStringLen (FgnStringLen tgt tgtL)
      let focus
            | Text.null network = Unfocused
            | Text.null channel = NetworkFocus network
            | otherwise         = ChannelFocus network (mkId channel)
-         filterFun
-           | filt == 0 = id
-           | otherwise = clientFilter st id
-         strs = toListOf (clientWindows . ix focus . winMessages . each . wlText) st
-     ptrs <- traverse (newCString . LText.unpack) (filterFun strs)
-     newArray0 nullPtr ptrs
+     case preview (clientWindows . ix focus) st of
+       Nothing  -> exportWindowPage 0 []
+       Just win ->
+         do let numbered = windowHistory (fromIntegral start) win
+
+                lineTime :: WindowLine -> Int64
+                lineTime = floor . utcTimeToPOSIXSeconds . unpackUTCTime . view wlTimestamp
+
+                beforeFilter
+                  | before == 0 = id
+                  | otherwise   = filter (\(_,l) -> lineTime l < fromIntegral before)
+                filterFun
+                  | filt == 0 = id
+                  | otherwise = clientFilter st (view wlText . snd)
+                limitFun
+                  | limit == 0 = id
+                  | otherwise  = take (fromIntegral limit)
+
+                page = limitFun (filterFun (beforeFilter numbered))
+                cursor = case page of
+                           [] -> 0
+                           _  -> fst (last page)
+
+            exportWindowPage (fromIntegral cursor)
+              [ (lineTime l, LText.toStrict (view wlText l)) | (_,l) <- page ]
+
+------------------------------------------------------------------------
+
+-- | Type of 'glirc_free_window_page' extension entry-point
+type Glirc_free_window_page =
+  Ptr FgnWindowPage {- ^ glirc allocated page -} ->
+  IO ()
+
+-- | Free a window page returned by @glirc_window_history@. If argument
+-- is @NULL@, nothing happens.
+glirc_free_window_page :: Glirc_free_window_page
+glirc_free_window_page = free
 
 ------------------------------------------------------------------------
 
 -- | Type of 'glirc_thread' extension entry-point
 type Glirc_thread =
   Ptr ()  {- ^ api token -} ->
-  FunPtr (Ptr () -> IO (Ptr ())) {- ^ start -} ->
-  FunPtr (Ptr () -> IO ()) {- ^ finish -} ->
+  FunPtr ThreadStart  {- ^ start -} ->
+  FunPtr ThreadFinish {- ^ finish -} ->
   Ptr () {- ^ start argument  -} ->
-  IO ()  {- ^ null terminated array of null terminated strings -}
+  IO ()
 
--- | This extension entry-point allocates a list of all the window lines for
--- the requested window. The lines are presented with newest line at the head
--- of the list.
--- The caller is responsible for freeing successful result with
--- @glirc_free_strings@.
+-- | Run the start function on one of the client's worker threads and
+-- pass its result to the finish function on the main thread. Unlike
+-- @glirc_submit_job@ the job is accepted even when the extension's
+-- queue is full.
 glirc_thread :: Glirc_thread
 glirc_thread stab start finish arg =
-  do mvar <- derefToken stab
-     modifyMVar_ mvar $ \(i,st) ->
-       do _ <- forkOS $
-            do result <- runThreadStart start arg
-               atomically (writeTQueue (view clientThreadJoins st) (i, ThreadEntry finish result))
-          let incThreads ae = ae { aeThreads = aeThreads ae + 1}
-          pure (i, over (clientExtensions . esActive . ix i) incThreads st)
+  do _ <- submitExtensionJob False stab start finish arg
+     return ()
+
+------------------------------------------------------------------------
+
+-- | Type of 'glirc_submit_job' extension entry-point
+type Glirc_submit_job =
+  Ptr ()  {- ^ api token -} ->
+  FunPtr ThreadStart  {- ^ start -} ->
+  FunPtr ThreadFinish {- ^ finish -} ->
+  Ptr () {- ^ start argument  -} ->
+  IO CLong {- ^ job ID, 0 when the queue is full -}
+
+-- | Queue the start function to run on one of the client's worker
+-- threads and pass its result to the finish function on the main
+-- thread. When the extension already has as many jobs waiting as its
+-- @queue-limit@ allows, the job is rejected and 0 is returned. The
+-- returned job ID can be used to cancel the job before it starts.
+-- Jobs that haven't started when the extension stops are cancelled.
+glirc_submit_job :: Glirc_submit_job
+glirc_submit_job = submitExtensionJob True
+
+-- | Start a job on a thread of its own rather than on one of the
+-- worker threads, for jobs that wait for a long time, and pass its
+-- result to the finish function on the main thread. The job runs at
+-- once, so it can't be cancelled, and it isn't limited by the
+-- extension's @queue-limit@ or @job-limit@.
+glirc_submit_long_job :: Glirc_submit_job
+glirc_submit_long_job stab start finish arg =
+  addExtensionJob stab start finish arg $ \_ run ae ->
+    Just <$> startLongJob run arg ae
+
+-- | Queue a job for the calling extension on the worker pool.
+submitExtensionJob ::
+  Bool {- ^ enforce queue limit -} ->
+  Glirc_submit_job
+submitExtensionJob limited stab start finish arg =
+  addExtensionJob stab start finish arg $ \st run ae ->
+    submitJob (view (clientExtensions . esWorkers) st) limited run arg ae
+
+-- | Add a job for the calling extension that reports its result to
+-- the main thread, using the given way of starting it.
+addExtensionJob ::
+  Ptr ()              {- ^ api token -} ->
+  FunPtr ThreadStart  {- ^ start     -} ->
+  FunPtr ThreadFinish {- ^ finish    -} ->
+  Ptr ()              {- ^ start argument -} ->
+  (ClientState -> (Int -> IO ()) -> ActiveExtension -> IO (Maybe (Int, ActiveExtension))) ->
+  IO CLong {- ^ job ID, 0 when the job wasn't started -}
+addExtensionJob stab start finish arg startJob =
+  do ref  <- derefToken stab
+     modifyClient ref $ \(i,st) ->
+       do let joins = view clientThreadJoins st
+              run jobId =
+                do t0     <- getMonotonicTime
+                   result <- runThreadStart start arg
+                   t1     <- getMonotonicTime
+                   atomically (writeTQueue joins (i, ThreadEntry jobId (t1 - t0) finish result))
+          res <- case preview (clientExtensions . esActive . ix i) st of
+                   Nothing -> return Nothing
+                   Just ae -> startJob st run ae
+          return $! case res of
+            Nothing        -> ((i, st), 0)
+            Just (jid, ae) -> ((i, set (clientExtensions . esActive . ix i) ae st), fromIntegral jid)
+
+------------------------------------------------------------------------
+
+-- | Type of 'glirc_cancel_job' extension entry-point
+type Glirc_cancel_job =
+  Ptr ()      {- ^ api token                 -} ->
+  CLong       {- ^ job ID                    -} ->
+  IO (Ptr ()) {- ^ returns job start argument -}
+
+-- | Cancel a job that is still waiting for a worker thread. Neither
+-- of its callbacks will be called and its start argument is returned.
+-- @NULL@ is returned when the job has already started.
+glirc_cancel_job :: Glirc_cancel_job
+glirc_cancel_job stab jid =
+  do ref  <- derefToken stab
+     modifyClient ref $ \(i,st) ->
+       do res <- traverse (cancelJob (fromIntegral jid))
+                          (preview (clientExtensions . esActive . ix i) st)
+          return $! case res of
+            Just (Just (ptr, ae)) -> ((i, set (clientExtensions . esActive . ix i) ae st), ptr)
+            _                     -> ((i, st), nullPtr)
+
+------------------------------------------------------------------------
+
+-- | Type of 'glirc_job_stats' extension entry-point
+type Glirc_job_stats =
+  Ptr ()          {- ^ api token          -} ->
+  Ptr FgnJobStats {- ^ statistics output  -} ->
+  IO ()
+
+-- | Report the number of the calling extension's jobs that are waiting
+-- and running along with the average running time of finished jobs.
+glirc_job_stats :: Glirc_job_stats
+glirc_job_stats stab out =
+  do ref  <- derefToken stab
+     (i,st) <- readClient ref
+     for_ (preview (clientExtensions . esActive . ix i) st) $ \ae ->
+       poke' out =<< jobStats ae
+
+------------------------------------------------------------------------
+
+-- | Type of 'glirc_subscribe' extension entry-point
+type Glirc_subscribe =
+  Ptr ()           {- ^ api token                     -} ->
+  Ptr FgnStringLen {- ^ commands, null for all        -} ->
+  CSize            {- ^ commands count                -} ->
+  IO CInt          {- ^ 0 on success                  -}
+
+-- | Replace the set of commands that are passed to the calling
+-- extension's process_message callback. A null array subscribes the
+-- extension to every command again.
+glirc_subscribe :: Glirc_subscribe
+glirc_subscribe stab cmdsPtr cmdsLen =
+  do ref  <- derefToken stab
+     subs <- if cmdsPtr == nullPtr
+               then return Nothing
+               else do cmds <- traverse peekFgnStringLen
+                           =<< peekArray (fromIntegral cmdsLen) cmdsPtr
+                       return $! Just $! HashSet.fromList (map Text.toUpper cmds)
+     modifyClient_ ref $ \(i,st) ->
+       let setSubs ae = ae { aeSubscriptions = subs }
+       in pure (i, over (clientExtensions . esActive . ix i) setSubs st)
+     return 0
+
+------------------------------------------------------------------------
+
+-- | Type of 'glirc_batch_messages' extension entry-point
+type Glirc_batch_messages =
+  Ptr ()           {- ^ api token                     -} ->
+  CInt             {- ^ non-zero to accept batches    -} ->
+  IO CInt          {- ^ 0 on success                  -}
+
+-- | Turn the calling extension's process_messages callback off or back
+-- on. Incoming messages are passed to process_message one at a time
+-- while it is off. Fails when turning on batches for an extension
+-- without a process_messages callback.
+glirc_batch_messages :: Glirc_batch_messages
+glirc_batch_messages stab enable =
+  do ref <- derefToken stab
+     modifyClient ref $ \(i,st) ->
+       let update ae
+             | enable == 0                      = Just ae { aeBatch = nullFunPtr }
+             | aeBatchCallback ae /= nullFunPtr = Just ae { aeBatch = aeBatchCallback ae }
+             | otherwise                        = Nothing
+       in pure $ case update =<< preview (clientExtensions . esActive . ix i) st of
+            Just ae -> ((i, set (clientExtensions . esActive . ix i) ae st), 0)
+            Nothing -> ((i, st), 1)
@@ -0,0 +1,140 @@
+{-|
+Module      : Client.CApi.Stats
+Description : Timing statistics for extension callbacks
+Copyright   : (c) Eric Mertens, 2018
+License     : ISC
+Maintainer  : emertens@gmail.com
+
+Counters and latency histograms recorded for each kind of callback
+made into an extension. Latencies are counted in buckets of powers of
+two microseconds, which is precise enough to tell a quick callback
+from a slow one without storing individual samples.
+
+-}
+
+module Client.CApi.Stats
+  ( -- * Callbacks
+    Callback(..)
+  , callbackName
+
+  -- * Statistics
+  , CallbackStats
+  , csCalls
+  , csDrops
+  , csTotal
+  , csMax
+  , ExtensionStats
+  , emptyExtensionStats
+  , recordCallback
+  , mergeExtensionStats
+  , callbackPercentile
+  ) where
+
+import           Data.IntMap.Strict (IntMap)
+import qualified Data.IntMap.Strict as IntMap
+import           Data.Map.Strict (Map)
+import qualified Data.Map.Strict as Map
+import           Data.Text (Text)
+import qualified Data.Text as Text
+
+-- | Kinds of calls made into an extension
+data Callback
+  = CallbackMessage -- ^ process_message and process_messages
+  | CallbackChat    -- ^ process_chat
+  | CallbackCommand -- ^ process_command
+  | CallbackTimer   -- ^ timer callbacks
+  | CallbackFinish  -- ^ job finish callbacks
+  deriving (Eq, Ord, Show, Enum, Bounded)
+
+-- | Name used for a callback in reports
+callbackName :: Callback -> Text
+callbackName c = Text.pack $
+  case c of
+    CallbackMessage -> "message"
+    CallbackChat    -> "chat"
+    CallbackCommand -> "command"
+    CallbackTimer   -> "timer"
+    CallbackFinish  -> "finish"
+
+-- | Statistics for one kind of callback
+data CallbackStats = CallbackStats
+  { csCalls   :: !Int          -- ^ number of calls
+  , csDrops   :: !Int          -- ^ messages dropped by the calls
+  , csTotal   :: !Double       -- ^ seconds spent in the calls
+  , csMax     :: !Double       -- ^ longest call in seconds
+  , csBuckets :: !(IntMap Int) -- ^ calls by latency bucket
+  }
+  deriving Show
+
+-- | Statistics for each kind of callback made into an extension
+type ExtensionStats = Map Callback CallbackStats
+
+-- | Statistics for an extension that hasn't been called
+emptyExtensionStats :: ExtensionStats
+emptyExtensionStats = Map.empty
+
+-- | Bucket @n@ counts the calls that took less than @2^n@ microseconds
+-- and at least half that.
+latencyBucket :: Double {- ^ seconds -} -> Int
+latencyBucket secs = go 0 1
+  where
+    micros = secs * 1e6
+    go n limit
+      | micros < limit || n >= 30 = n
+      | otherwise                 = go (n+1 :: Int) (limit * 2)
+
+-- | Upper bound of a latency bucket in seconds
+bucketLimit :: Int -> Double
+bucketLimit n = 2 ^^ n / 1e6
+
+-- | Add a call with its latency and drop count to the statistics.
+recordCallback ::
+  Callback       {- ^ kind of call       -} ->
+  Double         {- ^ latency in seconds -} ->
+  Int            {- ^ messages dropped   -} ->
+  ExtensionStats {- ^ statistics         -} ->
+  ExtensionStats
+recordCallback c secs drops = Map.alter (Just . add) c
+  where
+    bucket = latencyBucket secs
+
+    add Nothing   = CallbackStats
+      { csCalls   = 1
+      , csDrops   = drops
+      , csTotal   = secs
+      , csMax     = secs
+      , csBuckets = IntMap.singleton bucket 1
+      }
+    add (Just cs) = cs
+      { csCalls   = csCalls cs + 1
+      , csDrops   = csDrops cs + drops
+      , csTotal   = csTotal cs + secs
+      , csMax     = max secs (csMax cs)
+      , csBuckets = IntMap.insertWith (+) bucket 1 (csBuckets cs)
+      }
+
+-- | Combine statistics recorded separately for the same extension.
+mergeExtensionStats :: ExtensionStats -> ExtensionStats -> ExtensionStats
+mergeExtensionStats = Map.unionWith merge
+  where
+    merge x y = CallbackStats
+      { csCalls   = csCalls x + csCalls y
+      , csDrops   = csDrops x + csDrops y
+      , csTotal   = csTotal x + csTotal y
+      , csMax     = max (csMax x) (csMax y)
+      , csBuckets = IntMap.unionWith (+) (csBuckets x) (csBuckets y)
+      }
+
+-- | Upper bound in seconds on the latency of the given fraction of
+-- calls, for example @0.99@ for the 99th percentile.
+callbackPercentile :: Double -> CallbackStats -> Double
+callbackPercentile p cs = go 0 (IntMap.toAscList (csBuckets cs))
+  where
+    target = p * fromIntegral (csCalls cs)
+
+    go _ [] = csMax cs
+    go seen ((n,k):rest)
+      | fromIntegral seen' >= target = min (csMax cs) (bucketLimit n)
+      | otherwise                    = go seen' rest
+      where
+        seen' = seen + k :: Int
@@ -279,9 +279,17 @@ commandsList =
   , Command
       (pure "rtsstats")
       (pure ())
-      "Show the GHC RTS statistics.\n"
+      "Show the GHC RTS statistics and the hit rate of the message render cache.\n"
     $ ClientCommand cmdRtsStats noClientTab
 
+  , Command
+      (pure "extstats")
+      (pure ())
+      "Show call counts and latencies of extension callbacks.\n\
+      \\n\
+      \Callbacks slower than \^Bextension-slow-callback\^B milliseconds are also reported in the client window.\n"
+    $ ClientCommand cmdExtStats noClientTab
+
   , Command
       (pure "exec")
       (remainingArg "arguments")
@@ -360,6 +368,10 @@ cmdRtsStats st _ =
        Just{}  -> commandSuccess $ set clientRtsStats mb
                                  $ changeSubfocus FocusRtsStats st
 
+-- | Implementation of @/extstats@ command. Set subfocus to ExtStats.
+cmdExtStats :: ClientCommand ()
+cmdExtStats st _ = commandSuccess (changeSubfocus FocusExtStats st)
+
 -- | Implementation of @/help@ command. Set subfocus to Help.
 cmdHelp :: ClientCommand (Maybe String)
 cmdHelp st mb = commandSuccess (changeSubfocus focus st)
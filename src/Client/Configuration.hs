@@ -46,10 +46,18 @@ module Client.Configuration
   , configShowPing
   , configJumpModifier
   , configDigraphs
+  , configExtensionWorkers
+  , configExtensionSlowCallback
+  , configTlsSessionFile
+  , configWindowLineLimit
 
   , extensionPath
   , extensionRtldFlags
   , extensionArgs
+  , extensionQueueLimit
+  , extensionJobLimit
+  , extensionDispatch
+  , extensionDispatchQueue
 
   -- * Loading configuration
   , loadConfiguration
@@ -74,6 +82,7 @@ import           Client.Commands.Interpolation
 import           Client.Commands.Recognizer
 import           Client.Configuration.Colors
 import           Client.Configuration.Macros (macroMapSpec)
+import           Client.Configuration.Numbers
 import           Client.Configuration.ServerSettings
 import           Client.EventLoop.Actions
 import           Client.Image.Palette
@@ -125,6 +134,10 @@ data Configuration = Configuration
   , _configShowPing        :: Bool -- ^ visibility of ping time
   , _configJumpModifier    :: [Modifier] -- ^ Modifier used for jumping windows
   , _configDigraphs        :: Map Digraph Text -- ^ Extra digraphs
+  , _configExtensionWorkers :: Int -- ^ threads available to run extension jobs
+  , _configExtensionSlowCallback :: Int -- ^ milliseconds before an extension callback is reported, 0 disables
+  , _configTlsSessionFile  :: Maybe FilePath -- ^ file used to save TLS sessions across restarts
+  , _configWindowLineLimit :: Int -- ^ messages kept in each window, 0 for no limit
   }
   deriving Show
 
@@ -139,7 +152,7 @@ data PaddingMode
   = LeftPadding  !Int -- ^ Whitespace add to the left side of chat prefix
   | RightPadding !Int -- ^ Whitespace add to the right side of chat prefix
   | NoPadding         -- ^ No whitespace added
-  deriving (Show)
+  deriving (Eq, Show)
 
 data LayoutMode
   -- | Vertically stack all windows in a single column
@@ -175,6 +188,10 @@ data ExtensionConfiguration = ExtensionConfiguration
   { _extensionPath      :: FilePath -- ^ path to shared object
   , _extensionRtldFlags :: [RTLDFlags] -- ^ dynamic linker flags
   , _extensionArgs      :: [Text] -- ^ arguments to the extension on startup
+  , _extensionQueueLimit :: Int -- ^ jobs allowed to wait for a worker
+  , _extensionJobLimit  :: Maybe Int -- ^ jobs allowed to run at once, default leaves a worker for other extensions
+  , _extensionDispatch  :: Maybe Bool -- ^ run callbacks on a dispatcher thread, default from the extension
+  , _extensionDispatchQueue :: Int -- ^ callbacks allowed to wait for the dispatcher thread
   }
   deriving Show
 
@@ -247,6 +264,7 @@ resolvePaths ctx =
                              . over (ssSaslMechanism . mapped . _SaslEcdsa . _3) res
                              . over (ssLogDir        . mapped) res
   in over (configExtensions . mapped . extensionPath) res
+   . over (configTlsSessionFile . mapped) res
    . over (configServers    . mapped) resolveServerFilePaths
 
 configurationSpec ::
@@ -294,6 +312,14 @@ configurationSpec = sectionsSpec "config-file" $
                                "Initial setting for visibility of ping times"
      _configDigraphs        <- sec' mempty "extra-digraphs" (Map.fromList <$> listSpec digraphSpec)
                                "Extra digraphs"
+     _configExtensionWorkers <- sec' defaultExtensionWorkers "extension-workers" positiveSpec
+                               "Number of threads shared by extensions to run background jobs"
+     _configExtensionSlowCallback <- sec' defaultSlowCallback "extension-slow-callback" nonnegativeSpec
+                               "Milliseconds an extension callback can run before it is reported, 0 to never report"
+     _configTlsSessionFile  <- optSection' "tls-session-file" stringSpec
+                               "File used to save TLS sessions so reconnects after a restart can resume them"
+     _configWindowLineLimit <- sec' 0 "window-line-limit" nonnegativeSpec
+                               "Messages kept in each window, 0 for no limit"
      return (\def ->
              let _configDefaults = snd ssDefUpdate def
                  _configServers  = buildServerMap _configDefaults ssUpdates
@@ -388,11 +414,6 @@ keySpec = customSpec "emacs-key" stringSpec
                     Just x  -> Right x
 
 
-nonnegativeSpec :: (Ord a, Num a) => ValueSpec a
-nonnegativeSpec = customSpec "non-negative" numSpec
-                $ \x -> if x < 0 then Left "negative number"
-                                 else Right x
-
 
 paletteSpec :: ValueSpec Palette
 paletteSpec = sectionsSpec "palette" $
@@ -431,6 +452,22 @@ paletteSpec = sectionsSpec "palette" $
 extensionSpec :: ValueSpec ExtensionConfiguration
 extensionSpec = simpleExtensionSpec <!> fullExtensionSpec
 
+-- | Default number of threads used to run extension jobs
+defaultExtensionWorkers :: Int
+defaultExtensionWorkers = 4
+
+-- | Default number of callbacks waiting for an extension's dispatcher thread
+defaultDispatchQueue :: Int
+defaultDispatchQueue = 1024
+
+-- | Default milliseconds before a slow extension callback is reported
+defaultSlowCallback :: Int
+defaultSlowCallback = 250
+
+-- | Default number of jobs an extension can have waiting for a worker
+defaultQueueLimit :: Int
+defaultQueueLimit = 64
+
 -- | Default dynamic linker flags: @RTLD_LOCAL@ and @RTLD_NOW@
 defaultRtldFlags :: [RTLDFlags]
 defaultRtldFlags = [RTLD_LOCAL, RTLD_NOW]
@@ -443,6 +480,10 @@ simpleExtensionSpec =
      pure ExtensionConfiguration
        { _extensionRtldFlags = defaultRtldFlags
        , _extensionArgs      = []
+       , _extensionQueueLimit = defaultQueueLimit
+       , _extensionJobLimit  = Nothing
+       , _extensionDispatch  = Nothing
+       , _extensionDispatchQueue = defaultDispatchQueue
        , .. }
 
 -- | Full extension configuration allows the RTLD flags to be manually
@@ -458,6 +499,16 @@ fullExtensionSpec =
                             "Runtime dynamic linker flags"
      _extensionArgs      <- fromMaybe [] <$> optSection "args"
                             "Extension-specific configuration arguments"
+     _extensionQueueLimit <- fromMaybe defaultQueueLimit <$>
+                            optSection' "queue-limit" nonnegativeSpec
+                            "Maximum number of jobs waiting for a worker thread"
+     _extensionJobLimit  <- optSection' "job-limit" positiveSpec
+                            "Maximum number of jobs running at once, by default one less than extension-workers"
+     _extensionDispatch  <- optSection' "dispatch-thread" yesOrNoSpec
+                            "Run the extension on its own thread, observing messages without delaying them"
+     _extensionDispatchQueue <- fromMaybe defaultDispatchQueue <$>
+                            optSection' "dispatch-queue" positiveSpec
+                            "Maximum number of messages waiting for the dispatcher thread"
      pure ExtensionConfiguration {..}
 
 rtldFlagSpec :: ValueSpec RTLDFlags
@@ -0,0 +1,26 @@
+{-|
+Module      : Client.Configuration.Numbers
+Description : Configuration schema for bounded numbers
+Copyright   : (c) Eric Mertens, 2016
+License     : ISC
+Maintainer  : emertens@gmail.com
+
+Number specifications shared by the configuration sections.
+-}
+
+module Client.Configuration.Numbers
+  ( positiveSpec
+  , nonnegativeSpec
+  ) where
+
+import           Config.Schema.Spec
+
+positiveSpec :: (Ord a, Num a) => ValueSpec a
+positiveSpec = customSpec "positive" numSpec
+             $ \x -> if x <= 0 then Left "non-positive number"
+                              else Right x
+
+nonnegativeSpec :: (Ord a, Num a) => ValueSpec a
+nonnegativeSpec = customSpec "non-negative" numSpec
+                $ \x -> if x < 0 then Left "negative number"
+                                 else Right x
@@ -89,6 +89,7 @@ import           Client.Authentication.Scram (ScramDigest(..))
 import           Client.Commands.Interpolation
 import           Client.Commands.WordCompletion
 import           Client.Configuration.Macros (macroCommandSpec)
+import           Client.Configuration.Numbers (nonnegativeSpec)
 import           Client.State.Focus ( Focus (NetworkFocus, ChannelFocus) )
 import           Config.Schema.Spec
 import           Control.Exception (Exception, displayException, throwIO, try)
@@ -175,7 +176,8 @@ data WindowHint = WindowHint {
   windowHintName     :: Maybe Char,
   windowHintHideMeta :: Maybe Bool,
   windowHintSilent   :: Maybe Bool,
-  windowHintHidden   :: Maybe Bool
+  windowHintHidden   :: Maybe Bool,
+  windowHintLineLimit :: Maybe Int
 } deriving Show
 
 -- | Regular expression matched with original source to help with debugging.
@@ -385,6 +387,7 @@ windowHintsSpec = Map.fromList <$> listSpec entrySpec
            windowHintHidden   <- optSection' "hidden"    yesOrNoSpec "hide from statusbar"
            windowHintHideMeta <- optSection' "hide-meta" yesOrNoSpec "hide metadata by default"
            windowHintSilent   <- optSection' "silent"    yesOrNoSpec "hide activity counters"
+           windowHintLineLimit <- optSection' "line-limit" nonnegativeSpec "messages kept, 0 for no limit"
            pure (focus, WindowHint{..})
 
     focusSpec =
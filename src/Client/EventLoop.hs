@@ -17,7 +17,7 @@ module Client.EventLoop
   , ClientEvent(..)
   ) where
 
-import           Client.CApi (ThreadEntry, popTimer)
+import           Client.CApi (RemoteCall, ThreadEntry, popTimer)
 import           Client.Commands
 import           Client.Configuration (configJumpModifier, configKeyMap, configWindowNames, configDigraphs)
 import           Client.Configuration.ServerSettings
@@ -62,16 +62,17 @@ import           Irc.Message
 import           Irc.Codes
 import           Irc.RawIrcMsg
 import           LensUtils
-import           Hookup (ConnectionFailure(..))
+import           Hookup (ConnectionFailure(..), flushTlsSessionFile)
 
 
--- | Sum of the five possible event types the event loop handles
+-- | Sum of the six possible event types the event loop handles
 data ClientEvent
   = VtyEvent InternalEvent -- ^ Key presses and resizing
   | NetworkEvents (NonEmpty (Text, NetworkEvent)) -- ^ Incoming network events
   | TimerEvent Text TimedAction      -- ^ Timed action and the applicable network
   | ExtTimerEvent Int                     -- ^ extension ID
   | ThreadEvent Int ThreadEntry
+  | RemoteEvent [RemoteCall ClientState] -- ^ API calls from extension dispatcher threads
 
 
 -- | Block waiting for the next 'ClientEvent'. This function will compute
@@ -82,7 +83,7 @@ getEvent ::
   IO ClientEvent
 getEvent vty st =
   do timer <- prepareTimer
-     atomically (asum [timer, vtyEvent, networkEvents, threadJoin])
+     atomically (asum [timer, vtyEvent, networkEvents, threadJoin, remoteCalls])
   where
     vtyEvent = VtyEvent <$> readTChan (_eventChannel (inputIface vty))
 
@@ -109,6 +110,18 @@ getEvent vty st =
       do (i,r) <- readTQueue (view clientThreadJoins st)
          pure (ThreadEvent i r)
 
+    remoteCalls =
+      do let q = view (clientExtensions . esRemoteCalls) st
+         call  <- readTQueue q
+         calls <- drain q
+         pure (RemoteEvent (call : calls))
+
+    drain q =
+      do mb <- tryReadTQueue q
+         case mb of
+           Nothing -> pure []
+           Just x  -> (x :) <$> drain q
+
 -- | Compute the earliest scheduled timed action for the client
 earliestEvent :: ClientState -> Maybe (UTCTime, ClientEvent)
 earliestEvent st = earliest2 networkEvent extensionEvent
@@ -148,6 +161,8 @@ eventLoop vty st =
          eventLoop vty =<< clientExtTimer i st'
        ThreadEvent i result ->
          eventLoop vty =<< clientThreadJoin i result st'
+       RemoteEvent calls ->
+         eventLoop vty =<< clientRemoteCalls calls st'
        TimerEvent networkId action ->
          eventLoop vty =<< doTimerEvent networkId action st'
        VtyEvent (InputEvent vtyEvent) ->
@@ -155,16 +170,42 @@ eventLoop vty st =
        VtyEvent ResumeAfterSignal ->
          eventLoop vty =<< updateTerminalSize vty st
        NetworkEvents networkEvents ->
-         eventLoop vty =<< foldM doNetworkEvent st' networkEvents
+         eventLoop vty =<< doNetworkEvents st' (toList networkEvents)
+
+-- | Apply a list of network events to the client state. Consecutive
+-- lines from the same network are handled together so that extensions
+-- can process them as a batch.
+doNetworkEvents :: ClientState -> [(Text, NetworkEvent)] -> IO ClientState
+doNetworkEvents st events =
+  case events of
+    [] -> return st
+    (net, NetworkLines time lns) : events' ->
+      do let (more, rest) = spanLines net events'
+         st' <- doNetworkLines net (map ((,) time) lns ++ more) st
+         doNetworkEvents st' rest
+    event : events' ->
+      do st' <- doNetworkEvent st event
+         doNetworkEvents st' events'
+
+-- | Split off the lines at the front of a list of events that belong to
+-- the given network.
+spanLines ::
+  Text ->
+  [(Text, NetworkEvent)] ->
+  ([(ZonedTime, ByteString)], [(Text, NetworkEvent)])
+spanLines net ((net', NetworkLines time lns) : events)
+  | net == net' = let (more, rest) = spanLines net events
+                  in (map ((,) time) lns ++ more, rest)
+spanLines _ events = ([], events)
 
 -- | Apply a single network event to the client state.
 doNetworkEvent :: ClientState -> (Text, NetworkEvent) -> IO ClientState
 doNetworkEvent st (net, networkEvent) =
   case networkEvent of
-    NetworkLine  time line -> doNetworkLine  net time line st
+    NetworkLines time lns  -> doNetworkLines net (map ((,) time) lns) st
     NetworkError time ex   -> doNetworkError net time ex st
     NetworkOpen  time      -> doNetworkOpen  net time st
-    NetworkTLS   txts      -> doNetworkTLS   net txts st
+    NetworkTLS   res  txts -> doNetworkTLS   net res txts st
     NetworkClose time      -> doNetworkClose net time st
 
 -- | Sound the terminal bell assuming that the @BEL@ control code
@@ -198,11 +239,19 @@ doNetworkOpen networkId time st =
 -- | Update the TLS certificates for a connection
 doNetworkTLS ::
   Text   {- ^ network name      -} ->
+  Bool   {- ^ session resumed   -} ->
   [Text] {- ^ certificate lines -} ->
   ClientState ->
   IO ClientState
-doNetworkTLS network cert st =
-  pure $! over (clientConnections . ix network) upd st
+doNetworkTLS network resumed cert st =
+  do now <- getZonedTime
+     let msg = ClientMessage
+                 { _msgTime    = now
+                 , _msgNetwork = network
+                 , _msgBody    = NormalBody "TLS session resumed"
+                 }
+         st1 = over (clientConnections . ix network) upd st
+     pure $! if resumed then recordNetworkMessage msg st1 else st1
   where
     upd = set csCertificate cert
         . set (csPingStatus . _PingConnecting . _3) NoRestriction
@@ -270,37 +319,79 @@ reconnectLogicOnFailure ex cs st
           | otherwise                                                 -> False
 
 
--- | Respond to an IRC protocol line. This will parse the message, updated the
--- relevant connection state and update the UI buffers.
+-- | Respond to a run of IRC protocol lines from one network. The lines
+-- are parsed and offered to batching extensions together, then each
+-- line is handled in order by 'doNetworkLine'.
+doNetworkLines ::
+  Text                      {- ^ Network name                      -} ->
+  [(ZonedTime, ByteString)] {- ^ Raw IRC messages without newlines -} ->
+  ClientState               {- ^ client state                      -} ->
+  IO ClientState
+doNetworkLines networkId rawLines st =
+  case view (clientConnections . at networkId) st of
+    Nothing -> error "doNetworkLines: Network missing"
+    Just cs ->
+      do let parsed = [ (time, line, parseRawIrcLine line) | (time, line) <- rawLines ]
+             raws   = [ raw | (_, _, Just raw) <- parsed ]
+
+             -- lines before the connection is established are handled
+             -- by the client alone
+             restricted =
+               case view csPingStatus cs of
+                 PingConnecting _ _ NoRestriction -> False
+                 PingConnecting{}                 -> True
+                 _                                -> False
+
+         (st1, allowed) <-
+           if restricted
+             then return (st, map (const True) raws)
+             else clientBatchExtensions (view csNetwork cs) raws st
+
+         let step (allowed', st2) (time, line, mbRaw) =
+               case (mbRaw, allowed') of
+                 (Just _, a:as) -> (,) as       <$> doNetworkLine networkId time line mbRaw a    st2
+                 _              -> (,) allowed' <$> doNetworkLine networkId time line mbRaw True st2
+
+         snd <$> foldM step (allowed, st1) parsed
+
+-- | Respond to an IRC protocol line. This will update the relevant
+-- connection state and update the UI buffers.
 doNetworkLine ::
-  Text        {- ^ Network name                     -} ->
-  ZonedTime   {- ^ current time                     -} ->
-  ByteString  {- ^ Raw IRC message without newlines -} ->
-  ClientState {- ^ client state                     -} ->
+  Text             {- ^ Network name                     -} ->
+  ZonedTime        {- ^ current time                     -} ->
+  ByteString       {- ^ Raw IRC message without newlines -} ->
+  Maybe RawIrcLine {- ^ parsed message                   -} ->
+  Bool             {- ^ allowed by batching extensions   -} ->
+  ClientState      {- ^ client state                     -} ->
   IO ClientState
-doNetworkLine networkId time line st =
+doNetworkLine networkId time line parsed allowed st =
   case view (clientConnections . at networkId) st of
     Nothing -> error "doNetworkLine: Network missing"
     Just cs ->
       let network = view csNetwork cs in
-      case parseRawIrcMsg (asUtf8 line) of
+      case parsed of
         _ | PingConnecting _ _ WaitTLSRestriction <- view csPingStatus cs ->
           st <$ abortConnection StartTLSFailed (view csSocket cs)
 
-        Just raw
+        Just rawLine
           | PingConnecting _ _ StartTLSRestriction <- view csPingStatus cs ->
-          startTLSLine networkId cs st raw
+          startTLSLine networkId cs st (decodeRawIrcLine rawLine)
 
         Nothing ->
           do let msg = Text.pack ("Malformed message: " ++ show line)
              return $! recordError time network msg st
 
-        Just raw ->
-          do (st1,passed) <- clientNotifyExtensions network raw st
+        Just _ | not allowed -> return st
+
+        Just rawLine ->
+          do (st1,passed) <- clientNotifyExtensions network rawLine st
 
              if not passed then return st1 else do
 
-             let time' = computeEffectiveTime time (view msgTags raw)
+             -- decoded in full so that recorded messages don't keep
+             -- the received chunk alive
+             let raw   = decodeRawIrcLine rawLine
+                 time' = computeEffectiveTime time (view msgTags raw)
 
                  (stateHook, viewHook)
                       = over both applyMessageHooks
@@ -510,7 +601,9 @@ doCommandResult clearOnSuccess res =
 
 -- | Actions to be run when exiting the client.
 clientShutdown :: ClientState -> IO ()
-clientShutdown st = () <$ clientStopExtensions st
+clientShutdown st =
+  do _ <- clientStopExtensions st
+     flushTlsSessionFile
  -- other shutdown stuff might be added here later
 
 
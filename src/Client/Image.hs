@@ -13,13 +13,15 @@ module Client.Image (clientPicture) where
 
 import           Client.Image.Layout
 import           Client.State
+import           Client.State.RenderCache
 import           Control.Lens
 import           Graphics.Vty            (Background (..), Cursor (..),
                                           Picture (..))
 import           Graphics.Vty.Image
 
 -- | Generate a 'Picture' for the current client state. The resulting
--- client state is updated for render specific information like scrolling.
+-- client state is updated for render specific information like scrolling
+-- and the lines kept in the render cache.
 clientPicture :: ClientState -> (Picture, ClientState)
 clientPicture st = (pic, st')
     where
@@ -36,8 +38,9 @@ clientImage ::
   (Int, Int, Image, ClientState) {- ^ cursor row, cursor col, image, updated state -}
 clientImage st = (row, col, img, st')
   where
-    -- update client state for scroll clamp
+    -- update client state for scroll clamp and render cache
     !st' = set clientTextBoxOffset nextOffset
-         $ over clientScroll (max 0 . subtract overscroll) st
+         $ over clientScroll (max 0 . subtract overscroll)
+         $ over clientRenderCache (updateRenderCache (clientRenderKey st) drawn) st
 
-    (overscroll, row, col, nextOffset, img) = drawLayout st
+    (overscroll, row, col, nextOffset, img, drawn) = drawLayout st
@@ -11,6 +11,7 @@ module Client.Image.Layout (scrollAmount, drawLayout) where
 import Control.Lens
 import Client.State
 import Client.State.Focus
+import Client.State.RenderCache (DrawnLine)
 import Client.Configuration (LayoutMode(..))
 import Client.Image.PackedImage (Image', unpackImage)
 import Client.Image.StatusLine (statusLineImage, minorStatusLineImage)
@@ -21,10 +22,14 @@ import Client.View
 import Graphics.Vty.Image
 import Graphics.Vty.Attributes (defAttr)
 
+-- | Lines drawn with the render cache for each window: focus, width,
+-- rows to fill and the lines newest first
+type DrawnWindows = [(Focus, Int, Int, [DrawnLine])]
+
 -- | Compute the combined image for all the visible message windows.
 drawLayout ::
   ClientState            {- ^ client state                                     -} ->
-  (Int, Int, Int, Int, Image) {- ^ overscroll, cursor row, cursor col, next offset, final image -}
+  (Int, Int, Int, Int, Image, DrawnWindows) {- ^ overscroll, cursor row, cursor col, next offset, final image, drawn lines -}
 drawLayout st =
   case view clientLayout st of
     TwoColumn | not (null extrafocus) -> drawLayoutTwo st extrafocus
@@ -36,21 +41,24 @@ drawLayout st =
 drawLayoutOne ::
   ClientState            {- ^ client state                 -} ->
   [(Focus, Subfocus)]    {- ^ extra windows                -} ->
-  (Int, Int, Int, Int, Image) {- ^ overscroll and final image   -}
+  (Int, Int, Int, Int, Image, DrawnWindows) {- ^ overscroll and final image   -}
 drawLayoutOne st extrafocus =
-  (overscroll, row, col, nextOffset, output)
+  (overscroll, row, col, nextOffset, output, mainDrawn ++ extraDrawn)
   where
     w      = view clientWidth st
     h:hs   = splitHeights (rows - saveRows) (length extraLines)
     scroll = view clientScroll st
 
-    (overscroll, row, col, nextOffset, main) =
+    (overscroll, row, col, nextOffset, main, mainDrawn) =
         drawMain w (saveRows + h) scroll st
 
     output = vertCat $ reverse
            $ main
            : [ drawExtra st w h' foc subfoc imgs
-                 | (h', (foc, subfoc, imgs)) <- zip hs extraLines]
+                 | (h', (foc, subfoc, (imgs, _))) <- zip hs extraLines]
+
+    extraDrawn = [ (foc, w, h', drawn)
+                 | (h', (foc, _, (_, drawn))) <- zip hs extraLines]
 
     rows = view clientHeight st
 
@@ -64,9 +72,9 @@ drawLayoutOne st extrafocus =
 drawLayoutTwo ::
   ClientState            {- ^ client state                                -} ->
   [(Focus, Subfocus)]    {- ^ extra windows                               -} ->
-  (Int, Int, Int, Int, Image) {- ^ overscroll, cursor row, cursor col, offset, final image -}
+  (Int, Int, Int, Int, Image, DrawnWindows) {- ^ overscroll, cursor row, cursor col, offset, final image, drawn lines -}
 drawLayoutTwo st extrafocus =
-  (overscroll, row, col, nextOffset, output)
+  (overscroll, row, col, nextOffset, output, mainDrawn ++ extraDrawn)
   where
     [wl,wr] = divisions (view clientWidth st - 1) 2
     hs      = divisions (rows - length extraLines) (length extraLines)
@@ -76,9 +84,12 @@ drawLayoutTwo st extrafocus =
 
     extraImgs = vertCat $ reverse
              [ drawExtra st wr h' foc subfoc imgs
-                 | (h', (foc, subfoc, imgs)) <- zip hs extraLines]
+                 | (h', (foc, subfoc, (imgs, _))) <- zip hs extraLines]
+
+    extraDrawn = [ (foc, wr, h', drawn)
+                 | (h', (foc, _, (_, drawn))) <- zip hs extraLines]
 
-    (overscroll, row, col, nextOffset, main) =
+    (overscroll, row, col, nextOffset, main, mainDrawn) =
         drawMain wl rows scroll st
 
     pal     = clientPalette st
@@ -93,13 +104,14 @@ drawMain ::
   Int         {- ^ draw height     -} ->
   Int         {- ^ scroll amount   -} ->
   ClientState {- ^ client state    -} ->
-  (Int,Int,Int,Int,Image)
-drawMain w h scroll st = (overscroll, row, col, nextOffset, msgs <-> bottomImg)
+  (Int,Int,Int,Int,Image,DrawnWindows)
+drawMain w h scroll st =
+  (overscroll, row, col, nextOffset, msgs <-> bottomImg, [(focus, w, h' + scroll, drawn)])
   where
     focus = view clientFocus st
     subfocus = view clientSubfocus st
 
-    msgLines = viewLines focus subfocus w st
+    (msgLines, drawn) = viewLines focus subfocus w st
 
     (overscroll, msgs) = messagePane w h' scroll msgLines
 
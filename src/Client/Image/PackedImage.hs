@@ -21,6 +21,10 @@ module Client.Image.PackedImage
   , splitImage
   , imageText
   , resizeImage
+
+  -- * Image segments
+  , imageSegments
+  , segmentsImage
   ) where
 
 import           Data.List (findIndex)
@@ -110,3 +114,13 @@ resizeImage w img =
     LT -> fst (splitImage w img)
     EQ -> img
     GT -> img <> string defAttr (replicate (w-iw) ' ')
+
+-- | Break an image into its segments: attribute, text, terminal width
+-- and codepoint count.
+imageSegments :: Image' -> [(Attr, S.Text, Int, Int)]
+imageSegments EmptyImage'               = []
+imageSegments (HorizText' a t w l rest) = (a, t, w, l) : imageSegments rest
+
+-- | Rebuild an image from the segments produced by 'imageSegments'.
+segmentsImage :: [(Attr, S.Text, Int, Int)] -> Image'
+segmentsImage = foldr (\(a, t, w, l) rest -> HorizText' a t w l rest) EmptyImage'
@@ -83,7 +83,7 @@ data Palette = Palette
   , _palUModes        :: HashMap Char Attr -- ^ user mode attributes
   , _palSnomask       :: HashMap Char Attr -- ^ snotice mask attributes
   }
-  deriving Show
+  deriving (Eq, Show)
 
 makeLenses ''Palette
 
@@ -27,6 +27,7 @@ module Client.Network.Async
   , NetworkEvent(..)
   , createConnection
   , Client.Network.Async.send
+  , Client.Network.Async.sendMany
   , Client.Network.Async.recv
   , upgrade
 
@@ -80,10 +81,10 @@ upgrade c = join (swapMVar (connUpgrade c) (pure ()))
 data NetworkEvent
   -- | Event for successful connection to host (certificate lines)
   = NetworkOpen  !ZonedTime
-  -- | Event indicating TLS is in effect
-  | NetworkTLS  [Text]
-  -- | Event for a new recieved line (newline removed)
-  | NetworkLine  !ZonedTime !ByteString
+  -- | Event indicating TLS is in effect (session resumed, certificate lines)
+  | NetworkTLS  !Bool [Text]
+  -- | Event for new recieved lines (newlines removed)
+  | NetworkLines !ZonedTime [ByteString]
   -- | Report an error on network connection network connection failed
   | NetworkError !ZonedTime !SomeException
   -- | Final message indicating the network connection finished
@@ -121,6 +122,10 @@ instance Exception TerminationReason where
 send :: NetworkConnection -> ByteString -> IO ()
 send c msg = atomically (writeTQueue (connOutQueue c) msg)
 
+-- | Queue several messages for transmission in one transaction.
+sendMany :: NetworkConnection -> [ByteString] -> IO ()
+sendMany c msgs = atomically (traverse_ (writeTQueue (connOutQueue c)) msgs)
+
 recv :: NetworkConnection -> STM [NetworkEvent]
 recv = flushTQueue . connInQueue
 
@@ -198,9 +203,10 @@ startConnection settings inQueue outQueue upgradeMVar h =
       case view ssTls settings of
         TlsNo  -> True <$ putMVar upgradeMVar (pure ())
         TlsYes ->
-          do txts <- describeCertificates h
+          do txts    <- describeCertificates h
+             resumed <- getTlsSessionResumed h
              putMVar upgradeMVar (pure ())
-             atomically (writeTQueue inQueue (NetworkTLS txts))
+             atomically (writeTQueue inQueue (NetworkTLS resumed txts))
              pure True
         TlsStart ->
           do Hookup.send h "STARTTLS\n"
@@ -213,9 +219,10 @@ startConnection settings inQueue outQueue upgradeMVar h =
 
                -- pre-receiver was killed by a call to 'upgrade'
                Left e | Just AsyncCancelled <- fromException e ->
-                  do Hookup.upgradeTls (tlsParams settings) (view ssHostName settings) h
-                     txts <- describeCertificates h
-                     atomically (writeTQueue inQueue (NetworkTLS txts))
+                  do Hookup.upgradeTls (tlsParams settings) (view ssHostName settings) (ircPort settings) h
+                     txts    <- describeCertificates h
+                     resumed <- getTlsSessionResumed h
+                     atomically (writeTQueue inQueue (NetworkTLS resumed txts))
                      pure True
 
                -- something else went wrong with network IO
@@ -307,22 +314,47 @@ showByte x
   | x < 0x10  = '0' : showHex x ""
   | otherwise = showHex x ""
 
+-- | Transmit queued messages subject to the rate limit. Once a message
+-- is allowed, any further queued messages that the rate limit allows
+-- without delay are sent along with it in one write.
 sendLoop :: Connection -> TQueue ByteString -> RateLimit -> IO a
 sendLoop h outQueue rate =
   forever $
   do msg <- atomically (readTQueue outQueue)
      tickRateLimit rate
-     Hookup.send h msg
+     msgs <- gatherReady (B.length msg) [msg]
+     case msgs of
+       [one] -> Hookup.send h one
+       _     -> Hookup.sendMany h msgs
+  where
+    gatherReady n acc
+      | n >= maxSendBatch = pure (reverse acc)
+      | otherwise =
+          do next <- atomically (tryReadTQueue outQueue)
+             case next of
+               Nothing  -> pure (reverse acc)
+               Just msg ->
+                 do ok <- tryTickRateLimit rate
+                    if ok
+                      then gatherReady (n + B.length msg) (msg:acc)
+                      else do atomically (unGetTQueue outQueue msg)
+                              pure (reverse acc)
+
+-- | Number of bytes after which no more messages are added to a write,
+-- matching the largest TLS record.
+maxSendBatch :: Int
+maxSendBatch = 16384
 
 ircMaxMessageLength :: Int
 ircMaxMessageLength = 512
 
 receiveLoop :: Connection -> TQueue NetworkEvent -> IO ()
 receiveLoop h inQueue =
-  do mb <- recvLine h (4*ircMaxMessageLength)
-     for_ mb $ \msg ->
-       do unless (B.null msg) $ -- RFC says to ignore empty messages
+  do mb <- recvLines h (4*ircMaxMessageLength)
+     for_ mb $ \msgs ->
+       do let msgs' = filter (not . B.null) msgs -- RFC says to ignore empty messages
+          unless (null msgs') $
             do now <- getZonedTime
                atomically $ writeTQueue inQueue
-                          $ NetworkLine now msg
+                          $ NetworkLines now msgs'
           receiveLoop h inQueue
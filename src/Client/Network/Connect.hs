@@ -36,6 +36,7 @@ tlsParams ss = TlsParams
   , tpCipherSuite        = view ssTlsCiphers ss
   , tpCipherSuiteTls13   = view ssTls13Ciphers ss
   , tpVerify = view ssTlsVerify ss
+  , tpSessionCache = True
   , tpClientPrivateKeyPassword =
       case view ssTlsClientKeyPassword ss of
         Just (SecretText str) -> Just (Text.encodeUtf8 str)
@@ -46,6 +46,7 @@ module Client.State
   , clientEditMode
   , clientEditLock
   , clientRtsStats
+  , clientRenderCache
   , clientConfigPath
   , clientStsPolicy
   , clientHighlights
@@ -71,6 +72,7 @@ module Client.State
   , clientHighlightsFocus
   , clientWindowNames
   , clientPalette
+  , clientRenderKey
   , clientAutoconnects
   , clientActiveCommand
   , clientNextWindowName
@@ -105,6 +107,8 @@ module Client.State
   , esActive
   , esMVar
   , esStablePtr
+  , esRemoteCalls
+  , esWorkers
 
   -- * URL view
   , urlPattern
@@ -127,6 +131,7 @@ import           Client.State.Channel
 import qualified Client.State.EditBox as Edit
 import           Client.State.Focus
 import           Client.State.Network
+import           Client.State.RenderCache
 import           Client.State.Window
 import           ContextFilter
 import           Control.Applicative
@@ -151,6 +156,7 @@ import qualified Data.Text as Text
 import qualified Data.Text.Lazy as LText
 import           Data.Time
 import           Foreign.StablePtr
+import           Hookup (setTlsSessionFile)
 import           Irc.Codes
 import           Irc.Identifier
 import           Irc.Message
@@ -202,6 +208,7 @@ data ClientState = ClientState
   , _clientLogQueue          :: ![LogLine]                -- ^ log lines ready to write
   , _clientErrorMsg          :: Maybe Text                -- ^ transient error box text
   , _clientRtsStats          :: Maybe Stats               -- ^ most recent GHC RTS stats
+  , _clientRenderCache       :: !RenderCache              -- ^ wrapped lines from the last draw
 
   , _clientStsPolicy         :: !(HashMap Text StsPolicy) -- ^ STS policy entries
   , _clientHighlights        :: !(HashMap Identifier Highlight) -- ^ highlights
@@ -222,7 +229,9 @@ data Matcher = Matcher
 data ExtensionState = ExtensionState
   { _esActive    :: IntMap ActiveExtension     -- ^ active extensions
   , _esMVar      :: MVar ParkState             -- ^ 'MVar' used to with 'clientPark'
-  , _esStablePtr :: StablePtr (MVar ParkState) -- ^ 'StablePtr' used with 'clientPark'
+  , _esStablePtr :: StablePtr (ClientRef ClientState) -- ^ 'StablePtr' used with 'clientPark'
+  , _esWorkers   :: WorkerPool                 -- ^ threads running extension jobs
+  , _esRemoteCalls :: TQueue (RemoteCall ClientState) -- ^ entrypoints called from dispatcher threads
   }
 
 -- | ID of active extension and stored client state
@@ -251,13 +260,20 @@ clientLine = views (clientTextBox . Edit.line) (\(Edit.Line n t) -> (n, t))
 withClientState :: FilePath -> Configuration -> (ClientState -> IO a) -> IO a
 withClientState cfgPath cfg k =
 
-  withExtensionState $ \exts ->
+  withExtensionState (view configExtensionWorkers cfg) $ \exts ->
 
   do events    <- atomically newTQueue
      threadQueue <- atomically newTQueue
      sts       <- readPolicyFile
+     sessions  <- traverse (try . setTlsSessionFile) (view configTlsSessionFile cfg)
+                    :: IO (Maybe (Either IOError ()))
+     now       <- getZonedTime
      let ignoreIds = map mkId (view configIgnores cfg)
-     k ClientState
+         reportSessions =
+           case sessions of
+             Just (Left e) -> recordError now "" (Text.pack (displayException e))
+             _             -> id
+     k $ reportSessions ClientState
         { _clientWindows           = _Empty # ()
         , _clientIgnores           = HashSet.fromList ignoreIds
         , _clientIgnoreMask        = buildMask ignoreIds
@@ -288,18 +304,25 @@ withClientState cfgPath cfg k =
         , _clientLogQueue          = []
         , _clientErrorMsg          = Nothing
         , _clientRtsStats          = Nothing
+        , _clientRenderCache       = emptyRenderCache
         , _clientStsPolicy         = sts
         , _clientHighlights        = HashMap.empty
         }
 
-withExtensionState :: (ExtensionState -> IO a) -> IO a
-withExtensionState k =
+withExtensionState ::
+  Int {- ^ number of worker threads -} ->
+  (ExtensionState -> IO a) -> IO a
+withExtensionState workers k =
   do mvar <- newEmptyMVar
-     bracket (newStablePtr mvar) freeStablePtr $ \stab ->
+     pool <- newWorkerPool workers
+     remote <- newTQueueIO
+     bracket (newStablePtr (ClientRef mvar Nothing)) freeStablePtr $ \stab ->
        k ExtensionState
          { _esActive    = IntMap.empty
          , _esMVar      = mvar
          , _esStablePtr = stab
+         , _esWorkers   = pool
+         , _esRemoteCalls = remote
          }
 
 -- | Forcefully terminate the connection currently associated
@@ -594,6 +617,7 @@ recordWindowLine focus wl st = st2
       , _winHideMeta = fromMaybe (view (clientConfig . configHideMeta) st) (windowHintHideMeta =<< hints)
       , _winHidden   = fromMaybe False (windowHintHidden =<< hints)
       , _winSilent   = fromMaybe False (windowHintSilent =<< hints)
+      , _winLineLimit = fromMaybe (view (clientConfig . configWindowLineLimit) st) (windowHintLineLimit =<< hints)
       }
 
     st1 = over (clientWindows . at focus)
@@ -1114,6 +1138,11 @@ clientWindowNames = views (clientConfig . configWindowNames) Text.unpack
 clientPalette :: ClientState -> Palette
 clientPalette = view (clientConfig . configPalette)
 
+-- | Settings used to draw message lines, see "Client.State.RenderCache"
+clientRenderKey :: ClientState -> RenderKey
+clientRenderKey st =
+  RenderKey (clientPalette st) (view (clientConfig . configNickPadding) st)
+
 -- | Returns the list of network names that requested autoconnection.
 clientAutoconnects :: ClientState -> [Text]
 clientAutoconnects st =
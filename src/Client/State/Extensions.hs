@@ -15,29 +15,39 @@ module Client.State.Extensions
   , clientCommandExtension
   , clientStartExtensions
   , clientNotifyExtensions
+  , clientBatchExtensions
   , clientStopExtensions
   , clientExtTimer
   , clientThreadJoin
+  , clientRemoteCalls
   ) where
 
+import Control.Applicative ((<|>))
 import Control.Concurrent.MVar
+import Control.Concurrent.STM
 import Control.Monad.IO.Class
 import Control.Exception
 import Control.Lens
 import Control.Monad
 import Data.Foldable
+import Data.IORef
+import Data.Maybe (isNothing)
 import Data.Text (Text)
 import Data.Time
+import Foreign.Marshal (with)
 import Foreign.Ptr
 import Foreign.StablePtr
+import GHC.Clock (getMonotonicTime)
 import qualified Data.Text as Text
 import qualified Data.IntMap as IntMap
+import qualified Data.IntSet as IntSet
 
 import Irc.RawIrcMsg
 
 import Client.State
 import Client.Message
 import Client.CApi
+import Client.CApi.Stats
 import Client.CApi.Types
 import Client.Configuration
 
@@ -72,11 +82,61 @@ start1 st config =
                       Nothing -> 0
 
             let st1 = st & clientExtensions . esActive . at i ?~ ae
-            (st2, h) <- clientPark i st1 (startExtension (clientToken st1) config ae)
+            case dispatchMode config ae of
+              Right True -> startDispatched i config ae st1
+              mode ->
+                do (st2, h) <- clientPark i st1 (startExtension (clientToken st1) config ae)
 
-            -- save handle back into active extension
-            return $! st2 & clientExtensions . esActive . ix i %~ \ae' ->
-                        ae' { aeSession = h }
+                   -- save handle back into active extension
+                   let st3 = st2 & clientExtensions . esActive . ix i %~ \ae' ->
+                               ae' { aeSession = h }
+                   case mode of
+                     Left err -> do now <- getZonedTime
+                                    return $! recordError now "" err st3
+                     Right _  -> return st3
+
+-- | Decide if an extension runs on a dispatcher thread. The
+-- configuration overrides the extension's own preference unless the
+-- extension needs to drop messages.
+dispatchMode :: ExtensionConfiguration -> ActiveExtension -> Either Text Bool
+dispatchMode config ae =
+  case view extensionDispatch config of
+    Just False -> Right False
+    Just True
+      | hasFlag synchronousFlag (aeFlags ae) ->
+          Left ("Extension " <> aeName ae <> " can't use dispatch-thread, it drops messages")
+      | otherwise -> Right True
+    Nothing -> Right (hasFlag observeOnlyFlag (aeFlags ae))
+
+-- | Start an extension whose callbacks will run on its own dispatcher
+-- thread. The extension gets a token of its own so that its
+-- entrypoints can be run by the event loop once the dispatcher has
+-- taken over. The start callback itself runs synchronously.
+startDispatched ::
+  Int                    {- ^ extension ID            -} ->
+  ExtensionConfiguration {- ^ extension configuration -} ->
+  ActiveExtension        {- ^ extension               -} ->
+  ClientState            {- ^ client state            -} ->
+  IO ClientState
+startDispatched i config ae st =
+  do active <- newIORef False
+     let exts   = view clientExtensions st
+         remote = view esRemoteCalls exts
+         ref    = ClientRef (view esMVar exts) (Just (Remote i remote active))
+     token <- castStablePtrToPtr <$> newStablePtr ref
+     (st1, h) <- clientPark i st (startExtension token config ae)
+     writeIORef active True
+     d <- newDispatcher (view extensionDispatchQueue config) token (reportStats i remote)
+     return $! st1 & clientExtensions . esActive . ix i %~ \ae' ->
+                 ae' { aeSession = h, aeDispatcher = Just d }
+
+-- | Merge statistics recorded on a dispatcher thread into the extension.
+reportStats :: Int -> TQueue (RemoteCall ClientState) -> ExtensionStats -> IO ()
+reportStats i remote stats =
+  atomically $ writeTQueue remote $ RemoteCall i $ \(j, st) ->
+    return $! over (clientExtensions . esActive . ix j)
+                   (\ae -> ae { aeStats = mergeExtensionStats stats (aeStats ae) })
+                   st
 
 
 
@@ -84,16 +144,42 @@ start1 st config =
 clientStopExtensions ::
   ClientState    {- ^ client state                          -} ->
   IO ClientState {- ^ client state with extensions unloaded -}
-clientStopExtensions st =
-  do let (aes,st1) = st & clientExtensions . esActive %%~ upd
-     ifoldlM step st1 aes
+clientStopExtensions st0 =
+  do st <- traverseOf (clientExtensions . esActive . traverse) cancelQueuedJobs st0
+     let (aes,st1) = st & clientExtensions . esActive %%~ upd
+         busy = IntMap.filter (\ae -> aeLive ae && not (readyToClose ae))
+                              (view (clientExtensions . esActive) st)
+     st2 <- ifoldlM step st1 aes
+     ifoldlM stopJobs st2 busy
   where
     upd = fmap (fmap disable) . IntMap.partition readyToClose
     disable ae = ae { aeLive = False }
     readyToClose ae = aeThreads ae == 0
-    step i st2 ae =
-      do (st3,_) <- clientPark i st2 (stopExtension ae)
-         return st3
+    step i st2 ae = stopActive i ae st2
+
+-- | Ask an extension that still has jobs running to end them. It is
+-- stopped by 'clientThreadJoin' once the last one returns.
+stopJobs :: Int -> ClientState -> ActiveExtension -> IO ClientState
+stopJobs i st ae =
+  case aeDispatcher ae of
+    Nothing -> fst <$> clientPark i st (runExtensionStopJobs ae)
+    Just d  -> dispatchWaiting d CallbackFinish (0 <$ runExtensionStopJobs ae) st
+
+-- | Stop and unload an extension that has been removed from the active
+-- set. Extensions with a dispatcher thread are stopped on that thread
+-- once their queued callbacks have run.
+stopActive :: Int -> ActiveExtension -> ClientState -> IO ClientState
+stopActive i ae st =
+  case aeDispatcher ae of
+    Nothing ->
+      do (st1,_) <- clientPark i st (stopExtension ae)
+         return st1
+    Just d ->
+      do st1 <- serveRemoteUntil (stopDispatcher (runExtensionStop ae) d) st
+         st2 <- serveRemoteUntil (dispatcherStopped d) st1
+         closeExtension ae
+         freeStablePtr (castPtrToStablePtr (dispatcherToken d) :: StablePtr (ClientRef ClientState))
+         return st2
 
 
 -- | Dispatch chat messages through extensions before sending to server.
@@ -104,13 +190,25 @@ clientChatExtension ::
   ClientState {- ^ client state, allow message -} ->
   IO (ClientState, Bool)
 clientChatExtension net tgt msg st
-  | noCallback = return (st, True)
-  | otherwise  = evalNestedIO $
-                 do chat <- withChat net tgt msg
-                    liftIO (chat1 chat st (IntMap.toList (IntMap.filter aeLive aes)))
+  | null aes  = return (st, True)
+  | otherwise =
+      do (st1, allow) <-
+           if null syncs then return (st, True) else
+           evalNestedIO $
+             do chat <- withChat net tgt msg
+                liftIO (chat1 chat st syncs)
+         st2 <- if allow then foldM observeChat st1 asyncs else return st1
+         return (st2, allow)
   where
-    aes = view (clientExtensions . esActive) st
-    noCallback = all (\ae -> fgnChat (aeFgn ae) == nullFunPtr) aes
+    aes = IntMap.toList (IntMap.filter hasCallback (view (clientExtensions . esActive) st))
+    hasCallback ae = aeLive ae && fgnChat (aeFgn ae) /= nullFunPtr
+    syncs  = [ (i, ae) | (i, ae) <- aes, isNothing (aeDispatcher ae) ]
+    asyncs = [ (i, ae, d) | (i, ae) <- aes, Just d <- [aeDispatcher ae] ]
+
+    observeChat st' (i, ae, d) =
+      observe i d CallbackChat st' $ evalNestedIO $
+        do chat <- withChat net tgt msg
+           liftIO (dropped <$> chatExtension ae chat)
 
 chat1 ::
   Ptr FgnChat             {- ^ serialized chat message     -} ->
@@ -119,7 +217,7 @@ chat1 ::
   IO (ClientState, Bool)  {- ^ new state and allow         -}
 chat1 _    st [] = return (st, True)
 chat1 chat st ((i,ae):aes) =
-  do (st1, allow) <- clientPark i st (chatExtension ae chat)
+  do (st1, allow) <- clientCall CallbackChat dropped i st (chatExtension ae chat)
      if allow then chat1 chat st1 aes
               else return (st1, False)
 
@@ -127,27 +225,107 @@ chat1 chat st ((i,ae):aes) =
 -- | Dispatch incoming IRC message through extensions
 clientNotifyExtensions ::
   Text                   {- ^ network                 -} ->
-  RawIrcMsg              {- ^ incoming message        -} ->
+  RawIrcLine             {- ^ incoming message        -} ->
   ClientState            {- ^ client state            -} ->
   IO (ClientState, Bool) {- ^ drop message when false -}
 clientNotifyExtensions network raw st
-  | noCallback = return (st, True)
-  | otherwise  = evalNestedIO $
-                 do fgn <- withRawIrcMsg network raw
-                    liftIO (message1 fgn st (IntMap.toList (IntMap.filter aeLive aes)))
+  | null syncs, null asyncs = return (st, True)
+  | otherwise =
+      do (st1, allow) <-
+           if null syncs then return (st, True) else
+           evalNestedIO $
+             do fgn <- withFgnMsg network raw
+                liftIO (message1 fgn st syncs)
+         -- dispatched extensions observe the messages the client keeps
+         st2 <- if allow then foldM observeMessage st1 asyncs else return st1
+         return (st2, allow)
+  where
+    -- only marshal the message when some extension will look at it
+    cmd = asUtf8 (lineCommand raw)
+
+    -- extensions ahead of the first one that takes messages one at a
+    -- time have already seen this message in 'clientBatchExtensions'
+    syncs  = filter (isSubscribed cmd . snd) (snd (splitBatchExtensions st))
+    asyncs = [ (i, ae, d)
+             | (i, ae) <- IntMap.toList (view (clientExtensions . esActive) st)
+             , aeLive ae, isSubscribed cmd ae, hasMessageCallback ae
+             , Just d <- [aeDispatcher ae] ]
+
+    -- the message is marshaled again on the dispatcher thread, dropping
+    -- it there is recorded in the statistics but has no effect
+    observeMessage st' (i, ae, d) =
+      observe i d CallbackMessage st' $ evalNestedIO $
+        do fgn <- withFgnMsg network raw
+           liftIO (dropped <$> notifySingle ae fgn)
+
+-- | Dispatch a run of incoming IRC messages through the extensions that
+-- accept batches. Each extension sees the messages it subscribes to that
+-- weren't dropped by an earlier extension. This happens before any of
+-- the messages are processed by 'clientNotifyExtensions' and the client,
+-- so only the extensions loaded ahead of the first extension that takes
+-- messages one at a time are called here, keeping the load order.
+clientBatchExtensions ::
+  Text                     {- ^ network                      -} ->
+  [RawIrcLine]             {- ^ incoming messages            -} ->
+  ClientState              {- ^ client state                 -} ->
+  IO (ClientState, [Bool]) {- ^ drop each message when false -}
+clientBatchExtensions network raws st
+  | null aes  = return (st, map (const True) raws)
+  | otherwise = evalNestedIO $
+                do fgns <- traverse (withFgnMsg network) raws
+                   let msgs = zip3 [0 :: Int ..] (map (asUtf8 . lineCommand) raws) fgns
+                   liftIO (batch1 msgs (map (const True) raws) st aes)
+  where
+    aes = fst (splitBatchExtensions st)
+
+-- | Synchronous extensions that process incoming messages in load order,
+-- split into the leading extensions that accept batches and the rest.
+splitBatchExtensions ::
+  ClientState ->
+  ([(Int,ActiveExtension)], [(Int,ActiveExtension)])
+splitBatchExtensions st =
+  span (\(_,ae) -> aeBatch ae /= nullFunPtr)
+    [ (i, ae) | (i, ae) <- IntMap.toList (view (clientExtensions . esActive) st)
+              , aeLive ae, isNothing (aeDispatcher ae), hasMessageCallback ae ]
+
+-- | Extension processes incoming messages one way or the other
+hasMessageCallback :: ActiveExtension -> Bool
+hasMessageCallback ae = aeBatch ae /= nullFunPtr || fgnMessage (aeFgn ae) /= nullFunPtr
+
+-- | Pass a single message to an extension, as a batch of one when it
+-- only accepts batches.
+notifySingle :: ActiveExtension -> FgnMsg -> IO Bool
+notifySingle ae fgn
+  | fgnMessage (aeFgn ae) == nullFunPtr = and <$> notifyExtensionBatch ae [fgn]
+  | otherwise                           = with fgn $ \p -> notifyExtension ae p
+
+batch1 ::
+  [(Int, Text, FgnMsg)]    {- ^ index, command, and serialized message -} ->
+  [Bool]                   {- ^ messages still allowed                 -} ->
+  ClientState              {- ^ client state                           -} ->
+  [(Int,ActiveExtension)]  {- ^ extensions needing callback            -} ->
+  IO (ClientState, [Bool]) {- ^ new state and allow                    -}
+batch1 _    allowed st [] = return (st, allowed)
+batch1 msgs allowed st ((i,ae):aes)
+  | null selected = batch1 msgs allowed st aes
+  | otherwise =
+      do (st1, results) <- clientCall CallbackMessage (length . filter not) i st
+                             (notifyExtensionBatch ae (map snd selected))
+         let dropped  = IntSet.fromList [ j | ((j,_),False) <- zip selected results ]
+             allowed' = [ a && IntSet.notMember j dropped | (j,a) <- zip [0..] allowed ]
+         batch1 msgs allowed' st1 aes
   where
-    aes = view (clientExtensions . esActive) st
-    noCallback = all (\ae -> fgnMessage (aeFgn ae) == nullFunPtr) aes
+    selected = [ (j, fgn) | ((j, cmd, fgn), True) <- zip msgs allowed, isSubscribed cmd ae ]
 
 message1 ::
-  Ptr FgnMsg              {- ^ serialized IRC message      -} ->
+  FgnMsg                  {- ^ serialized IRC message      -} ->
   ClientState             {- ^ client state                -} ->
   [(Int,ActiveExtension)] {- ^ extensions needing callback -} ->
   IO (ClientState, Bool)  {- ^ new state and allow         -}
-message1 _    st [] = return (st, True)
-message1 chat st ((i,ae):aes) =
-  do (st1, allow) <- clientPark i st (notifyExtension ae chat)
-     if allow then message1 chat st1 aes
+message1 _   st [] = return (st, True)
+message1 fgn st ((i,ae):aes) =
+  do (st1, allow) <- clientCall CallbackMessage dropped i st (notifySingle ae fgn)
+     if allow then message1 fgn st1 aes
               else return (st1, False)
 
 
@@ -162,9 +340,12 @@ clientCommandExtension name command st =
   case find (\(_,ae) -> aeName ae == name)
             (IntMap.toList (IntMap.filter aeLive (view (clientExtensions . esActive) st))) of
         Nothing -> return Nothing
-        Just (i,ae) ->
-          do (st', _) <- clientPark i st (commandExtension command ae)
-             return (Just st')
+        Just (i,ae)
+          | Just d <- aeDispatcher ae ->
+              Just <$> dispatchWaiting d CallbackCommand (0 <$ commandExtension command ae) st
+          | otherwise ->
+              do (st', _) <- clientCall CallbackCommand (const 0) i st (commandExtension command ae)
+                 return (Just st')
 
 
 -- | Prepare the client to support reentry from the extension API.
@@ -180,6 +361,95 @@ clientPark i st k =
      (_,st') <- takeMVar mvar
      return (st', res)
 
+-- | Run a callback into an extension with 'clientPark' and record its
+-- latency and the number of messages it dropped in the extension's
+-- statistics. Calls slower than the configured threshold are reported.
+clientCall ::
+  Callback    {- ^ kind of callback                  -} ->
+  (a -> Int)  {- ^ number of messages dropped        -} ->
+  Int         {- ^ extension ID                      -} ->
+  ClientState {- ^ client state                      -} ->
+  IO a        {- ^ callback                          -} ->
+  IO (ClientState, a)
+clientCall cb drops i st k =
+  do t0       <- getMonotonicTime
+     (st1, r) <- clientPark i st k
+     t1       <- getMonotonicTime
+     let secs = t1 - t0
+         st2  = over (clientExtensions . esActive . ix i)
+                     (\ae -> ae { aeStats = recordCallback cb secs (drops r) (aeStats ae) })
+                     st1
+     st3 <- warnSlowCallback cb secs i st2
+     return (st3, r)
+
+-- | Drop count of a callback returning whether to allow a message
+dropped :: Bool -> Int
+dropped allow = if allow then 0 else 1
+
+-- | Report a callback that took longer than @extension-slow-callback@.
+warnSlowCallback ::
+  Callback    {- ^ kind of callback   -} ->
+  Double      {- ^ latency in seconds -} ->
+  Int         {- ^ extension ID       -} ->
+  ClientState {- ^ client state       -} ->
+  IO ClientState
+warnSlowCallback cb secs i st
+  | limit > 0
+  , ms >= limit
+  , Just ae <- preview (clientExtensions . esActive . ix i) st =
+      do now <- getZonedTime
+         let msg = Text.concat
+                     [ "Extension ", aeName ae, ": slow ", callbackName cb
+                     , " callback took ", Text.pack (show ms), " ms" ]
+         return $! recordError now "" msg st
+  | otherwise = return st
+  where
+    limit = view (clientConfig . configExtensionSlowCallback) st
+    ms    = round (secs * 1000) :: Int
+
+-- | Queue a callback that only observes the client on an extension's
+-- dispatcher thread. When the queue is full the callback is skipped
+-- and counted rather than delaying the client.
+observe ::
+  Int         {- ^ extension ID        -} ->
+  Dispatcher  {- ^ extension's thread  -} ->
+  Callback    {- ^ kind of callback    -} ->
+  ClientState {- ^ client state        -} ->
+  IO Int      {- ^ callback            -} ->
+  IO ClientState
+observe i d cb st act =
+  do queued <- atomically (tryDispatch cb act d)
+     return $! if queued then st else
+       over (clientExtensions . esActive . ix i)
+            (\ae -> ae { aeOverflow = aeOverflow ae + 1 })
+            st
+
+-- | Queue a callback that can't be skipped on an extension's dispatcher
+-- thread, waiting for room in the queue when necessary.
+dispatchWaiting ::
+  Dispatcher  {- ^ extension's thread  -} ->
+  Callback    {- ^ kind of callback    -} ->
+  IO Int      {- ^ callback            -} ->
+  ClientState {- ^ client state        -} ->
+  IO ClientState
+dispatchWaiting d cb act = serveRemoteUntil (dispatch cb act d)
+
+-- | Run the entrypoints called by extensions on dispatcher threads
+-- until the transaction succeeds. Waiting on a dispatcher without
+-- serving its entrypoints could deadlock.
+serveRemoteUntil :: STM () -> ClientState -> IO ClientState
+serveRemoteUntil done st =
+  do next <- atomically (Nothing <$ done <|> Just <$> readTQueue remote)
+     case next of
+       Nothing   -> return st
+       Just call -> serveRemoteUntil done =<< runRemoteCall call st
+  where
+    remote = view (clientExtensions . esRemoteCalls) st
+
+-- | Run entrypoints called by extensions on dispatcher threads.
+clientRemoteCalls :: [RemoteCall ClientState] -> ClientState -> IO ClientState
+clientRemoteCalls calls st = foldM (flip runRemoteCall) st calls
+
 -- | Get the pointer used by C extensions to reenter the client.
 clientToken :: ClientState -> Ptr ()
 clientToken = views (clientExtensions . esStablePtr) castStablePtrToPtr
@@ -194,9 +464,15 @@ clientExtTimer i st =
      case popTimer ae of
        Nothing -> return st
        Just (_, timerId, fun, dat, ae') ->
-         do let st1 = set (clientExtensions . esActive . ix i) ae' st
-            (st2,_) <- clientPark i st1 (runTimerCallback fun dat timerId)
-            return st2
+         do now <- getCurrentTime
+            let ae'' = catchUpTimer now (fromIntegral timerId) ae'
+                st1  = set (clientExtensions . esActive . ix i) ae'' st
+                run  = runTimerCallback fun dat timerId
+            case aeDispatcher ae'' of
+              Just d  -> dispatchWaiting d CallbackTimer (0 <$ run) st1
+              Nothing ->
+                do (st2,_) <- clientCall CallbackTimer (const 0) i st1 run
+                   return st2
 
 -- | Run the thread join action on a given extension.
 clientThreadJoin ::
@@ -206,16 +482,18 @@ clientThreadJoin ::
   IO ClientState
 clientThreadJoin i thread st =
   let ae = st ^?! clientExtensions . esActive . ix i
-  in finish ae { aeThreads = aeThreads ae - 1}
+  in finish (finishJob thread ae)
   where
     finish ae
       | aeLive ae = -- normal behavior, run finalizer
          do let st1 = set (clientExtensions . esActive . ix i) ae st
-            (st2,_) <- clientPark i st1 (threadFinish thread)
-            pure st2
+            case aeDispatcher ae of
+              Just d  -> dispatchWaiting d CallbackFinish (0 <$ threadFinish thread) st1
+              Nothing ->
+                do (st2,_) <- clientCall CallbackFinish (const 0) i st1 (threadFinish thread)
+                   pure st2
       | aeThreads ae == 0 = -- delayed stop, all threads done
          do let st1 = over (clientExtensions . esActive) (sans i) st
-            (st2,_) <- clientPark i st1 (stopExtension ae)
-            return st2
+            stopActive i ae st1
       | otherwise = -- delayed stop, more threads remain
          do pure (set (clientExtensions . esActive . ix i) ae st)
@@ -53,6 +53,7 @@ data Subfocus
   | FocusKeyMap      -- ^ Show key bindings
   | FocusHelp (Maybe Text) -- ^ Show help window with optional command
   | FocusRtsStats    -- ^ Show GHC RTS statistics
+  | FocusExtStats    -- ^ Show extension callback statistics
   | FocusIgnoreList  -- ^ Show ignored masks
   | FocusCert        -- ^ Show rendered certificate
   deriving (Eq,Show)
@@ -59,6 +59,7 @@ module Client.State.Network
 
   -- * Messages interactions
   , sendMsg
+  , sendMsgs
   , initialMessages
   , squelchIrcMsg
 
@@ -204,13 +205,24 @@ csNick = csUserInfo . uiNick
 -- with the given network. For @PRIVMSG@ and @NOTICE@ overlong
 -- commands are detected and transmitted as multiple messages.
 sendMsg :: NetworkState -> RawIrcMsg -> IO ()
-sendMsg cs msg =
+sendMsg cs = sendMany (view csSocket cs) . renderMsg cs
+
+-- | Transmit several messages on the connection associated with
+-- the given network in one transaction. Overlong messages are split
+-- as in 'sendMsg'.
+sendMsgs :: NetworkState -> [RawIrcMsg] -> IO ()
+sendMsgs cs = sendMany (view csSocket cs) . concatMap (renderMsg cs)
+
+-- | Render a message as the lines to transmit, splitting overlong
+-- @PRIVMSG@ and @NOTICE@ commands.
+renderMsg :: NetworkState -> RawIrcMsg -> [B.ByteString]
+renderMsg cs msg =
   case (view msgCommand msg, view msgParams msg) of
     ("PRIVMSG", [tgt,txt]) -> multiline "PRIVMSG" tgt txt
     ("NOTICE",  [tgt,txt]) -> multiline "NOTICE"  tgt txt
-    _ -> transmit msg
+    _ -> [transmit msg]
   where
-    transmit = send (view csSocket cs) . renderRawIrcMsg
+    transmit = renderRawIrcMsg
 
     actionPrefix = "\^AACTION "
     actionSuffix = "\^A"
@@ -223,15 +235,14 @@ sendMsg cs msg =
       let txtChunks     = utf8ChunksOf maxContentLen txt2
           maxContentLen = computeMaxMessageLength (view csUserInfo cs) tgt
                         - Text.length actionPrefix - Text.length actionSuffix
-      in for_ txtChunks $ \txtChunk ->
-           transmit $ rawIrcMsg cmd [tgt, actionPrefix <> txtChunk <> actionSuffix]
+      in [ transmit $ rawIrcMsg cmd [tgt, actionPrefix <> txtChunk <> actionSuffix]
+         | txtChunk <- txtChunks ]
 
     -- Normal case
     multiline cmd tgt txt =
       let txtChunks     = utf8ChunksOf maxContentLen txt
           maxContentLen = computeMaxMessageLength (view csUserInfo cs) tgt
-      in for_ txtChunks $ \txtChunk ->
-           transmit $ rawIrcMsg cmd [tgt, txtChunk]
+      in [ transmit $ rawIrcMsg cmd [tgt, txtChunk] | txtChunk <- txtChunks ]
 
 -- This is an approximation for splitting the text. It doesn't
 -- understand combining characters. A correct implementation
@@ -0,0 +1,145 @@
+{-|
+Module      : Client.State.RenderCache
+Description : Cache of wrapped chat message lines
+Copyright   : (c) Eric Mertens, 2016
+License     : ISC
+Maintainer  : emertens@gmail.com
+
+Chat messages are stored already rendered, but every redraw still
+attaches their timestamp and nickname prefix and wraps them to the
+width of the window. This module keeps the wrapped lines from the
+previous draw of each window so that a redraw only has to wrap the
+lines that weren't visible last time.
+
+Lines are found by window, draw width and the line's serial number in
+its window. The whole cache is emptied when the settings used to draw
+the lines change.
+
+-}
+
+module Client.State.RenderCache
+  ( -- * Cache
+    RenderCache
+  , emptyRenderCache
+  , renderCacheHits
+  , renderCacheMisses
+  , renderCacheFlushes
+  , renderCacheSize
+
+  -- * Drawing with the cache
+  , RenderKey(..)
+  , CachedLines
+  , DrawnLine(..)
+  , drawnImages
+  , renderCacheLines
+  , cachedWindowLine
+  , updateRenderCache
+  ) where
+
+import           Client.Configuration (PaddingMode)
+import           Client.Image.PackedImage (Image')
+import           Client.Image.Palette (Palette)
+import           Client.State.Focus (Focus)
+import           Client.State.Window (WindowLine, PackedTime, wlTimestamp)
+import           Control.Lens
+import           Data.IntMap.Strict (IntMap)
+import qualified Data.IntMap.Strict as IntMap
+import           Data.Map.Strict (Map)
+import qualified Data.Map.Strict as Map
+
+-- | Settings that affect how a window line is drawn
+data RenderKey = RenderKey !Palette !PaddingMode
+  deriving Eq
+
+-- | Wrapped lines of one message
+data CachedLine = CachedLine
+  { clTime   :: !PackedTime -- ^ timestamp, checked in case a window was recreated
+  , clImages :: [Image']    -- ^ wrapped lines, bottom line first
+  }
+
+-- | Cached lines of one window by serial number
+type CachedLines = IntMap CachedLine
+
+-- | Wrapped lines from the most recent draw of each window along with
+-- counters reported in @/rtsstats@
+data RenderCache = RenderCache
+  { rcKey     :: !(Maybe RenderKey)                 -- ^ settings of cached lines
+  , rcWindows :: !(Map (Focus, Int) CachedLines)    -- ^ lines by window and width
+  , renderCacheHits    :: !Int -- ^ lines drawn from the cache
+  , renderCacheMisses  :: !Int -- ^ lines wrapped while drawing
+  , renderCacheFlushes :: !Int -- ^ times the settings changed
+  }
+
+-- | A message line drawn in the current frame
+data DrawnLine = DrawnLine
+  { dlSerial :: !Int      -- ^ serial number of the line in its window
+  , dlHit    :: !Bool     -- ^ lines were found in the cache
+  , dlLine   :: CachedLine
+  }
+
+-- | Wrapped lines of a drawn line, bottom line first
+drawnImages :: DrawnLine -> [Image']
+drawnImages = clImages . dlLine
+
+-- | Cache with no lines
+emptyRenderCache :: RenderCache
+emptyRenderCache = RenderCache
+  { rcKey              = Nothing
+  , rcWindows          = Map.empty
+  , renderCacheHits    = 0
+  , renderCacheMisses  = 0
+  , renderCacheFlushes = 0
+  }
+
+-- | Number of lines currently cached
+renderCacheSize :: RenderCache -> Int
+renderCacheSize = sum . fmap IntMap.size . rcWindows
+
+-- | Cached lines for a window drawn at the given width. No lines are
+-- found when the cache was filled with different settings.
+renderCacheLines :: RenderKey -> Focus -> Int -> RenderCache -> CachedLines
+renderCacheLines key focus w rc
+  | rcKey rc == Just key = Map.findWithDefault IntMap.empty (focus, w) (rcWindows rc)
+  | otherwise            = IntMap.empty
+
+-- | Reuse the cached lines for a window line or draw it.
+cachedWindowLine ::
+  CachedLines               {- ^ window's cached lines -} ->
+  (WindowLine -> [Image'])  {- ^ draw wrapped lines    -} ->
+  Int                       {- ^ serial number         -} ->
+  WindowLine                {- ^ window line           -} ->
+  DrawnLine
+cachedWindowLine cached draw serial wl =
+  case IntMap.lookup serial cached of
+    Just cl | clTime cl == time -> DrawnLine serial True cl
+    _ -> DrawnLine serial False (CachedLine time (draw wl))
+  where
+    time = view wlTimestamp wl
+
+-- | Replace the cached lines with the lines drawn in this frame. Windows
+-- that weren't drawn are dropped and only enough lines to fill the
+-- window are kept for the others.
+updateRenderCache ::
+  RenderKey                        {- ^ settings used in this frame              -} ->
+  [(Focus, Int, Int, [DrawnLine])] {- ^ window, width, rows, lines newest first  -} ->
+  RenderCache                      {- ^ cache used in this frame                 -} ->
+  RenderCache
+updateRenderCache key frames rc = RenderCache
+  { rcKey              = Just key
+  , rcWindows          = Map.fromList
+                           [ ((focus, w), IntMap.fromList [ (dlSerial dl, dlLine dl) | dl <- dls ])
+                           | (focus, w, dls) <- visible ]
+  , renderCacheHits    = renderCacheHits rc + length (filter dlHit drawn)
+  , renderCacheMisses  = renderCacheMisses rc + length (filter (not . dlHit) drawn)
+  , renderCacheFlushes = renderCacheFlushes rc + flushed
+  }
+  where
+    visible = [ (focus, w, fill rows dls) | (focus, w, rows, dls) <- frames ]
+    drawn   = [ dl | (_, _, dls) <- visible, dl <- dls ]
+
+    flushed = case rcKey rc of
+                Just key' | key' /= key -> 1
+                _                       -> 0
+
+    fill n (dl:dls) | n > 0 = dl : fill (n - length (drawnImages dl)) dls
+    fill _ _                = []
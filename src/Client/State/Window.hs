@@ -24,9 +24,11 @@ module Client.State.Window
   , winHideMeta
   , winHidden
   , winSilent
+  , winLineLimit
+  , winSerial
 
   -- * Window lines
-  , WindowLines(..)
+  , WindowLines
   , WindowLine(..)
   , wlSummary
   , wlText
@@ -46,6 +48,7 @@ module Client.State.Window
   , windowActivate
   , windowDeactivate
   , windowClear
+  , windowHistory
 
     -- * Packed time
   , PackedTime
@@ -58,10 +61,21 @@ import           Client.Image.PackedImage
 import           Client.Message
 import           Control.Lens
 import           Control.Monad ((<$!>))
+import           Data.ByteString (ByteString)
+import qualified Data.ByteString as B
+import           Data.List (elemIndex, mapAccumL, nub)
+import           Data.Maybe (fromMaybe)
+import           Data.Sequence (Seq)
+import qualified Data.Sequence as Seq
 import           Data.Text.Lazy (Text)
+import qualified Data.Text.Encoding as Text
 import           Data.Time
+import           Data.Vector (Vector)
+import qualified Data.Vector as Vector
+import qualified Data.Vector.Unboxed as U
 import           Data.Word
 import           Data.Bits
+import           Graphics.Vty.Attributes (Attr)
 
 -- | A single message to be displayed in a window.
 -- The normal message line consists of the image prefix
@@ -78,11 +92,36 @@ data WindowLine = WindowLine
   }
 
 newtype PackedTime = PackedTime Word64
+  deriving Eq
+
+-- | The messages in a window. The most recent lines are kept rendered
+-- and older lines are packed into chunks that are unpacked whenever
+-- they are traversed, so that long scrollback costs a few large objects
+-- instead of many small ones.
+data WindowLines = WindowLines
+  { wlsRendered :: !Int               -- ^ number of rendered lines
+  , wlsLines    :: !RenderedLines     -- ^ rendered lines, newest first
+  , wlsPackedN  :: !Int               -- ^ number of packed lines
+  , wlsPacked   :: !(Seq PackedChunk) -- ^ packed lines, newest chunk first
+  }
 
-data WindowLines
-  = {-# UNPACK #-} !WindowLine :- WindowLines
+data RenderedLines
+  = {-# UNPACK #-} !WindowLine :- RenderedLines
   | Nil
 
+-- | Window lines stored as the UTF-8 text of their image segments and
+-- tables of the remaining fields. Lines are numbered newest first.
+data PackedChunk = PackedChunk
+  { pcCount      :: !Int               -- ^ lines in use, higher numbers have been dropped
+  , pcText       :: !ByteString        -- ^ text of every segment
+  , pcAttrs      :: !(Vector Attr)     -- ^ attributes used by the segments
+  , pcSegments   :: !(U.Vector Word32) -- ^ attribute, bytes, width and length of each segment
+  , pcLines      :: !(U.Vector Word32) -- ^ first prefix, image and full image segment and first byte of each line
+  , pcSummaries  :: !(Vector IrcSummary)
+  , pcImportance :: !(U.Vector Word8)
+  , pcTimestamps :: !(U.Vector Word64)
+  }
+
 -- | A 'Window' tracks all of the messages and metadata for a particular
 -- message buffer.
 data Window = Window
@@ -95,6 +134,8 @@ data Window = Window
   , _winHideMeta :: !Bool          -- ^ Hide metadata messages
   , _winHidden   :: !Bool          -- ^ Remove from jump rotation
   , _winSilent   :: !Bool          -- ^ Ignore activity
+  , _winLineLimit :: !Int          -- ^ Messages kept in buffer, 0 for no limit
+  , _winSerial   :: !Int           -- ^ Messages ever added, numbers lines for the render cache
   }
 
 data ActivityLevel = NoActivity | NormalActivity | HighActivity
@@ -105,7 +146,7 @@ data WindowLineImportance
   = WLBoring -- ^ Don't update unread count
   | WLNormal -- ^ Increment unread count
   | WLImportant -- ^ Increment unread count and set important flag
-  deriving (Eq, Ord, Show, Read)
+  deriving (Eq, Ord, Show, Read, Enum)
 
 makeLenses ''Window
 makeLenses ''WindowLine
@@ -120,7 +161,7 @@ wlText = wlFullImage . to imageText
 emptyWindow :: Window
 emptyWindow = Window
   { _winName'    = '\0'
-  , _winMessages = Nil
+  , _winMessages = noWindowLines
   , _winMarker   = Nothing
   , _winUnread   = 0
   , _winTotal    = 0
@@ -128,30 +169,52 @@ emptyWindow = Window
   , _winHideMeta = False
   , _winHidden   = False
   , _winSilent   = False
+  , _winLineLimit = 0
+  , _winSerial   = 0
   }
 
 windowClear :: Window -> Window
 windowClear w = w
-  { _winMessages = Nil
+  { _winMessages = noWindowLines
   , _winMarker = Nothing
   , _winUnread = 0
   , _winTotal = 0
   , _winMention  = WLBoring
   }
 
+-- | Lines of a window older than a history cursor, newest first, each
+-- paired with the cursor that continues after it. Cursors are line
+-- serial numbers so they keep naming the same lines when the oldest
+-- lines are dropped. Cursor 0 starts from the newest line, and is the
+-- cursor after the oldest line.
+windowHistory :: Int {- ^ cursor -} -> Window -> [(Int, WindowLine)]
+windowHistory start win =
+  zip [ if s == oldest then 0 else s | s <- [serial - skip - 1, serial - skip - 2 ..] ]
+      (drop skip (toListOf (winMessages . each) win))
+  where
+    serial = view winSerial win
+    oldest = serial - view winTotal win
+    skip
+      | start <= 0 = 0
+      | otherwise  = max 0 (serial - start)
+
 -- | Adds a given line to a window as the newest message. Window's
 -- unread count will be updated according to the given importance.
+-- The oldest messages beyond the window's line limit are dropped.
 addToWindow :: WindowLine -> Window -> Window
 addToWindow !msg !win = win
-    { _winMessages = msg :- view winMessages win
-    , _winTotal    = view winTotal win + 1
+    { _winMessages = msgs
+    , _winTotal    = wlsRendered msgs + wlsPackedN msgs
     , _winMarker   = (+1) <$!> view winMarker win
     , _winUnread   = if view wlImportance msg == WLBoring
                      then view winUnread win
                      else view winUnread win + 1
     , _winMention  = max (view winMention win) (view wlImportance msg)
     , _winHideMeta = view winHideMeta win
+    , _winSerial   = view winSerial win + 1
     }
+  where
+    msgs = addWindowLine (view winLineLimit win) msg (view winMessages win)
 
 -- | Update the window clearing the unread count and important flag.
 windowSeen :: Window -> Window
@@ -174,8 +237,142 @@ windowDeactivate = set winMarker (Just 0)
 
 
 instance Each WindowLines WindowLines WindowLine WindowLine where
-  each _ Nil = pure Nil
-  each f (x :- xs) = (:-) <$> f x <*> each f xs
+  each f (WindowLines n xs m cs) =
+    (\xs' cs' -> WindowLines n xs' m cs') <$> eachRendered xs <*> traverse eachChunk cs
+    where
+      eachRendered Nil       = pure Nil
+      eachRendered (y :- ys) = (:-) <$> f y <*> eachRendered ys
+
+      eachChunk c = packChunk <$> traverse f (chunkLines c)
+
+------------------------------------------------------------------------
+
+-- | Number of recent lines kept rendered in each window
+renderedLimit :: Int
+renderedLimit = 512
+
+-- | Number of lines packed together once they are older than the
+-- rendered lines
+chunkSize :: Int
+chunkSize = 64
+
+noWindowLines :: WindowLines
+noWindowLines = WindowLines 0 Nil 0 Seq.empty
+
+-- | Add a line as the newest one, packing lines that have aged out of
+-- the rendered lines and dropping the oldest lines beyond the limit.
+addWindowLine ::
+  Int {- ^ line limit, 0 for no limit -} ->
+  WindowLine -> WindowLines -> WindowLines
+addWindowLine limit wl (WindowLines n xs m cs) =
+  trimWindowLines limit (packRendered (WindowLines (n+1) (wl :- xs) m cs))
+
+packRendered :: WindowLines -> WindowLines
+packRendered wls@(WindowLines n xs m cs)
+  | n < renderedLimit + chunkSize = wls
+  | otherwise =
+      case splitRendered renderedLimit xs of
+        (keep, old) -> WindowLines renderedLimit keep (m + length old) (packChunk old Seq.<| cs)
+
+trimWindowLines :: Int -> WindowLines -> WindowLines
+trimWindowLines limit wls@(WindowLines n xs m cs)
+  | limit <= 0 || excess <= 0 = wls
+  | excess <= m = WindowLines n xs (m - excess) (dropPacked excess cs)
+  | otherwise   = WindowLines n' (takeRendered n' xs) 0 Seq.empty
+  where
+    excess = n + m - limit
+    n'     = min n limit
+
+-- | Drop the given number of the oldest packed lines.
+dropPacked :: Int -> Seq PackedChunk -> Seq PackedChunk
+dropPacked k cs
+  | k <= 0 = cs
+  | otherwise =
+      case Seq.viewr cs of
+        Seq.EmptyR -> cs
+        rest Seq.:> c
+          | pcCount c <= k -> dropPacked (k - pcCount c) rest
+          | otherwise      -> rest Seq.|> c { pcCount = pcCount c - k }
+
+takeRendered :: Int -> RenderedLines -> RenderedLines
+takeRendered k (x :- xs) | k > 0 = let !xs' = takeRendered (k-1) xs in x :- xs'
+takeRendered _ _                 = Nil
+
+splitRendered :: Int -> RenderedLines -> (RenderedLines, [WindowLine])
+splitRendered k (x :- xs)
+  | k > 0 = case splitRendered (k-1) xs of
+              (ys, old) -> (x :- ys, old)
+splitRendered _ xs = (Nil, renderedList xs)
+
+renderedList :: RenderedLines -> [WindowLine]
+renderedList Nil       = []
+renderedList (x :- xs) = x : renderedList xs
+
+-- | Pack a list of lines, newest first.
+packChunk :: [WindowLine] -> PackedChunk
+packChunk wls = PackedChunk
+  { pcCount      = length wls
+  , pcText       = B.concat [ bs | (_, bs, _, _) <- segs ]
+  , pcAttrs      = Vector.fromList attrs
+  , pcSegments   = U.fromList (concatMap segEntry segs)
+  , pcLines      = U.fromList (map fromIntegral (concat entries))
+  , pcSummaries  = Vector.fromList (map (view wlSummary) wls)
+  , pcImportance = U.fromList (map (fromIntegral . fromEnum . view wlImportance) wls)
+  , pcTimestamps = U.fromList [ t | WindowLine { _wlTimestamp = PackedTime t } <- wls ]
+  }
+  where
+    encode img = [ (a, Text.encodeUtf8 t, w, l) | (a, t, w, l) <- imageSegments img ]
+
+    parts = [ (encode (view wlPrefix wl), encode (view wlImage wl), encode (view wlFullImage wl))
+            | wl <- wls ]
+
+    segs  = concat [ p ++ i ++ f | (p, i, f) <- parts ]
+    attrs = nub [ a | (a, _, _, _) <- segs ]
+
+    segEntry (a, bs, w, l) =
+      map fromIntegral [fromMaybe 0 (elemIndex a attrs), B.length bs, w, l]
+
+    bytes xs = sum [ B.length bs | (_, bs, _, _) <- xs ]
+
+    (_, entries) = mapAccumL entry (0, 0) parts
+    entry (seg, off) (p, i, f) =
+      ( (seg + length p + length i + length f, off + bytes p + bytes i + bytes f)
+      , [seg, seg + length p, seg + length p + length i, off] )
+
+-- | Lines still in use in a chunk, newest first.
+chunkLines :: PackedChunk -> [WindowLine]
+chunkLines c = [ unpackLine c i | i <- [0 .. pcCount c - 1] ]
+
+unpackLine :: PackedChunk -> Int -> WindowLine
+unpackLine c i = WindowLine
+  { _wlSummary    = pcSummaries c Vector.! i
+  , _wlPrefix     = segmentsImage (segments s0 s1 b0)
+  , _wlImage      = segmentsImage (segments s1 s2 b1)
+  , _wlFullImage  = segmentsImage (segments s2 s3 b2)
+  , _wlImportance = toEnum (fromIntegral (pcImportance c U.! i))
+  , _wlTimestamp  = PackedTime (pcTimestamps c U.! i)
+  }
+  where
+    entry j = fromIntegral (pcLines c U.! j) :: Int
+    field' j k = fromIntegral (pcSegments c U.! (4*j + k)) :: Int
+
+    s0 = entry (4*i)
+    s1 = entry (4*i + 1)
+    s2 = entry (4*i + 2)
+    s3 | 4*i + 4 < U.length (pcLines c) = entry (4*i + 4)
+       | otherwise                      = U.length (pcSegments c) `div` 4
+
+    b0 = entry (4*i + 3)
+    b1 = b0 + sum [ field' j 1 | j <- [s0 .. s1-1] ]
+    b2 = b1 + sum [ field' j 1 | j <- [s1 .. s2-1] ]
+
+    segments j end off
+      | j >= end  = []
+      | otherwise = (pcAttrs c Vector.! field' j 0, txt, field' j 2, field' j 3)
+                  : segments (j+1) end (off + len)
+      where
+        len = field' j 1
+        txt = Text.decodeUtf8 (B.take len (B.drop off (pcText c)))
 
 ------------------------------------------------------------------------
 
@@ -16,9 +16,11 @@ module Client.View
 import           Client.Image.PackedImage
 import           Client.State
 import           Client.State.Focus
+import           Client.State.RenderCache
 import           Client.View.Cert
 import           Client.View.ChannelInfo
 import           Client.View.Digraphs
+import           Client.View.ExtensionStats
 import           Client.View.Help
 import           Client.View.IgnoreList
 import           Client.View.KeyMap
@@ -32,27 +34,32 @@ import           Client.View.UserList
 import           Client.View.Windows
 import           Control.Lens
 
-viewLines :: Focus -> Subfocus -> Int -> ClientState -> [Image']
+-- | Lines for a view along with the message lines drawn with the
+-- render cache.
+viewLines :: Focus -> Subfocus -> Int -> ClientState -> ([Image'], [DrawnLine])
 viewLines focus subfocus w !st =
   case (focus, subfocus) of
     _ | Just ("url",arg) <- clientActiveCommand st ->
-      urlSelectionView w focus arg st
+      plain $ urlSelectionView w focus arg st
     (ChannelFocus network channel, FocusInfo) ->
-      channelInfoImages network channel st
+      plain $ channelInfoImages network channel st
     (ChannelFocus network channel, FocusUsers)
-      | view clientDetailView st -> userInfoImages network channel st
-      | otherwise                -> userListImages network channel w st
+      | view clientDetailView st -> plain $ userInfoImages network channel st
+      | otherwise                -> plain $ userListImages network channel w st
     (ChannelFocus network channel, FocusMasks mode) ->
-      maskListImages mode network channel w st
-    (_, FocusWindows filt) -> windowsImages filt st
-    (_, FocusMentions)     -> mentionsViewLines w st
-    (_, FocusPalette)      -> paletteViewLines pal
-    (_, FocusDigraphs)     -> digraphLines w st
-    (_, FocusKeyMap)       -> keyMapLines st
-    (_, FocusHelp mb)      -> helpImageLines st mb pal
-    (_, FocusRtsStats)     -> rtsStatsLines (view clientRtsStats st) pal
-    (_, FocusIgnoreList)   -> ignoreListLines (view clientIgnores st) pal
-    (_, FocusCert)         -> certViewLines st
+      plain $ maskListImages mode network channel w st
+    (_, FocusWindows filt) -> plain $ windowsImages filt st
+    (_, FocusMentions)     -> plain $ mentionsViewLines w st
+    (_, FocusPalette)      -> plain $ paletteViewLines pal
+    (_, FocusDigraphs)     -> plain $ digraphLines w st
+    (_, FocusKeyMap)       -> plain $ keyMapLines st
+    (_, FocusHelp mb)      -> plain $ helpImageLines st mb pal
+    (_, FocusRtsStats)     -> plain $ rtsStatsLines (view clientRtsStats st)
+                                                    (view clientRenderCache st) pal
+    (_, FocusExtStats)     -> plain $ extensionStatsLines st pal
+    (_, FocusIgnoreList)   -> plain $ ignoreListLines (view clientIgnores st) pal
+    (_, FocusCert)         -> plain $ certViewLines st
     _ -> chatMessageImages focus w st
   where
     pal = clientPalette st
+    plain imgs = (imgs, [])
@@ -0,0 +1,79 @@
+{-# Language OverloadedStrings #-}
+{-|
+Module      : Client.View.ExtensionStats
+Description : View extension callback statistics
+Copyright   : (c) Eric Mertens, 2018
+License     : ISC
+Maintainer  : emertens@gmail.com
+
+Lines for the @/extstats@ command.
+
+-}
+
+module Client.View.ExtensionStats
+  ( extensionStatsLines
+  ) where
+
+import           Client.CApi
+import           Client.CApi.Stats
+import           Client.Image.PackedImage
+import           Client.Image.Palette
+import           Client.State
+import           Control.Lens
+import           Data.List (transpose)
+import qualified Data.Map as Map
+import           Data.Text (Text)
+import qualified Data.Text as Text
+import           Graphics.Vty.Attributes
+import           Numeric (showFFloat)
+
+-- | Generate lines used for @/extstats@.
+extensionStatsLines :: ClientState -> Palette -> [Image']
+extensionStatsLines st pal
+  | null aes  = [text' (view palError pal) "No extensions loaded"]
+  | otherwise = reverse (concatMap (extensionLines pal) aes)
+  where
+    aes = toListOf (clientExtensions . esActive . folded) st
+
+-- | Heading and table of callback statistics for one extension
+extensionLines :: Palette -> ActiveExtension -> [Image']
+extensionLines pal ae =
+  text' (view palLabel pal) (aeName ae) <> dispatcher :
+  if Map.null (aeStats ae)
+    then [text' defAttr "  no callbacks"]
+    else table pal header (map (uncurry row) (Map.toList (aeStats ae)))
+  where
+    dispatcher =
+      case aeDispatcher ae of
+        Nothing -> mempty
+        Just{}  -> text' defAttr (" (dispatch thread, " <>
+                                  Text.pack (show (aeOverflow ae)) <>
+                                  " skipped)")
+    header = ["callback", "calls", "drops", "mean", "p50", "p99", "max"]
+    row cb cs =
+      [ callbackName cb
+      , Text.pack (show (csCalls cs))
+      , Text.pack (show (csDrops cs))
+      , duration (csTotal cs / fromIntegral (csCalls cs))
+      , duration (callbackPercentile 0.50 cs)
+      , duration (callbackPercentile 0.99 cs)
+      , duration (csMax cs)
+      ]
+
+-- | Render rows with right aligned columns
+table :: Palette -> [Text] -> [[Text]] -> [Image']
+table pal header rows =
+  cells (view palLabel pal) header : map (cells defAttr) rows
+  where
+    widths = map (maximum . map Text.length) (transpose (header : rows))
+    cells attr = mconcat . zipWith (cell attr) widths
+    cell attr w t = text' attr (Text.replicate (w + 2 - Text.length t) " " <> t)
+
+-- | Render seconds with a unit suited to their size
+duration :: Double -> Text
+duration secs
+  | secs < 1e-3 = fixed (secs * 1e6) "us"
+  | secs < 1    = fixed (secs * 1e3) "ms"
+  | otherwise   = fixed secs "s"
+  where
+    fixed x unit = Text.pack (showFFloat (Just 1) x unit)
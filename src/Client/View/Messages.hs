@@ -8,7 +8,8 @@ Maintainer  : emertens@gmail.com
 
 This module returns the chat messages for the currently focused
 window in message view and gathers metadata entries into single
-lines.
+lines. Normal message lines are reused from the render cache when
+they were drawn in the previous frame.
 
 -}
 module Client.View.Messages
@@ -24,9 +25,11 @@ import           Client.Message
 import           Client.State
 import           Client.State.Focus
 import           Client.State.Network
+import           Client.State.RenderCache
 import           Client.State.Window
 import           Control.Lens
 import           Control.Monad
+import           Data.Either
 import           Data.List
 import           Graphics.Vty.Attributes
 import           Irc.Identifier
@@ -34,73 +37,84 @@ import           Irc.Message
 import           Irc.UserInfo
 
 
-chatMessageImages :: Focus -> Int -> ClientState -> [Image']
+-- | Lines of a window along with the message lines drawn with the
+-- render cache, both newest first.
+chatMessageImages :: Focus -> Int -> ClientState -> ([Image'], [DrawnLine])
 chatMessageImages focus w st =
   case preview (clientWindows . ix focus) st of
-    Nothing  -> []
+    Nothing  -> ([], [])
     Just win ->
-      let msgs     = toListOf each (view winMessages win)
-          hideMeta = view winHideMeta win in
-      if clientIsFiltered st
-        then windowLineProcessor hideMeta (clientFilter st (view wlText) msgs)
-        else
-          case view winMarker win of
-            Nothing -> windowLineProcessor hideMeta msgs
-            Just n  ->
-              windowLineProcessor hideMeta l ++
-              [marker] ++
-              windowLineProcessor hideMeta r
-              where
-                (l,r) = splitAt n msgs
+      let msgs     = zip [view winSerial win - 1, view winSerial win - 2 ..]
+                         (toListOf each (view winMessages win))
+          hideMeta = view winHideMeta win
+          parts
+            | clientIsFiltered st =
+                windowLineProcessor hideMeta (clientFilter st (view wlText . snd) msgs)
+            | otherwise =
+                case view winMarker win of
+                  Nothing -> windowLineProcessor hideMeta msgs
+                  Just n  ->
+                    windowLineProcessor hideMeta l ++
+                    [Left [marker]] ++
+                    windowLineProcessor hideMeta r
+                    where
+                      (l,r) = splitAt n msgs
+      in (concatMap (either id drawnImages) parts, rights parts)
 
   where
     palette = clientPalette st
     marker = string (view palLineMarker palette) (replicate w '-')
+    cached = renderCacheLines (clientRenderKey st) focus w (view clientRenderCache st)
     windowLineProcessor hideMeta
       | view clientDetailView st =
-          concatMap (reverse . fullLineWrap w) .
+          map (Left . reverse . fullLineWrap w) .
           if hideMeta
             then detailedImagesWithoutMetadata st
-            else map (view wlFullImage)
+            else map (view wlFullImage . snd)
 
-      | otherwise = windowLinesToImages st w hideMeta . filter (not . isNoisy)
+      | otherwise = windowLinesToImages st w hideMeta cached . filter (not . isNoisy . snd)
 
     isNoisy msg =
       case view wlSummary msg of
         ReplySummary code -> squelchIrcMsg (Reply "" code [])
         _                 -> False
 
-detailedImagesWithoutMetadata :: ClientState -> [WindowLine] -> [Image']
+detailedImagesWithoutMetadata :: ClientState -> [(Int, WindowLine)] -> [Image']
 detailedImagesWithoutMetadata st wwls =
   case gatherMetadataLines st wwls of
     ([], [])   -> []
-    ([], w:ws) -> view wlFullImage w
-                : detailedImagesWithoutMetadata st ws
+    ([], (_,w):ws) -> view wlFullImage w
+                    : detailedImagesWithoutMetadata st ws
     (_:_, wls) -> detailedImagesWithoutMetadata st wls
 
 
+-- | Draw the lines of a window. Normal message lines are drawn with the
+-- render cache and coalesced metadata lines are drawn every time.
 windowLinesToImages ::
-  ClientState  {- ^ client state  -} ->
-  Int          {- ^ draw width    -} ->
-  Bool         {- ^ hide metadata -} ->
-  [WindowLine] {- ^ window lines  -} ->
-  [Image']     {- ^ image lines   -}
-windowLinesToImages st w hideMeta wwls =
+  ClientState         {- ^ client state          -} ->
+  Int                 {- ^ draw width            -} ->
+  Bool                {- ^ hide metadata         -} ->
+  CachedLines         {- ^ window's cached lines -} ->
+  [(Int, WindowLine)] {- ^ numbered window lines -} ->
+  [Either [Image'] DrawnLine] {- ^ image lines   -}
+windowLinesToImages st w hideMeta cached wwls =
   case gatherMetadataLines st wwls of
     ([], [])   -> []
-    ([], wl:wls) -> drawWindowLine palette w padAmt wl
-                ++ windowLinesToImages st w hideMeta wls
+    ([], (serial,wl):wls) ->
+         Right (cachedWindowLine cached (drawWindowLine palette w padAmt) serial wl)
+       : windowLinesToImages st w hideMeta cached wls
     ((img,who,mbnext):mds, wls)
 
-      | hideMeta -> windowLinesToImages st w hideMeta wls
+      | hideMeta -> windowLinesToImages st w hideMeta cached wls
 
       | otherwise ->
-         wrap
-           metaPad
-           (mconcat
-              (intersperse " "
-                 (startMetadata img mbnext who mds palette)))
-      ++ windowLinesToImages st w hideMeta wls
+         Left
+           (wrap
+              metaPad
+              (mconcat
+                 (intersperse " "
+                    (startMetadata img mbnext who mds palette))))
+       : windowLinesToImages st w hideMeta cached wls
 
   where
     palette = clientPalette st
@@ -153,8 +167,8 @@ continueMetadata acc who1 ((img, who2, mbwho3):mds) palette
 
 gatherMetadataLines ::
   ClientState ->
-  [WindowLine] ->
-  ( [(Image', Identifier, Maybe Identifier)] , [ WindowLine ] )
+  [(Int, WindowLine)] ->
+  ( [(Image', Identifier, Maybe Identifier)] , [ (Int, WindowLine) ] )
   -- ^ metadata entries are reversed
 gatherMetadataLines st = go []
   where
@@ -162,7 +176,7 @@ gatherMetadataLines st = go []
       | Just (img, ws') <- bulkMetadata st ws =
           go ((img, "", Nothing) : acc) ws'
     go acc (w:ws)
-      | Just (img,who,mbnext) <- metadataWindowLine st w =
+      | Just (img,who,mbnext) <- metadataWindowLine st (snd w) =
           go ((img,who,mbnext) : acc) ws
 
     go acc ws = (acc,ws)
@@ -181,10 +195,10 @@ metadataWindowLine st wl =
 
 bulkMetadata ::
   ClientState ->
-  [WindowLine] ->
-  Maybe (Image', [WindowLine])
+  [(Int, WindowLine)] ->
+  Maybe (Image', [(Int, WindowLine)])
 bulkMetadata st wls
-  | (quits, wls') <- span isMassQuit wls
+  | (quits, wls') <- span (isMassQuit . snd) wls
   , let n = length quits
   , n > 10
   = Just (string (view palMeta pal) ("(split:" <> show n <> ")") <>
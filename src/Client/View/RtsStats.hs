@@ -16,19 +16,51 @@ module Client.View.RtsStats
 
 import           Client.Image.PackedImage
 import           Client.Image.Palette
+import           Client.State.RenderCache
 import           Control.Lens
+import           Data.Text (Text)
+import qualified Data.Text as Text
 import           Graphics.Vty.Attributes
+import           Numeric (showFFloat)
 import           RtsStats
 
--- | Generate lines used for @/rtsstats@.
-rtsStatsLines :: Maybe Stats -> Palette -> [Image']
-rtsStatsLines Nothing pal = [text' (view palError pal) "Statistics not available"]
-rtsStatsLines (Just stats) pal
-  | null entries = [text' (view palError pal) "Statistics empty"]
-  | otherwise    = zipWith (\v l -> padV wv v <> " " <> l) valueImages labelImages
+-- | Generate lines used for @/rtsstats@. The render cache counters
+-- are shown below the GHC statistics.
+rtsStatsLines :: Maybe Stats -> RenderCache -> Palette -> [Image']
+rtsStatsLines mbStats cache pal = entryLines pal (renderCacheEntries cache) ++ rtsLines
+  where
+    rtsLines =
+      case mbStats of
+        Nothing -> [text' (view palError pal) "Statistics not available"]
+        Just stats
+          | null entries -> [text' (view palError pal) "Statistics empty"]
+          | otherwise    -> entryLines pal entries
+          where
+            entries = statsToEntries stats
+
+-- | Right-aligned values followed by their labels
+entryLines :: Palette -> [(Text, Text)] -> [Image']
+entryLines pal entries = zipWith (\v l -> padV wv v <> " " <> l) valueImages labelImages
   where
-    entries     = statsToEntries stats
     labelImages = map (text' (view palLabel pal) . fst) entries
     valueImages = map (text' defAttr . snd) entries
     wv          = maximum (0 : map imageWidth valueImages)
     padV n img  = string defAttr (replicate (n - imageWidth img) ' ') <> img
+
+-- | Counters of the message line render cache, bottom line first
+renderCacheEntries :: RenderCache -> [(Text, Text)]
+renderCacheEntries cache = reverse
+  [ ("Render cache hits"    , render hits)
+  , ("Render cache misses"  , render misses)
+  , ("Render cache hit rate", Text.pack (showFFloat (Just 1) rate "%"))
+  , ("Render cache lines"   , render (renderCacheSize cache))
+  , ("Render cache flushes" , render (renderCacheFlushes cache))
+  ]
+  where
+    hits   = renderCacheHits cache
+    misses = renderCacheMisses cache
+    rate   | hits + misses == 0 = 0
+           | otherwise          = 100 * fromIntegral hits / fromIntegral (hits + misses) :: Double
+
+    render :: Int -> Text
+    render = Text.pack . show
@@ -13,7 +13,14 @@ module Main (main) where
 
 import           Client.Commands.Arguments.Spec
 import           Client.Commands.Arguments.Parser
+import           Client.Image.PackedImage
+import           Client.Message
+import           Client.State.Window
 import           Control.Applicative
+import           Data.Text (Text)
+import qualified Data.Text.Lazy as LText
+import           Data.Time
+import           Graphics.Vty.Attributes (Attr, defAttr, withForeColor, withStyle, red, blue, bold)
 import           System.Exit
 import           Test.HUnit
 
@@ -25,7 +32,7 @@ main =
        else exitFailure
 
 tests :: Test
-tests = test [ argumentParserTests ]
+tests = test [ argumentParserTests, windowHistoryTests, windowLinesTests ]
 
 argumentParserTests :: Test
 argumentParserTests = test
@@ -71,3 +78,94 @@ argumentParserTests = test
        (Just ("some", " text here"))
        (parse () (liftA2 (,) (simpleToken "first") (remainingArg "second")) "  some  text here")
   ]
+
+-- | Window line showing a number
+numberLine :: Int -> WindowLine
+numberLine i = WindowLine
+  { _wlSummary    = NoSummary
+  , _wlPrefix     = mempty
+  , _wlImage      = img
+  , _wlFullImage  = img
+  , _wlImportance = WLNormal
+  , _wlTimestamp  = packZonedTime (ZonedTime (LocalTime (fromGregorian 2020 1 1) midnight) utc)
+  }
+  where
+    img = string defAttr (show i)
+
+-- | Text of the lines of a history page and the cursor after it
+historyPage :: Int -> Int -> Window -> ([String], Int)
+historyPage cursor n win =
+  case take n (windowHistory cursor win) of
+    []   -> ([], 0)
+    page -> ( [ LText.unpack (imageText (_wlFullImage l)) | (_, l) <- page ]
+            , fst (last page) )
+
+windowHistoryTests :: Test
+windowHistoryTests = test
+  [ assertEqual "first page"
+       (["20","19","18"], 17)
+       (historyPage 0 3 win1)
+
+  , assertEqual "page continues after lines are trimmed"
+       (["17","16"], 0)
+       (historyPage 17 3 win2)
+
+  , assertEqual "cursor of trimmed lines"
+       ([], 0)
+       (historyPage 12 3 win2)
+  ]
+  where
+    limited = emptyWindow { _winLineLimit = 10 }
+    win1    = foldl (flip addToWindow) limited (map numberLine [1..20])
+    win2    = foldl (flip addToWindow) win1    (map numberLine [21..25])
+
+-- | Window line with several segments and attributes and non-ASCII text
+richLine :: Int -> WindowLine
+richLine i = WindowLine
+  { _wlSummary    = NoSummary
+  , _wlPrefix     = string (withForeColor defAttr red) ("<nick" ++ show (i `mod` 7) ++ "> ")
+  , _wlImage      = img
+  , _wlFullImage  = string defAttr "12:00 " <> img
+  , _wlImportance = [WLBoring, WLNormal, WLImportant] !! (i `mod` 3)
+  , _wlTimestamp  = packZonedTime (utcToZonedTime utc (addUTCTime (fromIntegral i) epoch))
+  }
+  where
+    epoch = UTCTime (fromGregorian 2020 1 1) 0
+    img   = string (withStyle defAttr bold) "h\233llo "
+         <> string (withForeColor defAttr blue) ("w\246rld \9731 " ++ show i)
+         <> (if even i then string defAttr " \26085\26412\35486" else mempty)
+
+type Segments = [(Attr, Text, Int, Int)]
+
+-- | Everything a window keeps about a line, in a comparable form
+lineParts ::
+  WindowLine ->
+  (Segments, Segments, Segments, IrcSummary, WindowLineImportance, UTCTime)
+lineParts l =
+  ( imageSegments (_wlPrefix l)
+  , imageSegments (_wlImage l)
+  , imageSegments (_wlFullImage l)
+  , _wlSummary l
+  , _wlImportance l
+  , unpackUTCTime (_wlTimestamp l) )
+
+-- | Lines of a window as they are kept, newest first. Older lines are
+-- packed into chunks once there are more than 576 of them.
+windowLinesTests :: Test
+windowLinesTests = test
+  [ assertEqual "packed lines unpack unchanged"
+       (map (lineParts . richLine) [1000, 999 .. 1])
+       (windowParts (addLines [1..1000] emptyWindow))
+
+  , assertEqual "trimming drops part of a packed chunk"
+       (map (lineParts . richLine) [1000, 999 .. 301])
+       (windowParts limited)
+
+  , assertEqual "trimmed window total"
+       700
+       (_winTotal limited)
+  ]
+  where
+    addLines ns win = foldl (flip addToWindow) win (map richLine ns)
+    limited         = addLines [1..1000] emptyWindow { _winLineLimit = 700 }
+    windowParts win = [ lineParts l | (_, l) <- windowHistory 0 win ]